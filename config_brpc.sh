@@ -38,10 +38,12 @@ else
     LDD=ldd
 fi
 
-TEMP=`getopt -o v: --long headers:,libs:,cc:,cxx:,with-glog,with-thrift,with-rdma,with-mesalink,with-bthread-tracer,with-debug-bthread-sche-safety,with-debug-lock,with-asan,nodebugsymbols,werror -n 'config_brpc' -- "$@"`
+TEMP=`getopt -o v: --long headers:,libs:,cc:,cxx:,with-glog,with-thrift,with-rdma,with-lz4,with-zstd,with-mesalink,with-bthread-tracer,with-debug-bthread-sche-safety,with-debug-lock,with-asan,nodebugsymbols,werror -n 'config_brpc' -- "$@"`
 WITH_GLOG=0
 WITH_THRIFT=0
 WITH_RDMA=0
+WITH_LZ4=0
+WITH_ZSTD=0
 WITH_MESALINK=0
 WITH_BTHREAD_TRACER=0
 WITH_ASAN=0
@@ -71,6 +73,8 @@ while true; do
         --with-glog ) WITH_GLOG=1; shift 1 ;;
         --with-thrift) WITH_THRIFT=1; shift 1 ;;
         --with-rdma) WITH_RDMA=1; shift 1 ;;
+        --with-lz4) WITH_LZ4=1; shift 1 ;;
+        --with-zstd) WITH_ZSTD=1; shift 1 ;;
         --with-mesalink) WITH_MESALINK=1; shift 1 ;;
         --with-bthread-tracer) WITH_BTHREAD_TRACER=1; shift 1 ;;
         --with-debug-bthread-sche-safety ) BRPC_DEBUG_BTHREAD_SCHE_SAFETY=1; shift 1 ;;
@@ -232,34 +236,6 @@ append_linking $GFLAGS_LIB gflags
 PROTOBUF_LIB=$(find_dir_of_lib_or_die protobuf)
 append_linking $PROTOBUF_LIB protobuf
 
-LEVELDB_LIB=$(find_dir_of_lib_or_die leveldb)
-# required by leveldb
-if [ -f $LEVELDB_LIB/libleveldb.a ]; then
-    if [ -f $LEVELDB_LIB/libleveldb.$SO ]; then
-        if $LDD $LEVELDB_LIB/libleveldb.$SO | grep -q libsnappy; then
-            SNAPPY_LIB=$(find_dir_of_lib snappy)
-            REQUIRE_SNAPPY="yes"
-        fi
-    fi
-    if [ -z "$REQUIRE_SNAPPY" ]; then
-        if [ "$SYSTEM" = "Darwin" ]; then
-	        STATIC_LINKINGS="$STATIC_LINKINGS $LEVELDB_LIB/libleveldb.a"
-        else
-	        STATIC_LINKINGS="$STATIC_LINKINGS -lleveldb"
-        fi
-    elif [ -f $SNAPPY_LIB/libsnappy.a ]; then
-        if [ "$SYSTEM" = "Darwin" ]; then
-	        STATIC_LINKINGS="$STATIC_LINKINGS $LEVELDB_LIB/libleveldb.a $SNAPPY_LIB/libsnappy.a"
-        else
-	        STATIC_LINKINGS="$STATIC_LINKINGS -lleveldb -lsnappy"
-        fi
-    else
-	    DYNAMIC_LINKINGS="$DYNAMIC_LINKINGS -lleveldb"
-    fi
-else
-	DYNAMIC_LINKINGS="$DYNAMIC_LINKINGS -lleveldb"
-fi
-
 PROTOC=$(find_bin_or_die protoc)
 
 GFLAGS_HDR=$(find_dir_of_header_or_die gflags/gflags.h)
@@ -354,8 +330,6 @@ if [ $WITH_ASAN != 0 ]; then
   DYNAMIC_LINKINGS="$DYNAMIC_LINKINGS -fsanitize=address"
 fi
 
-LEVELDB_HDR=$(find_dir_of_header_or_die leveldb/db.h)
-
 if [ $WITH_BTHREAD_TRACER != 0 ]; then
     if [ "$SYSTEM" != "Linux" ] || [ "$(uname -m)" != "x86_64" ]; then
         >&2 $ECHO "bthread tracer is only supported on Linux x86_64 platform"
@@ -373,8 +347,8 @@ if [ $WITH_BTHREAD_TRACER != 0 ]; then
     fi
 fi
 
-HDRS=$($ECHO "$LIBUNWIND_HDR\n$GFLAGS_HDR\n$PROTOBUF_HDR\n$ABSL_HDR\n$LEVELDB_HDR\n$OPENSSL_HDR" | sort | uniq)
-LIBS=$($ECHO "$LIBUNWIND_LIB\n$GFLAGS_LIB\n$PROTOBUF_LIB\n$ABSL_LIB\n$LEVELDB_LIB\n$OPENSSL_LIB\n$SNAPPY_LIB" | sort | uniq)
+HDRS=$($ECHO "$LIBUNWIND_HDR\n$GFLAGS_HDR\n$PROTOBUF_HDR\n$ABSL_HDR\n$OPENSSL_HDR" | sort | uniq)
+LIBS=$($ECHO "$LIBUNWIND_LIB\n$GFLAGS_LIB\n$PROTOBUF_LIB\n$ABSL_LIB\n$OPENSSL_LIB" | sort | uniq)
 
 absent_in_the_list() {
     TMP=`$ECHO "$1\n$2" | sort | uniq`
@@ -489,6 +463,28 @@ if [ $WITH_RDMA != 0 ]; then
     append_to_output "WITH_RDMA=1"
 fi
 
+if [ $WITH_LZ4 != 0 ]; then
+    LZ4_LIB=$(find_dir_of_lib_or_die lz4)
+    LZ4_HDR=$(find_dir_of_header_or_die lz4frame.h)
+    append_to_output_libs "$LZ4_LIB"
+    append_to_output_headers "$LZ4_HDR"
+
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_LZ4=1"
+
+    append_to_output "DYNAMIC_LINKINGS+=-llz4"
+fi
+
+if [ $WITH_ZSTD != 0 ]; then
+    ZSTD_LIB=$(find_dir_of_lib_or_die zstd)
+    ZSTD_HDR=$(find_dir_of_header_or_die zstd.h)
+    append_to_output_libs "$ZSTD_LIB"
+    append_to_output_headers "$ZSTD_HDR"
+
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_ZSTD=1"
+
+    append_to_output "DYNAMIC_LINKINGS+=-lzstd"
+fi
+
 if [ $WITH_MESALINK != 0 ]; then
     CPPFLAGS="${CPPFLAGS} -DUSE_MESALINK"
 fi
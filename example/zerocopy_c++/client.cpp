@@ -0,0 +1,119 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// A client fetching large attachments from blob_server and reporting CPU
+// consumed by the server per GB sent. Compare results of blob_server with
+// and without -socket_enable_zerocopy.
+
+#include <gflags/gflags.h>
+#include <bthread/bthread.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+#include <brpc/channel.h>
+#include "blob.pb.h"
+
+DEFINE_int32(thread_num, 4, "Number of threads to fetch blobs");
+DEFINE_int32(blob_size, 4 * 1024 * 1024, "Bytes of each blob");
+DEFINE_string(connection_type, "", "Connection type. Available values: single, pooled, short");
+DEFINE_string(server, "0.0.0.0:8002", "IP Address of server");
+DEFINE_int32(timeout_ms, 5000, "RPC timeout in milliseconds");
+DEFINE_int32(test_seconds, 10, "Seconds of the test");
+
+bvar::LatencyRecorder g_latency_recorder("client");
+bvar::Adder<int64_t> g_received_bytes;
+butil::atomic<bool> g_stop(false);
+
+static brpc::Channel g_channel;
+
+static bool Fetch(example::BlobResponse* response) {
+    example::BlobService_Stub stub(&g_channel);
+    example::BlobRequest request;
+    request.set_size(FLAGS_blob_size);
+    brpc::Controller cntl;
+    stub.Fetch(&cntl, &request, response, NULL);
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Fail to fetch blob: " << cntl.ErrorText();
+        return false;
+    }
+    g_latency_recorder << cntl.latency_us();
+    g_received_bytes << cntl.response_attachment().size();
+    return true;
+}
+
+static void* Receiver(void*) {
+    example::BlobResponse response;
+    while (!g_stop.load(butil::memory_order_relaxed)) {
+        if (!Fetch(&response)) {
+            bthread_usleep(50000);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+
+    brpc::ChannelOptions options;
+    options.connection_type = FLAGS_connection_type;
+    options.timeout_ms = FLAGS_timeout_ms;
+    options.max_retry = 0;
+    if (g_channel.Init(FLAGS_server.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize channel";
+        return -1;
+    }
+
+    example::BlobResponse begin;
+    if (!Fetch(&begin)) {
+        return -1;
+    }
+    const int64_t begin_received = g_received_bytes.get_value();
+    const int64_t start_us = butil::gettimeofday_us();
+    std::vector<bthread_t> bids(FLAGS_thread_num);
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        if (bthread_start_background(&bids[i], NULL, Receiver, NULL) != 0) {
+            LOG(ERROR) << "Fail to create bthread";
+            return -1;
+        }
+    }
+    bthread_usleep(FLAGS_test_seconds * 1000000L);
+    g_stop.store(true, butil::memory_order_relaxed);
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        bthread_join(bids[i], NULL);
+    }
+    const int64_t end_us = butil::gettimeofday_us();
+
+    example::BlobResponse end;
+    if (!Fetch(&end)) {
+        return -1;
+    }
+    const double gb = (g_received_bytes.get_value() - begin_received)
+        / (1024.0 * 1024 * 1024);
+    const double server_cpu_s =
+        (end.server_cpu_us() - begin.server_cpu_us()) / 1000000.0;
+    const int64_t zerocopy = end.zerocopy_bytes() - begin.zerocopy_bytes();
+    const int64_t copied = end.copied_bytes() - begin.copied_bytes();
+    LOG(INFO) << "blob_size=" << FLAGS_blob_size
+              << " threads=" << FLAGS_thread_num
+              << " throughput=" << gb * 1000000 / (end_us - start_us) << "GB/s"
+              << " latency=" << g_latency_recorder.latency() << "us"
+              << " latency_99=" << g_latency_recorder.latency_percentile(0.99) << "us"
+              << " server_cpu_per_gb=" << (gb > 0 ? server_cpu_s / gb : 0) << "s"
+              << " zerocopy_ratio="
+              << (zerocopy + copied > 0 ? (double)zerocopy / (zerocopy + copied) : 0);
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// A server sending large attachments, run with -socket_enable_zerocopy
+// to write them with MSG_ZEROCOPY.
+
+#include <sys/resource.h>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/fast_rand.h>
+#include <bvar/bvar.h>
+#include <brpc/server.h>
+#include "blob.pb.h"
+
+DEFINE_int32(port, 8002, "TCP Port of this server");
+DEFINE_int32(max_blob_size, 16 * 1024 * 1024, "Max size of blobs");
+
+namespace example {
+class BlobServiceImpl : public BlobService {
+public:
+    BlobServiceImpl()
+        : _sent_bytes("blob_server_sent_bytes") {
+        std::string buf;
+        buf.resize(FLAGS_max_blob_size);
+        butil::fast_rand_bytes(&buf[0], buf.size());
+        _blob.append(buf);
+    }
+
+    void Fetch(google::protobuf::RpcController* cntl_base,
+               const BlobRequest* request,
+               BlobResponse* response,
+               google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        const size_t size = std::min((size_t)std::max(request->size(), (int64_t)0),
+                                     _blob.size());
+        // Referencing blocks of `_blob', no copying in user space.
+        _blob.append_to(&cntl->response_attachment(), size);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        response->set_server_cpu_us(
+            usage.ru_utime.tv_sec * 1000000L + usage.ru_utime.tv_usec +
+            usage.ru_stime.tv_sec * 1000000L + usage.ru_stime.tv_usec);
+        // Bytes copied by the kernel in spite of MSG_ZEROCOPY (e.g. through
+        // loopback) are not counted in rpc_socket_zerocopy_bytes.
+        const std::string zerocopy_str =
+            bvar::Variable::describe_exposed("rpc_socket_zerocopy_bytes");
+        const int64_t zerocopy_bytes =
+            zerocopy_str.empty() ? 0 : atoll(zerocopy_str.c_str());
+        response->set_zerocopy_bytes(zerocopy_bytes);
+        _sent_bytes << size;
+        response->set_copied_bytes(_sent_bytes.get_value() - zerocopy_bytes);
+    }
+
+private:
+    butil::IOBuf _blob;
+    bvar::Adder<int64_t> _sent_bytes;
+};
+}  // namespace example
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+
+    brpc::Server server;
+    example::BlobServiceImpl blob_service_impl;
+    if (server.AddService(&blob_service_impl, 
+                          brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
+        LOG(ERROR) << "Fail to add service";
+        return -1;
+    }
+    brpc::ServerOptions options;
+    if (server.Start(FLAGS_port, &options) != 0) {
+        LOG(ERROR) << "Fail to start BlobServer";
+        return -1;
+    }
+    server.RunUntilAskedToQuit();
+    return 0;
+}
@@ -17,6 +17,8 @@
 
 
 #include <inttypes.h>
+#include <algorithm>                        // std::find
+#include <mutex>                            // std::unique_lock
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                 // fd_guard 
 #include "butil/fd_utility.h"               // make_close_on_exec
@@ -36,7 +38,7 @@ Acceptor::Acceptor(bthread_keytable_pool_t* pool)
     , _idle_timeout_sec(-1)
     , _close_idle_tid(INVALID_BTHREAD)
     , _listened_fd(-1)
-    , _acception_id(0)
+    , _nlistening(0)
     , _empty_cond(&_map_mutex)
     , _force_ssl(false)
     , _ssl_ctx(NULL) 
@@ -56,6 +58,47 @@ int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
         LOG(FATAL) << "Invalid listened_fd=" << listened_fd;
         return -1;
     }
+    if (StartAcceptInternal(std::vector<int>(1, listened_fd), idle_timeout_sec,
+                            ssl_ctx, force_ssl) != 0) {
+        // Ownership of `listened_fd' is not transferred on failure.
+        return -1;
+    }
+    return 0;
+}
+
+int Acceptor::StartAccept(const std::vector<int>& listened_fds,
+                          int idle_timeout_sec,
+                          const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                          bool force_ssl) {
+    size_t nowned = 0;
+    const int rc = StartAcceptInternal(listened_fds, idle_timeout_sec,
+                                       ssl_ctx, force_ssl, &nowned);
+    if (rc != 0) {
+        // The first `nowned' fds are closed by their Sockets which were
+        // set failed inside StartAcceptInternal, close the rest here.
+        for (size_t i = nowned; i < listened_fds.size(); ++i) {
+            if (listened_fds[i] >= 0) {
+                close(listened_fds[i]);
+            }
+        }
+    }
+    return rc;
+}
+
+int Acceptor::StartAcceptInternal(const std::vector<int>& listened_fds,
+                                  int idle_timeout_sec,
+                                  const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                                  bool force_ssl, size_t* nowned) {
+    if (listened_fds.empty()) {
+        LOG(FATAL) << "No listened_fd";
+        return -1;
+    }
+    for (size_t i = 0; i < listened_fds.size(); ++i) {
+        if (listened_fds[i] < 0) {
+            LOG(FATAL) << "Invalid listened_fd=" << listened_fds[i];
+            return -1;
+        }
+    }
 
     if (!ssl_ctx && force_ssl) {
         LOG(ERROR) << "Fail to force SSL for all connections "
@@ -63,7 +106,7 @@ int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
         return -1;
     }
     
-    BAIDU_SCOPED_LOCK(_map_mutex);
+    std::unique_lock<butil::Mutex> mu(_map_mutex);
     if (_status == UNINITIALIZED) {
         if (Initialize() != 0) {
             LOG(FATAL) << "Fail to initialize Acceptor";
@@ -87,20 +130,42 @@ int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
     _force_ssl = force_ssl;
     _ssl_ctx = ssl_ctx;
     
-    // Creation of _acception_id is inside lock so that OnNewConnections
+    // Creation of _acception_ids is inside lock so that OnNewConnections
     // (which may run immediately) should see sane fields set below.
-    SocketOptions options;
-    options.fd = listened_fd;
-    options.user = this;
-    options.bthread_tag = _bthread_tag;
-    options.on_edge_triggered_events = OnNewConnections;
-    if (Socket::Create(options, &_acception_id) != 0) {
-        // Close-idle-socket thread will be stopped inside destructor
-        LOG(FATAL) << "Fail to create _acception_id";
-        return -1;
+    _acception_ids.clear();
+    _nlistening = 0;
+    for (size_t i = 0; i < listened_fds.size(); ++i) {
+        SocketOptions options;
+        options.fd = listened_fds[i];
+        options.user = this;
+        options.bthread_tag = _bthread_tag;
+        options.on_edge_triggered_events = OnNewConnections;
+        if (listened_fds.size() > 1) {
+            // Inherited by accepted connections.
+            options.event_dispatcher_index = i;
+        }
+        SocketId id;
+        if (Socket::Create(options, &id) != 0) {
+            // Close-idle-socket thread will be stopped inside destructor
+            LOG(FATAL) << "Fail to create acception socket";
+            // Stop created sockets outside lock since BeforeRecycle() may
+            // be called inside SetFailed().
+            std::vector<SocketId> created;
+            created.swap(_acception_ids);
+            mu.unlock();
+            for (size_t j = 0; j < created.size(); ++j) {
+                Socket::SetFailed(created[j]);
+            }
+            return -1;
+        }
+        _acception_ids.push_back(id);
+        ++_nlistening;
+        if (nowned) {
+            *nowned = i + 1;
+        }
     }
     
-    _listened_fd = listened_fd;
+    _listened_fd = listened_fds[0];
     _status = RUNNING;
     return 0;
 }
@@ -135,8 +200,10 @@ void Acceptor::StopAccept(int /*closewait_ms*/) {
         _status = STOPPING;
     }
 
-    // Don't set _acception_id to 0 because BeforeRecycle needs it.
-    Socket::SetFailed(_acception_id);
+    // Don't clear _acception_ids because BeforeRecycle needs it.
+    for (size_t i = 0; i < _acception_ids.size(); ++i) {
+        Socket::SetFailed(_acception_ids[i]);
+    }
 
     // SetFailed all existing connections. Connections added after this piece
     // of code will be SetFailed directly in OnNewConnectionsUntilEAGAIN
@@ -294,6 +361,8 @@ void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
         }
         options.use_rdma = am->_use_rdma;
         options.bthread_tag = am->_bthread_tag;
+        options.event_dispatcher_index =
+            acception->_io_event.event_dispatcher_index();
         if (Socket::Create(options, &socket_id) != 0) {
             LOG(ERROR) << "Fail to create Socket";
             continue;
@@ -345,12 +414,15 @@ void Acceptor::OnNewConnections(Socket* acception) {
 
 void Acceptor::BeforeRecycle(Socket* sock) {
     BAIDU_SCOPED_LOCK(_map_mutex);
-    if (sock->id() == _acception_id) {
-        // Set _listened_fd to -1 when acception socket has been recycled
-        // so that we are ensured no more events will arrive (and `Join'
-        // will return to its caller)
-        _listened_fd = -1;
-        _empty_cond.Broadcast();
+    if (std::find(_acception_ids.begin(), _acception_ids.end(), sock->id())
+        != _acception_ids.end()) {
+        // Set _listened_fd to -1 when all acception sockets have been
+        // recycled so that we are ensured no more events will arrive (and
+        // `Join' will return to its caller)
+        if (--_nlistening == 0) {
+            _listened_fd = -1;
+            _empty_cond.Broadcast();
+        }
         return;
     }
     // If a Socket could not be addressed shortly after its creation, it
@@ -58,6 +58,18 @@ public:
                     const std::shared_ptr<SocketSSLContext>& ssl_ctx,
                     bool force_ssl);
 
+    // [thread-safe] Accept connections from all `listened_fds' which are
+    // SO_REUSEPORT sockets bound to a same address. Events of the i-th fd
+    // and connections accepted from it are handled by the i-th (modulo
+    // -event_dispatcher_num) EventDispatcher. Unlike the overload above,
+    // `listened_fds' are never left to the caller: on failure, fds already
+    // wrapped in acception Sockets are closed when the Sockets are failed
+    // and recycled, the remaining ones are closed before returning.
+    // Return 0 on success, -1 otherwise.
+    int StartAccept(const std::vector<int>& listened_fds, int idle_timeout_sec,
+                    const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                    bool force_ssl);
+
     // [thread-safe] Stop accepting connections.
     // `closewait_ms' is not used anymore.
     void StopAccept(int /*closewait_ms*/);
@@ -65,9 +77,13 @@ public:
     // Wait until all existing Sockets(defined in socket.h) are recycled.
     void Join();
 
-    // The parameter to StartAccept. Negative when acceptor is stopped.
+    // The parameter to StartAccept (the first one if there're multiple).
+    // Negative when acceptor is stopped.
     int listened_fd() const { return _listened_fd; }
 
+    // Number of listened fds passed to StartAccept.
+    size_t listened_fd_count() const { return _acception_ids.size(); }
+
     // Get number of existing connections.
     size_t ConnectionCount() const;
 
@@ -80,6 +96,13 @@ public:
     Status status() const { return _status; }
 
 private:
+    // Create acception sockets for `listened_fds'. Number of fds owned by
+    // created sockets is stored in `nowned' if it's not NULL.
+    int StartAcceptInternal(const std::vector<int>& listened_fds,
+                            int idle_timeout_sec,
+                            const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                            bool force_ssl, size_t* nowned = NULL);
+
     // Accept connections.
     static void OnNewConnectionsUntilEAGAIN(Socket* m);
     static void OnNewConnections(Socket* m);
@@ -98,8 +121,10 @@ private:
     bthread_t _close_idle_tid;
 
     int _listened_fd;
-    // The Socket tso accept connections.
-    SocketId _acception_id;
+    // The Sockets to accept connections, one for each listened fd.
+    std::vector<SocketId> _acception_ids;
+    // Number of Sockets in _acception_ids which are not recycled yet.
+    size_t _nlistening;
 
     butil::Mutex _map_mutex;
     butil::ConditionVariable _empty_cond;
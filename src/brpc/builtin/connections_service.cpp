@@ -135,6 +135,9 @@ void ConnectionsService::PrintConnections(
             "<th>OutBytes/m</th>"
             "<th>Out/m</th>"
             "<th>Rtt/Var(ms)</th>"
+            "<th>ZeroCopyOut</th>"
+            "<th>ZcFallback</th>"
+            "<th>CopiedOut</th>"
             "<th>SocketId</th>"
             "</tr>\n";
     } else {
@@ -145,7 +148,7 @@ void ConnectionsService::PrintConnections(
         os << "SSL|Protocol    |fd   |"
             "InBytes/s|In/s  |InBytes/m |In/m    |"
             "OutBytes/s|Out/s |OutBytes/m|Out/m   |"
-            "Rtt/Var(ms)|SocketId\n";
+            "Rtt/Var(ms)|ZeroCopyOut|ZcFallback|CopiedOut |SocketId\n";
     }
 
     const char* const bar = (use_html ? "</td><td>" : "|");
@@ -191,7 +194,10 @@ void ConnectionsService::PrintConnections(
                << min_width("-", 6) << bar
                << min_width("-", 10) << bar
                << min_width("-", 8) << bar
-               << min_width("-", 11) << bar;
+               << min_width("-", 11) << bar
+               << min_width("-", 11) << bar
+               << min_width("-", 10) << bar
+               << min_width("-", 10) << bar;
         } else {
             {
                 SocketUniquePtr agent_sock;
@@ -308,7 +314,12 @@ void ConnectionsService::PrintConnections(
                << min_width(stat.out_num_messages_s, 6) << bar
                << min_width(stat.out_size_m, 10) << bar
                << min_width(stat.out_num_messages_m, 8) << bar
-               << min_width(rtt_display, 11) << bar;
+               << min_width(rtt_display, 11) << bar
+               // Bytes written with MSG_ZEROCOPY and sent without copying,
+               // copied by the kernel anyway, and written by ordinary writes.
+               << min_width(ptr->_zerocopy_bytes.load(butil::memory_order_relaxed), 11) << bar
+               << min_width(ptr->_zerocopy_fallback_bytes.load(butil::memory_order_relaxed), 10) << bar
+               << min_width(ptr->_copied_bytes.load(butil::memory_order_relaxed), 10) << bar;
         }
 
         if (use_html) {
@@ -0,0 +1,130 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gflags/gflags.h>
+#include "brpc/closure_guard.h"        // ClosureGuard
+#include "brpc/controller.h"           // Controller
+#include "brpc/server.h"               // Server
+#include "brpc/details/hot_peers.h"
+#include "brpc/builtin/common.h"
+#include "brpc/builtin/hot_peers_service.h"
+
+namespace brpc {
+
+DECLARE_bool(enable_hot_peers);
+DECLARE_int32(hot_peers_capacity);
+DECLARE_int32(hot_peers_window_s);
+
+static void PrintHotPeers(std::ostream& os, HotPeersMetric metric,
+                          bool current_window, size_t k, bool use_html) {
+    std::vector<HotPeer> peers;
+    const int64_t total = GetHotPeers(metric, current_window, k, &peers);
+    if (use_html) {
+        os << "<h3>" << HotPeersMetricName(metric) << " (total=" << total
+           << ")</h3>\n<table class=\"gridtable\" border=\"1\"><tr>"
+            "<th>Peer</th><th>Count</th><th>Percent</th><th>MaxError</th></tr>\n";
+    } else {
+        os << "# " << HotPeersMetricName(metric) << " (total=" << total << ")\n"
+           << "Peer | Count | Percent | MaxError\n";
+    }
+    for (size_t i = 0; i < peers.size(); ++i) {
+        const HotPeer& p = peers[i];
+        const double percent = (total > 0 ? p.count * 100.0 / total : 0);
+        if (use_html) {
+            os << "<tr><td>" << HotPeerName(p.peer) << "</td><td>" << p.count
+               << "</td><td>" << percent << "%</td><td>" << p.error
+               << "</td></tr>\n";
+        } else {
+            os << HotPeerName(p.peer) << " | " << p.count << " | "
+               << percent << "% | " << p.error << '\n';
+        }
+    }
+    if (use_html) {
+        os << "</table>\n";
+    } else {
+        os << '\n';
+    }
+}
+
+void HotPeersService::default_method(::google::protobuf::RpcController* cntl_base,
+                                     const ::brpc::HotPeersRequest*,
+                                     ::brpc::HotPeersResponse*,
+                                     ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const bool use_html = UseHTML(cntl->http_request());
+    cntl->http_response().set_content_type(
+        use_html ? "text/html" : "text/plain");
+
+    size_t k = 10;
+    const std::string* k_str = cntl->http_request().uri().GetQuery("k");
+    if (k_str != NULL) {
+        char* endptr = NULL;
+        const long v = strtol(k_str->c_str(), &endptr, 10);
+        if (*endptr != '\0' || v <= 0) {
+            cntl->SetFailed(EINVAL, "Invalid k=%s", k_str->c_str());
+            return;
+        }
+        k = v;
+    }
+    // Show the window in progress which is partial, rather than the last
+    // complete one.
+    const bool current_window =
+        (cntl->http_request().uri().GetQuery("current") != NULL);
+
+    butil::IOBufBuilder os;
+    if (use_html) {
+        os << "<!DOCTYPE html><html><head>\n"
+           << gridtable_style()
+           << "<script language=\"javascript\" type=\"text/javascript\" src=\"/js/jquery_min\"></script>\n"
+           << TabsHead()
+           << "</head><body>";
+        cntl->server()->PrintTabsBody(os, "hot_peers");
+    }
+    if (!FLAGS_enable_hot_peers) {
+        os << "hot peers are not tracked, turn on -enable_hot_peers"
+           << (use_html ? "<br>\n" : "\n");
+    }
+    os << "Top " << k << " peers in the "
+       << (current_window ? "current" : "last") << ' '
+       << FLAGS_hot_peers_window_s << "-second window, "
+       << FLAGS_hot_peers_capacity << " peers are tracked in each thread. ";
+    if (use_html) {
+        os << (current_window ?
+               "<a href=\"/hot_peers\">last window</a>" :
+               "<a href=\"/hot_peers?current\">current window</a>")
+           << "<br>\n";
+    } else {
+        os << "Append ?current to see the current window\n\n";
+    }
+    for (int i = 0; i < HOT_PEERS_METRIC_COUNT; ++i) {
+        PrintHotPeers(os, (HotPeersMetric)i, current_window, k, use_html);
+    }
+    if (use_html) {
+        os << "</body></html>\n";
+    }
+    os.move_to(cntl->response_attachment());
+}
+
+void HotPeersService::GetTabInfo(TabInfoList* info_list) const {
+    TabInfo* info = info_list->add();
+    info->path = "/hot_peers";
+    info->tab_name = "hot_peers";
+}
+
+} // namespace brpc
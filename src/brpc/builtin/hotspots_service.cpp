@@ -31,6 +31,8 @@
 #include "brpc/builtin/pprof_perl.h"
 #include "brpc/builtin/hotspots_service.h"
 #include "brpc/details/tcmalloc_extension.h"
+#include "brpc/details/continuous_profiler.h"
+#include "brpc/details/server_private_accessor.h"
 
 extern "C" {
 int BAIDU_WEAK ProfilerStart(const char* fname);
@@ -606,6 +608,119 @@ static void DisplayResult(Controller* cntl,
     }
 }
 
+// /hotspots/cpu?recent shows samples of the continuous profiler taken in
+// `seconds' seconds till `ago' seconds ago, optionally of one `method'.
+static int ReadAgo(const Controller* cntl) {
+    const std::string* param = cntl->http_request().uri().GetQuery("ago");
+    if (param == NULL) {
+        return 0;
+    }
+    char* endptr = NULL;
+    const long ago = strtol(param->c_str(), &endptr, 10);
+    if (endptr != param->c_str() + param->length() || ago < 0) {
+        return -1;
+    }
+    return ago;
+}
+
+static void DoRecentCpuProfiling(Controller* cntl,
+                                 ::google::protobuf::Closure* done,
+                                 butil::IOBufBuilder& os, int seconds) {
+    ClosureGuard done_guard(done);
+    const bool use_html = UseHTML(cntl->http_request());
+    if (!IsContinuousProfilerRunning()) {
+        os << "Continuous profiler is not enabled, set -continuous_profiler_hz "
+            "to positive" << (use_html ? "</body></html>" : "\n");
+        os.move_to(cntl->response_attachment());
+        cntl->http_response().set_status_code(HTTP_STATUS_FORBIDDEN);
+        return;
+    }
+    const int ago = ReadAgo(cntl);
+    if (ago < 0) {
+        os << "Invalid ago" << (use_html ? "</body></html>" : "\n");
+        os.move_to(cntl->response_attachment());
+        cntl->http_response().set_status_code(HTTP_STATUS_BAD_REQUEST);
+        return;
+    }
+    const void* tag = NULL;
+    const std::string* method = cntl->http_request().uri().GetQuery("method");
+    if (method != NULL) {
+        const Server::MethodProperty* mp =
+            ServerPrivateAccessor(cntl->server()).FindMethodPropertyByFullName(*method);
+        if (mp == NULL) {
+            os << "Unknown method=" << *method << (use_html ? "</body></html>" : "\n");
+            os.move_to(cntl->response_attachment());
+            cntl->http_response().set_status_code(HTTP_STATUS_BAD_REQUEST);
+            return;
+        }
+        tag = mp->status;
+    }
+    LOG(INFO) << cntl->remote_side() << " requests for recent cpu profile of "
+              << seconds << " seconds till " << ago << " seconds ago"
+              << (method ? " of " : "") << (method ? *method : "");
+
+    char prof_name[128];
+    if (MakeProfName(PROFILING_CPU, prof_name, sizeof(prof_name)) != 0) {
+        os << "Fail to create prof name: " << berror()
+           << (use_html ? "</body></html>" : "\n");
+        os.move_to(cntl->response_attachment());
+        cntl->http_response().set_status_code(HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    const int64_t end_s = ContinuousProfilerNow() - ago;
+    if (DumpContinuousProfile(prof_name, end_s - seconds, end_s, tag, NULL) < 0) {
+        os << "Fail to write " << prof_name << (use_html ? "</body></html>" : "\n");
+        os.move_to(cntl->response_attachment());
+        cntl->http_response().set_status_code(HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    // Profiles are named by seconds, drop results cached for another window
+    // or method dumped in the same second.
+    std::string cache_dir(prof_name);
+    cache_dir.append(".cache");
+    butil::DeleteFile(butil::FilePath(cache_dir), true);
+    DisplayResult(cntl, done_guard.release(), prof_name, os.buf(), PROFILING_CPU);
+}
+
+// Show numbers of samples of methods of the server in the window of
+// /hotspots/cpu?recent, with links to profiles of the methods.
+static void PrintRecentMethods(std::ostream& os, const Controller* cntl,
+                               int seconds, int ago) {
+    std::map<const void*, int64_t> ntag;
+    const int64_t end_s = ContinuousProfilerNow() - ago;
+    CountContinuousProfile(end_s - seconds, end_s, &ntag);
+    std::vector<std::pair<int64_t, const void*> > sorted;
+    int64_t total = 0;
+    for (std::map<const void*, int64_t>::const_iterator
+             it = ntag.begin(); it != ntag.end(); ++it) {
+        sorted.push_back(std::make_pair(it->second, it->first));
+        total += it->second;
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              std::greater<std::pair<int64_t, const void*> >());
+    ServerPrivateAccessor accessor(cntl->server());
+    os << "<pre>Samples of recent " << seconds << " seconds till " << ago
+       << " seconds ago: " << total << '\n';
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        const std::string* name = NULL;
+        if (sorted[i].second != NULL) {
+            name = accessor.FindMethodNameByStatus(
+                static_cast<const MethodStatus*>(sorted[i].second));
+        }
+        os << "  " << sorted[i].first << '\t';
+        if (name != NULL) {
+            os << "<a href='/hotspots/cpu?recent&seconds=" << seconds
+               << "&ago=" << ago << "&method=" << *name << "'>"
+               << *name << "</a>\n";
+        } else if (sorted[i].second == NULL) {
+            os << "(not processing requests)\n";
+        } else {
+            os << "(methods of other servers)\n";
+        }
+    }
+    os << "</pre>";
+}
+
 static void DoProfiling(ProfilingType type,
                         ::google::protobuf::RpcController* cntl_base,
                         ::google::protobuf::Closure* done) {
@@ -653,6 +768,10 @@ static void DoProfiling(ProfilingType type,
         }
     }
 
+    if (type == PROFILING_CPU && cntl->http_request().uri().GetQuery("recent")) {
+        return DoRecentCpuProfiling(cntl, done_guard.release(), os, seconds);
+    }
+
     // Log requester
     std::ostringstream client_info;
     client_info << cntl->remote_side();
@@ -856,7 +975,14 @@ static void StartProfiling(ProfilingType type,
     butil::IOBufBuilder os;
     bool enabled = false;
     const char* extra_desc = "";
-    if (type == PROFILING_CPU) {
+    const bool recent = (type == PROFILING_CPU &&
+                         cntl->http_request().uri().GetQuery("recent"));
+    if (recent) {
+        enabled = IsContinuousProfilerRunning();
+        if (!enabled) {
+            extra_desc = " (-continuous_profiler_hz is 0)";
+        }
+    } else if (type == PROFILING_CPU) {
         enabled = cpu_profiler_enabled;
     } else if (type == PROFILING_CONTENTION) {
         enabled = true;
@@ -921,7 +1047,7 @@ static void StartProfiling(ProfilingType type,
     ProfilingClient profiling_client;
     size_t nwaiters = 0;
     ProfilingEnvironment & env = g_env[type];
-    if (view == NULL) {
+    if (view == NULL && !recent) {
         BAIDU_SCOPED_LOCK(env.mutex);
         if (env.client) {
             profiling_client = *env.client;
@@ -1011,6 +1137,13 @@ static void StartProfiling(ProfilingType type,
     if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
         os << "&seconds=" << seconds;
     }
+    if (recent) {
+        const std::string* method = cntl->http_request().uri().GetQuery("method");
+        os << "&recent&ago=" << ReadAgo(cntl);
+        if (method) {
+            os << "&method=" << *method;
+        }
+    }
     if (profiling_client.id != 0) {
         os << "&profiling_id=" << profiling_client.id;
     }
@@ -1143,6 +1276,20 @@ static void StartProfiling(ProfilingType type,
             return;
         }
     }
+    if (recent && view == NULL) {
+        const int ago = ReadAgo(cntl);
+        if (ago < 0) {
+            os << "Invalid ago</body></html>";
+            os.move_to(cntl->response_attachment());
+            cntl->http_response().set_status_code(HTTP_STATUS_BAD_REQUEST);
+            return;
+        }
+        PrintRecentMethods(os, cntl, seconds, ago);
+    } else if (type == PROFILING_CPU && view == NULL &&
+               IsContinuousProfilerRunning()) {
+        os << "<p>Continuous profiler is on, see <a href='/hotspots/cpu?recent"
+            "&seconds=60'>recent 60 seconds</a></p>";
+    }
 
     if (nwaiters >= CONCURRENT_PROFILING_LIMIT) {
         os << "Your profiling request is rejected because of "
@@ -1163,7 +1310,9 @@ static void StartProfiling(ProfilingType type,
             os << ", showing in about " << wait_seconds << " seconds ...";
         }
     } else {
-        if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
+        if (recent && view == NULL) {
+            os << "Generating " << type_str << " profile of recent samples ...";
+        } else if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
             os << "Profiling " << ProfilingType2String(type) << " for "
                << seconds << " seconds ...";
         } else {
@@ -95,6 +95,8 @@ void IndexService::default_method(::google::protobuf::RpcController* controller,
     if (!as_more) {
         os << Path("/status", html_addr) << " : Status of services" << NL
            << Path("/connections", html_addr) << " : List all connections" << NL
+           << Path("/hot_peers", html_addr)
+           << " : Peers with most messages, bytes and errors" << NL
            << Path("/flags", html_addr) << " : List all gflags" << NL
            << SP << Path("/flags/port", html_addr) << " : List the gflag" << NL
            << SP << Path("/flags/guard_page_size;help*", html_addr)
@@ -19,9 +19,14 @@
 #include <vector>
 #include <iomanip>
 #include <map>
+#include <gflags/gflags.h>
 #include "brpc/controller.h"                // Controller
 #include "brpc/server.h"                    // Server
 #include "brpc/closure_guard.h"             // ClosureGuard
+#include "brpc/progressive_attachment.h"    // ProgressiveAttachment
+#include "brpc/socket.h"                    // Socket
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/builtin/common.h"
 #include "bvar/bvar.h"
@@ -35,9 +40,18 @@ DECLARE_int32(bvar_max_dump_multi_dimension_metric_number);
 
 namespace brpc {
 
+DEFINE_int32(prometheus_metrics_chunk_size, 65536,
+             "/brpc_metrics is sent in chunks of about so many bytes as soon "
+             "as they're formatted, rather than being built as a whole page "
+             "before sending. 0 to disable");
+BRPC_VALIDATE_GFLAG(prometheus_metrics_chunk_size, NonNegativeInteger);
+
 // Defined in server.cpp
 extern const char* const g_server_info_prefix;
 
+static const char* const OPENMETRICS_CONTENT_TYPE =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
 // This is a class that convert bvar result to prometheus output.
 // Currently the output only includes gauge and summary for two
 // reasons:
@@ -45,21 +59,46 @@ extern const char* const g_server_info_prefix;
 // more counter is just another gauge.
 // 2) Histogram and summary is equivalent except that histogram
 // calculates quantiles in the server side.
+// The exception is buckets of LatencyRecorders using histograms(see
+// -bvar_latency_recorder_use_histogram), which are output as histograms
+// so that they can be aggregated across instances.
+// If `pa' is not NULL, output is sent to `pa' in chunks once it's larger
+// than -prometheus_metrics_chunk_size, otherwise it's kept in `os'.
 class PrometheusMetricsDumper : public bvar::Dumper {
 public:
-    explicit PrometheusMetricsDumper(butil::IOBufBuilder* os,
-                                     const std::string& server_prefix)
+    PrometheusMetricsDumper(butil::IOBufBuilder* os,
+                            const std::string& server_prefix,
+                            PrometheusFormat format = PROMETHEUS_FORMAT_TEXT,
+                            ProgressiveAttachment* pa = NULL)
         : _os(os)
-        , _server_prefix(server_prefix) {
+        , _server_prefix(server_prefix)
+        , _format(format)
+        , _pa(pa)
+        , _failed(false)
+        , _counter(false) {
     }
 
     bool dump(const std::string& name, const butil::StringPiece& desc) override;
     bool dump_mvar(const std::string& name, const butil::StringPiece& desc) override;
     bool dump_comment(const std::string& name, const std::string& type) override;
 
+    // Send output to `pa' if it's at least -prometheus_metrics_chunk_size
+    // bytes or `force' is true. Returns false if the client is gone.
+    bool Flush(bool force);
+
+    // True if output could not be sent to `pa'.
+    bool failed() const { return _failed; }
+
 private:
     DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
 
+    // Output HELP(not in OpenMetrics where it's optional) and TYPE lines.
+    void DumpHelpAndType(const butil::StringPiece& name, const char* type);
+
+    // Return true iff name is buckets of a LatencyRecorder.
+    bool DumpLatencyHistogram(const butil::StringPiece& name,
+                              const butil::StringPiece& desc);
+
     // Return true iff name ends with suffix output by LatencyRecorder.
     bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
                                    const butil::StringPiece& desc);
@@ -81,6 +120,11 @@ private:
 private:
     butil::IOBufBuilder* _os;
     const std::string _server_prefix;
+    const PrometheusFormat _format;
+    ProgressiveAttachment* _pa;
+    bool _failed;
+    // True if samples of mvars being dumped are counters.
+    bool _counter;
     std::map<std::string, SummaryItems> _m;
 };
 
@@ -90,24 +134,57 @@ butil::StringPiece GetMetricsName(const std::string& name) {
     return butil::StringPiece(name.data(), size);
 }
 
+bool PrometheusMetricsDumper::Flush(bool force) {
+    if (_pa == NULL) {
+        return true;
+    }
+    if (_failed) {
+        return false;
+    }
+    butil::IOBuf& buf = _os->buf();
+    if (buf.empty() ||
+        (!force && buf.size() < (size_t)FLAGS_prometheus_metrics_chunk_size)) {
+        return true;
+    }
+    // Don't wait for a slow client which makes the connection overcrowded,
+    // mvars are dumped with a global lock held.
+    if (_pa->Write(buf) != 0) {
+        PLOG(WARNING) << "Fail to send metrics to " << _pa->remote_side();
+        _failed = true;
+        return false;
+    }
+    buf.clear();
+    return true;
+}
+
+void PrometheusMetricsDumper::DumpHelpAndType(const butil::StringPiece& name,
+                                              const char* type) {
+    if (_format != PROMETHEUS_FORMAT_OPENMETRICS) {
+        *_os << "# HELP " << name << '\n';
+    }
+    *_os << "# TYPE " << name << ' ' << type << '\n';
+}
+
 bool PrometheusMetricsDumper::dump(const std::string& name,
                                    const butil::StringPiece& desc) {
     if (!desc.empty() && desc[0] == '"') {
         // there is no necessary to monitor string in prometheus
         return true;
     }
+    if (DumpLatencyHistogram(name, desc)) {
+        return Flush(false);
+    }
     if (DumpLatencyRecorderSuffix(name, desc)) {
         // Has encountered name with suffix exposed by LatencyRecorder,
         // Leave it to DumpLatencyRecorderSuffix to output Summary.
-        return true;
+        return Flush(false);
     }
 
     auto metrics_name = GetMetricsName(name);
 
-    *_os << "# HELP " << metrics_name << '\n'
-         << "# TYPE " << metrics_name << " gauge" << '\n'
-         << name << " " << desc << '\n';
-    return true;
+    DumpHelpAndType(metrics_name, "gauge");
+    *_os << name << " " << desc << '\n';
+    return Flush(false);
 }
 
 bool PrometheusMetricsDumper::dump_mvar(const std::string& name, const butil::StringPiece& desc) {
@@ -115,14 +192,26 @@ bool PrometheusMetricsDumper::dump_mvar(const std::string& name, const butil::St
         // there is no necessary to monitor string in prometheus
         return true;
     }
-    *_os << name << " " << desc << "\n";
-    return true;
+    if (_counter && _format == PROMETHEUS_FORMAT_OPENMETRICS) {
+        // Samples of counters are suffixed with _total in OpenMetrics.
+        const size_t pos = name.find('{');
+        if (pos == std::string::npos) {
+            *_os << name << "_total";
+        } else {
+            *_os << butil::StringPiece(name.data(), pos) << "_total"
+                 << butil::StringPiece(name.data() + pos, name.size() - pos);
+        }
+    } else {
+        *_os << name;
+    }
+    *_os << ' ' << desc << '\n';
+    return Flush(false);
 }
 
 bool PrometheusMetricsDumper::dump_comment(const std::string& name, const std::string& type) {
-    *_os << "# HELP " << name << '\n'
-         << "# TYPE " << name << " " << type << '\n';
-    return true;
+    _counter = (type == "counter");
+    DumpHelpAndType(name, type.c_str());
+    return Flush(false);
 }
 
 const PrometheusMetricsDumper::SummaryItems*
@@ -168,6 +257,43 @@ PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece&
     return NULL;
 }
 
+bool PrometheusMetricsDumper::DumpLatencyHistogram(
+    const butil::StringPiece& name,
+    const butil::StringPiece& desc) {
+    if (!name.ends_with("_latency_histogram")) {
+        return false;
+    }
+    // desc is {"buckets":[[le1,c1],[le2,c2],...],"sum":S,"count":C}, all
+    // numbers are non-negative integers.
+    std::vector<int64_t> numbers;
+    const char* p = desc.data();
+    const char* const end = desc.data() + desc.size();
+    while (p < end) {
+        if (*p < '0' || *p > '9') {
+            ++p;
+            continue;
+        }
+        int64_t n = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+            n = n * 10 + (*p - '0');
+        }
+        numbers.push_back(n);
+    }
+    if (numbers.size() < 2 || numbers.size() % 2 != 0) {
+        return false;
+    }
+    const size_t nbucket = numbers.size() / 2 - 1;
+    DumpHelpAndType(name, "histogram");
+    for (size_t i = 0; i < nbucket; ++i) {
+        *_os << name << "_bucket{le=\"" << numbers[2 * i] << "\"} "
+             << numbers[2 * i + 1] << '\n';
+    }
+    *_os << name << "_bucket{le=\"+Inf\"} " << numbers.back() << '\n'
+         << name << "_sum " << numbers[numbers.size() - 2] << '\n'
+         << name << "_count " << numbers.back() << '\n';
+    return true;
+}
+
 bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
     const butil::StringPiece& name,
     const butil::StringPiece& desc) {
@@ -181,9 +307,8 @@ bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
     if (!si->IsComplete()) {
         return true;
     }
-    *_os << "# HELP " << si->metric_name << '\n'
-         << "# TYPE " << si->metric_name << " summary\n"
-         << si->metric_name << "{quantile=\""
+    DumpHelpAndType(si->metric_name, "summary");
+    *_os << si->metric_name << "{quantile=\""
          << (double)(bvar::FLAGS_bvar_latency_p1) / 100 << "\"} "
          << si->latency_percentiles[0] << '\n'
          << si->metric_name << "{quantile=\""
@@ -197,10 +322,13 @@ bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
          << si->metric_name << "{quantile=\"0.9999\"} "
          << si->latency_percentiles[4] << '\n'
          << si->metric_name << "{quantile=\"1\"} "
-         << si->latency_percentiles[5] << '\n'
-         << si->metric_name << "{quantile=\"avg\"} "
-         << si->latency_avg << '\n'
-         << si->metric_name << "_sum "
+         << si->latency_percentiles[5] << '\n';
+    if (_format != PROMETHEUS_FORMAT_OPENMETRICS) {
+        // Quantiles must be numbers in OpenMetrics.
+        *_os << si->metric_name << "{quantile=\"avg\"} "
+             << si->latency_avg << '\n';
+    }
+    *_os << si->metric_name << "_sum "
          // There is no sum of latency in bvar output, just use
          // average * count as approximation
          << si->latency_avg * si->count << '\n'
@@ -208,37 +336,89 @@ bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
     return true;
 }
 
+static PrometheusFormat GetPrometheusFormat(const HttpHeader& header) {
+    const std::string* accept = header.GetHeader("Accept");
+    if (accept != NULL &&
+        accept->find("application/openmetrics-text") != std::string::npos) {
+        return PROMETHEUS_FORMAT_OPENMETRICS;
+    }
+    return PROMETHEUS_FORMAT_TEXT;
+}
+
 void PrometheusMetricsService::default_method(::google::protobuf::RpcController* cntl_base,
                                               const ::brpc::MetricsRequest*,
                                               ::brpc::MetricsResponse*,
                                               ::google::protobuf::Closure* done) {
     ClosureGuard done_guard(done);
     Controller *cntl = static_cast<Controller*>(cntl_base);
-    cntl->http_response().set_content_type("text/plain");
-    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment()) != 0) {
+    const PrometheusFormat format = GetPrometheusFormat(cntl->http_request());
+    cntl->http_response().set_content_type(
+        format == PROMETHEUS_FORMAT_OPENMETRICS ?
+        OPENMETRICS_CONTENT_TYPE : "text/plain");
+    if (FLAGS_prometheus_metrics_chunk_size > 0 &&
+        cntl->request_protocol() == PROTOCOL_HTTP) {
+        butil::intrusive_ptr<ProgressiveAttachment> pa =
+            cntl->CreateProgressiveAttachment();
+        if (pa != NULL) {
+            SocketUniquePtr sock;
+            ControllerPrivateAccessor(cntl).get_sending_socket()->ReAddress(&sock);
+            // Send the header now, metrics follow as chunks. cntl is
+            // destroyed after running done.
+            done_guard.reset(NULL);
+            if (DumpPrometheusMetricsToProgressiveAttachment(
+                    pa.get(), format) != 0) {
+                // Close the connection before `pa' ends the chunked body,
+                // otherwise the client takes the truncated metrics as
+                // complete ones.
+                sock->SetFailed(EFAILEDSOCKET, "Fail to dump metrics");
+            }
+            return;
+        }
+    }
+    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment(), format) != 0) {
         cntl->SetFailed("Fail to dump metrics");
         return;
     }
 }
 
-int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
+static int DumpPrometheusMetrics(butil::IOBuf* output,
+                                 PrometheusFormat format,
+                                 ProgressiveAttachment* pa) {
     butil::IOBufBuilder os;
-    PrometheusMetricsDumper dumper(&os, g_server_info_prefix);
+    PrometheusMetricsDumper dumper(&os, g_server_info_prefix, format, pa);
     const int ndump = bvar::Variable::dump_exposed(&dumper, NULL);
-    if (ndump < 0) {
+    if (ndump < 0 || dumper.failed()) {
         return -1;
     }
-    os.move_to(*output);
 
     if (bvar::FLAGS_bvar_max_dump_multi_dimension_metric_number > 0) {
-        PrometheusMetricsDumper dumper_md(&os, g_server_info_prefix);
-        const int ndump_md = bvar::MVariable::dump_exposed(&dumper_md, NULL);
-        if (ndump_md < 0) {
+        PrometheusMetricsDumper dumper_md(&os, g_server_info_prefix, format, pa);
+        bvar::MVariable::dump_exposed(&dumper_md, NULL);
+        if (dumper_md.failed()) {
             return -1;
         }
-        output->append(butil::IOBuf::Movable(os.buf()));
     }
+    if (format == PROMETHEUS_FORMAT_OPENMETRICS) {
+        os << "# EOF\n";
+    }
+    if (pa != NULL) {
+        return dumper.Flush(true) ? 0 : -1;
+    }
+    os.move_to(*output);
     return 0;
 }
 
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
+    return DumpPrometheusMetrics(output, PROMETHEUS_FORMAT_TEXT, NULL);
+}
+
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output, PrometheusFormat format) {
+    return DumpPrometheusMetrics(output, format, NULL);
+}
+
+int DumpPrometheusMetricsToProgressiveAttachment(ProgressiveAttachment* pa,
+                                                 PrometheusFormat format) {
+    return DumpPrometheusMetrics(NULL, format, pa);
+}
+
 } // namespace brpc
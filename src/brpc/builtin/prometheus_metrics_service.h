@@ -23,6 +23,16 @@
 
 namespace brpc {
 
+class ProgressiveAttachment;
+
+enum PrometheusFormat {
+    // text/plain; version=0.0.4
+    PROMETHEUS_FORMAT_TEXT,
+    // application/openmetrics-text; version=1.0.0, chosen when the scraper
+    // accepts it.
+    PROMETHEUS_FORMAT_OPENMETRICS,
+};
+
 class PrometheusMetricsService : public brpc_metrics {
 public:
     void default_method(::google::protobuf::RpcController* cntl_base,
@@ -33,6 +43,13 @@ public:
 
 butil::StringPiece GetMetricsName(const std::string& name);
 int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output);
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output, PrometheusFormat format);
+
+// Send metrics to `pa' in chunks of about -prometheus_metrics_chunk_size
+// bytes as soon as they're formatted, so that the whole output is never
+// held in memory. Returns 0 on success, -1 if the client is gone.
+int DumpPrometheusMetricsToProgressiveAttachment(ProgressiveAttachment* pa,
+                                                 PrometheusFormat format);
 
 } // namepace brpc
 
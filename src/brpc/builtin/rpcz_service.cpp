@@ -29,6 +29,7 @@
 #include "brpc/server.h"
 #include "brpc/errno.pb.h"
 #include "brpc/span.h"
+#include "brpc/details/rpc_phase.h"
 #include "brpc/builtin/rpcz_service.h"
 
 
@@ -321,6 +322,23 @@ static void PrintBthreadSpan(std::ostream& os, const RpczSpan& span, int64_t* la
     PrintAnnotations(os, std::numeric_limits<int64_t>::max(), last_time, extr, num_extr);
 }
 
+// Print time spent in phases of the request in one line, so that queueing
+// is easy to be separated from processing.
+static void PrintServerPhases(std::ostream& os, const RpczSpan& span) {
+    const int64_t times[RPC_PHASE_COUNT + 1] = {
+        span.received_real_us(), span.start_parse_real_us(),
+        span.start_callback_real_us(), span.start_send_real_us(),
+        span.start_write_real_us(), span.sent_real_us() };
+    os << "Phases:";
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        if (times[i] != 0 && times[i + 1] >= times[i]) {
+            os << ' ' << RpcPhaseName((RpcPhase)i) << '='
+               << times[i + 1] - times[i] << "us";
+        }
+    }
+    os << std::endl;
+}
+
 static void PrintServerSpan(std::ostream& os, const RpczSpan& span,
                             bool use_html) {
     SpanInfoExtractor server_extr(span.info().c_str());
@@ -379,6 +397,12 @@ static void PrintServerSpan(std::ostream& os, const RpczSpan& span,
             os << " Responding" << std::endl;
         }
     }
+
+    if (PrintAnnotationsAndRealTimeSpan(
+            os, span.start_write_real_us(),
+            &last_time, extr, ARRAY_SIZE(extr))) {
+        os << " Writing response" << std::endl;
+    }
     
     if (PrintAnnotationsAndRealTimeSpan(
             os, span.sent_real_us(),
@@ -388,6 +412,7 @@ static void PrintServerSpan(std::ostream& os, const RpczSpan& span,
 
     PrintAnnotations(os, std::numeric_limits<int64_t>::max(),
                      &last_time, extr, ARRAY_SIZE(extr));
+    PrintServerPhases(os, span);
 }
 
 class RpczSpanFilter : public SpanFilter {
@@ -29,6 +29,7 @@
 #include "brpc/compress.h"
 #include "brpc/global.h"
 #include "brpc/span.h"
+#include "brpc/details/tracing.h"
 #include "brpc/details/load_balancer_with_naming.h"
 #include "brpc/controller.h"
 #include "brpc/channel.h"
@@ -488,6 +489,9 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         span->set_start_send_us(start_send_us);
         cntl->_span = span;
     }
+    if (cntl->_sender == NULL) {
+        StartClientTrace(cntl);
+    }
     // Override some options if they haven't been set by Controller
     if (cntl->timeout_ms() == UNSET_MAGIC_NUM) {
         cntl->set_timeout_ms(_options.timeout_ms);
@@ -43,6 +43,7 @@
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
 #include "brpc/rpc_dump.h"
 #include "brpc/details/usercode_backup_pool.h"  // RunUserCode
+#include "brpc/details/tracing.h"               // EndClientTrace
 #include "brpc/mongo_service_adaptor.h"
 
 // Force linking the .o in UT (which analysis deps by inclusions)
@@ -265,6 +266,9 @@ void Controller::ResetPods() {
     _timeout_id = 0;
     _begin_time_us = 0;
     _end_time_us = 0;
+    _begin_time_stat = bthread_time_stat_t();
+    _phase_times.clear();
+    _trace_ctx.clear();
     _tos = 0;
     _preferred_index = -1;
     _request_compress_type = COMPRESS_TYPE_NONE;
@@ -995,6 +999,9 @@ void Controller::OnRPCEnd(int64_t end_time_us) {
     if (NULL != _backup_request_policy) {
         _backup_request_policy->OnRPCEnd(this);
     }
+    if (_trace_ctx.sampled) {
+        EndClientTrace(this);
+    }
 }
 
 void Controller::RunDoneInBackupThread(void* arg) {
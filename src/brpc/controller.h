@@ -47,6 +47,8 @@
 #include "brpc/grpc.h"
 #include "brpc/kvmap.h"
 #include "brpc/rpc_dump.h"
+#include "brpc/details/rpc_phase.h"           // RpcPhaseTimes
+#include "brpc/trace.h"                       // TraceContext
 
 // EAUTH is defined in MAC
 #ifndef EAUTH
@@ -829,6 +831,13 @@ private:
     // Begin/End time of a single RPC call (since Epoch in microseconds)
     int64_t _begin_time_us;
     int64_t _end_time_us;
+    // Time stats of the bthread when it began to process this request
+    // (server-side).
+    bthread_time_stat_t _begin_time_stat;
+    // When phases of processing this request began (server-side).
+    RpcPhaseTimes _phase_times;
+    // Context of the span of this RPC in brpc/trace.h
+    TraceContext _trace_ctx;
     short _tos;    // Type of service.
     // The index of parse function which `InputMessenger' will use
     int _preferred_index;
@@ -0,0 +1,572 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <gflags/gflags.h>
+#include "butil/build_config.h"
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "butil/files/file_enumerator.h"
+#include "butil/file_util.h"
+#include "butil/threading/platform_thread.h"
+#include "bvar/bvar.h"
+#include "bthread/task_meta.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/continuous_profiler.h"
+
+#if defined(OS_LINUX)
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace bthread {
+extern __thread bthread::LocalStorage tls_bls;
+// Defined in bthread.cpp
+extern int sample_current_stack(void* ucontext, void** pcs, int max_depth);
+}
+
+namespace brpc {
+
+static bool validate_continuous_profiler_hz(const char*, int32_t val) {
+    if (val < 0 || val > 1000) {
+        return false;
+    }
+    if (val > 0) {
+        StartContinuousProfiler();
+    }
+    return true;
+}
+
+DEFINE_int32(continuous_profiler_hz, 0,
+             "Sample stacks of each bthread worker so many times per second of "
+             "its CPU time and keep the samples for /hotspots/cpu?recent, 0 "
+             "disables the continuous profiler. A low value like 19 is "
+             "recommended for always-on profiling");
+BRPC_VALIDATE_GFLAG(continuous_profiler_hz, validate_continuous_profiler_hz);
+
+DEFINE_int32(continuous_profiler_max_seconds, 300,
+             "Keep samples of the continuous profiler for so many seconds");
+BRPC_VALIDATE_GFLAG(continuous_profiler_max_seconds, PositiveInteger);
+
+int64_t ContinuousProfilerNow() {
+    return butil::monotonic_time_s();
+}
+
+#if defined(OS_LINUX)
+
+static const int MAX_SAMPLE_DEPTH = 48;
+// Capacity of the sample ring of a worker, which is drained every 100ms.
+static const uint32_t SAMPLE_RING_SIZE = 256;
+static const size_t MAX_SAMPLED_WORKERS = 1024;
+
+struct Sample {
+    int64_t time_s;
+    const void* tag;
+    int depth;
+    void* pcs[MAX_SAMPLE_DEPTH];
+};
+
+// Samples of one worker. Written by the signal handler running in the
+// worker and read by the profiler thread.
+struct WorkerSampler {
+    // 0 when the sampler is not used by any worker.
+    butil::atomic<pid_t> tid;
+    // The perf_event, -1 if the worker is sampled by `timer' or not armed.
+    butil::atomic<int> fd;
+    bool has_timer;
+    timer_t timer;
+    butil::atomic<uint32_t> head;
+    butil::atomic<uint32_t> tail;
+    // Samples dropped because the ring is full.
+    butil::atomic<uint32_t> nfull;
+    Sample samples[SAMPLE_RING_SIZE];
+};
+
+// Samplers are never freed because signal handlers may be looking at them,
+// samplers of quitted workers are reused for new workers.
+static butil::static_atomic<WorkerSampler*> g_samplers[MAX_SAMPLED_WORKERS] = {};
+static butil::static_atomic<size_t> g_nsampler = BUTIL_STATIC_ATOMIC_INIT(0);
+static butil::static_atomic<bool> g_running = BUTIL_STATIC_ATOMIC_INIT(false);
+static butil::static_atomic<int> g_armed_hz = BUTIL_STATIC_ATOMIC_INIT(0);
+static pthread_once_t g_start_once = PTHREAD_ONCE_INIT;
+
+struct ContinuousProfilerVars {
+    bvar::Adder<int64_t> nsample;
+    bvar::Adder<int64_t> ndropped;
+    bvar::PassiveStatus<int> nworker;
+
+    ContinuousProfilerVars()
+        : nsample("continuous_profiler_sample_count")
+        , ndropped("continuous_profiler_dropped_count")
+        , nworker("continuous_profiler_worker_count", get_nworker, NULL) {}
+
+    static int get_nworker(void*) {
+        int n = 0;
+        const size_t nsampler = g_nsampler.load(butil::memory_order_acquire);
+        for (size_t i = 0; i < nsampler; ++i) {
+            WorkerSampler* s = g_samplers[i].load(butil::memory_order_acquire);
+            if (s && (s->fd.load(butil::memory_order_relaxed) >= 0 || s->has_timer)) {
+                ++n;
+            }
+        }
+        return n;
+    }
+};
+static ContinuousProfilerVars* g_vars = NULL;
+
+// Rolling profile: seconds -> (tag + pcs) -> count.
+typedef std::unordered_map<std::string, int64_t> StackCountMap;
+static pthread_mutex_t g_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<int64_t, StackCountMap>* g_profile = NULL;
+
+// Not used by glibc, gperftools (SIGPROF) or the bthread tracer (SIGURG).
+static int SampleSignal() {
+    return SIGRTMIN + 4;
+}
+
+// Caution: This function should be async-signal-safe.
+static void SampleHandler(int, siginfo_t* info, void* ucontext) {
+    const int saved_errno = errno;
+    WorkerSampler* s = NULL;
+    if (info->si_code == SI_TIMER) {
+        s = static_cast<WorkerSampler*>(info->si_value.sival_ptr);
+    } else {
+        const size_t n = g_nsampler.load(butil::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+            WorkerSampler* p = g_samplers[i].load(butil::memory_order_acquire);
+            if (p != NULL && p->fd.load(butil::memory_order_relaxed) == info->si_fd) {
+                s = p;
+                break;
+            }
+        }
+    }
+    if (s == NULL || s->tid.load(butil::memory_order_relaxed) != syscall(SYS_gettid)) {
+        errno = saved_errno;
+        return;
+    }
+    const int fd = s->fd.load(butil::memory_order_relaxed);
+    if (fd >= 0) {
+        // Arm the perf_event for next overflow.
+        ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
+    }
+    const uint32_t head = s->head.load(butil::memory_order_relaxed);
+    if (head - s->tail.load(butil::memory_order_acquire) >= SAMPLE_RING_SIZE) {
+        s->nfull.fetch_add(1, butil::memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+    Sample& smp = s->samples[head % SAMPLE_RING_SIZE];
+    smp.time_s = butil::monotonic_time_s();
+    smp.tag = bthread::tls_bls.sampling_tag;
+    smp.depth = bthread::sample_current_stack(ucontext, smp.pcs, MAX_SAMPLE_DEPTH);
+    s->head.store(head + 1, butil::memory_order_release);
+    errno = saved_errno;
+}
+
+static bool RegisterSampleHandler() {
+    struct sigaction old_sa;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = SampleHandler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&sa.sa_mask);
+    if (sigaction(SampleSignal(), NULL, &old_sa) != 0) {
+        PLOG(ERROR) << "Fail to sigaction";
+        return false;
+    }
+    if (old_sa.sa_handler != SIG_DFL && old_sa.sa_handler != SIG_IGN) {
+        LOG(ERROR) << "Signal handler of " << SampleSignal()
+                   << " is already registered";
+        return false;
+    }
+    if (sigaction(SampleSignal(), &sa, NULL) != 0) {
+        PLOG(ERROR) << "Fail to sigaction";
+        return false;
+    }
+    return true;
+}
+
+static int OpenPerfEvent(pid_t tid, int hz) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_period = 1000000000L / hz;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.wakeup_events = 1;
+    const int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1,
+                           PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct f_owner_ex owner;
+    owner.type = F_OWNER_TID;
+    owner.pid = tid;
+    if (fcntl(fd, F_SETFL, O_ASYNC) != 0 ||
+        fcntl(fd, F_SETSIG, SampleSignal()) != 0 ||
+        fcntl(fd, F_SETOWN_EX, &owner) != 0 ||
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool CreateCpuTimer(WorkerSampler* s, pid_t tid, int hz) {
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SampleSignal();
+    sev.sigev_value.sival_ptr = s;
+    sev._sigev_un._tid = tid;
+    // MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED) in linux.
+    const clockid_t clock = ((~(clockid_t)tid) << 3) | 6;
+    if (timer_create(clock, &sev, &s->timer) != 0) {
+        return false;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000L / hz;
+    its.it_value = its.it_interval;
+    if (timer_settime(s->timer, 0, &its, NULL) != 0) {
+        timer_delete(s->timer);
+        return false;
+    }
+    return true;
+}
+
+static void Arm(WorkerSampler* s, int hz) {
+    const pid_t tid = s->tid.load(butil::memory_order_relaxed);
+    // Prefer perf_event which is more accurate, use the CPU-time timer when
+    // perf_event is not permitted (say in containers).
+    const int fd = OpenPerfEvent(tid, hz);
+    if (fd >= 0) {
+        s->fd.store(fd, butil::memory_order_release);
+        if (ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) == 0) {
+            return;
+        }
+        s->fd.store(-1, butil::memory_order_release);
+        close(fd);
+    }
+    if (CreateCpuTimer(s, tid, hz)) {
+        s->has_timer = true;
+        return;
+    }
+    PLOG(WARNING) << "Fail to sample worker=" << tid;
+}
+
+static void Disarm(WorkerSampler* s) {
+    const int fd = s->fd.exchange(-1, butil::memory_order_acq_rel);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (s->has_timer) {
+        s->has_timer = false;
+        timer_delete(s->timer);
+    }
+}
+
+// Move samples in rings of workers into the rolling profile.
+static void Drain() {
+    std::string key;
+    int64_t nsample = 0;
+    int64_t ndropped = 0;
+    const int64_t now_s = butil::monotonic_time_s();
+    const int64_t oldest_s = now_s - FLAGS_continuous_profiler_max_seconds;
+    BAIDU_SCOPED_LOCK(g_profile_mutex);
+    const size_t n = g_nsampler.load(butil::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        WorkerSampler* s = g_samplers[i].load(butil::memory_order_acquire);
+        if (s == NULL) {
+            continue;
+        }
+        const uint32_t head = s->head.load(butil::memory_order_acquire);
+        uint32_t tail = s->tail.load(butil::memory_order_relaxed);
+        for (; tail != head; ++tail) {
+            const Sample& smp = s->samples[tail % SAMPLE_RING_SIZE];
+            if (smp.depth <= 0 || smp.time_s < oldest_s) {
+                ++ndropped;
+                continue;
+            }
+            key.assign((const char*)&smp.tag, sizeof(smp.tag));
+            key.append((const char*)smp.pcs, smp.depth * sizeof(void*));
+            ++(*g_profile)[smp.time_s][key];
+            ++nsample;
+        }
+        s->tail.store(tail, butil::memory_order_release);
+        ndropped += s->nfull.exchange(0, butil::memory_order_relaxed);
+    }
+    while (!g_profile->empty() && g_profile->begin()->first < oldest_s) {
+        g_profile->erase(g_profile->begin());
+    }
+    g_vars->nsample << nsample;
+    g_vars->ndropped << ndropped;
+}
+
+static bool IsWorker(const std::string& tid_str) {
+    char comm[32];
+    std::string path = "/proc/self/task/" + tid_str + "/comm";
+    FILE* fp = fopen(path.c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    const size_t nr = fread(comm, 1, sizeof(comm) - 1, fp);
+    fclose(fp);
+    comm[nr] = '\0';
+    // See TaskControl::worker_thread.
+    return strncmp(comm, "brpc_wkr:", 9) == 0;
+}
+
+static void ListWorkers(std::vector<pid_t>* tids) {
+    tids->clear();
+    butil::FileEnumerator task_enum(butil::FilePath("/proc/self/task"), false,
+                                    butil::FileEnumerator::DIRECTORIES);
+    for (butil::FilePath name = task_enum.Next(); !name.empty();
+         name = task_enum.Next()) {
+        const std::string tid_str = name.BaseName().value();
+        if (IsWorker(tid_str)) {
+            tids->push_back(atoi(tid_str.c_str()));
+        }
+    }
+}
+
+// Make samplers of current workers armed with `hz', or disarm all samplers
+// when `hz' is 0.
+static void SyncWorkers(int hz, bool rearm) {
+    Drain();
+    std::vector<pid_t> tids;
+    if (hz > 0) {
+        ListWorkers(&tids);
+    }
+    std::sort(tids.begin(), tids.end());
+    size_t n = g_nsampler.load(butil::memory_order_relaxed);
+    std::vector<WorkerSampler*> free_samplers;
+    for (size_t i = 0; i < n; ++i) {
+        WorkerSampler* s = g_samplers[i].load(butil::memory_order_relaxed);
+        const pid_t tid = s->tid.load(butil::memory_order_relaxed);
+        std::vector<pid_t>::iterator it =
+            std::lower_bound(tids.begin(), tids.end(), tid);
+        if (tid != 0 && it != tids.end() && *it == tid) {
+            if (rearm) {
+                Disarm(s);
+                Arm(s, hz);
+            }
+            tids.erase(it);
+            continue;
+        }
+        if (tid != 0) {
+            Disarm(s);
+            s->tid.store(0, butil::memory_order_relaxed);
+        }
+        free_samplers.push_back(s);
+    }
+    for (size_t i = 0; i < tids.size(); ++i) {
+        WorkerSampler* s = NULL;
+        if (!free_samplers.empty()) {
+            s = free_samplers.back();
+            free_samplers.pop_back();
+        } else if (n < MAX_SAMPLED_WORKERS) {
+            s = new WorkerSampler;
+            s->tid.store(0, butil::memory_order_relaxed);
+            s->fd.store(-1, butil::memory_order_relaxed);
+            s->has_timer = false;
+            s->head.store(0, butil::memory_order_relaxed);
+            s->tail.store(0, butil::memory_order_relaxed);
+            s->nfull.store(0, butil::memory_order_relaxed);
+            g_samplers[n].store(s, butil::memory_order_release);
+            g_nsampler.store(++n, butil::memory_order_release);
+        } else {
+            LOG_EVERY_SECOND(WARNING) << "Too many workers to sample";
+            break;
+        }
+        s->tid.store(tids[i], butil::memory_order_relaxed);
+        Arm(s, hz);
+    }
+    g_armed_hz.store(hz, butil::memory_order_relaxed);
+    g_running.store(hz > 0 && ContinuousProfilerVars::get_nworker(NULL) > 0,
+                    butil::memory_order_release);
+}
+
+static void* ProfilerThread(void*) {
+    butil::PlatformThread::SetName("brpc_cprofiler");
+    int armed_hz = 0;
+    int64_t last_sync_us = 0;
+    while (true) {
+        const int hz = FLAGS_continuous_profiler_hz;
+        const int64_t now_us = butil::monotonic_time_us();
+        if (hz != armed_hz || (hz > 0 && now_us >= last_sync_us + 1000000L)) {
+            // New workers may be added at any time.
+            SyncWorkers(hz, hz != armed_hz);
+            armed_hz = hz;
+            last_sync_us = now_us;
+        } else {
+            Drain();
+        }
+        usleep(100000);
+    }
+    return NULL;
+}
+
+static void StartProfilerThread() {
+    if (!RegisterSampleHandler()) {
+        return;
+    }
+    g_profile = new std::map<int64_t, StackCountMap>;
+    g_vars = new ContinuousProfilerVars;
+    pthread_t th;
+    const int rc = pthread_create(&th, NULL, ProfilerThread, NULL);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create continuous profiler thread: " << berror(rc);
+        return;
+    }
+    pthread_detach(th);
+}
+
+void StartContinuousProfiler() {
+    pthread_once(&g_start_once, StartProfilerThread);
+}
+
+bool IsContinuousProfilerRunning() {
+    return g_running.load(butil::memory_order_acquire);
+}
+
+// Merge samples in [begin_s, end_s) with tag `tag' (or all if it's NULL).
+static void MergeSamples(int64_t begin_s, int64_t end_s, const void* tag,
+                         StackCountMap* merged,
+                         std::map<const void*, int64_t>* ntag) {
+    if (g_profile == NULL) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(g_profile_mutex);
+    for (std::map<int64_t, StackCountMap>::const_iterator
+             it = g_profile->lower_bound(begin_s);
+         it != g_profile->end() && it->first < end_s; ++it) {
+        for (StackCountMap::const_iterator it2 = it->second.begin();
+             it2 != it->second.end(); ++it2) {
+            const void* key_tag = NULL;
+            memcpy(&key_tag, it2->first.data(), sizeof(key_tag));
+            if (ntag) {
+                (*ntag)[key_tag] += it2->second;
+            }
+            if (merged && (tag == NULL || tag == key_tag)) {
+                (*merged)[it2->first] += it2->second;
+            }
+        }
+    }
+}
+
+void CountContinuousProfile(int64_t begin_s, int64_t end_s,
+                            std::map<const void*, int64_t>* ntag) {
+    MergeSamples(begin_s, end_s, NULL, NULL, ntag);
+}
+
+int64_t DumpContinuousProfile(const char* filename,
+                              int64_t begin_s, int64_t end_s,
+                              const void* tag,
+                              std::map<const void*, int64_t>* ntag) {
+    StackCountMap merged;
+    MergeSamples(begin_s, end_s, tag, &merged, ntag);
+
+    // The legacy format of CPU profiles of gperftools, all fields are words:
+    // header: 0, 3, 0, sampling period in microseconds, 0
+    // record: count, depth, pc1, ..., pc<depth>
+    // trailer: 0, 1, 0
+    // followed by the text of /proc/self/maps.
+    const int hz = std::max(g_armed_hz.load(butil::memory_order_relaxed), 1);
+    std::vector<uintptr_t> words;
+    words.reserve(8 + merged.size() * 8);
+    const uintptr_t header[] = { 0, 3, 0, (uintptr_t)(1000000 / hz), 0 };
+    words.insert(words.end(), header, header + ARRAY_SIZE(header));
+    int64_t nsample = 0;
+    for (StackCountMap::const_iterator it = merged.begin();
+         it != merged.end(); ++it) {
+        const size_t depth = (it->first.size() - sizeof(void*)) / sizeof(void*);
+        words.push_back(it->second);
+        words.push_back(depth);
+        const size_t off = words.size();
+        words.resize(off + depth);
+        memcpy(&words[off], it->first.data() + sizeof(void*),
+               depth * sizeof(void*));
+        nsample += it->second;
+    }
+    const uintptr_t trailer[] = { 0, 1, 0 };
+    words.insert(words.end(), trailer, trailer + ARRAY_SIZE(trailer));
+
+    std::string maps;
+    if (!butil::ReadFileToString(butil::FilePath("/proc/self/maps"), &maps)) {
+        PLOG(ERROR) << "Fail to read /proc/self/maps";
+        return -1;
+    }
+    const butil::FilePath path(filename);
+    butil::File::Error error;
+    if (!butil::CreateDirectoryAndGetError(path.DirName(), &error)) {
+        LOG(ERROR) << "Fail to create directory of " << filename << ", " << error;
+        return -1;
+    }
+    FILE* fp = fopen(filename, "w");
+    if (fp == NULL) {
+        PLOG(ERROR) << "Fail to open " << filename;
+        return -1;
+    }
+    const bool ok =
+        fwrite(words.data(), sizeof(uintptr_t), words.size(), fp) == words.size() &&
+        fwrite(maps.data(), 1, maps.size(), fp) == maps.size();
+    if (fclose(fp) != 0 || !ok) {
+        PLOG(ERROR) << "Fail to write " << filename;
+        return -1;
+    }
+    return nsample;
+}
+
+#else  // OS_LINUX
+
+void StartContinuousProfiler() {
+    LOG(WARNING) << "Continuous profiler is only supported on linux";
+}
+
+bool IsContinuousProfilerRunning() {
+    return false;
+}
+
+void CountContinuousProfile(int64_t, int64_t, std::map<const void*, int64_t>*) {}
+
+int64_t DumpContinuousProfile(const char*, int64_t, int64_t, const void*,
+                              std::map<const void*, int64_t>*) {
+    return -1;
+}
+
+#endif  // OS_LINUX
+
+} // namespace brpc
@@ -0,0 +1,64 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_CONTINUOUS_PROFILER_H
+#define BRPC_CONTINUOUS_PROFILER_H
+
+#include <stdint.h>
+#include <map>
+
+namespace brpc {
+
+// A low-frequency sampling profiler which is always on (when
+// -continuous_profiler_hz is positive). Each bthread worker is interrupted
+// every 1/hz seconds of its CPU time (by a perf_event or a thread CPU-time
+// timer), the stack of the running bthread is captured by walking frame
+// pointers and tagged with the MethodStatus of the request being processed
+// by the bthread. Samples are aggregated into per-second buckets of a
+// rolling profile, so that CPU usage of any recent window can be looked up
+// after the fact, say a transient spike one minute ago.
+
+// Start the sampling thread if it's not started yet. Called when
+// -continuous_profiler_hz is set to positive.
+void StartContinuousProfiler();
+
+// True if samples are being taken.
+bool IsContinuousProfilerRunning();
+
+// Seconds since an unspecified starting point, the clock of samples.
+int64_t ContinuousProfilerNow();
+
+// Write samples taken in [begin_s, end_s) into `filename' in the format of
+// CPU profiles of gperftools, which can be analyzed by pprof. If `tag' is
+// not NULL, only samples tagged with `tag' are written.
+// Numbers of samples of different tags in the window (regardless of `tag')
+// are stored into `ntag' if it's not NULL, samples not taken in processing
+// of any request are counted with tag NULL.
+// Returns number of samples written, -1 on error.
+int64_t DumpContinuousProfile(const char* filename,
+                              int64_t begin_s, int64_t end_s,
+                              const void* tag,
+                              std::map<const void*, int64_t>* ntag);
+
+// Count samples of different tags in [begin_s, end_s).
+void CountContinuousProfile(int64_t begin_s, int64_t end_s,
+                            std::map<const void*, int64_t>* ntag);
+
+} // namespace brpc
+
+#endif // BRPC_CONTINUOUS_PROFILER_H
@@ -147,6 +147,19 @@ public:
         return *this;
     }
 
+    // Server-side only.
+    ControllerPrivateAccessor& set_phase_begin_us(RpcPhase phase, int64_t tm) {
+        _cntl->_phase_times.begin_us[phase] = tm;
+        return *this;
+    }
+    void set_phase_end_us(int64_t tm) { _cntl->_phase_times.end_us = tm; }
+    const RpcPhaseTimes& phase_times() const { return _cntl->_phase_times; }
+
+    TraceContext* mutable_trace_context() { return &_cntl->_trace_ctx; }
+    const TraceContext* trace_context() const { return &_cntl->_trace_ctx; }
+    int64_t begin_time_us() const { return _cntl->_begin_time_us; }
+    int64_t end_time_us() const { return _cntl->_end_time_us; }
+
     ControllerPrivateAccessor& set_health_check_call() {
         _cntl->add_flag(Controller::FLAGS_HEALTH_CHECK_CALL);
         return *this;
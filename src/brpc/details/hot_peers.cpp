@@ -0,0 +1,347 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/thread_local.h"                   // thread_atexit
+#include "butil/synchronization/lock.h"
+#include "bvar/passive_status.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/hot_peers.h"
+
+namespace brpc {
+
+DEFINE_bool(enable_hot_peers, false,
+            "Track peers with most messages, bytes and errors, see /hot_peers. "
+            "Costs some nanoseconds per message, more when there're many "
+            "distinct peers");
+BRPC_VALIDATE_GFLAG(enable_hot_peers, PassValidate);
+
+DEFINE_int32(hot_peers_capacity, 64,
+             "Max number of peers tracked for each metric in each thread. "
+             "Counts of peers ranked beyond are unreliable");
+BRPC_VALIDATE_GFLAG(hot_peers_capacity, PositiveInteger);
+
+DEFINE_int32(hot_peers_window_s, 10,
+             "Hot peers are found in windows of so many seconds");
+BRPC_VALIDATE_GFLAG(hot_peers_window_s, PositiveInteger);
+
+const char* HotPeersMetricName(HotPeersMetric metric) {
+    switch (metric) {
+    case HOT_PEERS_MESSAGES:
+        return "messages";
+    case HOT_PEERS_BYTES_IN:
+        return "bytes_in";
+    case HOT_PEERS_BYTES_OUT:
+        return "bytes_out";
+    case HOT_PEERS_ERRORS:
+        return "errors";
+    case HOT_PEERS_METRIC_COUNT:
+        break;
+    }
+    return "unknown";
+}
+
+int SpaceSavingSketch::init(size_t capacity) {
+    butil::FlatMap<butil::EndPoint, size_t> index;
+    if (index.init(capacity * 2 + 1) != 0) {
+        return -1;
+    }
+    _index.swap(index);
+    _capacity = capacity;
+    _total = 0;
+    _items.clear();
+    _items.reserve(capacity);
+    return 0;
+}
+
+void SpaceSavingSketch::add(const butil::EndPoint& key, int64_t n,
+                            int64_t error) {
+    if (_capacity == 0) {
+        return;
+    }
+    _total += n;
+    size_t* index = _index.seek(key);
+    if (index != NULL) {
+        Item& item = _items[*index];
+        item.count += n;
+        item.error += error;
+        return;
+    }
+    if (_items.size() < _capacity) {
+        _index[key] = _items.size();
+        Item item = { key, n, error };
+        _items.push_back(item);
+        return;
+    }
+    // Replace the key with minimum count. The linear scan is cheap since
+    // the capacity is small and hot keys hit the index above.
+    size_t min_i = 0;
+    for (size_t i = 1; i < _items.size(); ++i) {
+        if (_items[i].count < _items[min_i].count) {
+            min_i = i;
+        }
+    }
+    Item& item = _items[min_i];
+    _index.erase(item.key);
+    _index[key] = min_i;
+    item.key = key;
+    item.error = item.count + error;
+    item.count += n;
+}
+
+void SpaceSavingSketch::merge(const SpaceSavingSketch& other) {
+    const int64_t total = _total + other._total;
+    for (size_t i = 0; i < other._items.size(); ++i) {
+        const Item& item = other._items[i];
+        add(item.key, item.count, item.error);
+    }
+    _total = total;
+}
+
+void SpaceSavingSketch::clear() {
+    _total = 0;
+    _items.clear();
+    _index.clear();
+}
+
+void SpaceSavingSketch::swap(SpaceSavingSketch& other) {
+    std::swap(_capacity, other._capacity);
+    std::swap(_total, other._total);
+    _items.swap(other._items);
+    _index.swap(other._index);
+}
+
+std::string HotPeerName(const butil::EndPoint& peer) {
+    if (butil::is_endpoint_extended(peer)) {
+        return butil::endpoint2str(peer).c_str();
+    }
+    return butil::ip2str(peer.ip).c_str();
+}
+
+// Stats recorded by one thread. The mutex is only contended with readers
+// of the stats.
+struct ThreadHotPeers {
+    ThreadHotPeers() : window_start(-1) {}
+
+    butil::Mutex mutex;
+    // Starting second of the window that `cur' is in.
+    int64_t window_start;
+    SpaceSavingSketch cur[HOT_PEERS_METRIC_COUNT];
+    SpaceSavingSketch prev[HOT_PEERS_METRIC_COUNT];
+};
+
+struct HotPeersRegistry {
+    butil::Mutex mutex;
+    std::vector<ThreadHotPeers*> threads;
+    // Stats of exited threads.
+    ThreadHotPeers exited;
+};
+
+static HotPeersRegistry* GetRegistry() {
+    static HotPeersRegistry* registry = new HotPeersRegistry;
+    return registry;
+}
+
+// Returns starting second of the current window.
+static int64_t CurrentWindow() {
+    const int64_t now_s = butil::cpuwide_time_s();
+    return now_s - now_s % FLAGS_hot_peers_window_s;
+}
+
+// Move `t' to the window starting at `window'. Called with t->mutex held.
+static void Rotate(ThreadHotPeers* t, int64_t window) {
+    if (window == t->window_start) {
+        return;
+    }
+    const size_t capacity = FLAGS_hot_peers_capacity;
+    for (int i = 0; i < HOT_PEERS_METRIC_COUNT; ++i) {
+        // Stats of the last window are kept if it's just before `window',
+        // which may not be true after -hot_peers_window_s is changed.
+        if (window == t->window_start + FLAGS_hot_peers_window_s) {
+            t->prev[i].swap(t->cur[i]);
+        } else {
+            t->prev[i].clear();
+        }
+        if (t->cur[i].capacity() != capacity) {
+            t->cur[i].init(capacity);
+        } else {
+            t->cur[i].clear();
+        }
+    }
+    t->window_start = window;
+}
+
+static __thread ThreadHotPeers* tls_hot_peers = NULL;
+static __thread bool tls_hot_peers_destroyed = false;
+
+static void DestroyThreadHotPeers(void* arg) {
+    ThreadHotPeers* t = static_cast<ThreadHotPeers*>(arg);
+    HotPeersRegistry* r = GetRegistry();
+    {
+        BAIDU_SCOPED_LOCK(r->mutex);
+        r->threads.erase(std::remove(r->threads.begin(), r->threads.end(), t),
+                         r->threads.end());
+    }
+    {
+        const int64_t window = CurrentWindow();
+        BAIDU_SCOPED_LOCK(r->exited.mutex);
+        Rotate(&r->exited, window);
+        BAIDU_SCOPED_LOCK(t->mutex);
+        Rotate(t, window);
+        for (int i = 0; i < HOT_PEERS_METRIC_COUNT; ++i) {
+            r->exited.cur[i].merge(t->cur[i]);
+            r->exited.prev[i].merge(t->prev[i]);
+        }
+    }
+    delete t;
+    tls_hot_peers = NULL;
+    tls_hot_peers_destroyed = true;
+}
+
+// Returns stats of this thread, NULL if the thread is exiting.
+static ThreadHotPeers* GetThreadHotPeers() {
+    ThreadHotPeers* t = tls_hot_peers;
+    if (t != NULL) {
+        return t;
+    }
+    if (tls_hot_peers_destroyed) {
+        return NULL;
+    }
+    t = new (std::nothrow) ThreadHotPeers;
+    if (t == NULL) {
+        return NULL;
+    }
+    HotPeersRegistry* r = GetRegistry();
+    {
+        BAIDU_SCOPED_LOCK(r->mutex);
+        r->threads.push_back(t);
+    }
+    tls_hot_peers = t;
+    butil::thread_atexit(DestroyThreadHotPeers, t);
+    return t;
+}
+
+void AddHotPeerStats(const butil::EndPoint& remote_side,
+                     int64_t messages, int64_t bytes_in,
+                     int64_t bytes_out, int64_t errors) {
+    if (!FLAGS_enable_hot_peers) {
+        return;
+    }
+    ThreadHotPeers* t = GetThreadHotPeers();
+    if (t == NULL) {
+        return;
+    }
+    // Connections from different ports of a client are counted together.
+    const butil::EndPoint peer = butil::is_endpoint_extended(remote_side) ?
+        remote_side : butil::EndPoint(remote_side.ip, 0);
+    const int64_t window = CurrentWindow();
+    BAIDU_SCOPED_LOCK(t->mutex);
+    Rotate(t, window);
+    if (messages) {
+        t->cur[HOT_PEERS_MESSAGES].add(peer, messages);
+    }
+    if (bytes_in) {
+        t->cur[HOT_PEERS_BYTES_IN].add(peer, bytes_in);
+    }
+    if (bytes_out) {
+        t->cur[HOT_PEERS_BYTES_OUT].add(peer, bytes_out);
+    }
+    if (errors) {
+        t->cur[HOT_PEERS_ERRORS].add(peer, errors);
+    }
+}
+
+static bool CompareCount(const HotPeer& p1, const HotPeer& p2) {
+    return p1.count > p2.count;
+}
+
+int64_t GetHotPeers(HotPeersMetric metric, bool current_window,
+                    size_t k, std::vector<HotPeer>* out) {
+    out->clear();
+    if (metric < 0 || metric >= HOT_PEERS_METRIC_COUNT) {
+        return 0;
+    }
+    // Sketches of different threads are summed up.
+    butil::FlatMap<butil::EndPoint, HotPeer> peers;
+    if (peers.init(FLAGS_hot_peers_capacity * 2 + 1) != 0) {
+        return 0;
+    }
+    int64_t total = 0;
+    const int64_t window = CurrentWindow();
+    auto collect = [&](ThreadHotPeers* t) {
+        BAIDU_SCOPED_LOCK(t->mutex);
+        Rotate(t, window);
+        const SpaceSavingSketch& s =
+            current_window ? t->cur[metric] : t->prev[metric];
+        total += s.total();
+        for (size_t i = 0; i < s.items().size(); ++i) {
+            const SpaceSavingSketch::Item& item = s.items()[i];
+            HotPeer* p = peers.seek(item.key);
+            if (p == NULL) {
+                HotPeer hp = { item.key, 0, 0 };
+                p = &(peers[item.key] = hp);
+            }
+            p->count += item.count;
+            p->error += item.error;
+        }
+    };
+    HotPeersRegistry* r = GetRegistry();
+    {
+        BAIDU_SCOPED_LOCK(r->mutex);
+        for (size_t i = 0; i < r->threads.size(); ++i) {
+            collect(r->threads[i]);
+        }
+    }
+    collect(&r->exited);
+
+    out->reserve(peers.size());
+    for (auto it = peers.begin(); it != peers.end(); ++it) {
+        out->push_back(it->second);
+    }
+    std::sort(out->begin(), out->end(), CompareCount);
+    if (out->size() > k) {
+        out->resize(k);
+    }
+    return total;
+}
+
+static void PrintTopPeers(std::ostream& os, void* arg) {
+    const HotPeersMetric metric =
+        static_cast<HotPeersMetric>(reinterpret_cast<intptr_t>(arg));
+    std::vector<HotPeer> peers;
+    GetHotPeers(metric, false, 5, &peers);
+    for (size_t i = 0; i < peers.size(); ++i) {
+        if (i) {
+            os << ' ';
+        }
+        os << HotPeerName(peers[i].peer) << ':' << peers[i].count;
+    }
+}
+
+static bvar::PassiveStatus<std::string> s_hot_peers_by_messages(
+    "rpc_hot_peers_by_messages", PrintTopPeers, (void*)(intptr_t)HOT_PEERS_MESSAGES);
+static bvar::PassiveStatus<std::string> s_hot_peers_by_bytes_in(
+    "rpc_hot_peers_by_bytes_in", PrintTopPeers, (void*)(intptr_t)HOT_PEERS_BYTES_IN);
+static bvar::PassiveStatus<std::string> s_hot_peers_by_bytes_out(
+    "rpc_hot_peers_by_bytes_out", PrintTopPeers, (void*)(intptr_t)HOT_PEERS_BYTES_OUT);
+static bvar::PassiveStatus<std::string> s_hot_peers_by_errors(
+    "rpc_hot_peers_by_errors", PrintTopPeers, (void*)(intptr_t)HOT_PEERS_ERRORS);
+
+} // namespace brpc
@@ -0,0 +1,117 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_HOT_PEERS_H
+#define BRPC_HOT_PEERS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "butil/endpoint.h"
+#include "butil/containers/flat_map.h"
+
+namespace brpc {
+
+// Find peers which contribute most messages, bytes or errors among all
+// connections of this process, without keeping a counter for every peer.
+// Peers are keyed by IP, connections from different ports of a client are
+// counted together (except IPv6 and unix sockets which are keyed by the
+// whole address).
+
+enum HotPeersMetric {
+    // Messages cut from connections: requests at server side and responses
+    // at client side.
+    HOT_PEERS_MESSAGES = 0,
+    HOT_PEERS_BYTES_IN,
+    HOT_PEERS_BYTES_OUT,
+    // Unparsable messages, failed authentications and writes.
+    HOT_PEERS_ERRORS,
+    HOT_PEERS_METRIC_COUNT
+};
+
+const char* HotPeersMetricName(HotPeersMetric metric);
+
+// Space-Saving sketch (Metwally et al.) which tracks at most `capacity'
+// keys. When a key not tracked arrives at a full sketch, the key with
+// minimum count is replaced and the new key inherits the count as its
+// overestimation. Any key whose real count is more than total/capacity is
+// guaranteed to be tracked.
+// Not thread-safe.
+class SpaceSavingSketch {
+public:
+    struct Item {
+        butil::EndPoint key;
+        // Estimated count, never less than the real count.
+        int64_t count;
+        // Max overestimation of `count'.
+        int64_t error;
+    };
+
+    SpaceSavingSketch() : _capacity(0), _total(0) {}
+
+    // Returns 0 on success, -1 otherwise.
+    int init(size_t capacity);
+    size_t capacity() const { return _capacity; }
+
+    // Add `n' to the count of `key'.
+    void add(const butil::EndPoint& key, int64_t n) { add(key, n, 0); }
+    void add(const butil::EndPoint& key, int64_t n, int64_t error);
+
+    // Add all items of `other' into this sketch.
+    void merge(const SpaceSavingSketch& other);
+
+    void clear();
+    void swap(SpaceSavingSketch& other);
+
+    // Sum of all counts added.
+    int64_t total() const { return _total; }
+    const std::vector<Item>& items() const { return _items; }
+
+private:
+    size_t _capacity;
+    int64_t _total;
+    std::vector<Item> _items;
+    // key -> index in _items
+    butil::FlatMap<butil::EndPoint, size_t> _index;
+};
+
+// Record stats of the peer at `remote_side'. Called in the paths of
+// InputMessenger and Socket::Write.
+void AddHotPeerStats(const butil::EndPoint& remote_side,
+                     int64_t messages, int64_t bytes_in,
+                     int64_t bytes_out, int64_t errors);
+
+// Printable name of a peer.
+std::string HotPeerName(const butil::EndPoint& peer);
+
+struct HotPeer {
+    butil::EndPoint peer;
+    int64_t count;
+    int64_t error;
+};
+
+// Get top `k' peers by `metric' in the last complete window (of
+// -hot_peers_window_s seconds), or in the window in progress if
+// `current_window' is true. Sorted by count in descending order.
+// Returns sum of counts of all peers in the window.
+int64_t GetHotPeers(HotPeersMetric metric, bool current_window,
+                    size_t k, std::vector<HotPeer>* out);
+
+} // namespace brpc
+
+#endif // BRPC_HOT_PEERS_H
@@ -17,13 +17,21 @@
 
 
 #include <limits>
+#include <gflags/gflags.h>
 #include "butil/macros.h"
 #include "brpc/controller.h"
+#include "brpc/details/controller_private_accessor.h"
 #include "brpc/details/server_private_accessor.h"
+#include "brpc/details/tracing.h"
 #include "brpc/details/method_status.h"
 
 namespace brpc {
 
+DEFINE_bool(rpc_phase_breakdown, false,
+            "Record distributions of time spent by requests in phases(queue, "
+            "parse, handler, serialize, write) for methods added while this "
+            "flag is on, shown in /status");
+
 static int cast_int(void* arg) {
     return *(int*)arg;
 }
@@ -36,11 +44,24 @@ static int cast_cl(void* arg) {
     return 0;
 }
 
+static double get_window_average_us(void* arg) {
+    const bvar::Window<bvar::IntRecorder>* w =
+        static_cast<bvar::Window<bvar::IntRecorder>*>(arg);
+    return w->get_value().get_average_double() / 1000.0;
+}
+
 MethodStatus::MethodStatus()
     : _nconcurrency(0)
     , _nconcurrency_bvar(cast_int, &_nconcurrency)
     , _eps_bvar(&_nerror_bvar)
     , _max_concurrency_bvar(cast_cl, &_cl)
+    , _on_cpu_window(&_on_cpu_ns, -1)
+    , _runqueue_wait_window(&_runqueue_wait_ns, -1)
+    , _blocked_window(&_blocked_ns, -1)
+    , _on_cpu_us_bvar(get_window_average_us, &_on_cpu_window)
+    , _runqueue_wait_us_bvar(get_window_average_us, &_runqueue_wait_window)
+    , _blocked_us_bvar(get_window_average_us, &_blocked_window)
+    , _phase_rec(FLAGS_rpc_phase_breakdown ? new RpcPhaseRecorder : NULL)
 {
 }
 
@@ -60,6 +81,18 @@ int MethodStatus::Expose(const butil::StringPiece& prefix) {
     if (_latency_rec.expose(prefix) != 0) {
         return -1;
     }
+    if (_on_cpu_us_bvar.expose_as(prefix, "on_cpu_us") != 0) {
+        return -1;
+    }
+    if (_runqueue_wait_us_bvar.expose_as(prefix, "runqueue_wait_us") != 0) {
+        return -1;
+    }
+    if (_blocked_us_bvar.expose_as(prefix, "blocked_us") != 0) {
+        return -1;
+    }
+    if (_phase_rec && _phase_rec->Expose(prefix) != 0) {
+        return -1;
+    }
     if (_cl) {
         if (_max_concurrency_bvar.expose_as(prefix, "max_concurrency") != 0) {
             return -1;
@@ -136,6 +169,17 @@ void MethodStatus::Describe(
     OutputValue(os, "max_latency: ", _latency_rec.max_latency_name(),
                 _latency_rec.max_latency(), options, false);
 
+    // Where time of requests goes.
+    OutputValue(os, "on_cpu_us: ", _on_cpu_us_bvar.name(),
+                _on_cpu_us_bvar.get_value(), options, false);
+    OutputValue(os, "runqueue_wait_us: ", _runqueue_wait_us_bvar.name(),
+                _runqueue_wait_us_bvar.get_value(), options, false);
+    OutputValue(os, "blocked_us: ", _blocked_us_bvar.name(),
+                _blocked_us_bvar.get_value(), options, false);
+    if (_phase_rec) {
+        _phase_rec->Describe(os, options);
+    }
+
     // Concurrency
     OutputValue(os, "concurrency: ", _nconcurrency_bvar.name(),
                 _nconcurrency, options, false);
@@ -145,6 +189,17 @@ void MethodStatus::Describe(
     }
 }
 
+void MethodStatus::OnTaskTime(const bthread_time_stat_t& begin) {
+    bthread_time_stat_t end;
+    if (begin.tid == INVALID_BTHREAD || bthread_get_time_stat(&end) != 0 ||
+        end.tid != begin.tid) {
+        return;
+    }
+    _on_cpu_ns << end.on_cpu_ns - begin.on_cpu_ns;
+    _runqueue_wait_ns << end.runqueue_wait_ns - begin.runqueue_wait_ns;
+    _blocked_ns << end.blocked_ns - begin.blocked_ns;
+}
+
 void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
     _cl.reset(cl);
 }
@@ -157,11 +212,18 @@ int HandleResponseWritten(bthread_id_t id, void* data, int /*error_code*/) {
 }
 
 ConcurrencyRemover::~ConcurrencyRemover() {
+    ServerPrivateAccessor accessor(_c->server());
+    EndServerTrace(_c);
     if (_status) {
+        if (bthread::tls_bls.sampling_tag == _status) {
+            bthread::tls_bls.sampling_tag = NULL;
+        }
         _status->OnResponded(_c->ErrorCode(), butil::cpuwide_time_us() - _received_us);
+        _status->OnTaskTime(accessor.begin_time_stat(_c));
+        _status->OnPhases(ControllerPrivateAccessor(_c).phase_times());
         _status = NULL;
     }
-    ServerPrivateAccessor(_c->server()).RemoveConcurrency(_c);
+    accessor.RemoveConcurrency(_c);
 }
 
 }  // namespace brpc
@@ -20,10 +20,16 @@
 #define  BRPC_METHOD_STATUS_H
 
 #include "butil/macros.h"                  // DISALLOW_COPY_AND_ASSIGN
+#include "bthread/bthread.h"               // bthread_get_time_stat
+#include "bthread/task_meta.h"             // LocalStorage
 #include "bvar/bvar.h"                    // vars
 #include "brpc/describable.h"
 #include "brpc/concurrency_limiter.h"
+#include "brpc/details/rpc_phase.h"
 
+namespace bthread {
+extern __thread bthread::LocalStorage tls_bls;
+}
 
 namespace brpc {
 
@@ -48,6 +54,21 @@ public:
     // did the time keeping and the cost is better saved. 
     void OnResponded(int error_code, int64_t latency_us);
 
+    // Call this in the bthread which began to process the request and
+    // got time stats `begin' at that time, so that time spent by the
+    // bthread on running, waiting in run queues and being blocked is
+    // attributed to the method. Time of requests whose responses are sent
+    // in other bthreads (asynchronous done) is not counted.
+    void OnTaskTime(const bthread_time_stat_t& begin);
+
+    // Call this when the response of a request is sent, with timestamps of
+    // phases of the request.
+    void OnPhases(const RpcPhaseTimes& times) {
+        if (_phase_rec) {
+            _phase_rec->Record(times);
+        }
+    }
+
     // Expose internal vars.
     // Return 0 on success, -1 otherwise.
     int Expose(const butil::StringPiece& prefix);
@@ -73,6 +94,19 @@ friend class Server;
     bvar::PassiveStatus<int>  _nconcurrency_bvar;
     bvar::PerSecond<bvar::Adder<int64_t>> _eps_bvar;
     bvar::PassiveStatus<int32_t> _max_concurrency_bvar;
+    // Nanoseconds per request.
+    bvar::IntRecorder _on_cpu_ns;
+    bvar::IntRecorder _runqueue_wait_ns;
+    bvar::IntRecorder _blocked_ns;
+    bvar::Window<bvar::IntRecorder> _on_cpu_window;
+    bvar::Window<bvar::IntRecorder> _runqueue_wait_window;
+    bvar::Window<bvar::IntRecorder> _blocked_window;
+    // Average microseconds per request in recent window.
+    bvar::PassiveStatus<double> _on_cpu_us_bvar;
+    bvar::PassiveStatus<double> _runqueue_wait_us_bvar;
+    bvar::PassiveStatus<double> _blocked_us_bvar;
+    // Not NULL iff -rpc_phase_breakdown was on when this method was added.
+    std::unique_ptr<RpcPhaseRecorder> _phase_rec;
 };
 
 struct ResponseWriteInfo {
@@ -94,7 +128,31 @@ private:
     int64_t _received_us;
 };
 
+// Restores fields of bthread local storage set for a request (sampling_tag,
+// trace_parent) when leaving the scope. The processing of a request may go
+// on after CallMethod() returns (asynchronous done) while the bthread, e.g.
+// the one processing the last message in-place, proceeds to other requests
+// which must not see these fields.
+class RequestLocalStorageGuard {
+public:
+    RequestLocalStorageGuard()
+        : _sampling_tag(bthread::tls_bls.sampling_tag)
+        , _trace_parent(bthread::tls_bls.trace_parent) {}
+    ~RequestLocalStorageGuard() {
+        bthread::tls_bls.sampling_tag = _sampling_tag;
+        bthread::tls_bls.trace_parent = _trace_parent;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RequestLocalStorageGuard);
+    const void* _sampling_tag;
+    const void* _trace_parent;
+};
+
 inline bool MethodStatus::OnRequested(int* rejected_cc, Controller* cntl) {
+    // Samples of the continuous profiler in this bthread are attributed to
+    // this method from now on.
+    bthread::tls_bls.sampling_tag = this;
     const int cc = _nconcurrency.fetch_add(1, butil::memory_order_relaxed) + 1;
     if (NULL == _cl || _cl->OnRequested(cc, cntl)) {
         return true;
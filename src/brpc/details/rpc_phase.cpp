@@ -0,0 +1,162 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <string.h>
+#include "butil/string_printf.h"
+#include "bvar/passive_status.h"
+#include "bvar/detail/histogram.h"
+#include "brpc/describable.h"
+#include "brpc/details/rpc_phase.h"
+
+namespace brpc {
+
+const char* RpcPhaseName(RpcPhase phase) {
+    switch (phase) {
+    case RPC_PHASE_QUEUE:
+        return "queue";
+    case RPC_PHASE_PARSE:
+        return "parse";
+    case RPC_PHASE_HANDLER:
+        return "handler";
+    case RPC_PHASE_SERIALIZE:
+        return "serialize";
+    case RPC_PHASE_WRITE:
+        return "write";
+    case RPC_PHASE_COUNT:
+        break;
+    }
+    return "unknown";
+}
+
+void RpcPhaseTimes::clear() {
+    memset(begin_us, 0, sizeof(begin_us));
+    end_us = 0;
+}
+
+int64_t RpcPhaseTimes::duration_us(RpcPhase phase) const {
+    const int64_t begin = begin_us[phase];
+    const int64_t end = (phase + 1 < RPC_PHASE_COUNT ?
+                         begin_us[phase + 1] : end_us);
+    if (begin == 0 || end == 0 || end < begin) {
+        return -1;
+    }
+    return end - begin;
+}
+
+static double get_phase_average_us(void* arg);
+
+struct RpcPhaseRecorder::Phase {
+    Phase()
+        : window(&histogram, -1)
+        , avg_us(get_phase_average_us, this) {}
+
+    bvar::detail::Histogram histogram;
+    bvar::detail::HistogramWindow window;
+    bvar::PassiveStatus<double> avg_us;
+};
+
+static double get_phase_average_us(void* arg) {
+    const bvar::detail::HistogramBuckets b =
+        static_cast<RpcPhaseRecorder::Phase*>(arg)->window.get_value();
+    const uint64_t n = b.count();
+    return n ? (double)b.sum / n : 0;
+}
+
+RpcPhaseRecorder::RpcPhaseRecorder()
+    : _phases(new Phase[RPC_PHASE_COUNT]) {}
+
+RpcPhaseRecorder::~RpcPhaseRecorder() {
+    delete [] _phases;
+}
+
+void RpcPhaseRecorder::Record(const RpcPhaseTimes& times) {
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        const int64_t us = times.duration_us((RpcPhase)i);
+        if (us >= 0) {
+            _phases[i].histogram << us;
+        }
+    }
+}
+
+int RpcPhaseRecorder::Expose(const butil::StringPiece& prefix) {
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        const std::string name = butil::string_printf(
+            "phase_%s_us", RpcPhaseName((RpcPhase)i));
+        if (_phases[i].avg_us.expose_as(prefix, name) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void RpcPhaseRecorder::GetPhase(RpcPhase phase, double ratio,
+                                double* avg_us, int64_t* percentile_us) const {
+    const bvar::detail::HistogramBuckets b = _phases[phase].window.get_value();
+    const uint64_t n = b.count();
+    *avg_us = n ? (double)b.sum / n : 0;
+    *percentile_us = b.get_number(ratio);
+}
+
+void RpcPhaseRecorder::GetCumulatedPhase(
+    RpcPhase phase, bvar::detail::HistogramBuckets* buckets) const {
+    *buckets = _phases[phase].histogram.get_value();
+}
+
+void RpcPhaseRecorder::Describe(std::ostream& os,
+                                const DescribeOptions& options) const {
+    static const char* const colors[RPC_PHASE_COUNT] = {
+        "#e6550d", "#fdae6b", "#3182bd", "#9ecae1", "#31a354" };
+    double avg[RPC_PHASE_COUNT];
+    int64_t p99[RPC_PHASE_COUNT];
+    double total = 0;
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        GetPhase((RpcPhase)i, 0.99, &avg[i], &p99[i]);
+        total += avg[i];
+    }
+    if (!options.use_html) {
+        os << "phases(avg/p99 us):";
+        for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+            os << ' ' << RpcPhaseName((RpcPhase)i) << '='
+               << (int64_t)avg[i] << '/' << p99[i];
+        }
+        os << '\n';
+        return;
+    }
+    // Widths of segments are proportional to average time of the phases.
+    const int BAR_WIDTH = 400;
+    os << "<p>phases: <span style=\"display:inline-block;width:" << BAR_WIDTH
+       << "px;height:12px;vertical-align:middle;background:#eee\">";
+    for (int i = 0; total > 0 && i < RPC_PHASE_COUNT; ++i) {
+        const int width = (int)(avg[i] / total * BAR_WIDTH + 0.5);
+        if (width > 0) {
+            os << "<span style=\"display:inline-block;height:12px;width:"
+               << width << "px;background:" << colors[i] << "\" title=\""
+               << RpcPhaseName((RpcPhase)i) << " avg=" << (int64_t)avg[i]
+               << "us p99=" << p99[i] << "us\"></span>";
+        }
+    }
+    os << "</span>";
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        os << " <span style=\"color:" << colors[i] << "\">&#9632;</span>"
+           << RpcPhaseName((RpcPhase)i) << '=' << (int64_t)avg[i] << '/'
+           << p99[i];
+    }
+    os << " (avg/p99 us)</p>\n";
+}
+
+} // namespace brpc
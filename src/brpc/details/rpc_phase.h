@@ -0,0 +1,109 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RPC_PHASE_H
+#define BRPC_RPC_PHASE_H
+
+#include <stdint.h>
+#include <ostream>
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
+
+namespace bvar {
+namespace detail {
+struct HistogramBuckets;
+} // namespace detail
+} // namespace bvar
+
+namespace brpc {
+
+struct DescribeOptions;
+
+// Phases of processing a request at server side, in order.
+enum RpcPhase {
+    // From the moment that InputMessenger cut the message to the moment that
+    // a bthread began to process it, namely waiting for a worker.
+    RPC_PHASE_QUEUE = 0,
+    // Parsing meta and the request.
+    RPC_PHASE_PARSE,
+    // Running the user's method until done->Run() is called.
+    RPC_PHASE_HANDLER,
+    // Serializing and packing the response.
+    RPC_PHASE_SERIALIZE,
+    // Handing the response to the socket, namely the time spent in
+    // Socket::Write(), which may write the data or just queue it after
+    // responses queued before. Time of waiting for the response to be
+    // written by other bthreads is not included (even if the request is
+    // traced by rpcz, which waits for it).
+    RPC_PHASE_WRITE,
+    RPC_PHASE_COUNT
+};
+
+const char* RpcPhaseName(RpcPhase phase);
+
+// Timestamps(in butil::cpuwide_time_us() which reads TSC) when phases of a
+// request began. 0 means that the phase was not reached.
+struct RpcPhaseTimes {
+    int64_t begin_us[RPC_PHASE_COUNT];
+    // When the last phase ended.
+    int64_t end_us;
+
+    RpcPhaseTimes() { clear(); }
+    void clear();
+
+    // Microseconds spent in `phase', -1 if the phase or the next one was not
+    // reached.
+    int64_t duration_us(RpcPhase phase) const;
+};
+
+// Distributions of time spent in each phase by requests of a method.
+class RpcPhaseRecorder {
+public:
+    RpcPhaseRecorder();
+    ~RpcPhaseRecorder();
+
+    void Record(const RpcPhaseTimes& times);
+
+    // Expose average microseconds of phases in recent window as
+    // <prefix>_phase_<name>_us.
+    // Returns 0 on success, -1 otherwise.
+    int Expose(const butil::StringPiece& prefix);
+
+    // Get average and percentile at `ratio' of `phase' in recent window.
+    void GetPhase(RpcPhase phase, double ratio,
+                  double* avg_us, int64_t* percentile_us) const;
+
+    // Get distribution of `phase' since this recorder was created.
+    void GetCumulatedPhase(RpcPhase phase,
+                           bvar::detail::HistogramBuckets* buckets) const;
+
+    // Print a stacked bar of average time of phases in html, or a line of
+    // averages and 99th percentiles in plain text.
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+    // Stats of one phase, defined in the .cpp.
+    struct Phase;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RpcPhaseRecorder);
+    Phase* _phases;
+};
+
+} // namespace brpc
+
+#endif // BRPC_RPC_PHASE_H
@@ -42,6 +42,9 @@ public:
 
     // Returns true if the `max_concurrency' limit is not reached.
     bool AddConcurrency(Controller* c) {
+        // Called by all protocols when processing of the request begins,
+        // time of the bthread is attributed to the method from now on.
+        bthread_get_time_stat(&c->_begin_time_stat);
         if (_server->options().max_concurrency <= 0) {
             return true;
         }
@@ -50,12 +53,27 @@ public:
                 <= _server->options().max_concurrency);
     }
 
+    const bthread_time_stat_t& begin_time_stat(const Controller* c) const {
+        return c->_begin_time_stat;
+    }
+
     void RemoveConcurrency(const Controller* c) {
         if (c->has_flag(Controller::FLAGS_ADDED_CONCURRENCY)) {
             butil::subtle::NoBarrier_AtomicIncrement(&_server->_concurrency, -1);
         }
     }
 
+    // Full name of the method whose status is `status', NULL if not found.
+    const std::string* FindMethodNameByStatus(const MethodStatus* status) const {
+        for (Server::MethodMap::const_iterator it = _server->_method_map.begin();
+             it != _server->_method_map.end(); ++it) {
+            if (it->second.status == status) {
+                return &it->second.method->full_name();
+            }
+        }
+        return NULL;
+    }
+
     // Find by MethodDescriptor::full_name
     const Server::MethodProperty*
     FindMethodPropertyByFullName(const butil::StringPiece &fullname) {
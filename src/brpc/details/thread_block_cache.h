@@ -0,0 +1,166 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_THREAD_BLOCK_CACHE_H
+#define BRPC_THREAD_BLOCK_CACHE_H
+
+#include <algorithm>
+#include <new>
+#include <vector>
+#include "butil/macros.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "butil/thread_local.h"
+
+namespace brpc {
+
+// Free blocks of a pool, shared by all threads.
+struct BlockFreeList {
+    butil::Mutex mutex;
+    std::vector<void*> blocks;
+
+    void Push(void* mem) {
+        BAIDU_SCOPED_LOCK(mutex);
+        blocks.push_back(mem);
+    }
+
+    void Push(void* const* begin, void* const* end) {
+        BAIDU_SCOPED_LOCK(mutex);
+        blocks.insert(blocks.end(), begin, end);
+    }
+
+    // Move at most `n' blocks into `out'. Returns number of blocks moved.
+    int Pop(void** out, int n) {
+        BAIDU_SCOPED_LOCK(mutex);
+        n = std::min((size_t)n, blocks.size());
+        std::copy(blocks.end() - n, blocks.end(), out);
+        blocks.resize(blocks.size() - n);
+        return n;
+    }
+};
+
+// Thread-local caches of blocks in front of the BlockFreeLists of a pool,
+// so that allocating and freeing blocks rarely contend on the lists.
+// Each cache has `NLIST' stacks of at most `CAPACITY' blocks, each stack is
+// bound to a free list where its blocks are returned to. `Pool' separates
+// caches of different pools.
+// Blocks may be freed after the cache of the thread was destroyed at exit,
+// in which case Get() returns NULL and callers should use the free lists
+// directly.
+template <typename Pool, int NLIST, int CAPACITY>
+class ThreadBlockCache {
+public:
+    // Returns the cache of the calling thread, NULL if the thread is exiting
+    // or memory is exhausted.
+    static ThreadBlockCache* Get() {
+        TLSData* d = tls_data();
+        ThreadBlockCache* c = d->cache;
+        if (BAIDU_UNLIKELY(c == NULL)) {
+            if (d->destroyed) {
+                return NULL;
+            }
+            c = new (std::nothrow) ThreadBlockCache;
+            if (c == NULL) {
+                return NULL;
+            }
+            d->cache = c;
+            butil::thread_atexit(Destroy, c);
+        }
+        return c;
+    }
+
+    // Return blocks of stack `i' to `list' from now on. Blocks cached for
+    // another list are returned to that list first.
+    void Bind(int i, BlockFreeList* list) {
+        if (_lists[i] != list) {
+            Flush(i, _nblock[i]);
+            _lists[i] = list;
+        }
+    }
+
+    int size(int i) const { return _nblock[i]; }
+
+    // Requires size(i) > 0.
+    void* Pop(int i) { return _blocks[i][--_nblock[i]]; }
+
+    // Requires size(i) < CAPACITY.
+    void Push(int i, void* mem) { _blocks[i][_nblock[i]++] = mem; }
+
+    // Move at most `n' blocks from the bound list into the empty stack `i'.
+    // Returns number of blocks moved.
+    int Refill(int i, int n) {
+        _nblock[i] = _lists[i]->Pop(_blocks[i], std::min(n, CAPACITY));
+        return _nblock[i];
+    }
+
+    // Fill the empty stack `i' with blocks given by `fetch(void** out, int n)'
+    // which puts at most `n' blocks into `out' and returns number of them.
+    template <typename Fetch>
+    int Refill(int i, int n, const Fetch& fetch) {
+        _nblock[i] = fetch(_blocks[i], std::min(n, CAPACITY));
+        return _nblock[i];
+    }
+
+    // Move `n' blocks at the top of stack `i' back to the bound list.
+    void Flush(int i, int n) {
+        if (n > 0) {
+            void** const end = _blocks[i] + _nblock[i];
+            _lists[i]->Push(end - n, end);
+            _nblock[i] -= n;
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ThreadBlockCache);
+
+    struct TLSData {
+        ThreadBlockCache* cache;
+        bool destroyed;
+    };
+
+    static TLSData* tls_data() {
+        static BAIDU_THREAD_LOCAL TLSData d = { NULL, false };
+        return &d;
+    }
+
+    ThreadBlockCache() {
+        for (int i = 0; i < NLIST; ++i) {
+            _nblock[i] = 0;
+            _lists[i] = NULL;
+        }
+    }
+
+    static void Destroy(void* arg) {
+        ThreadBlockCache* c = static_cast<ThreadBlockCache*>(arg);
+        for (int i = 0; i < NLIST; ++i) {
+            c->Flush(i, c->_nblock[i]);
+        }
+        delete c;
+        TLSData* d = tls_data();
+        d->cache = NULL;
+        d->destroyed = true;
+    }
+
+    int _nblock[NLIST];
+    BlockFreeList* _lists[NLIST];
+    void* _blocks[NLIST][CAPACITY];
+};
+
+}  // namespace brpc
+
+#endif  // BRPC_THREAD_BLOCK_CACHE_H
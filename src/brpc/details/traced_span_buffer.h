@@ -0,0 +1,123 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_TRACED_SPAN_BUFFER_H
+#define BRPC_TRACED_SPAN_BUFFER_H
+
+#include <new>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "brpc/trace.h"
+
+namespace brpc {
+
+// Bounded buffer of finished spans which are pushed by any thread and
+// popped by the exporting thread, without locks.
+// Each slot has a sequence number telling its state (see Vyukov's bounded
+// MPMC queue): a producer claims the slot at `_tail' by CAS when the
+// sequence equals the position, and publishes the span by bumping the
+// sequence. The consumer takes the slot when the sequence is position + 1
+// and releases it for the next round by setting position + capacity.
+class TracedSpanBuffer {
+public:
+    TracedSpanBuffer() : _slots(NULL), _mask(0), _tail(0), _head(0) {}
+    ~TracedSpanBuffer() { delete [] _slots; }
+
+    // `capacity' is rounded up to power of 2.
+    // Returns 0 on success, -1 otherwise.
+    int init(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) {
+            cap <<= 1;
+        }
+        _slots = new (std::nothrow) Slot[cap];
+        if (_slots == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < cap; ++i) {
+            _slots[i].seq.store(i, butil::memory_order_relaxed);
+        }
+        _mask = cap - 1;
+        return 0;
+    }
+
+    // Returns false when the buffer is full.
+    bool push(const TracedSpan& span) {
+        uint64_t pos = _tail.load(butil::memory_order_relaxed);
+        Slot* slot = NULL;
+        while (true) {
+            slot = &_slots[pos & _mask];
+            const uint64_t seq = slot->seq.load(butil::memory_order_acquire);
+            const int64_t diff = (int64_t)(seq - pos);
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Not released by the consumer yet.
+                return false;
+            } else {
+                pos = _tail.load(butil::memory_order_relaxed);
+            }
+        }
+        slot->span = span;
+        slot->seq.store(pos + 1, butil::memory_order_release);
+        return true;
+    }
+
+    // Pop at most `max' spans into `out'. Only called by one thread.
+    // Returns number of spans popped.
+    size_t pop(TracedSpan* out, size_t max) {
+        uint64_t head = _head.load(butil::memory_order_relaxed);
+        size_t n = 0;
+        for (; n < max; ++n, ++head) {
+            Slot* slot = &_slots[head & _mask];
+            if (slot->seq.load(butil::memory_order_acquire) != head + 1) {
+                break;
+            }
+            out[n] = slot->span;
+            slot->seq.store(head + _mask + 1, butil::memory_order_release);
+        }
+        _head.store(head, butil::memory_order_release);
+        return n;
+    }
+
+    // Number of spans claimed by producers so far.
+    uint64_t pushed() const { return _tail.load(butil::memory_order_acquire); }
+    // Number of spans popped so far.
+    uint64_t popped() const { return _head.load(butil::memory_order_acquire); }
+    size_t capacity() const { return _mask + 1; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TracedSpanBuffer);
+
+    struct Slot {
+        butil::atomic<uint64_t> seq;
+        TracedSpan span;
+    };
+
+    Slot* _slots;
+    uint64_t _mask;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<uint64_t> _tail;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<uint64_t> _head;
+};
+
+} // namespace brpc
+
+#endif // BRPC_TRACED_SPAN_BUFFER_H
@@ -0,0 +1,64 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_TRACING_H
+#define BRPC_TRACING_H
+
+#include <string>
+#include "brpc/trace.h"
+
+namespace brpc {
+
+class Controller;
+
+// Hooks of brpc::TraceContext in the RPC paths, see brpc/trace.h
+
+// Name of the http/h2 header carrying the context.
+extern const char* const TRACEPARENT_HEADER;
+
+// Decide the context of the server-side span of the request being
+// processed with `cntl'. `traceparent' is from the request, NULL if absent.
+void StartServerTrace(Controller* cntl, const std::string* traceparent);
+
+// Spans of RPCs issued in the current bthread are children of the server
+// span of `cntl' from now on, until EndServerTrace(cntl) is called or the
+// bthread leaves the RequestLocalStorageGuard around the call to the method.
+// Set to NULL when `cntl' is not traced.
+void EnterServerTrace(const Controller* cntl);
+
+// Called when the response of `cntl' is sent.
+void EndServerTrace(const Controller* cntl);
+
+// Decide the context of the client-side span of the RPC to be issued with
+// `cntl', as a child of the server span in the current bthread.
+void StartClientTrace(Controller* cntl);
+
+// Called when the RPC of `cntl' ends.
+void EndClientTrace(const Controller* cntl);
+
+// Print the context to be sent with the request of `cntl' into `buf' which
+// has at least TRACEPARENT_LENGTH + 1 bytes.
+// Returns false if the request is not in any trace.
+bool GetTraceParentToSend(const Controller* cntl, char* buf);
+
+// Put `span' into the buffer to be exported. Dropped if the buffer is full.
+void SubmitTracedSpan(const TracedSpan& span);
+
+} // namespace brpc
+
+#endif // BRPC_TRACING_H
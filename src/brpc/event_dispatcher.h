@@ -20,6 +20,7 @@
 #define BRPC_EVENT_DISPATCHER_H
 
 #include "butil/macros.h"                     // DISALLOW_COPY_AND_ASSIGN
+#include "butil/build_config.h"               // OS_LINUX
 #include "bthread/types.h"                   // bthread_t, bthread_attr_t
 #include "brpc/versioned_ref_with_id.h"
 
@@ -87,6 +88,10 @@ namespace rdma {
 class RdmaEndpoint;
 }
 
+#if defined(OS_LINUX)
+class IoUringPoller;
+#endif
+
 // Dispatch edge-triggered events of file descriptors to consumers
 // running in separate bthreads.
 class EventDispatcher {
@@ -173,6 +178,13 @@ private:
     // The epoll/kqueue fd to watch events.
     int _event_dispatcher_fd;
 
+#if defined(OS_LINUX)
+    // Non-NULL when -event_dispatcher_use_io_uring is on, in which case
+    // readiness of fds is polled with io_uring and _event_dispatcher_fd is
+    // its fd. Reads and writes are still done by Socket with syscalls.
+    IoUringPoller* _io_uring;
+#endif
+
     // false unless Stop() is called.
     volatile bool _stop;
 
@@ -187,6 +199,9 @@ private:
 };
 
 EventDispatcher& GetGlobalEventDispatcher(int fd, bthread_tag_t tag);
+// Get the `index'-th (modulo -event_dispatcher_num) dispatcher of `tag', or
+// the one chosen by hashing `fd' when `index' is negative.
+EventDispatcher& GetGlobalEventDispatcher(int fd, bthread_tag_t tag, int index);
 
 // IOEvent class manages the IO events of a file descriptor conveniently.
 template <typename T>
@@ -195,7 +210,8 @@ public:
     IOEvent()
         : _init(false)
         , _event_data_id(INVALID_IO_EVENT_DATA_ID)
-        , _bthread_tag(bthread_self_tag()) {}
+        , _bthread_tag(bthread_self_tag())
+        , _dispatcher_index(-1) {}
 
     ~IOEvent() { Reset(); }
 
@@ -228,7 +244,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag)
+        return GetGlobalEventDispatcher(fd, _bthread_tag, _dispatcher_index)
             .AddConsumer(_event_data_id, fd);
     }
 
@@ -238,7 +254,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag).RemoveConsumer(fd);
+        return GetGlobalEventDispatcher(fd, _bthread_tag, _dispatcher_index).RemoveConsumer(fd);
     }
 
     // See comments of `EventDispatcher::RegisterEvent'.
@@ -247,7 +263,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag)
+        return GetGlobalEventDispatcher(fd, _bthread_tag, _dispatcher_index)
             .RegisterEvent(_event_data_id, fd, pollin);
     }
 
@@ -257,7 +273,7 @@ public:
             LOG(ERROR) << "IOEvent has not been initialized";
             return -1;
         }
-        return GetGlobalEventDispatcher(fd, _bthread_tag)
+        return GetGlobalEventDispatcher(fd, _bthread_tag, _dispatcher_index)
             .UnregisterEvent(_event_data_id, fd, pollin);
     }
 
@@ -268,6 +284,15 @@ public:
         return _bthread_tag;
     }
 
+    // See SocketOptions::event_dispatcher_index. Must be set before
+    // AddConsumer().
+    void set_event_dispatcher_index(int index) {
+        _dispatcher_index = index;
+    }
+    int event_dispatcher_index() const {
+        return _dispatcher_index;
+    }
+
 private:
     // Generic callback to handle input event.
     static int OnInputEvent(void* user_data, uint32_t events,
@@ -294,6 +319,7 @@ private:
     bool _init;
     IOEventDataId _event_data_id;
     bthread_tag_t _bthread_tag;
+    int _dispatcher_index;
 };
 
 } // namespace brpc
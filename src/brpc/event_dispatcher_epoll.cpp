@@ -24,15 +24,28 @@ namespace brpc {
 
 EventDispatcher::EventDispatcher()
     : _event_dispatcher_fd(-1)
+    , _io_uring(NULL)
     , _stop(false)
     , _tid(0)
     , _thread_attr(BTHREAD_ATTR_NORMAL) {
-    _event_dispatcher_fd = epoll_create(1024 * 1024);
-    if (_event_dispatcher_fd < 0) {
-        PLOG(FATAL) << "Fail to create epoll";
-        return;
+    if (FLAGS_event_dispatcher_use_io_uring) {
+        IoUringPoller* io_uring = new IoUringPoller;
+        if (io_uring->Init() == 0) {
+            _io_uring = io_uring;
+            _event_dispatcher_fd = io_uring->fd();
+        } else {
+            PLOG(WARNING) << "Fail to init io_uring, fallback to epoll";
+            delete io_uring;
+        }
+    }
+    if (_io_uring == NULL) {
+        _event_dispatcher_fd = epoll_create(1024 * 1024);
+        if (_event_dispatcher_fd < 0) {
+            PLOG(FATAL) << "Fail to create epoll";
+            return;
+        }
+        CHECK_EQ(0, butil::make_close_on_exec(_event_dispatcher_fd));
     }
-    CHECK_EQ(0, butil::make_close_on_exec(_event_dispatcher_fd));
 
     _wakeup_fds[0] = -1;
     _wakeup_fds[1] = -1;
@@ -45,6 +58,12 @@ EventDispatcher::EventDispatcher()
 EventDispatcher::~EventDispatcher() {
     Stop();
     Join();
+    if (_io_uring) {
+        // The fd is owned by _io_uring.
+        delete _io_uring;
+        _io_uring = NULL;
+        _event_dispatcher_fd = -1;
+    }
     if (_event_dispatcher_fd >= 0) {
         close(_event_dispatcher_fd);
         _event_dispatcher_fd = -1;
@@ -96,7 +115,9 @@ bool EventDispatcher::Running() const {
 void EventDispatcher::Stop() {
     _stop = true;
 
-    if (_event_dispatcher_fd >= 0) {
+    if (_io_uring) {
+        _io_uring->Wakeup();
+    } else if (_event_dispatcher_fd >= 0) {
         epoll_event evt = { EPOLLOUT,  { NULL } };
         epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_ADD, _wakeup_fds[1], &evt);
     }
@@ -115,6 +136,9 @@ int EventDispatcher::RegisterEvent(IOEventDataId event_data_id,
         errno = EINVAL;
         return -1;
     }
+    if (_io_uring) {
+        return _io_uring->RegisterEvent(event_data_id, fd, pollin);
+    }
 
     epoll_event evt;
     evt.data.u64 = event_data_id;
@@ -139,6 +163,9 @@ int EventDispatcher::RegisterEvent(IOEventDataId event_data_id,
 
 int EventDispatcher::UnregisterEvent(IOEventDataId event_data_id,
                                      int fd, bool pollin) {
+    if (_io_uring) {
+        return _io_uring->UnregisterEvent(event_data_id, fd, pollin);
+    }
     if (pollin) {
         epoll_event evt;
         evt.data.u64 = event_data_id;
@@ -158,6 +185,9 @@ int EventDispatcher::AddConsumer(IOEventDataId event_data_id, int fd) {
         errno = EINVAL;
         return -1;
     }
+    if (_io_uring) {
+        return _io_uring->AddConsumer(event_data_id, fd);
+    }
     epoll_event evt;
     evt.data.u64 = event_data_id;
     evt.events = EPOLLIN | EPOLLET;
@@ -178,6 +208,13 @@ int EventDispatcher::RemoveConsumer(int fd) {
     // from epoll again! If the fd was level-triggered and there's data left,
     // epoll_wait will keep returning events of the fd continuously, making
     // program abnormal.
+    if (_io_uring) {
+        if (_io_uring->RemoveConsumer(fd) < 0) {
+            PLOG(WARNING) << "Fail to remove fd=" << fd << " from io_uring";
+            return -1;
+        }
+        return 0;
+    }
     if (epoll_ctl(_event_dispatcher_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
         PLOG(WARNING) << "Fail to remove fd=" << fd << " from epfd=" << _event_dispatcher_fd;
         return -1;
@@ -193,15 +230,22 @@ void* EventDispatcher::RunThis(void* arg) {
 void EventDispatcher::Run() {
     while (!_stop) {
         epoll_event e[32];
+        int n = 0;
+        if (_io_uring) {
+            // Completions are reaped from the shared ring without syscalls
+            // as long as there're some.
+            n = _io_uring->Wait(e, ARRAY_SIZE(e));
+        } else {
 #ifdef BRPC_ADDITIONAL_EPOLL
-        // Performance downgrades in examples.
-        int n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), 0);
-        if (n == 0) {
-            n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
-        }
+            // Performance downgrades in examples.
+            n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), 0);
+            if (n == 0) {
+                n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
+            }
 #else
-        const int n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
+            n = epoll_wait(_event_dispatcher_fd, e, ARRAY_SIZE(e), -1);
 #endif
+        }
         if (_stop) {
             // epoll_ctl/epoll_wait should have some sort of memory fencing
             // guaranteeing that we(after epoll_wait) see _stop set before
@@ -213,7 +257,7 @@ void EventDispatcher::Run() {
                 // We've checked _stop, no wake-up will be missed.
                 continue;
             }
-            PLOG(FATAL) << "Fail to epoll_wait epfd=" << _event_dispatcher_fd;
+            PLOG(FATAL) << "Fail to wait events, fd=" << _event_dispatcher_fd;
             break;
         }
         for (int i = 0; i < n; ++i) {
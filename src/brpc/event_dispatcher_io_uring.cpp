@@ -0,0 +1,468 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/version.h>
+#include "butil/containers/flat_map.h"
+#include "butil/synchronization/lock.h"
+#ifdef BRPC_SOCKET_HAS_EOF
+#include "brpc/details/has_epollrdhup.h"
+#endif
+
+// Multishot poll and in-place poll updates were added in Linux 5.13.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0) && defined(__NR_io_uring_setup)
+#define BRPC_HAS_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace brpc {
+
+DEFINE_bool(event_dispatcher_use_io_uring, false,
+            "Poll readiness of fds with io_uring instead of epoll. Readiness "
+            "of all fds is delivered through a shared completion ring so that "
+            "a busy dispatcher reaps events without entering the kernel. "
+            "Only polling goes through io_uring, reads and writes are still "
+            "syscalls. Falls back to epoll if the kernel does not support it");
+
+// The io_uring poll backend of EventDispatcher. Polls fds with multishot
+// IORING_OP_POLL_ADD. Every registered fd has exactly one armed poll request
+// whose user_data is the IOEventDataId, so completions can be handed to
+// EventDispatcher::Run() as if they were epoll_events.
+// Polls are edge-triggered like EPOLLET, thus Socket is unaware of the
+// backend being used. Data is not read or written through the ring.
+class IoUringPoller {
+public:
+    IoUringPoller();
+    ~IoUringPoller();
+
+    // Setup the ring. Returns 0 on success, -1 otherwise and errno is set.
+    int Init();
+
+    // Same semantics as the methods of EventDispatcher with the same names.
+    int AddConsumer(IOEventDataId event_data_id, int fd);
+    int RegisterEvent(IOEventDataId event_data_id, int fd, bool pollin);
+    int UnregisterEvent(IOEventDataId event_data_id, int fd, bool pollin);
+    int RemoveConsumer(int fd);
+
+    // Wake up the thread blocking in Wait().
+    int Wakeup();
+
+    // Block until some events are ready and fill at most `max_events' of
+    // them into `events' in the format of epoll_wait. Returns number of
+    // events filled, which may be 0 after Wakeup(). -1 on error.
+    int Wait(epoll_event* events, int max_events);
+
+    int fd() const { return _ring_fd; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(IoUringPoller);
+
+    struct Interest {
+        IOEventDataId event_data_id;
+        uint32_t events;
+    };
+
+    // Add/modify/remove the interest of `fd', must be called with _mutex held.
+    int AddInterestLocked(IOEventDataId event_data_id, int fd, uint32_t events);
+    int ModifyInterestLocked(IOEventDataId event_data_id, int fd, uint32_t events);
+    int RemoveInterestLocked(int fd);
+
+    // Re-arm the poll request of `event_data_id' which was terminated by
+    // the kernel (e.g. when the completion queue overflowed).
+    void Rearm(IOEventDataId event_data_id);
+
+    // Push one sqe and submit it to the kernel with _mutex held.
+    int SubmitLocked(uint8_t opcode, int fd, uint64_t addr, uint32_t len,
+                     uint32_t poll_events, uint64_t user_data);
+
+    static uint32_t InputEvents() {
+        uint32_t events = EPOLLIN;
+#ifdef BRPC_SOCKET_HAS_EOF
+        events |= has_epollrdhup;
+#endif
+        return events;
+    }
+
+    // user_data of requests whose completions should be ignored.
+    static const uint64_t CONTROL_USER_DATA = INVALID_IO_EVENT_DATA_ID;
+
+    int _ring_fd;
+    void* _ring_ptr;
+    size_t _ring_size;
+    void* _sqes_ptr;
+    size_t _sqes_size;
+    unsigned _sq_entries;
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_mask;
+    unsigned* _sq_array;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned* _cq_mask;
+
+#ifdef BRPC_HAS_IO_URING
+    io_uring_sqe* _sqes;
+    io_uring_cqe* _cqes;
+#endif
+
+    // Protects the submission queue, `_interests' and `_fds'. Only the
+    // dispatching thread consumes the completion queue, which needs no
+    // locking.
+    butil::Mutex _mutex;
+    butil::FlatMap<int, Interest> _interests;
+    // fd of each Interest indexed by its IOEventDataId.
+    butil::FlatMap<IOEventDataId, int> _fds;
+};
+
+IoUringPoller::IoUringPoller()
+    : _ring_fd(-1)
+    , _ring_ptr(NULL)
+    , _ring_size(0)
+    , _sqes_ptr(NULL)
+    , _sqes_size(0)
+    , _sq_entries(0)
+    , _sq_head(NULL)
+    , _sq_tail(NULL)
+    , _sq_mask(NULL)
+    , _sq_array(NULL)
+    , _cq_head(NULL)
+    , _cq_tail(NULL)
+    , _cq_mask(NULL)
+#ifdef BRPC_HAS_IO_URING
+    , _sqes(NULL)
+    , _cqes(NULL)
+#endif
+{}
+
+IoUringPoller::~IoUringPoller() {
+    if (_sqes_ptr) {
+        munmap(_sqes_ptr, _sqes_size);
+        _sqes_ptr = NULL;
+    }
+    if (_ring_ptr) {
+        munmap(_ring_ptr, _ring_size);
+        _ring_ptr = NULL;
+    }
+    if (_ring_fd >= 0) {
+        close(_ring_fd);
+        _ring_fd = -1;
+    }
+}
+
+#ifdef BRPC_HAS_IO_URING
+
+// Only poll requests go through the submission queue, the large completion
+// queue absorbs bursts of readiness notifications.
+static const unsigned IO_URING_SQ_ENTRIES = 256;
+static const unsigned IO_URING_CQ_ENTRIES = 16384;
+
+int IoUringPoller::Init() {
+    if (_interests.init(1024) != 0 || _fds.init(1024) != 0) {
+        LOG(ERROR) << "Fail to init _interests or _fds";
+        errno = ENOMEM;
+        return -1;
+    }
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = IO_URING_CQ_ENTRIES;
+    _ring_fd = syscall(__NR_io_uring_setup, IO_URING_SQ_ENTRIES, &params);
+    if (_ring_fd < 0) {
+        return -1;
+    }
+    CHECK_EQ(0, butil::make_close_on_exec(_ring_fd));
+    // IORING_FEAT_RSRC_TAGS was added along with multishot poll in 5.13,
+    // use it to detect kernels built from older sources.
+    const uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+        IORING_FEAT_POLL_32BITS | IORING_FEAT_RSRC_TAGS;
+    if ((params.features & required) != required) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    _ring_size = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    _ring_ptr = mmap(NULL, _ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    if (_ring_ptr == MAP_FAILED) {
+        _ring_ptr = NULL;
+        return -1;
+    }
+    _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes_ptr = mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+    if (_sqes_ptr == MAP_FAILED) {
+        _sqes_ptr = NULL;
+        return -1;
+    }
+    char* p = (char*)_ring_ptr;
+    _sq_entries = params.sq_entries;
+    _sq_head = (unsigned*)(p + params.sq_off.head);
+    _sq_tail = (unsigned*)(p + params.sq_off.tail);
+    _sq_mask = (unsigned*)(p + params.sq_off.ring_mask);
+    _sq_array = (unsigned*)(p + params.sq_off.array);
+    _cq_head = (unsigned*)(p + params.cq_off.head);
+    _cq_tail = (unsigned*)(p + params.cq_off.tail);
+    _cq_mask = (unsigned*)(p + params.cq_off.ring_mask);
+    _sqes = (io_uring_sqe*)_sqes_ptr;
+    _cqes = (io_uring_cqe*)(p + params.cq_off.cqes);
+    return 0;
+}
+
+int IoUringPoller::SubmitLocked(uint8_t opcode, int fd, uint64_t addr,
+                                uint32_t len, uint32_t poll_events,
+                                uint64_t user_data) {
+    // Only submitters (with _mutex held) write the tail.
+    const unsigned tail = *_sq_tail;
+    if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+        // Never happens since every sqe is submitted immediately.
+        errno = EBUSY;
+        return -1;
+    }
+    const unsigned index = tail & *_sq_mask;
+    io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->poll32_events = poll_events;
+    sqe->user_data = user_data;
+    _sq_array[index] = index;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int nretry = 0;
+    while (true) {
+        const unsigned pending =
+            tail + 1 - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        if (pending == 0) {
+            return 0;
+        }
+        const int rc = syscall(__NR_io_uring_enter, _ring_fd,
+                               pending, 0, 0, NULL, 0);
+        if (rc >= 0) {
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno == EAGAIN || errno == EBUSY) && ++nretry < 3) {
+            // The kernel is short of memory or the completion queue is
+            // overflowing, which should be resolved soon.
+            sched_yield();
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            // Don't block here. The sqe stays in the ring and will be
+            // submitted by the next io_uring_enter(), including the one
+            // in Wait().
+            return 0;
+        }
+        return -1;
+    }
+}
+
+int IoUringPoller::AddInterestLocked(IOEventDataId event_data_id,
+                                     int fd, uint32_t events) {
+    if (_interests.seek(fd) != NULL) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (SubmitLocked(IORING_OP_POLL_ADD, fd, 0, IORING_POLL_ADD_MULTI,
+                     events, event_data_id) != 0) {
+        return -1;
+    }
+    Interest& interest = _interests[fd];
+    interest.event_data_id = event_data_id;
+    interest.events = events;
+    _fds[event_data_id] = fd;
+    return 0;
+}
+
+int IoUringPoller::ModifyInterestLocked(IOEventDataId event_data_id,
+                                        int fd, uint32_t events) {
+    Interest* interest = _interests.seek(fd);
+    if (interest == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (interest->event_data_id != event_data_id) {
+        // Rare. Replace the request to change its user_data.
+        if (SubmitLocked(IORING_OP_POLL_REMOVE, -1, interest->event_data_id,
+                         0, 0, CONTROL_USER_DATA) != 0 ||
+            SubmitLocked(IORING_OP_POLL_ADD, fd, 0, IORING_POLL_ADD_MULTI,
+                         events, event_data_id) != 0) {
+            return -1;
+        }
+        _fds.erase(interest->event_data_id);
+        _fds[event_data_id] = fd;
+    } else if (SubmitLocked(IORING_OP_POLL_REMOVE, -1, event_data_id,
+                            IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI,
+                            events, CONTROL_USER_DATA) != 0) {
+        return -1;
+    }
+    interest->event_data_id = event_data_id;
+    interest->events = events;
+    return 0;
+}
+
+int IoUringPoller::RemoveInterestLocked(int fd) {
+    Interest* interest = _interests.seek(fd);
+    if (interest == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    const IOEventDataId event_data_id = interest->event_data_id;
+    _interests.erase(fd);
+    _fds.erase(event_data_id);
+    return SubmitLocked(IORING_OP_POLL_REMOVE, -1, event_data_id,
+                        0, 0, CONTROL_USER_DATA);
+}
+
+void IoUringPoller::Rearm(IOEventDataId event_data_id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const int* fd = _fds.seek(event_data_id);
+    if (fd == NULL) {
+        // Removed after the poll was terminated.
+        return;
+    }
+    const Interest* interest = _interests.seek(*fd);
+    if (interest == NULL) {
+        return;
+    }
+    if (SubmitLocked(IORING_OP_POLL_ADD, *fd, 0, IORING_POLL_ADD_MULTI,
+                     interest->events, event_data_id) != 0) {
+        PLOG(ERROR) << "Fail to re-arm poll of fd=" << *fd;
+    }
+}
+
+int IoUringPoller::Wakeup() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return SubmitLocked(IORING_OP_NOP, -1, 0, 0, 0, CONTROL_USER_DATA);
+}
+
+int IoUringPoller::Wait(epoll_event* events, int max_events) {
+    IOEventDataId terminated[32];
+    max_events = std::min(max_events, (int)ARRAY_SIZE(terminated));
+    while (true) {
+        // Only this thread moves the head.
+        unsigned head = *_cq_head;
+        const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // Nothing to reap, sleep in the kernel. Also submit sqes left
+            // by SubmitLocked() if there're any.
+            const unsigned pending =
+                __atomic_load_n(_sq_tail, __ATOMIC_ACQUIRE) -
+                __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+            if (syscall(__NR_io_uring_enter, _ring_fd, pending, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        int n = 0;
+        int nterminated = 0;
+        for (; head != tail && n < max_events; ++head) {
+            const io_uring_cqe& cqe = _cqes[head & *_cq_mask];
+            if (cqe.user_data == CONTROL_USER_DATA || cqe.res == -ECANCELED) {
+                continue;
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE) && cqe.res >= 0) {
+                terminated[nterminated++] = cqe.user_data;
+            }
+            events[n].events = cqe.res >= 0 ? (uint32_t)cqe.res : EPOLLERR;
+            events[n].data.u64 = cqe.user_data;
+            ++n;
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        for (int i = 0; i < nterminated; ++i) {
+            Rearm(terminated[i]);
+        }
+        return n;
+    }
+}
+
+#else  // BRPC_HAS_IO_URING
+
+int IoUringPoller::Init() {
+    errno = ENOSYS;
+    return -1;
+}
+
+int IoUringPoller::AddInterestLocked(IOEventDataId, int, uint32_t) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int IoUringPoller::ModifyInterestLocked(IOEventDataId, int, uint32_t) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int IoUringPoller::RemoveInterestLocked(int) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int IoUringPoller::Wakeup() {
+    errno = ENOSYS;
+    return -1;
+}
+
+int IoUringPoller::Wait(epoll_event*, int) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif  // BRPC_HAS_IO_URING
+
+int IoUringPoller::AddConsumer(IOEventDataId event_data_id, int fd) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return AddInterestLocked(event_data_id, fd, InputEvents());
+}
+
+int IoUringPoller::RegisterEvent(IOEventDataId event_data_id,
+                                 int fd, bool pollin) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    uint32_t events = EPOLLOUT;
+#ifdef BRPC_SOCKET_HAS_EOF
+    events |= has_epollrdhup;
+#endif
+    if (pollin) {
+        return ModifyInterestLocked(event_data_id, fd, events | InputEvents());
+    }
+    return AddInterestLocked(event_data_id, fd, events);
+}
+
+int IoUringPoller::UnregisterEvent(IOEventDataId event_data_id,
+                                   int fd, bool pollin) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (pollin) {
+        return ModifyInterestLocked(event_data_id, fd, InputEvents());
+    }
+    return RemoveInterestLocked(fd);
+}
+
+int IoUringPoller::RemoveConsumer(int fd) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return RemoveInterestLocked(fd);
+}
+
+} // namespace brpc
@@ -59,6 +59,8 @@
 #include "brpc/compress.h"
 #include "brpc/policy/gzip_compress.h"
 #include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
 
 // Protocols
 #include "brpc/protocol.h"
@@ -92,12 +94,16 @@
 #include "brpc/server.h"
 #include "brpc/trackme.h"             // TrackMe
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/numa_block_pool.h"       // InitNumaBlockPool
+#include "brpc/huge_page_block_arena.h" // InitHugePageBlockArena
 #if defined(OS_LINUX)
 #include <malloc.h>                   // malloc_trim
 #endif
 #include "butil/fd_guard.h"
 #include "butil/files/file_watcher.h"
 
+DECLARE_bool(bthread_numa_aware);
+
 extern "C" {
 // defined in gperftools/malloc_extension_c.h
 void BAIDU_WEAK MallocExtension_ReleaseFreeMemory(void);
@@ -105,6 +111,8 @@ void BAIDU_WEAK MallocExtension_ReleaseFreeMemory(void);
 
 namespace brpc {
 
+DECLARE_int32(iobuf_arena_size_mb);
+
 DECLARE_bool(usercode_in_pthread);
 
 DEFINE_int32(free_memory_to_system_interval, 0,
@@ -400,6 +408,18 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterCompressHandler(COMPRESS_TYPE_SNAPPY, snappy_compress) != 0) {
         exit(1);
     }
+#if BRPC_WITH_LZ4
+    CompressHandler lz4_compress = { Lz4Compress, Lz4Decompress, "lz4" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_LZ4, lz4_compress) != 0) {
+        exit(1);
+    }
+#endif
+#if BRPC_WITH_ZSTD
+    CompressHandler zstd_compress = { ZstdCompress, ZstdDecompress, "zstd" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_ZSTD, zstd_compress) != 0) {
+        exit(1);
+    }
+#endif
 
     // Protocols
     Protocol baidu_protocol = { ParseRpcMessage,
@@ -603,6 +623,7 @@ static void GlobalInitializeOrDieImpl() {
             handler.verify = NULL;
             handler.arg = NULL;
             handler.name = protocols[i].name;
+            handler.process_mode = INPUT_PROCESS_DEFAULT;
             if (get_or_new_client_side_messenger()->AddHandler(handler) != 0) {
                 exit(1);
             }
@@ -614,6 +635,30 @@ static void GlobalInitializeOrDieImpl() {
     ConcurrencyLimiterExtension()->RegisterOrDie("constant", &g_ext->constant_cl);
     ConcurrencyLimiterExtension()->RegisterOrDie("timeout", &g_ext->timeout_cl);
 
+    bool numa_block_pool_inited = false;
+    if (FLAGS_bthread_numa_aware) {
+        // Allocate IOBuf blocks in the node where they're filled, which is
+        // also the node that parses them since workers don't steal across
+        // nodes unless they have to.
+        if (InitNumaBlockPool() != 0) {
+            LOG(WARNING) << "Fail to init NUMA block pool, "
+                            "allocate IOBuf blocks with malloc";
+        } else {
+            numa_block_pool_inited = true;
+        }
+    }
+    if (FLAGS_iobuf_arena_size_mb > 0 && numa_block_pool_inited) {
+        // Both hook butil::iobuf::blockmem_allocate, only one can be used.
+        LOG(WARNING) << "-iobuf_arena_size_mb=" << FLAGS_iobuf_arena_size_mb
+                     << " is ignored since IOBuf blocks are allocated from "
+                        "NUMA block pools (-bthread_numa_aware)";
+    } else if (FLAGS_iobuf_arena_size_mb > 0) {
+        if (InitHugePageBlockArena() != 0) {
+            LOG(WARNING) << "Fail to init IOBuf arena, "
+                            "allocate IOBuf blocks with malloc";
+        }
+    }
+
     if (FLAGS_usercode_in_pthread) {
         // Optional. If channel/server are initialized before main(), this
         // flag may be false at here even if it will be set to true after
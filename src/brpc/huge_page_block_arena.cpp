@@ -0,0 +1,298 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/build_config.h"
+#include "butil/iobuf.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "bvar/bvar.h"
+#include "brpc/details/thread_block_cache.h"
+#include "brpc/huge_page_block_arena.h"
+
+namespace butil {
+namespace iobuf {
+extern void* (*blockmem_allocate)(size_t);
+extern void  (*blockmem_deallocate)(void*);
+}
+}
+
+namespace brpc {
+
+DEFINE_int32(iobuf_arena_size_mb, 0,
+             "Allocate IOBuf blocks from an arena of so many MB backed by "
+             "huge pages, 0 means blocks are allocated by malloc. Ignored "
+             "when the NUMA block pool is used (-bthread_numa_aware), which "
+             "hooks the allocation of IOBuf blocks first");
+DEFINE_bool(iobuf_arena_use_hugetlb, false,
+            "Map the IOBuf arena with MAP_HUGETLB, which needs enough huge "
+            "pages reserved in /proc/sys/vm/nr_hugepages. Otherwise the arena "
+            "is madvised to use transparent huge pages");
+
+namespace arena {
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static const int NCLASS = 3;
+static const char* const g_class_names[NCLASS] = { "small", "default", "large" };
+
+struct SizeClass {
+    size_t block_size;
+    // Max number of blocks cached in each thread.
+    int tls_capacity;
+
+    BlockFreeList free_list;
+
+    butil::atomic<int64_t> npage;
+    bvar::PassiveStatus<int64_t>* page_count;
+    bvar::Adder<int64_t> block_count;
+};
+
+// The arena is never destroyed because blocks may be freed at any time.
+static SizeClass* g_classes = NULL;
+static char* g_begin = NULL;
+static char* g_end = NULL;
+static size_t g_npage = 0;
+static butil::atomic<size_t> g_next_page(0);
+// Size class of each huge page, -1 for unused pages.
+static int8_t* g_page_class = NULL;
+static bvar::Adder<int64_t>* g_fallback = NULL;
+static bvar::PassiveStatus<double>* g_occupancy = NULL;
+
+static int64_t get_page_count(void* arg) {
+    return static_cast<SizeClass*>(arg)->npage.load(butil::memory_order_relaxed);
+}
+
+static double get_occupancy(void*) {
+    const size_t used = std::min(
+        g_next_page.load(butil::memory_order_relaxed), g_npage);
+    return g_npage ? (double)used / g_npage : 0;
+}
+
+static int SizeClassOfSize(size_t size) {
+    if (size <= butil::IOBuf::SMALL_BLOCK_SIZE) {
+        return butil::IOBuf::SMALL_BLOCK;
+    } else if (size <= butil::IOBuf::DEFAULT_BLOCK_SIZE) {
+        return butil::IOBuf::DEFAULT_BLOCK;
+    } else if (size <= butil::IOBuf::LARGE_BLOCK_SIZE &&
+               size > butil::IOBuf::LARGE_BLOCK_SIZE / 2) {
+        return butil::IOBuf::LARGE_BLOCK;
+    }
+    return -1;
+}
+
+int SizeClassOfBlock(const void* mem) {
+    const char* p = static_cast<const char*>(mem);
+    if (p < g_begin || p >= g_end) {
+        return -1;
+    }
+    return g_page_class[(p - g_begin) / HUGE_PAGE_SIZE];
+}
+
+// Carve a new huge page into free blocks of `c'. Called with
+// c.free_list.mutex held.
+static bool AddPage(SizeClass& c, int cls) {
+    const size_t page = g_next_page.fetch_add(1, butil::memory_order_relaxed);
+    if (page >= g_npage) {
+        return false;
+    }
+    g_page_class[page] = cls;
+    char* const begin = g_begin + page * HUGE_PAGE_SIZE;
+    // Push in reverse order so that blocks are handed out from the
+    // beginning of the page.
+    for (size_t off = HUGE_PAGE_SIZE; off >= c.block_size; off -= c.block_size) {
+        c.free_list.blocks.push_back(begin + off - c.block_size);
+    }
+    c.npage.fetch_add(1, butil::memory_order_relaxed);
+    return true;
+}
+
+// Each thread caches blocks of all classes. Capacity of the cache of large
+// blocks is less than others, see SizeClass::tls_capacity.
+typedef ThreadBlockCache<SizeClass, NCLASS, 64> TLSCache;
+
+// Returns the TLS cache, NULL if the thread is exiting.
+static TLSCache* GetCache() {
+    TLSCache* tc = TLSCache::Get();
+    if (tc != NULL) {
+        for (int i = 0; i < NCLASS; ++i) {
+            tc->Bind(i, &g_classes[i].free_list);
+        }
+    }
+    return tc;
+}
+
+// Move at most `n' blocks from the arena into `out'. Returns number of
+// blocks moved.
+static int FetchBlocks(int cls, void** out, int n) {
+    SizeClass& c = g_classes[cls];
+    BAIDU_SCOPED_LOCK(c.free_list.mutex);
+    std::vector<void*>& blocks = c.free_list.blocks;
+    if (blocks.empty() && !AddPage(c, cls)) {
+        return 0;
+    }
+    n = std::min((size_t)n, blocks.size());
+    std::copy(blocks.end() - n, blocks.end(), out);
+    blocks.resize(blocks.size() - n);
+    return n;
+}
+
+void* AllocateBlock(size_t size) {
+    const int cls = SizeClassOfSize(size);
+    if (cls < 0 || g_classes == NULL) {
+        return malloc(size);
+    }
+    SizeClass& c = g_classes[cls];
+    void* mem = NULL;
+    TLSCache* tc = GetCache();
+    if (tc == NULL) {
+        if (FetchBlocks(cls, &mem, 1) == 0) {
+            mem = NULL;
+        }
+    } else if (tc->size(cls) > 0 ||
+               tc->Refill(cls, c.tls_capacity / 2, [cls](void** out, int n) {
+                   return FetchBlocks(cls, out, n);
+               }) > 0) {
+        mem = tc->Pop(cls);
+    }
+    if (mem == NULL) {
+        *g_fallback << 1;
+        return malloc(size);
+    }
+    c.block_count << 1;
+    return mem;
+}
+
+void DeallocateBlock(void* mem) {
+    const int cls = SizeClassOfBlock(mem);
+    if (cls < 0) {
+        free(mem);
+        return;
+    }
+    SizeClass& c = g_classes[cls];
+    c.block_count << -1;
+    TLSCache* tc = GetCache();
+    if (tc == NULL) {
+        c.free_list.Push(mem);
+        return;
+    }
+    if (tc->size(cls) == c.tls_capacity) {
+        tc->Flush(cls, c.tls_capacity / 2);
+    }
+    tc->Push(cls, mem);
+}
+
+// Reserve `bytes' of address space aligned to HUGE_PAGE_SIZE.
+static void* MapArena(size_t bytes, bool use_hugetlb) {
+#if defined(OS_LINUX) && defined(MAP_HUGETLB)
+    if (use_hugetlb) {
+        void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            return mem;
+        }
+        PLOG(WARNING) << "Fail to map " << bytes << " bytes of huge pages, "
+                         "use transparent huge pages instead";
+    }
+#else
+    (void)use_hugetlb;
+#endif
+    const size_t len = bytes + HUGE_PAGE_SIZE;
+    void* mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to reserve " << len << " bytes for IOBuf arena";
+        return NULL;
+    }
+    char* const begin = (char*)(((uintptr_t)mem + HUGE_PAGE_SIZE - 1)
+                                & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    // Return unaligned head and tail.
+    if (begin != mem) {
+        munmap(mem, begin - (char*)mem);
+    }
+    munmap(begin + bytes, (char*)mem + len - (begin + bytes));
+#if defined(OS_LINUX) && defined(MADV_HUGEPAGE)
+    if (madvise(begin, bytes, MADV_HUGEPAGE) != 0) {
+        PLOG(WARNING) << "Fail to madvise IOBuf arena with MADV_HUGEPAGE";
+    }
+#endif
+    return begin;
+}
+
+int InitBlockArena(size_t bytes, bool use_hugetlb) {
+    if (g_classes != NULL) {
+        LOG(ERROR) << "IOBuf arena was initialized";
+        return -1;
+    }
+    bytes = bytes / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (bytes == 0) {
+        LOG(ERROR) << "IOBuf arena must be at least " << HUGE_PAGE_SIZE << " bytes";
+        return -1;
+    }
+    void* mem = MapArena(bytes, use_hugetlb);
+    if (mem == NULL) {
+        return -1;
+    }
+    g_npage = bytes / HUGE_PAGE_SIZE;
+    g_page_class = new int8_t[g_npage];
+    memset(g_page_class, -1, g_npage);
+    g_fallback = new bvar::Adder<int64_t>("iobuf_arena_fallback");
+    g_occupancy = new bvar::PassiveStatus<double>(
+        "iobuf_arena_occupancy", get_occupancy, NULL);
+    SizeClass* classes = new SizeClass[NCLASS];
+    for (int i = 0; i < NCLASS; ++i) {
+        SizeClass& c = classes[i];
+        c.block_size = butil::IOBuf::block_size_of(
+            static_cast<butil::IOBuf::BlockSizeClass>(i));
+        // Don't cache more than 512KB of blocks in each thread.
+        c.tls_capacity = std::min((size_t)64, 524288 / c.block_size);
+        c.npage.store(0, butil::memory_order_relaxed);
+        c.page_count = new bvar::PassiveStatus<int64_t>(
+            "iobuf_arena_page_count", g_class_names[i], get_page_count, &c);
+        c.block_count.expose_as("iobuf_arena_block_count", g_class_names[i]);
+    }
+    g_begin = static_cast<char*>(mem);
+    g_end = g_begin + bytes;
+    g_classes = classes;
+    return 0;
+}
+
+}  // namespace arena
+
+int InitHugePageBlockArena() {
+    if (butil::iobuf::blockmem_allocate != ::malloc) {
+        LOG(WARNING) << "Allocation of IOBuf blocks has been hooked, "
+                        "skip IOBuf arena";
+        return -1;
+    }
+    if (arena::InitBlockArena(FLAGS_iobuf_arena_size_mb * 1048576UL,
+                              FLAGS_iobuf_arena_use_hugetlb) != 0) {
+        return -1;
+    }
+    butil::iobuf::blockmem_allocate = arena::AllocateBlock;
+    butil::iobuf::blockmem_deallocate = arena::DeallocateBlock;
+    return 0;
+}
+
+}  // namespace brpc
@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_HUGE_PAGE_BLOCK_ARENA_H
+#define BRPC_HUGE_PAGE_BLOCK_ARENA_H
+
+#include <stddef.h>
+
+namespace brpc {
+
+// Allocate memory of IOBuf blocks from an arena backed by 2MB huge pages,
+// which reduces TLB misses and allocator overhead when moving GBs of data
+// per second.
+//
+// -iobuf_arena_size_mb of address space is reserved with MAP_HUGETLB when
+// -iobuf_arena_use_hugetlb is on, or madvised to use transparent huge pages
+// otherwise. The arena is split into huge pages, each page is carved into
+// blocks of one size class (see IOBuf::BlockSizeClass) on demand:
+//   small    blocks <= IOBuf::SMALL_BLOCK_SIZE
+//   default  blocks <= IOBuf::DEFAULT_BLOCK_SIZE
+//   large    blocks in (IOBuf::LARGE_BLOCK_SIZE/2, IOBuf::LARGE_BLOCK_SIZE]
+// Other sizes and allocations after the arena is exhausted come from malloc.
+// Freed blocks are reused by blocks of the same class, each thread caches a
+// few blocks of each class to avoid contentions.
+//
+// Occupancy is exposed as bvars:
+//   iobuf_arena_page_count_<class>   huge pages used by the class
+//   iobuf_arena_block_count_<class>  blocks in use
+//   iobuf_arena_occupancy            fraction of huge pages used
+//   iobuf_arena_fallback             allocations falling back to malloc
+
+// Replace butil::iobuf::blockmem_allocate/blockmem_deallocate with the arena.
+// Called in GlobalInitializeOrDie() when -iobuf_arena_size_mb is positive.
+// Fails if the allocation has been hooked already, e.g. by the NUMA block
+// pool (see numa_block_pool.h), only one of them can be used.
+// Returns 0 on success, -1 otherwise.
+int InitHugePageBlockArena();
+
+namespace arena {
+
+// [Internal] Initialize the arena. Exposed for testing.
+int InitBlockArena(size_t bytes, bool use_hugetlb);
+
+// [Internal] Allocate/free a block of `size' bytes.
+void* AllocateBlock(size_t size);
+void DeallocateBlock(void* mem);
+
+// Returns size class of `mem', -1 if `mem' is not allocated from the arena.
+int SizeClassOfBlock(const void* mem);
+
+}  // namespace arena
+
+}  // namespace brpc
+
+#endif  // BRPC_HUGE_PAGE_BLOCK_ARENA_H
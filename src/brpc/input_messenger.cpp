@@ -16,11 +16,14 @@
 // under the License.
 
 
+#include <memory>
+#include <vector>
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                      // fd_guard
 #include "butil/logging.h"                       // CHECK
 #include "butil/time.h"                          // cpuwide_time_us
 #include "butil/fd_utility.h"                    // make_non_blocking
+#include "butil/string_splitter.h"               // StringSplitter
 #include "bthread/bthread.h"                     // bthread_start_background
 #include "bthread/unstable.h"                   // bthread_flush
 #include "bvar/bvar.h"                          // bvar::Adder
@@ -28,6 +31,7 @@
 #include "brpc/reloadable_flags.h"         // BRPC_VALIDATE_GFLAG
 #include "brpc/protocol.h"                 // ListProtocols
 #include "brpc/rdma/rdma_endpoint.h"
+#include "brpc/details/hot_peers.h"       // AddHotPeerStats
 #include "brpc/input_messenger.h"
 
 
@@ -72,6 +76,23 @@ DEFINE_int32(socket_tcp_user_timeout_ms, -1,
              "connection and return ETIMEDOUT to the application. Only linux supports "
              "TCP_USER_TIMEOUT.");
 
+DEFINE_string(inline_process_protocols, "",
+              "Comma-separated protocols whose messages from one read are "
+              "processed one by one in the bthread reading the connection, "
+              "e.g. \"redis,memcache\". Must be set before servers or "
+              "channels are created");
+
+DEFINE_string(batch_process_protocols, "",
+              "Comma-separated protocols whose messages from one read are "
+              "processed one by one in a single bthread. Must be set before "
+              "servers or channels are created");
+
+DEFINE_int32(input_process_fallback_us, 1000,
+             "If a message processed inline or in a batch takes more than so "
+             "many microseconds, remaining messages from the same read are "
+             "processed in separate bthreads");
+BRPC_VALIDATE_GFLAG(input_process_fallback_us, NonNegativeInteger);
+
 DECLARE_bool(usercode_in_pthread);
 DECLARE_bool(usercode_in_coroutine);
 DECLARE_uint64(max_body_size);
@@ -191,15 +212,12 @@ struct RunLastMessage {
     }
 };
 
-static void QueueMessage(InputMessageBase* to_run_msg,
-                         int* num_bthread_created,
-                         bthread_keytable_pool_t* keytable_pool) {
-    if (!to_run_msg) {
-        return;
-    }
-    // Create bthread for last_msg. The bthread is not scheduled
-    // until bthread_flush() is called (in the worse case).
-                
+// Run fn(arg) in a new bthread, or in the calling thread if the bthread
+// can't be created. The bthread is not scheduled until bthread_flush() is
+// called (in the worse case).
+static void StartProcessing(void* (*fn)(void*), void* arg,
+                            int* num_bthread_created,
+                            bthread_keytable_pool_t* keytable_pool) {
     // TODO(gejun): Join threads.
     bthread_t th;
     bthread_attr_t tmp = (FLAGS_usercode_in_pthread ?
@@ -207,12 +225,72 @@ static void QueueMessage(InputMessageBase* to_run_msg,
                           BTHREAD_ATTR_NORMAL) | BTHREAD_NOSIGNAL;
     tmp.keytable_pool = keytable_pool;
     tmp.tag = bthread_self_tag();
-    if (!FLAGS_usercode_in_coroutine && bthread_start_background(
-            &th, &tmp, ProcessInputMessage, to_run_msg) == 0) {
+    if (!FLAGS_usercode_in_coroutine &&
+        bthread_start_background(&th, &tmp, fn, arg) == 0) {
         ++*num_bthread_created;
     } else {
-        ProcessInputMessage(to_run_msg);
+        fn(arg);
+    }
+}
+
+static void QueueMessage(InputMessageBase* to_run_msg,
+                         int* num_bthread_created,
+                         bthread_keytable_pool_t* keytable_pool) {
+    if (!to_run_msg) {
+        return;
+    }
+    StartProcessing(ProcessInputMessage, to_run_msg,
+                    num_bthread_created, keytable_pool);
+}
+
+// Process `msg' in the calling bthread. Returns false if it took too long
+// to process more messages in the same way.
+static bool ProcessInputMessageInPlace(InputMessageBase* msg) {
+    const int64_t begin_us = butil::cpuwide_time_us();
+    ProcessInputMessage(msg);
+    return butil::cpuwide_time_us() - begin_us <= FLAGS_input_process_fallback_us;
+}
+
+// Messages from one read in INPUT_PROCESS_BATCH.
+struct InputMessageBatch {
+    bthread_keytable_pool_t* keytable_pool;
+    std::vector<InputMessageBase*> msgs;
+};
+
+static void* ProcessInputMessageBatch(void* arg) {
+    std::unique_ptr<InputMessageBatch> batch(static_cast<InputMessageBatch*>(arg));
+    int num_bthread_created = 0;
+    bool in_place = true;
+    for (size_t i = 0; i < batch->msgs.size(); ++i) {
+        if (in_place) {
+            in_place = ProcessInputMessageInPlace(batch->msgs[i]);
+        } else {
+            QueueMessage(batch->msgs[i], &num_bthread_created,
+                         batch->keytable_pool);
+        }
     }
+    if (num_bthread_created) {
+        bthread_flush();
+    }
+    return NULL;
+}
+
+static InputProcessMode GetInputProcessModeOf(const char* protocol_name) {
+    for (butil::StringSplitter sp(FLAGS_inline_process_protocols.c_str(), ',');
+         sp; ++sp) {
+        if (strlen(protocol_name) == sp.length() &&
+            strncmp(protocol_name, sp.field(), sp.length()) == 0) {
+            return INPUT_PROCESS_INLINE;
+        }
+    }
+    for (butil::StringSplitter sp(FLAGS_batch_process_protocols.c_str(), ',');
+         sp; ++sp) {
+        if (strlen(protocol_name) == sp.length() &&
+            strncmp(protocol_name, sp.field(), sp.length()) == 0) {
+            return INPUT_PROCESS_BATCH;
+        }
+    }
+    return INPUT_PROCESS_SPAWN;
 }
 
 InputMessenger::InputMessageClosure::~InputMessageClosure() noexcept(false) {
@@ -239,6 +317,11 @@ int InputMessenger::ProcessNewMessage(
     
     size_t last_size = m->_read_buf.length();
     int num_bthread_created = 0;
+    // Messages to be processed in one bthread in INPUT_PROCESS_BATCH.
+    std::vector<InputMessageBase*> batch;
+    // False if a message processed inline took too long.
+    bool in_place = true;
+    int rc = 0;
     while (1) {
         size_t index = 8888;
         ParseResult pr = CutInputMessage(m, &index, read_eof);
@@ -250,17 +333,21 @@ int InputMessenger::ProcessNewMessage(
                 m->_last_msg_size += (last_size - m->_read_buf.length());
                 break;
             } else if (pr.error() == PARSE_ERROR_TRY_OTHERS) {
+                AddHotPeerStats(m->remote_side(), 0, 0, 0, 1);
                 LOG(WARNING)
                     << "Close " << *m << " due to unknown message: "
                     << butil::ToPrintable(m->_read_buf);
                 m->SetFailed(EINVAL, "Close %s due to unknown message",
                                 m->description().c_str());
-                return -1;
+                rc = -1;
+                break;
             } else {
+                AddHotPeerStats(m->remote_side(), 0, 0, 0, 1);
                 LOG(WARNING) << "Close " << *m << ": " << pr.error_str();
                 m->SetFailed(EINVAL, "Close %s: %s",
                                 m->description().c_str(), pr.error_str());
-                return -1;
+                rc = -1;
+                break;
             }
         }
 
@@ -276,6 +363,7 @@ int InputMessenger::ProcessNewMessage(
         }
         m->_last_msg_size += (last_size - cur_size);
         last_size = cur_size;
+        AddHotPeerStats(m->remote_side(), 1, m->_last_msg_size, 0, 0);
         const size_t old_avg = m->_avg_msg_size;
         if (old_avg != 0) {
             m->_avg_msg_size = (old_avg * (MSG_SIZE_WINDOW - 1) + m->_last_msg_size)
@@ -312,10 +400,12 @@ int InputMessenger::ProcessNewMessage(
                     m->SetAuthentication(0);
                 } else {
                     m->SetAuthentication(ERPCAUTH);
+                    AddHotPeerStats(m->remote_side(), 0, 0, 0, 1);
                     LOG(WARNING) << "Fail to authenticate " << *m;
                     m->SetFailed(ERPCAUTH, "Fail to authenticate %s",
                                     m->description().c_str());
-                    return -1;
+                    rc = -1;
+                    break;
                 }
             } else {
                 LOG_IF(FATAL, auth_error != 0) <<
@@ -323,20 +413,37 @@ int InputMessenger::ProcessNewMessage(
                     "destroyed when authentication failed";
             }
         }
-        if (!m->is_read_progressive()) {
-            // Transfer ownership to last_msg
-            last_msg.reset(msg.release());
-        } else {
+        if (m->is_read_progressive()) {
             QueueMessage(msg.release(), &num_bthread_created,
                                 m->_keytable_pool);
             bthread_flush();
             num_bthread_created = 0;
+        } else if (!in_place) {
+            QueueMessage(msg.release(), &num_bthread_created,
+                         m->_keytable_pool);
+        } else if (_handlers[index].process_mode == INPUT_PROCESS_INLINE) {
+            in_place = ProcessInputMessageInPlace(msg.release());
+        } else if (_handlers[index].process_mode == INPUT_PROCESS_BATCH) {
+            batch.push_back(msg.release());
+        } else {
+            // Transfer ownership to last_msg
+            last_msg.reset(msg.release());
         }
     }
+    if (batch.size() == 1) {
+        // A single message is processed in this bthread as the last message.
+        last_msg.reset(batch[0]);
+    } else if (!batch.empty()) {
+        InputMessageBatch* b = new InputMessageBatch;
+        b->keytable_pool = m->_keytable_pool;
+        b->msgs.swap(batch);
+        StartProcessing(ProcessInputMessageBatch, b,
+                        &num_bthread_created, m->_keytable_pool);
+    }
     if (num_bthread_created) {
         bthread_flush();
     }
-    return 0;
+    return rc;
 }
 
 void InputMessenger::OnNewMessages(Socket* m) {
@@ -348,6 +455,9 @@ void InputMessenger::OnNewMessages(Socket* m) {
     //   "process") in this bthread. All messages except the last one will be
     //   processed in separate bthreads. To minimize the overhead, scheduling
     //   is batched(notice the BTHREAD_NOSIGNAL and bthread_flush).
+    //   Handlers in INPUT_PROCESS_INLINE process the messages in this bthread
+    //   instead, and handlers in INPUT_PROCESS_BATCH process them in one
+    //   bthread, both in the order that messages are received.
     // - Verify will always be called in this bthread at most once and before
     //   any process.
     InputMessenger* messenger = static_cast<InputMessenger*>(m->user());
@@ -453,6 +563,9 @@ int InputMessenger::AddHandler(const InputMessageHandler& handler) {
     if (_handlers[index].parse == NULL) {
         // The same protocol might be added more than twice
         _handlers[index] = handler;
+        if (handler.process_mode == INPUT_PROCESS_DEFAULT) {
+            _handlers[index].process_mode = GetInputProcessModeOf(handler.name);
+        }
     } else if (_handlers[index].parse != handler.parse 
                || _handlers[index].process != handler.process) {
         CHECK(_handlers[index].parse == handler.parse);
@@ -487,6 +600,9 @@ int InputMessenger::AddNonProtocolHandler(const InputMessageHandler& handler) {
     }
     const int index = _max_index.load(butil::memory_order_relaxed) + 1;
     _handlers[index] = handler;
+    if (handler.process_mode == INPUT_PROCESS_DEFAULT) {
+        _handlers[index].process_mode = GetInputProcessModeOf(handler.name);
+    }
     _max_index.store(index, butil::memory_order_release);
     return 0;
 }
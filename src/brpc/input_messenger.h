@@ -30,6 +30,27 @@ namespace rdma {
 class RdmaEndpoint;
 }
 
+// How messages cut from one read of a connection are processed.
+enum InputProcessMode {
+    // Decided by -inline_process_protocols and -batch_process_protocols
+    // when the handler is added, INPUT_PROCESS_SPAWN if the protocol is not
+    // listed in either flag.
+    INPUT_PROCESS_DEFAULT = 0,
+    // Every message except the last one is processed in a separate bthread,
+    // the last one is processed in the bthread reading the connection.
+    INPUT_PROCESS_SPAWN = 1,
+    // Messages are processed one by one in the bthread reading the
+    // connection, in the order they're received. Suitable for pipelined
+    // small requests which are processed quickly (redis, memcache...).
+    INPUT_PROCESS_INLINE = 2,
+    // All messages are handed to a single bthread and processed one by one
+    // in the order they're received.
+    INPUT_PROCESS_BATCH = 3,
+};
+// In INPUT_PROCESS_INLINE and INPUT_PROCESS_BATCH, once processing a message
+// takes more than -input_process_fallback_us (e.g. the handler blocks), the
+// remaining messages of the same read are processed in separate bthreads.
+
 struct InputMessageHandler {
     // The callback to cut a message from `source'.
     // Returned message will be passed to process_request or process_response
@@ -68,6 +89,9 @@ struct InputMessageHandler {
 
     // Name of this handler, must be string constant.
     const char* name;
+
+    // How to process messages parsed by this handler.
+    InputProcessMode process_mode;
 };
 
 // Process messages from connections.
@@ -0,0 +1,222 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <string>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/iobuf.h"
+#include "butil/logging.h"
+#include "bvar/bvar.h"
+#include "bthread/numa.h"
+#include "brpc/details/thread_block_cache.h"
+#include "brpc/numa_block_pool.h"
+
+namespace butil {
+namespace iobuf {
+extern void* (*blockmem_allocate)(size_t);
+extern void  (*blockmem_deallocate)(void*);
+}
+}
+
+namespace brpc {
+
+DEFINE_int32(numa_block_pool_size_mb, 4096,
+             "Address space reserved for IOBuf blocks in each NUMA node. "
+             "Memory is committed on demand, blocks are allocated by malloc "
+             "after the pool of a node is exhausted");
+
+namespace numa {
+
+static const size_t BLOCK_SIZE = butil::IOBuf::DEFAULT_BLOCK_SIZE;
+// Max number of blocks cached in each thread.
+static const int TLS_CACHE_CAPACITY = 64;
+// Number of blocks moved between the TLS cache and the pool at once.
+static const int TLS_CACHE_BATCH = 32;
+
+struct NodePool {
+    char* begin;
+    size_t capacity;
+    butil::atomic<size_t> used;
+
+    BlockFreeList free_list;
+
+    bvar::PassiveStatus<int64_t>* block_count;
+    bvar::Adder<int64_t> remote_free;
+    bvar::Adder<int64_t> fallback;
+};
+
+static int64_t get_block_count(void* arg) {
+    const NodePool* pool = static_cast<const NodePool*>(arg);
+    return pool->used.load(butil::memory_order_relaxed) / BLOCK_SIZE;
+}
+
+// Pools are never destroyed because blocks may be freed at any time.
+static NodePool* g_pools = NULL;
+static int g_nnode = 0;
+static char* g_begin = NULL;
+static char* g_end = NULL;
+static size_t g_bytes_per_node = 0;
+
+// Each thread caches blocks of the node it's running on.
+typedef ThreadBlockCache<NodePool, 1, TLS_CACHE_CAPACITY> TLSCache;
+
+// Returns the TLS cache bound to `node', NULL if the thread is exiting.
+static TLSCache* GetCache(int node) {
+    TLSCache* c = TLSCache::Get();
+    if (c != NULL) {
+        // Blocks cached before the thread was migrated to another node are
+        // returned to their node.
+        c->Bind(0, &g_pools[node].free_list);
+    }
+    return c;
+}
+
+static void* AllocateFromPool(NodePool& pool) {
+    void* mem = NULL;
+    if (pool.free_list.Pop(&mem, 1) == 1) {
+        return mem;
+    }
+    const size_t offset = pool.used.fetch_add(BLOCK_SIZE, butil::memory_order_relaxed);
+    if (offset + BLOCK_SIZE <= pool.capacity) {
+        return pool.begin + offset;
+    }
+    pool.used.fetch_sub(BLOCK_SIZE, butil::memory_order_relaxed);
+    return NULL;
+}
+
+void* AllocateBlockOnNode(size_t size, int node) {
+    if (size > BLOCK_SIZE || node < 0 || node >= g_nnode) {
+        return malloc(size);
+    }
+    NodePool& pool = g_pools[node];
+    TLSCache* c = GetCache(node);
+    if (c == NULL) {
+        void* mem = AllocateFromPool(pool);
+        return mem ? mem : malloc(size);
+    }
+    if (c->size(0) > 0 || c->Refill(0, TLS_CACHE_BATCH) > 0) {
+        return c->Pop(0);
+    }
+    void* mem = AllocateFromPool(pool);
+    if (mem == NULL) {
+        pool.fallback << 1;
+        return malloc(size);
+    }
+    return mem;
+}
+
+int NodeOfBlock(const void* mem) {
+    const char* p = static_cast<const char*>(mem);
+    if (p < g_begin || p >= g_end) {
+        return -1;
+    }
+    return (p - g_begin) / g_bytes_per_node;
+}
+
+void DeallocateBlockOnNode(void* mem, int node) {
+    const int home = NodeOfBlock(mem);
+    if (home < 0) {
+        free(mem);
+        return;
+    }
+    NodePool& pool = g_pools[home];
+    TLSCache* c = NULL;
+    if (home != node) {
+        pool.remote_free << 1;
+    } else {
+        c = GetCache(node);
+    }
+    if (c == NULL) {
+        pool.free_list.Push(mem);
+        return;
+    }
+    if (c->size(0) == TLS_CACHE_CAPACITY) {
+        c->Flush(0, TLS_CACHE_BATCH);
+    }
+    c->Push(0, mem);
+}
+
+static void* BlockAllocate(size_t size) {
+    return AllocateBlockOnNode(size, bthread::current_numa_node());
+}
+
+static void BlockDeallocate(void* mem) {
+    DeallocateBlockOnNode(mem, bthread::current_numa_node());
+}
+
+int InitNumaBlockPool(int nnode, size_t bytes_per_node) {
+    if (g_pools != NULL) {
+        LOG(ERROR) << "NUMA block pool was initialized";
+        return -1;
+    }
+    if (nnode <= 0 || bytes_per_node < BLOCK_SIZE) {
+        LOG(ERROR) << "Invalid nnode=" << nnode
+                   << " bytes_per_node=" << bytes_per_node;
+        return -1;
+    }
+    bytes_per_node = bytes_per_node / BLOCK_SIZE * BLOCK_SIZE;
+    const size_t total = bytes_per_node * nnode;
+    void* mem = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to reserve " << total << " bytes for NUMA block pool";
+        return -1;
+    }
+    NodePool* pools = new NodePool[nnode];
+    for (int i = 0; i < nnode; ++i) {
+        NodePool& pool = pools[i];
+        pool.begin = static_cast<char*>(mem) + bytes_per_node * i;
+        pool.capacity = bytes_per_node;
+        pool.used.store(0, butil::memory_order_relaxed);
+        if (bthread::bind_memory_to_numa_node(pool.begin, bytes_per_node, i) != 0) {
+            PLOG(WARNING) << "Fail to bind memory of block pool to numa node=" << i;
+        }
+        const std::string node_str = std::to_string(i);
+        pool.block_count = new bvar::PassiveStatus<int64_t>(
+            "iobuf_numa_block_count", node_str, get_block_count, &pool);
+        pool.remote_free.expose_as("iobuf_numa_remote_free", node_str);
+        pool.fallback.expose_as("iobuf_numa_fallback", node_str);
+    }
+    g_begin = static_cast<char*>(mem);
+    g_end = g_begin + total;
+    g_bytes_per_node = bytes_per_node;
+    g_nnode = nnode;
+    g_pools = pools;
+    return 0;
+}
+
+}  // namespace numa
+
+int InitNumaBlockPool() {
+    if (butil::iobuf::blockmem_allocate != ::malloc) {
+        LOG(WARNING) << "Allocation of IOBuf blocks has been hooked, "
+                        "skip NUMA block pool";
+        return -1;
+    }
+    if (numa::InitNumaBlockPool(bthread::numa_node_num(),
+                                FLAGS_numa_block_pool_size_mb * 1048576UL) != 0) {
+        return -1;
+    }
+    butil::iobuf::blockmem_allocate = numa::BlockAllocate;
+    butil::iobuf::blockmem_deallocate = numa::BlockDeallocate;
+    return 0;
+}
+
+}  // namespace brpc
@@ -0,0 +1,68 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_NUMA_BLOCK_POOL_H
+#define BRPC_NUMA_BLOCK_POOL_H
+
+#include <stddef.h>
+
+namespace brpc {
+
+// Allocate memory of IOBuf blocks from pools of NUMA nodes.
+//
+// Address space of -numa_block_pool_size_mb is reserved for each node and
+// bound to the node. A block is allocated from the pool of the node that
+// the calling thread is running on, and is always returned to the pool it
+// came from. Freeing a block in another node is counted as a "remote free".
+// Each thread caches a few blocks of its node to avoid contentions on the
+// pool. Blocks larger than IOBuf::DEFAULT_BLOCK_SIZE and blocks allocated
+// after a pool is exhausted come from malloc.
+//
+// Per-node statistics are exposed as bvars:
+//   iobuf_numa_block_count_<node>   blocks carved from the pool
+//   iobuf_numa_remote_free_<node>   blocks freed by threads in other nodes
+//   iobuf_numa_fallback_<node>      allocations falling back to malloc
+
+// Replace butil::iobuf::blockmem_allocate/blockmem_deallocate with the pool.
+// Called in GlobalInitializeOrDie() when -bthread_numa_aware is on, before
+// the huge page arena (see huge_page_block_arena.h) which is skipped then.
+// Fails if the allocation has been hooked already.
+// Returns 0 on success, -1 otherwise.
+int InitNumaBlockPool();
+
+namespace numa {
+
+// [Internal] Initialize the pool with `nnode' nodes. Exposed for testing.
+int InitNumaBlockPool(int nnode, size_t bytes_per_node);
+
+// [Internal] Allocate a block of `size' bytes from the pool of `node'.
+void* AllocateBlockOnNode(size_t size, int node);
+
+// [Internal] Free a block allocated from the pool as if the caller is
+// running on `node'.
+void DeallocateBlockOnNode(void* mem, int node);
+
+// Returns the node that `mem' was allocated from, -1 if `mem' is not
+// allocated from the pool.
+int NodeOfBlock(const void* mem);
+
+}  // namespace numa
+
+}  // namespace brpc
+
+#endif  // BRPC_NUMA_BLOCK_POOL_H
@@ -42,6 +42,7 @@
 #include "brpc/details/usercode_backup_pool.h"
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/details/server_private_accessor.h"
+#include "brpc/details/tracing.h"
 
 extern "C" {
 void bthread_assign_data(void* data);
@@ -265,8 +266,10 @@ void SendRpcResponse(int64_t correlation_id, Controller* cntl,
                      MethodStatus* method_status, int64_t received_us) {
     ControllerPrivateAccessor accessor(cntl);
     Span* span = accessor.span();
+    const int64_t start_send_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERIALIZE, start_send_us);
     if (span) {
-        span->set_start_send_us(butil::cpuwide_time_us());
+        span->set_start_send_us(start_send_us);
     }
     Socket* sock = accessor.get_sending_socket();
 
@@ -297,6 +300,8 @@ void SendRpcResponse(int64_t correlation_id, Controller* cntl,
     StreamIds response_stream_ids = accessor.response_streams();
 
     if (cntl->IsCloseConnection()) {
+        // Still dumped, without a response.
+        SubmitSampledRequest(cntl, cntl->ErrorCode(), 0, received_us);
         for(size_t i = 0; i < response_stream_ids.size(); ++i) {
             StreamClose(response_stream_ids[i]);
         }
@@ -377,9 +382,14 @@ void SendRpcResponse(int64_t correlation_id, Controller* cntl,
         }
     }
 
+    SubmitSampledRequest(cntl, error_code, res_buf.size(), received_us);
+
+    const int64_t start_write_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_WRITE, start_write_us);
     ResponseWriteInfo args;
     bthread_id_t response_id = INVALID_BTHREAD_ID;
     if (span) {
+        span->set_start_write_us(start_write_us);
         span->set_response_size(res_buf.size());
         CHECK_EQ(0, bthread_id_create(&response_id, &args, HandleResponseWritten));
     }
@@ -440,6 +450,7 @@ void SendRpcResponse(int64_t correlation_id, Controller* cntl,
         }
     }
 
+    accessor.set_phase_end_us(butil::cpuwide_time_us());
     if (span) {
         bthread_id_join(response_id);
         // Do not care about the result of background writing.
@@ -556,6 +567,9 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     Socket* socket = socket_guard.get();
     const Server* server = static_cast<const Server*>(msg_base->arg());
     ScopedNonServiceError non_service_error(server);
+    // Don't leak sampling_tag and trace_parent of this request to the
+    // following ones processed in this bthread.
+    RequestLocalStorageGuard bls_guard;
 
     RpcMeta meta;
     if (!ParsePbFromIOBuf(&meta, msg->meta)) {
@@ -566,6 +580,12 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     }
     const RpcRequestMeta &request_meta = meta.request();
 
+    std::unique_ptr<Controller> cntl(new (std::nothrow) Controller);
+    if (NULL == cntl.get()) {
+        LOG(WARNING) << "Fail to new Controller";
+        return;
+    }
+
     SampledRequest* sample = AskToBeSampled();
     if (sample) {
         sample->meta.set_service_name(request_meta.service_name());
@@ -575,13 +595,8 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         sample->meta.set_attachment_size(meta.attachment_size());
         sample->meta.set_authentication_data(meta.authentication_data());
         sample->request = msg->payload;
-        sample->submit(start_parse_us);
-    }
-
-    std::unique_ptr<Controller> cntl(new (std::nothrow) Controller);
-    if (NULL == cntl.get()) {
-        LOG(WARNING) << "Fail to new Controller";
-        return;
+        // Submitted with metadata of the response in SendRpcResponse().
+        cntl->reset_sampled_request(sample);
     }
 
     RpcPBMessages* messages = NULL;
@@ -609,6 +624,8 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         .set_auth_context(socket->auth_context())
         .set_request_protocol(PROTOCOL_BAIDU_STD)
         .set_begin_time_us(msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_QUEUE, msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_PARSE, start_parse_us)
         .move_in_server_receiving_sock(socket_guard);
 
     if (meta.has_stream_settings()) {
@@ -639,6 +656,8 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         span->set_start_parse_us(start_parse_us);
         span->set_request_size(msg->payload.size() + msg->meta.size() + 12);
     }
+    StartServerTrace(cntl.get(), request_meta.has_traceparent() ?
+                     &request_meta.traceparent() : NULL);
 
     MethodStatus* method_status = NULL;
     do {
@@ -681,7 +700,11 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             break;
           }
             svc = server->options().baidu_master_service;
-            auto sampled_request = new (std::nothrow) SampledRequest;
+            // Reuse the sample to be dumped if there's one.
+            SampledRequest* sampled_request = cntl->release_sampled_request();
+            if (NULL == sampled_request) {
+                sampled_request = new (std::nothrow) SampledRequest;
+            }
             if (NULL == sampled_request) {
                 cntl->SetFailed(ENOMEM, "Fail to get sampled_request");
                 break;
@@ -808,10 +831,13 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         // optional, just release resource ASAP
         msg.reset();
 
+        const int64_t start_callback_us = butil::cpuwide_time_us();
+        accessor.set_phase_begin_us(RPC_PHASE_HANDLER, start_callback_us);
         if (span) {
-            span->set_start_callback_us(butil::cpuwide_time_us());
+            span->set_start_callback_us(start_callback_us);
             span->AsParent();
         }
+        EnterServerTrace(cntl.get());
         if (!FLAGS_usercode_in_pthread) {
             return svc->CallMethod(method, cntl.release(), 
                                    messages->Request(),
@@ -1087,6 +1113,10 @@ void PackRpcRequest(butil::IOBuf* req_buf,
         request_meta->set_span_id(span->span_id());
         request_meta->set_parent_span_id(span->parent_span_id());
     }
+    char traceparent[TRACEPARENT_LENGTH + 1];
+    if (GetTraceParentToSend(cntl, traceparent)) {
+        request_meta->set_traceparent(traceparent, TRACEPARENT_LENGTH);
+    }
 
     SerializeRpcHeaderAndMeta(req_buf, meta, req_size + attached_size);
     req_buf->append(request_body);
@@ -38,6 +38,7 @@
 #include "brpc/rpc_dump.h"                          // SampledRequest
 #include "brpc/http_status_code.h"                  // HTTP_STATUS_*
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/tracing.h"
 #include "brpc/builtin/index_service.h"             // IndexService
 #include "brpc/policy/gzip_compress.h"
 #include "brpc/policy/http2_rpc_protocol.h"
@@ -726,6 +727,10 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
         hreq.SetHeader("x-bd-parent-span-id", butil::string_printf(
                            "%llu", (unsigned long long)span->parent_span_id()));
     }
+    char traceparent[TRACEPARENT_LENGTH + 1];
+    if (GetTraceParentToSend(cntl, traceparent)) {
+        hreq.SetHeader(TRACEPARENT_HEADER, traceparent);
+    }
 }
 
 void PackHttpRequest(butil::IOBuf* buf,
@@ -835,14 +840,18 @@ HttpResponseSender::~HttpResponseSender() {
     }
     ControllerPrivateAccessor accessor(cntl);
     Span* span = accessor.span();
+    const int64_t start_send_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERIALIZE, start_send_us);
     if (span) {
-        span->set_start_send_us(butil::cpuwide_time_us());
+        span->set_start_send_us(start_send_us);
     }
     ConcurrencyRemover concurrency_remover(_method_status, cntl, _received_us);
     Socket* socket = accessor.get_sending_socket();
     const google::protobuf::Message* res = NULL != _messages ? _messages->Response() : NULL;
     
     if (cntl->IsCloseConnection()) {
+        // Still dumped, without a response.
+        SubmitSampledRequest(cntl, cntl->ErrorCode(), 0, _received_us);
         socket->SetFailed();
         return;
     }
@@ -1016,7 +1025,10 @@ HttpResponseSender::~HttpResponseSender() {
             if (FLAGS_http_verbose) {
                 LOG(INFO) << '\n' << *h2_response;
             }
+            const int64_t start_write_us = butil::cpuwide_time_us();
+            accessor.set_phase_begin_us(RPC_PHASE_WRITE, start_write_us);
             if (span) {
+                span->set_start_write_us(start_write_us);
                 span->set_response_size(h2_response->EstimatedByteSize());
             }
             rc = socket->Write(h2_response, &wopt);
@@ -1032,7 +1044,12 @@ HttpResponseSender::~HttpResponseSender() {
         if (FLAGS_http_verbose) {
             PrintMessage(res_buf, false, !!content);
         }
+        SubmitSampledRequest(cntl, cntl->ErrorCode(), res_buf.size(),
+                             _received_us);
+        const int64_t start_write_us = butil::cpuwide_time_us();
+        accessor.set_phase_begin_us(RPC_PHASE_WRITE, start_write_us);
         if (span) {
+            span->set_start_write_us(start_write_us);
             span->set_response_size(res_buf.size());
         }
         rc = socket->Write(&res_buf, &wopt);
@@ -1046,6 +1063,7 @@ HttpResponseSender::~HttpResponseSender() {
         return;
     }
 
+    accessor.set_phase_end_us(butil::cpuwide_time_us());
     if (span) {
         bthread_id_join(response_id);
         // Do not care about the result of background writing.
@@ -1407,6 +1425,9 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     Socket* socket = socket_guard.get();
     const Server* server = static_cast<const Server*>(msg->arg());
     ScopedNonServiceError non_service_error(server);
+    // Don't leak sampling_tag and trace_parent of this request to the
+    // following ones processed in this bthread.
+    RequestLocalStorageGuard bls_guard;
 
     Controller* cntl = new (std::nothrow) Controller;
     if (NULL == cntl) {
@@ -1441,6 +1462,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         .set_auth_context(socket->auth_context())
         .set_request_protocol(is_http2 ? PROTOCOL_H2 : PROTOCOL_HTTP)
         .set_begin_time_us(msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_QUEUE, msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_PARSE, start_parse_us)
         .move_in_server_receiving_sock(socket_guard);
     
     // Read log-id. errno may be set when input to strtoull overflows.
@@ -1498,6 +1521,7 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         span->set_protocol(is_http2 ? PROTOCOL_H2 : PROTOCOL_HTTP);
         span->set_request_size(imsg_guard->parsed_length());
     }
+    StartServerTrace(cntl, req_header.GetHeader(TRACEPARENT_HEADER));
     
     if (!server->IsRunning()) {
         cntl->SetFailed(ELOGOFF, "Server is stopping");
@@ -1516,11 +1540,14 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         accessor.set_method(md);
         cntl->request_attachment().swap(req_body);
         google::protobuf::Closure* done = new HttpResponseSenderAsDone(&resp_sender);
+        const int64_t start_callback_us = butil::cpuwide_time_us();
+        accessor.set_phase_begin_us(RPC_PHASE_HANDLER, start_callback_us);
         if (span) {
             span->ResetServerSpanName(md->full_name());
-            span->set_start_callback_us(butil::cpuwide_time_us());
+            span->set_start_callback_us(start_callback_us);
             span->AsParent();
         }
+        EnterServerTrace(cntl);
         // `cntl', `req' and `res' will be deleted inside `done'
         return svc->CallMethod(md, cntl, NULL, NULL, done);
     }
@@ -1689,7 +1716,9 @@ void ProcessHttpRequest(InputMessageBase *msg) {
 
                 butil::EndPoint ep;
                 MakeRawHttpRequest(&sample->request, &req_header, ep, &req_body);
-                sample->submit(start_parse_us);
+                // Submitted with metadata of the response in
+                // ~HttpResponseSender().
+                cntl->reset_sampled_request(sample);
             }
         }
     } else {
@@ -1704,10 +1733,13 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     google::protobuf::Closure* done = new HttpResponseSenderAsDone(&resp_sender);
     imsg_guard.reset();  // optional, just release resource ASAP
 
+    const int64_t start_callback_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_HANDLER, start_callback_us);
     if (span) {
-        span->set_start_callback_us(butil::cpuwide_time_us());
+        span->set_start_callback_us(start_callback_us);
         span->AsParent();
     }
+    EnterServerTrace(cntl);
     if (!FLAGS_usercode_in_pthread) {
         return svc->CallMethod(method, cntl, req, res, done);
     }
@@ -91,6 +91,9 @@ HuluCompressType CompressType2Hulu(CompressType type) {
     case COMPRESS_TYPE_LZ4:
         LOG(ERROR) << "Hulu doesn't support LZ4";
         return HULU_COMPRESS_TYPE_NONE;
+    case COMPRESS_TYPE_ZSTD:
+        LOG(ERROR) << "Hulu doesn't support ZSTD";
+        return HULU_COMPRESS_TYPE_NONE;
     default:
         LOG(ERROR) << "Unknown CompressType=" << type;
         return HULU_COMPRESS_TYPE_NONE;
@@ -345,6 +348,7 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
     Socket* socket = socket_guard.get();
     const Server* server = static_cast<const Server*>(msg_base->arg());
     ScopedNonServiceError non_service_error(server);
+    RequestLocalStorageGuard bls_guard;
 
     HuluRpcRequestMeta meta;
     if (!ParsePbFromIOBuf(&meta, msg->meta)) {
@@ -0,0 +1,214 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#if BRPC_WITH_LZ4
+
+#include <lz4frame.h>
+#include "butil/logging.h"
+#include "butil/thread_local.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/protocol.h"
+#include "brpc/compress.h"
+
+namespace brpc {
+namespace policy {
+
+// Max bytes fed into LZ4F_compressUpdate() each time, the same as the block
+// size of frames.
+static const size_t LZ4_CHUNK_SIZE = 64 * 1024;
+
+// LZ4 contexts are expensive to create, reuse them in each thread. Calls
+// to Lz4Compress/Lz4Decompress never yield, so a bthread always uses
+// contexts of the same pthread during one call.
+struct Lz4Context {
+    Lz4Context() : cctx(NULL), dctx(NULL), buf(NULL), buf_size(0) {
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+        prefs.frameInfo.blockMode = LZ4F_blockLinked;
+    }
+    ~Lz4Context() {
+        LZ4F_freeCompressionContext(cctx);
+        LZ4F_freeDecompressionContext(dctx);
+        free(buf);
+    }
+    int Init() {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)) ||
+            LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+            return -1;
+        }
+        // Enough for the output of any LZ4F_compressXXX() call.
+        buf_size = LZ4F_compressBound(LZ4_CHUNK_SIZE, &prefs);
+        buf = (char*)malloc(buf_size);
+        return buf ? 0 : -1;
+    }
+
+    LZ4F_cctx* cctx;
+    LZ4F_dctx* dctx;
+    LZ4F_preferences_t prefs;
+    char* buf;
+    size_t buf_size;
+};
+
+static BAIDU_THREAD_LOCAL Lz4Context* tls_lz4_context = NULL;
+
+static void DeleteLz4Context(void* arg) {
+    delete static_cast<Lz4Context*>(arg);
+}
+
+static Lz4Context* GetLz4Context() {
+    Lz4Context* ctx = tls_lz4_context;
+    if (ctx == NULL) {
+        ctx = new (std::nothrow) Lz4Context;
+        if (ctx == NULL || ctx->Init() != 0) {
+            LOG(ERROR) << "Fail to create Lz4Context";
+            delete ctx;
+            return NULL;
+        }
+        tls_lz4_context = ctx;
+        butil::thread_atexit(DeleteLz4Context, ctx);
+    }
+    return ctx;
+}
+
+bool Lz4Compress(const google::protobuf::Message& msg, butil::IOBuf* buf) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    bool ok;
+    if (msg.GetDescriptor() == Serializer::descriptor()) {
+        ok = ((const Serializer&)msg).SerializeTo(&wrapper);
+    } else {
+        ok = msg.SerializeToZeroCopyStream(&wrapper);
+    }
+    if (!ok) {
+        LOG(WARNING) << "Fail to serialize input pb="
+                     << msg.GetDescriptor()->full_name();
+        return false;
+    }
+    return Lz4Compress(serialized_pb, buf);
+}
+
+bool Lz4Decompress(const butil::IOBuf& data, google::protobuf::Message* msg) {
+    butil::IOBuf binary_pb;
+    if (!Lz4Decompress(data, &binary_pb)) {
+        return false;
+    }
+    bool ok;
+    butil::IOBufAsZeroCopyInputStream stream(binary_pb);
+    if (msg->GetDescriptor() == Deserializer::descriptor()) {
+        ok = ((Deserializer*)msg)->DeserializeFrom(&stream);
+    } else {
+        ok = msg->ParseFromZeroCopyStream(&stream);
+    }
+    if (!ok) {
+        LOG(WARNING) << "Fail to deserialize input message="
+                     << msg->GetDescriptor()->full_name();
+    }
+    return ok;
+}
+
+bool Lz4Compress(const butil::IOBuf& in, butil::IOBuf* out) {
+    Lz4Context* ctx = GetLz4Context();
+    if (ctx == NULL) {
+        return false;
+    }
+    size_t n = LZ4F_compressBegin(ctx->cctx, ctx->buf, ctx->buf_size, &ctx->prefs);
+    if (LZ4F_isError(n)) {
+        LOG(WARNING) << "Fail to LZ4F_compressBegin: " << LZ4F_getErrorName(n);
+        return false;
+    }
+    out->append(ctx->buf, n);
+    // Compress blocks of `in' one by one without flattening.
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        butil::StringPiece blk = in.backing_block(i);
+        while (!blk.empty()) {
+            const size_t len = std::min(blk.size(), LZ4_CHUNK_SIZE);
+            n = LZ4F_compressUpdate(ctx->cctx, ctx->buf, ctx->buf_size,
+                                    blk.data(), len, NULL);
+            if (LZ4F_isError(n)) {
+                LOG(WARNING) << "Fail to LZ4F_compressUpdate: "
+                             << LZ4F_getErrorName(n);
+                return false;
+            }
+            out->append(ctx->buf, n);
+            blk.remove_prefix(len);
+        }
+    }
+    n = LZ4F_compressEnd(ctx->cctx, ctx->buf, ctx->buf_size, NULL);
+    if (LZ4F_isError(n)) {
+        LOG(WARNING) << "Fail to LZ4F_compressEnd: " << LZ4F_getErrorName(n);
+        return false;
+    }
+    out->append(ctx->buf, n);
+    return true;
+}
+
+bool Lz4Decompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    Lz4Context* ctx = GetLz4Context();
+    if (ctx == NULL) {
+        return false;
+    }
+    // Decompress blocks of `in' directly into blocks of `out'.
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    char* dst = NULL;
+    int dst_size = 0;
+    size_t hint = 1;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i <= nblock; ++i) {
+        const butil::StringPiece blk =
+            (i < nblock ? in.backing_block(i) : butil::StringPiece());
+        const char* src = blk.data();
+        size_t src_left = blk.size();
+        // After all input is consumed (i == nblock), keep flushing data
+        // buffered inside the context when the last output area was full.
+        while (i < nblock ? src_left > 0 : (hint != 0 && dst_size == 0)) {
+            if (dst_size == 0 && !stream.Next((void**)&dst, &dst_size)) {
+                LOG(WARNING) << "Fail to allocate output";
+                return false;
+            }
+            size_t dlen = dst_size;
+            size_t slen = src_left;
+            hint = LZ4F_decompress(ctx->dctx, dst, &dlen, src, &slen, NULL);
+            if (LZ4F_isError(hint)) {
+                LOG(WARNING) << "Fail to LZ4F_decompress: "
+                             << LZ4F_getErrorName(hint);
+                LZ4F_resetDecompressionContext(ctx->dctx);
+                stream.BackUp(dst_size);
+                return false;
+            }
+            dst += dlen;
+            dst_size -= dlen;
+            src += slen;
+            src_left -= slen;
+            if (i == nblock && dlen == 0) {
+                break;
+            }
+        }
+    }
+    stream.BackUp(dst_size);
+    if (hint != 0) {
+        LOG(WARNING) << "Fail to LZ4F_decompress: incomplete frame";
+        LZ4F_resetDecompressionContext(ctx->dctx);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
+
+#endif  // if BRPC_WITH_LZ4
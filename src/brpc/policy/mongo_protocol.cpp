@@ -176,6 +176,7 @@ void ProcessMongoRequest(InputMessageBase* msg_base) {
     Socket* socket = socket_guard.get();
     const Server* server = static_cast<const Server*>(msg_base->arg());
     ScopedNonServiceError non_service_error(server);
+    RequestLocalStorageGuard bls_guard;
 
     char buf[sizeof(mongo_head_t)];
     const char *p = (const char *)msg->meta.fetch(buf, sizeof(buf));
@@ -1628,6 +1628,7 @@ ParseResult RtmpChunkStream::Feed(const RtmpBasicHeader& bh,
             st = g_client_msg_status;
         }
         if (st) {
+            RequestLocalStorageGuard bls_guard;
             butil::Timer tm;
             tm.start();
             CHECK(st->OnRequested());
@@ -78,6 +78,9 @@ SofaCompressType CompressType2Sofa(CompressType type) {
     case COMPRESS_TYPE_LZ4:
         LOG(ERROR) << "sofa-pbrpc does not support LZ4";
         return SOFA_COMPRESS_TYPE_NONE;
+    case COMPRESS_TYPE_ZSTD:
+        LOG(ERROR) << "sofa-pbrpc does not support ZSTD";
+        return SOFA_COMPRESS_TYPE_NONE;
     default:
         LOG(ERROR) << "Unknown SofaCompressType=" << type;
         return SOFA_COMPRESS_TYPE_NONE;
@@ -322,6 +325,7 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
     Socket* socket = socket_guard.get();
     const Server* server = static_cast<const Server*>(msg_base->arg());
     ScopedNonServiceError non_service_error(server);
+    RequestLocalStorageGuard bls_guard;
 
     SofaRpcMeta meta;
     if (!ParsePbFromIOBuf(&meta, msg->meta)) {
@@ -459,6 +459,7 @@ void ProcessThriftRequest(InputMessageBase* msg_base) {
     Socket* socket = socket_guard.get();
     const Server* server = static_cast<const Server*>(msg_base->arg());
     ScopedNonServiceError non_service_error(server);
+    RequestLocalStorageGuard bls_guard;
 
     ThriftClosure* thrift_done = new ThriftClosure;
     ClosureGuard done_guard(thrift_done);
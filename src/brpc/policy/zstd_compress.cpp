@@ -0,0 +1,266 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#if BRPC_WITH_ZSTD
+
+#include <pthread.h>
+#include <gflags/gflags.h>
+#include <zstd.h>
+#include "butil/atomicops.h"
+#include "butil/file_util.h"
+#include "butil/logging.h"
+#include "butil/thread_local.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/protocol.h"
+#include "brpc/compress.h"
+#include "brpc/reloadable_flags.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(zstd_compression_level, 1, "Compression level of zstd, larger "
+             "levels compress better but slower");
+BRPC_VALIDATE_GFLAG(zstd_compression_level, PassValidate);
+
+DEFINE_string(zstd_dictionary_file, "", "Path to the dictionary shared "
+              "by clients and servers for zstd compression, empty means "
+              "no dictionary");
+
+struct ZstdDictionary {
+    ZSTD_CDict* cdict;
+    ZSTD_DDict* ddict;
+};
+
+// Dictionaries are never freed after being replaced because they may
+// still be used by other threads. Replacements should be rare.
+static butil::atomic<ZstdDictionary*> g_zstd_dict(NULL);
+static pthread_once_t g_load_zstd_dict_once = PTHREAD_ONCE_INIT;
+
+int SetZstdDictionary(const butil::StringPiece& dict) {
+    ZstdDictionary* d = NULL;
+    if (!dict.empty()) {
+        d = new ZstdDictionary;
+        d->cdict = ZSTD_createCDict(dict.data(), dict.size(),
+                                    FLAGS_zstd_compression_level);
+        d->ddict = ZSTD_createDDict(dict.data(), dict.size());
+        if (d->cdict == NULL || d->ddict == NULL) {
+            LOG(ERROR) << "Fail to create zstd dictionary";
+            ZSTD_freeCDict(d->cdict);
+            ZSTD_freeDDict(d->ddict);
+            delete d;
+            return -1;
+        }
+    }
+    g_zstd_dict.store(d, butil::memory_order_release);
+    return 0;
+}
+
+static void LoadZstdDictionary() {
+    if (FLAGS_zstd_dictionary_file.empty() ||
+        g_zstd_dict.load(butil::memory_order_relaxed) != NULL) {
+        return;
+    }
+    std::string dict;
+    if (!butil::ReadFileToString(butil::FilePath(FLAGS_zstd_dictionary_file),
+                                 &dict)) {
+        LOG(ERROR) << "Fail to read zstd dictionary from "
+                   << FLAGS_zstd_dictionary_file;
+        return;
+    }
+    if (SetZstdDictionary(dict) == 0) {
+        LOG(INFO) << "Loaded zstd dictionary from " << FLAGS_zstd_dictionary_file
+                  << ", dict_id=" << ZSTD_getDictID_fromDict(dict.data(), dict.size());
+    }
+}
+
+static const ZstdDictionary* GetZstdDictionary() {
+    pthread_once(&g_load_zstd_dict_once, LoadZstdDictionary);
+    return g_zstd_dict.load(butil::memory_order_acquire);
+}
+
+// zstd contexts are expensive to create, reuse them in each thread. Calls
+// to ZstdCompress/ZstdDecompress never yield, so a bthread always uses
+// contexts of the same pthread during one call.
+struct ZstdContext {
+    ZstdContext() : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {}
+    ~ZstdContext() {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+};
+
+static BAIDU_THREAD_LOCAL ZstdContext* tls_zstd_context = NULL;
+
+static void DeleteZstdContext(void* arg) {
+    delete static_cast<ZstdContext*>(arg);
+}
+
+static ZstdContext* GetZstdContext() {
+    ZstdContext* ctx = tls_zstd_context;
+    if (ctx == NULL) {
+        ctx = new (std::nothrow) ZstdContext;
+        if (ctx == NULL || ctx->cctx == NULL || ctx->dctx == NULL) {
+            LOG(ERROR) << "Fail to create ZstdContext";
+            delete ctx;
+            return NULL;
+        }
+        tls_zstd_context = ctx;
+        butil::thread_atexit(DeleteZstdContext, ctx);
+    }
+    return ctx;
+}
+
+bool ZstdCompress(const google::protobuf::Message& msg, butil::IOBuf* buf) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    bool ok;
+    if (msg.GetDescriptor() == Serializer::descriptor()) {
+        ok = ((const Serializer&)msg).SerializeTo(&wrapper);
+    } else {
+        ok = msg.SerializeToZeroCopyStream(&wrapper);
+    }
+    if (!ok) {
+        LOG(WARNING) << "Fail to serialize input pb="
+                     << msg.GetDescriptor()->full_name();
+        return false;
+    }
+    return ZstdCompress(serialized_pb, buf);
+}
+
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* msg) {
+    butil::IOBuf binary_pb;
+    if (!ZstdDecompress(data, &binary_pb)) {
+        return false;
+    }
+    bool ok;
+    butil::IOBufAsZeroCopyInputStream stream(binary_pb);
+    if (msg->GetDescriptor() == Deserializer::descriptor()) {
+        ok = ((Deserializer*)msg)->DeserializeFrom(&stream);
+    } else {
+        ok = msg->ParseFromZeroCopyStream(&stream);
+    }
+    if (!ok) {
+        LOG(WARNING) << "Fail to deserialize input message="
+                     << msg->GetDescriptor()->full_name();
+    }
+    return ok;
+}
+
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    ZstdContext* ctx = GetZstdContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    const ZstdDictionary* dict = GetZstdDictionary();
+    ZSTD_CCtx_reset(ctx->cctx, ZSTD_reset_session_only);
+    ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
+                           FLAGS_zstd_compression_level);
+    ZSTD_CCtx_refCDict(ctx->cctx, dict ? dict->cdict : NULL);
+
+    // Compress blocks of `in' directly into blocks of `out'.
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer output = { NULL, 0, 0 };
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i <= nblock; ++i) {
+        const butil::StringPiece blk =
+            (i < nblock ? in.backing_block(i) : butil::StringPiece());
+        ZSTD_inBuffer input = { blk.data(), blk.size(), 0 };
+        const ZSTD_EndDirective mode = (i < nblock ? ZSTD_e_continue : ZSTD_e_end);
+        while (true) {
+            if (output.pos == output.size) {
+                int size = 0;
+                if (!stream.Next(&output.dst, &size)) {
+                    LOG(WARNING) << "Fail to allocate output";
+                    return false;
+                }
+                output.size = size;
+                output.pos = 0;
+            }
+            const size_t rc = ZSTD_compressStream2(ctx->cctx, &output, &input, mode);
+            if (ZSTD_isError(rc)) {
+                LOG(WARNING) << "Fail to ZSTD_compressStream2: "
+                             << ZSTD_getErrorName(rc);
+                stream.BackUp(output.size - output.pos);
+                return false;
+            }
+            if (mode == ZSTD_e_end ? rc == 0 : input.pos == input.size) {
+                break;
+            }
+        }
+    }
+    stream.BackUp(output.size - output.pos);
+    return true;
+}
+
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    ZstdContext* ctx = GetZstdContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    const ZstdDictionary* dict = GetZstdDictionary();
+    ZSTD_DCtx_reset(ctx->dctx, ZSTD_reset_session_only);
+    ZSTD_DCtx_refDDict(ctx->dctx, dict ? dict->ddict : NULL);
+
+    // Decompress blocks of `in' directly into blocks of `out'.
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer output = { NULL, 0, 0 };
+    size_t hint = 1;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i <= nblock; ++i) {
+        const butil::StringPiece blk =
+            (i < nblock ? in.backing_block(i) : butil::StringPiece());
+        ZSTD_inBuffer input = { blk.data(), blk.size(), 0 };
+        // After all input is consumed (i == nblock), keep flushing data
+        // buffered inside the context when the last output area was full.
+        while (i < nblock ? input.pos < input.size
+                          : (hint != 0 && output.pos == output.size)) {
+            if (output.pos == output.size) {
+                int size = 0;
+                if (!stream.Next(&output.dst, &size)) {
+                    LOG(WARNING) << "Fail to allocate output";
+                    return false;
+                }
+                output.size = size;
+                output.pos = 0;
+            }
+            const size_t last_pos = output.pos;
+            hint = ZSTD_decompressStream(ctx->dctx, &output, &input);
+            if (ZSTD_isError(hint)) {
+                LOG(WARNING) << "Fail to ZSTD_decompressStream: "
+                             << ZSTD_getErrorName(hint);
+                stream.BackUp(output.size - output.pos);
+                return false;
+            }
+            if (i == nblock && output.pos == last_pos) {
+                break;
+            }
+        }
+    }
+    stream.BackUp(output.size - output.pos);
+    if (hint != 0) {
+        LOG(WARNING) << "Fail to ZSTD_decompressStream: incomplete frame";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
+
+#endif  // if BRPC_WITH_ZSTD
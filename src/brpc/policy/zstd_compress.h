@@ -0,0 +1,59 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_POLICY_ZSTD_COMPRESS_H
+#define BRPC_POLICY_ZSTD_COMPRESS_H
+
+#if BRPC_WITH_ZSTD
+
+#include <google/protobuf/message.h>          // Message
+#include "butil/iobuf.h"                       // IOBuf
+#include "butil/strings/string_piece.h"        // StringPiece
+
+
+namespace brpc {
+namespace policy {
+
+// Compress serialized `msg' into `buf'.
+bool ZstdCompress(const google::protobuf::Message& msg, butil::IOBuf* buf);
+
+// Parse `msg' from decompressed `buf'
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* msg);
+
+// Put compressed `in' into `out'.
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out);
+
+// Put decompressed `in' into `out'.
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out);
+
+// Use `dict' as the dictionary of all zstd compression and decompression
+// in this process, replacing the one loaded from -zstd_dictionary_file.
+// Small messages (say less than a few KB) are compressed much better with
+// a dictionary trained from samples of them, e.g. by `zstd --train'.
+// Clients and servers must use the same dictionary. An empty `dict'
+// disables the dictionary.
+// The dictionary is compressed with -zstd_compression_level at the time
+// of calling this function.
+// Returns 0 on success, -1 otherwise.
+int SetZstdDictionary(const butil::StringPiece& dict);
+
+}  // namespace policy
+} // namespace brpc
+
+#endif  // if BRPC_WITH_ZSTD
+
+#endif // BRPC_POLICY_ZSTD_COMPRESS_H
@@ -15,19 +15,25 @@
 // specific language governing permissions and limitations
 // under the License.
 
-
 #include <gflags/gflags.h>
 #include <fcntl.h>                    // O_CREAT
+#include <algorithm>                  // std::sort
 #include "butil/file_util.h"
 #include "butil/raw_pack.h"
 #include "butil/unique_ptr.h"
 #include "butil/fast_rand.h"
 #include "butil/files/file_enumerator.h"
 #include "bvar/bvar.h"
+#include "bthread/execution_queue.h"
 #include "brpc/log.h"
 #include "brpc/reloadable_flags.h"
+#include "brpc/controller.h"
 #include "brpc/rpc_dump.h"
 #include "brpc/protocol.h"
+#include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
 
 namespace bvar {
 std::string read_command_name();
@@ -44,6 +50,10 @@ DECLARE_uint64(max_body_size);
 // <rpc_dump_dir>/<DUMPED_FILE_PREFIX>.yyyymmdd_hhmmss_uuuuus
 // ...
 // <rpc_dump_dir>/<DUMPED_FILE_PREFIX>.yyyymmdd_hhmmss_uuuuus
+//
+// A dumped file is a sequence of records and compressed chunks:
+//   record: "PRPC" <body_size:32> <meta_size:32> <RpcDumpMeta> <request>
+//   chunk:  "PRPZ" <body_size:32> <compress_type:32> <compressed records>
 
 DEFINE_bool(rpc_dump, false,
             "Dump requests into files so that they can replayed "
@@ -57,13 +67,91 @@ DEFINE_int32(rpc_dump_max_files, 32,
              "If new file is needed, oldest file is removed.");
 DEFINE_int32(rpc_dump_max_requests_in_one_file, 1000,
              "Max number of requests in one dumped file");
+DEFINE_int32(rpc_dump_compress_type, 0,
+             "Compress dumped requests with this CompressType, "
+             "0: none, 1: snappy, 2: gzip, 4: lz4, 5: zstd");
+DEFINE_int32(rpc_dump_max_pending_mb, 64,
+             "Max size in MB of dumped requests waiting for being written, "
+             "requests beyond are dropped");
+
+struct DumpCompressor {
+    CompressType type;
+    bool (*compress)(const butil::IOBuf& in, butil::IOBuf* out);
+    bool (*decompress)(const butil::IOBuf& in, butil::IOBuf* out);
+};
+
+static bool GzipCompressData(const butil::IOBuf& in, butil::IOBuf* out) {
+    return policy::GzipCompress(in, out, NULL);
+}
+
+static const DumpCompressor s_dump_compressors[] = {
+    { COMPRESS_TYPE_SNAPPY, policy::SnappyCompress, policy::SnappyDecompress },
+    { COMPRESS_TYPE_GZIP, GzipCompressData, policy::GzipDecompress },
+#if BRPC_WITH_LZ4
+    { COMPRESS_TYPE_LZ4, policy::Lz4Compress, policy::Lz4Decompress },
+#endif
+#if BRPC_WITH_ZSTD
+    { COMPRESS_TYPE_ZSTD, policy::ZstdCompress, policy::ZstdDecompress },
+#endif
+};
+
+static const DumpCompressor* FindDumpCompressor(int type) {
+    for (size_t i = 0; i < ARRAY_SIZE(s_dump_compressors); ++i) {
+        if (s_dump_compressors[i].type == type) {
+            return &s_dump_compressors[i];
+        }
+    }
+    return NULL;
+}
+
+static bool ValidateDumpCompressType(const char*, int32_t val) {
+    return val == COMPRESS_TYPE_NONE || FindDumpCompressor(val) != NULL;
+}
 
 BRPC_VALIDATE_GFLAG(rpc_dump, PassValidate);
 BRPC_VALIDATE_GFLAG(rpc_dump_max_requests_in_one_file, PositiveInteger);
 BRPC_VALIDATE_GFLAG(rpc_dump_max_files, PositiveInteger);
+BRPC_VALIDATE_GFLAG(rpc_dump_compress_type, ValidateDumpCompressType);
+BRPC_VALIDATE_GFLAG(rpc_dump_max_pending_mb, PositiveInteger);
 
 static const size_t UNWRITTEN_BUFSIZE = 1024 * 1024;
 static const int64_t FLUSH_TIMEOUT = 2000000L; // 2s
+static const size_t RECORD_HEADER_SIZE = 12;
+
+// Serialized requests written into files in one batch.
+struct DumpBatch {
+    butil::IOBuf data;
+    // Close current file after writing this batch.
+    bool close_file;
+    int compress_type;
+    int max_files;
+    butil::FilePath dir;
+};
+
+// Write batches into files, running in a dedicated pthread.
+class RpcDumpWriter {
+public:
+    RpcDumpWriter() : _cur_fd(-1), _last_file_time(0) {}
+    ~RpcDumpWriter() { CloseFile(); }
+
+    void Write(DumpBatch* batch);
+
+private:
+    bool OpenFileIfNeeded(const DumpBatch& batch);
+    void CloseFile() {
+        if (_cur_fd >= 0) {
+            close(_cur_fd);
+            _cur_fd = -1;
+        }
+    }
+
+    int _cur_fd;        // fd of current file
+    int64_t _last_file_time;  // time for the postfix of last file
+    // the queue for remembering oldest file to remove.
+    std::deque<std::string> _filenames;
+    // current filename, being here just to reuse memory.
+    std::string _cur_filename;
+};
 
 class RpcDumpContext {
 public:
@@ -77,42 +165,62 @@ public:
     
     RpcDumpContext()
         : _cur_req_count(0)
-        , _cur_fd(-1)
+        , _unwritten_count(0)
         , _last_round(0)
         , _max_requests_in_one_file(0)
         , _max_files(0)
+        , _compress_type(0)
         , _sched_write_time(butil::gettimeofday_us() + FLUSH_TIMEOUT)
-        , _last_file_time(0)
+        , _writer_started(false)
+        , _pending_bytes(0)
+        , _ndropped("rpc_dump_dropped")
+        , _pending_bytes_var("rpc_dump_pending_bytes", GetPendingBytes, this)
     {
         _command_name = bvar::read_command_name();
         SaveFlags();
         // Clean the directory at fist time.
         butil::DeleteFile(_dir, true); 
-    }
-    ~RpcDumpContext() {
-        if (_cur_fd >= 0) {
-            close(_cur_fd);
-            _cur_fd = -1;
+        bthread::ExecutionQueueOptions options;
+        options.use_pthread = true;
+        if (bthread::execution_queue_start(&_writer_queue, &options,
+                                           WriteBatches, this) != 0) {
+            LOG(ERROR) << "Fail to start writer of dumped requests";
+        } else {
+            _writer_started = true;
         }
     }
     
 private:
+    // Pass unwritten requests to the writing thread.
+    void Flush(bool close_file);
+
+    static int WriteBatches(void* meta, bthread::TaskIterator<DumpBatch*>& iter);
+
+    static int64_t GetPendingBytes(void* arg) {
+        return static_cast<RpcDumpContext*>(arg)->_pending_bytes.load(
+            butil::memory_order_relaxed);
+    }
+
     std::string _command_name;
-    int _cur_req_count; // written #req in current file
-    int _cur_fd;        // fd of current file
+    int _cur_req_count; // #req in current file
+    int _unwritten_count; // #req in _unwritten_buf
     size_t _last_round;
     // save gflags which could be reloaded at anytime.
     int _max_requests_in_one_file;
     int _max_files;
+    int _compress_type;
     int64_t _sched_write_time;     // duetime of last write
-    int64_t _last_file_time;  // time for the postfix of last file
-    // the queue for remembering oldest file to remove.
-    std::deque<std::string> _filenames;
     butil::FilePath _dir;
-    // current filename, being here just to reuse memory.
-    std::string _cur_filename;
     // buffering output to file so they can be written in batch.
     butil::IOBuf _unwritten_buf;
+
+    bool _writer_started;
+    bthread::ExecutionQueueId<DumpBatch*> _writer_queue;
+    // Bytes passed to the writing thread but not written yet.
+    butil::atomic<int64_t> _pending_bytes;
+    RpcDumpWriter _writer;
+    bvar::Adder<int64_t> _ndropped;
+    bvar::PassiveStatus<int64_t> _pending_bytes_var;
 };
 
 bvar::CollectorSpeedLimit g_rpc_dump_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
@@ -136,6 +244,22 @@ void SampledRequest::destroy() {
     delete this;
 }
 
+void SubmitSampledRequest(Controller* cntl, int error_code,
+                          size_t response_size, int64_t received_us) {
+    const SampledRequest* sample = cntl->sampled_request();
+    // Samples created by AskToBeSampled() always have arrival_time_us, other
+    // samples (created for BaiduMasterService) are not dumped.
+    if (sample == NULL || !sample->meta.has_arrival_time_us()) {
+        return;
+    }
+    SampledRequest* s = cntl->release_sampled_request();
+    s->meta.set_error_code(error_code);
+    s->meta.set_response_size(response_size);
+    const int64_t now = butil::cpuwide_time_us();
+    s->meta.set_latency_us(now - received_us);
+    s->submit(now);
+}
+
 // Save gflags which could be reloaded at anytime.
 void RpcDumpContext::SaveFlags() {
     std::string dir;
@@ -149,6 +273,7 @@ void RpcDumpContext::SaveFlags() {
 
     _max_requests_in_one_file = FLAGS_rpc_dump_max_requests_in_one_file;
     _max_files = FLAGS_rpc_dump_max_files;
+    _compress_type = FLAGS_rpc_dump_compress_type;
 }
 
 // Dump a request.
@@ -161,10 +286,13 @@ void RpcDumpContext::Dump(size_t round, SampledRequest* sample) {
     if (!Serialize(_unwritten_buf, sample)) {
         return;
     }
+    ++_unwritten_count;
     ++_cur_req_count;
+    bool close_file = false;
     if (_cur_req_count >= _max_requests_in_one_file) {
         // Reach the limit of #request in a file.
         RPC_VLOG << "Write because _cur_req_count=" << _cur_req_count;
+        close_file = true;
     } else if (_unwritten_buf.size() >= UNWRITTEN_BUFSIZE) {
         // Too much unwritten data
         RPC_VLOG << "Write because _unwritten_buf=" << _unwritten_buf.size();
@@ -174,69 +302,142 @@ void RpcDumpContext::Dump(size_t round, SampledRequest* sample) {
     } else {
         return;
     }
+    Flush(close_file);
+}
 
-    // Open file if needed.
+void RpcDumpContext::Flush(bool close_file) {
+    _sched_write_time = butil::gettimeofday_us() + FLUSH_TIMEOUT;
+    if (close_file) {
+        _cur_req_count = 0;
+    }
+    if (!_writer_started) {
+        _ndropped << _unwritten_count;
+        _unwritten_count = 0;
+        _unwritten_buf.clear();
+        return;
+    }
+    DumpBatch* batch = new (std::nothrow) DumpBatch;
+    if (batch == NULL) {
+        LOG(ERROR) << "Fail to new DumpBatch";
+        return;
+    }
+    const int64_t size = _unwritten_buf.size();
+    if (_pending_bytes.load(butil::memory_order_relaxed) + size >
+        FLAGS_rpc_dump_max_pending_mb * 1048576L) {
+        // Writing can't catch up with dumping. The batch is still sent
+        // (without data) to close the file if needed.
+        _ndropped << _unwritten_count;
+        _unwritten_buf.clear();
+    } else {
+        _pending_bytes.fetch_add(size, butil::memory_order_relaxed);
+        batch->data.swap(_unwritten_buf);
+    }
+    _unwritten_count = 0;
+    batch->close_file = close_file;
+    batch->compress_type = _compress_type;
+    batch->max_files = _max_files;
+    batch->dir = _dir;
+    if (bthread::execution_queue_execute(_writer_queue, batch) != 0) {
+        LOG(ERROR) << "Fail to pass dumped requests to the writer";
+        _pending_bytes.fetch_sub(batch->data.size(), butil::memory_order_relaxed);
+        delete batch;
+    }
+}
+
+int RpcDumpContext::WriteBatches(void* meta,
+                                 bthread::TaskIterator<DumpBatch*>& iter) {
+    RpcDumpContext* ctx = static_cast<RpcDumpContext*>(meta);
+    for (; iter; ++iter) {
+        DumpBatch* batch = *iter;
+        const int64_t size = batch->data.size();
+        ctx->_writer.Write(batch);
+        ctx->_pending_bytes.fetch_sub(size, butil::memory_order_relaxed);
+        delete batch;
+    }
+    return 0;
+}
+
+bool RpcDumpWriter::OpenFileIfNeeded(const DumpBatch& batch) {
+    if (_cur_fd >= 0) {
+        return true;
+    }
+    // Make sure the dir exists.
+    butil::File::Error error;
+    if (!butil::CreateDirectoryAndGetError(batch.dir, &error)) {
+        LOG(ERROR) << "Fail to create directory=`" << batch.dir.value()
+                   << "', " << error;
+        return false;
+    }
+    // Remove oldest files.
+    while ((int)_filenames.size() >= batch.max_files && !_filenames.empty()) {
+        butil::DeleteFile(butil::FilePath(_filenames.front()), false);
+        _filenames.pop_front();
+    }
+    // Make current time as postfix.
+    int64_t cur_file_time = butil::gettimeofday_us();
+    // Make postfix monotonic.
+    if (cur_file_time <= _last_file_time) {
+        cur_file_time = _last_file_time + 1;
+    }
+    time_t rawtime = cur_file_time / 1000000L;
+    struct tm* timeinfo = localtime(&rawtime);
+    char ts_buf[64];
+    strftime(ts_buf, sizeof(ts_buf), "%Y%m%d_%H%M%S", timeinfo);
+    butil::string_printf(&_cur_filename, "%s/" DUMPED_FILE_PREFIX ".%s_%06u",
+                        batch.dir.value().c_str(), ts_buf,
+                        (unsigned)(cur_file_time - rawtime * 1000000L));
+    _cur_fd = open(_cur_filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
     if (_cur_fd < 0) {
-        // Make sure the dir exists.
-        butil::File::Error error;
-        if (!butil::CreateDirectoryAndGetError(_dir, &error)) {
-            LOG(ERROR) << "Fail to create directory=`" << _dir.value()
-                       << "', " << error;
-            return;
-        }
-        // Remove oldest files.
-        while ((int)_filenames.size() >= _max_files && !_filenames.empty()) {
-            butil::DeleteFile(butil::FilePath(_filenames.front()), false);
-            _filenames.pop_front();
-        }
-        // Make current time as postfix.
-        int64_t cur_file_time = butil::gettimeofday_us();
-        // Make postfix monotonic.
-        if (cur_file_time <= _last_file_time) {
-            cur_file_time = _last_file_time + 1;
-        }
-        time_t rawtime = cur_file_time / 1000000L;
-        struct tm* timeinfo = localtime(&rawtime);
-        char ts_buf[64];
-        strftime(ts_buf, sizeof(ts_buf), "%Y%m%d_%H%M%S", timeinfo);
-        butil::string_printf(&_cur_filename, "%s/" DUMPED_FILE_PREFIX ".%s_%06u",
-                            _dir.value().c_str(), ts_buf,
-                            (unsigned)(cur_file_time - rawtime * 1000000L));
-        _cur_fd = open(_cur_filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
-        if (_cur_fd < 0) {
-            PLOG(ERROR) << "Fail to open " << _cur_filename;
-            return;
-        }
-        _last_file_time = cur_file_time;
-        _filenames.push_back(_cur_filename);
-    }
-    // Write all data in _unwritten_buf. This is different from writing
-    // into a socket: local file should always be writable unless error occurs
-    bool fail_to_write = false;
-    while (!_unwritten_buf.empty()) {
-        if (_unwritten_buf.cut_into_file_descriptor(_cur_fd) < 0) {
-            if (errno != EINTR && errno != EAGAIN) {
-                PLOG(ERROR) << "Fail to write into " << _cur_filename;
-                fail_to_write = true;
-                break;
+        PLOG(ERROR) << "Fail to open " << _cur_filename;
+        return false;
+    }
+    _last_file_time = cur_file_time;
+    _filenames.push_back(_cur_filename);
+    return true;
+}
+
+void RpcDumpWriter::Write(DumpBatch* batch) {
+    butil::IOBuf& data = batch->data;
+    if (!data.empty()) {
+        const DumpCompressor* compressor = FindDumpCompressor(batch->compress_type);
+        if (compressor) {
+            butil::IOBuf compressed;
+            if (compressor->compress(data, &compressed)) {
+                char header[RECORD_HEADER_SIZE];
+                memcpy(header, "PRPZ", 4);
+                butil::RawPacker(header + 4)
+                    .pack32(compressed.size())
+                    .pack32(batch->compress_type);
+                data.clear();
+                data.append(header, sizeof(header));
+                data.append(compressed.movable());
+            } else {
+                LOG(ERROR) << "Fail to compress dumped requests, "
+                              "write them uncompressed";
             }
         }
     }
-    _unwritten_buf.clear();
-    _sched_write_time = butil::gettimeofday_us() + FLUSH_TIMEOUT;
-    if (fail_to_write || _cur_req_count >= _max_requests_in_one_file) {
-        // clean up
-        if (_cur_fd >= 0) {
-            close(_cur_fd);
-            _cur_fd = -1;
+    if (!data.empty() && OpenFileIfNeeded(*batch)) {
+        // Write all data. This is different from writing into a socket:
+        // local file should always be writable unless error occurs
+        while (!data.empty()) {
+            if (data.cut_into_file_descriptor(_cur_fd) < 0) {
+                if (errno != EINTR && errno != EAGAIN) {
+                    PLOG(ERROR) << "Fail to write into " << _cur_filename;
+                    CloseFile();
+                    break;
+                }
+            }
         }
-        _cur_req_count = 0;
+    }
+    if (batch->close_file) {
+        CloseFile();
     }
 }
 
 bool RpcDumpContext::Serialize(butil::IOBuf& buf, SampledRequest* sample) {
     // Use the header of baidu_std.
-    char rpc_header[12];
+    char rpc_header[RECORD_HEADER_SIZE];
     butil::IOBuf::Area header_area = buf.reserve(sizeof(rpc_header));
     
     const size_t starting_size = buf.size();
@@ -259,17 +460,15 @@ bool RpcDumpContext::Serialize(butil::IOBuf& buf, SampledRequest* sample) {
 
 SampleIterator::SampleIterator(const butil::StringPiece& dir)
     : _cur_fd(-1)
-    , _enum(NULL)
+    , _listed(false)
     , _dir(std::string(dir.data(), dir.size())) {
 }
 
 SampleIterator::~SampleIterator() {
-    if (_cur_fd) {
+    if (_cur_fd >= 0) {
         ::close(_cur_fd);
         _cur_fd = -1;
     }
-    delete _enum;
-    _enum = NULL;
 }
 
 SampledRequest* SampleIterator::Next() {
@@ -307,25 +506,34 @@ SampledRequest* SampleIterator::Next() {
             _cur_fd = -1;
         }
         
-        if (_enum == NULL) {
-            _enum = new butil::FileEnumerator(
-                _dir, false, butil::FileEnumerator::FILES);
+        if (!_listed) {
+            _listed = true;
+            butil::FileEnumerator e(_dir, false, butil::FileEnumerator::FILES);
+            for (butil::FilePath name = e.Next(); !name.empty(); name = e.Next()) {
+                _files.push_back(name);
+            }
+            // Postfixes of dumped files are creation time. Sort in reverse
+            // order so that the oldest file is popped first.
+            std::sort(_files.begin(), _files.end());
+            std::reverse(_files.begin(), _files.end());
         }
-        butil::FilePath filename = _enum->Next();
-        if (filename.empty()) {
+        if (_files.empty()) {
             return NULL;
         }
+        const butil::FilePath filename = _files.back();
+        _files.pop_back();
         _cur_fd = open(filename.value().c_str(), O_RDONLY);
     }
 }
 
 SampledRequest* SampleIterator::Pop(butil::IOBuf& buf, bool* format_error) {
-    char backing_buf[12];
+    char backing_buf[RECORD_HEADER_SIZE];
     const char* p = (const char*)buf.fetch(backing_buf, sizeof(backing_buf));
     if (NULL == p) {  // buf.length() < sizeof(backing_buf)
         return NULL;
     }
-    if (*(const uint32_t*)p != *(const uint32_t*)"PRPC") {
+    const bool compressed = (memcmp(p, "PRPZ", 4) == 0);
+    if (!compressed && *(const uint32_t*)p != *(const uint32_t*)"PRPC") {
         LOG(ERROR) << "Unmatched magic string";
         *format_error = true;
         return NULL;
@@ -340,6 +548,28 @@ SampledRequest* SampleIterator::Pop(butil::IOBuf& buf, bool* format_error) {
     } else if (buf.length() < sizeof(backing_buf) + body_size) {
         return NULL;
     }
+    if (compressed) {
+        // `meta_size' is compress_type of the chunk.
+        const DumpCompressor* compressor = FindDumpCompressor(meta_size);
+        if (compressor == NULL) {
+            LOG(ERROR) << "Unknown compress_type=" << meta_size;
+            *format_error = true;
+            return NULL;
+        }
+        buf.pop_front(sizeof(backing_buf));
+        butil::IOBuf chunk;
+        buf.cutn(&chunk, body_size);
+        butil::IOBuf records;
+        if (!compressor->decompress(chunk, &records)) {
+            LOG(ERROR) << "Fail to decompress chunk of dumped requests";
+            *format_error = true;
+            return NULL;
+        }
+        // Records in the chunk are read before remaining data.
+        records.append(buf.movable());
+        buf.swap(records);
+        return Pop(buf, format_error);
+    }
     if (meta_size > body_size) {
         LOG(ERROR) << "meta_size=" << meta_size << " is bigger than body_size="
                    << body_size;
@@ -19,22 +19,28 @@
 #ifndef BRPC_RPC_DUMP_H
 #define BRPC_RPC_DUMP_H
 
+#include <vector>
 #include <gflags/gflags_declare.h>
 #include "butil/iobuf.h"                            // IOBuf
 #include "butil/files/file_path.h"                  // FilePath
+#include "butil/time.h"                             // gettimeofday_us
 #include "bvar/collector.h"
 #include "brpc/rpc_dump.pb.h"                       // RpcDumpMeta
 
-namespace butil {
-class FileEnumerator;
-}
-
 namespace brpc {
 
+class Controller;
+
 DECLARE_bool(rpc_dump);
 
 // Randomly take samples of all requests and write into a file in batch in
 // a background thread.
+// Samples are submitted into thread-local buffers of bvar::Collector, which
+// serializes them in the collecting thread and passes them in batch to a
+// dedicated writing thread, which (optionally) compresses and writes them
+// into files. File IO never blocks the request path or the collecting
+// thread, samples are dropped when too many bytes are waiting for being
+// written (-rpc_dump_max_pending_mb).
 
 // Example:
 //   SampledRequest* sample = AskToBeSampled();
@@ -69,9 +75,23 @@ inline SampledRequest* AskToBeSampled() {
     if (!FLAGS_rpc_dump || !bvar::is_collectable(&g_rpc_dump_sl)) {
         return NULL;
     }
-    return new (std::nothrow) SampledRequest;
+    SampledRequest* sample = new (std::nothrow) SampledRequest;
+    if (sample) {
+        // Replayer reproduces the arrival process with this timestamp.
+        sample->meta.set_arrival_time_us(butil::gettimeofday_us());
+    }
+    return sample;
 }
 
+// Submit the sample returned by AskToBeSampled() and attached to `cntl'
+// by reset_sampled_request() along with metadata of the response, which
+// should be called just before the response is written. Does nothing if
+// `cntl' does not have such a sample.
+// `received_us' is the butil::cpuwide_time_us() when the request was
+// received.
+void SubmitSampledRequest(Controller* cntl, int error_code,
+                          size_t response_size, int64_t received_us);
+
 // Read samples from dumped files in a directory.
 // Example:
 //   SampleIterator it("./rpc_dump_echo_server");
@@ -83,8 +103,8 @@ public:
     explicit SampleIterator(const butil::StringPiece& dir);
     ~SampleIterator();
 
-    // Read a sample. Order of samples are not guaranteed to be same with
-    // the order that they're stored in dumped files.
+    // Read a sample. Files are read in the order that they're created, and
+    // samples in a file are mostly ordered by arrival_time_us.
     // Returns the sample which should be deleted by caller. NULL means
     // all dumped files are read.
     SampledRequest* Next();
@@ -96,7 +116,9 @@ private:
     
     butil::IOPortal _cur_buf;
     int _cur_fd;
-    butil::FileEnumerator* _enum;
+    bool _listed;
+    // Files not read yet, in reverse order of names.
+    std::vector<butil::FilePath> _files;
     butil::FilePath _dir;
 };
 
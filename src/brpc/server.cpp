@@ -20,6 +20,9 @@
 #include <arpa/inet.h>                              // inet_aton
 #include <fcntl.h>                                  // O_CREAT
 #include <sys/stat.h>                               // mkdir
+#if defined(__linux__)
+#include <linux/filter.h>                           // sock_filter
+#endif
 #include <gflags/gflags.h>
 #include <google/protobuf/descriptor.h>             // ServiceDescriptor
 #include "idl_options.pb.h"                         // option(idl_support)
@@ -64,6 +67,7 @@
 #include "brpc/builtin/bthreads_service.h"     // BthreadsService
 #include "brpc/builtin/ids_service.h"          // IdsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
+#include "brpc/builtin/hot_peers_service.h"    // HotPeersService
 #include "brpc/builtin/hotspots_service.h"     // HotspotsService
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/builtin/memory_service.h"
@@ -118,6 +122,7 @@ DEFINE_bool(enable_threads_service, false, "Enable /threads");
 
 DECLARE_int32(usercode_backup_threads);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_int32(event_dispatcher_num);
 
 // NOTE: never make s_ncore extern const whose ctor seq against other
 // compilation units is undefined.
@@ -152,7 +157,9 @@ ServerOptions::ServerOptions()
     , redis_service(NULL)
     , bthread_tag(BTHREAD_TAG_DEFAULT)
     , rpc_pb_message_factory(NULL)
-    , ignore_eovercrowded(false) {
+    , ignore_eovercrowded(false)
+    , listen_per_event_dispatcher(false)
+    , reuse_port_cpu_steering(false) {
     if (s_ncore > 0) {
         num_threads = s_ncore + 1;
     }
@@ -576,6 +583,10 @@ int Server::AddBuiltinServices() {
         LOG(ERROR) << "Fail to add SocketsService";
         return -1;
     }
+    if (AddBuiltinService(new (std::nothrow) HotPeersService)) {
+        LOG(ERROR) << "Fail to add HotPeersService";
+        return -1;
+    }
     if (AddBuiltinService(new (std::nothrow) GetFaviconService)) {
         LOG(ERROR) << "Fail to add GetFaviconService";
         return -1;
@@ -632,6 +643,7 @@ Acceptor* Server::BuildAcceptor() {
         handler.verify = protocols[i].verify;
         handler.arg = this;
         handler.name = protocols[i].name;
+        handler.process_mode = INPUT_PROCESS_DEFAULT;
         if (acceptor->AddHandler(handler) != 0) {
             LOG(ERROR) << "Fail to add handler into Acceptor("
                        << acceptor << ')';
@@ -736,6 +748,60 @@ static int get_port_from_fd(int fd) {
     return ntohs(addr.sin_port);
 }
 
+// Steer a new connection to the listener whose index is the CPU handling
+// the SYN modulo `nlistener', which keeps the connection on the CPU
+// receiving its packets when RSS/RPS is configured accordingly.
+static int AttachCpuSteeringProgram(int fd, int nlistener) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    struct sock_filter code[] = {
+        // A = raw_smp_processor_id()
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        // A = A % nlistener
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nlistener },
+        // return A
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = ARRAY_SIZE(code);
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) != 0) {
+        PLOG(WARNING) << "Fail to attach reuseport program to fd=" << fd;
+        return -1;
+    }
+    return 0;
+#else
+    (void)fd;
+    (void)nlistener;
+    LOG(WARNING) << "SO_ATTACH_REUSEPORT_CBPF is not supported";
+    return -1;
+#endif
+}
+
+int Server::ListenPerEventDispatcher(int first_fd, std::vector<int>* fds) {
+    fds->clear();
+    fds->push_back(first_fd);
+    for (int i = 1; i < FLAGS_event_dispatcher_num; ++i) {
+        // _listen_addr.port is resolved already.
+        const int fd = tcp_listen(_listen_addr, true);
+        if (fd < 0) {
+            PLOG(ERROR) << "Fail to listen " << _listen_addr
+                        << " with SO_REUSEPORT";
+            for (size_t j = 1; j < fds->size(); ++j) {
+                close((*fds)[j]);
+            }
+            fds->clear();
+            return -1;
+        }
+        fds->push_back(fd);
+    }
+    if (_options.reuse_port_cpu_steering) {
+        // Not fatal, the kernel distributes connections by hash.
+        AttachCpuSteeringProgram(first_fd, fds->size());
+    }
+    return 0;
+}
+
 bool Server::CreateConcurrencyLimiter(const AdaptiveMaxConcurrency& amc,
                                       ConcurrencyLimiter** out) {
     if (amc.type() == AdaptiveMaxConcurrency::UNLIMITED) {
@@ -1122,7 +1188,8 @@ int Server::StartInternal(const butil::EndPoint& endpoint,
     _listen_addr = endpoint;
     for (int port = port_range.min_port; port <= port_range.max_port; ++port) {
         _listen_addr.port = port;
-        butil::fd_guard sockfd(tcp_listen(_listen_addr));
+        butil::fd_guard sockfd(tcp_listen(_listen_addr,
+                                          _options.listen_per_event_dispatcher));
         if (sockfd < 0) {
             if (port != port_range.max_port) { // not the last port, try next
                 continue;
@@ -1161,6 +1228,22 @@ int Server::StartInternal(const butil::EndPoint& endpoint,
         GenerateVersionIfNeeded();
         g_running_server_count.fetch_add(1, butil::memory_order_relaxed);
 
+        if (_options.listen_per_event_dispatcher &&
+            FLAGS_event_dispatcher_num > 1) {
+            std::vector<int> fds;
+            if (ListenPerEventDispatcher(sockfd, &fds) != 0) {
+                return -1;
+            }
+            sockfd.release();
+            // Pass ownership of `fds' to `_am'
+            if (_am->StartAccept(fds, _options.idle_timeout_sec,
+                                 _default_ssl_ctx,
+                                 _options.force_ssl) != 0) {
+                LOG(ERROR) << "Fail to start acceptor";
+                return -1;
+            }
+            break; // stop trying
+        }
         // Pass ownership of `sockfd' to `_am'
         if (_am->StartAccept(sockfd, _options.idle_timeout_sec,
                              _default_ssl_ctx,
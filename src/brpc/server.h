@@ -292,6 +292,21 @@ struct ServerOptions {
     // [CUATION] You should not enabling this option if your rpc is heavy-loaded.
     bool ignore_eovercrowded;
 
+    // Open one SO_REUSEPORT listening socket for each EventDispatcher
+    // (-event_dispatcher_num) rather than a single one. Connections are
+    // accepted, read and processed by the dispatcher of the listening socket
+    // that the kernel puts them in, which removes the single accepting path
+    // of servers with lots of short connections.
+    // Default: false
+    bool listen_per_event_dispatcher;
+
+    // When listen_per_event_dispatcher is true, attach a BPF program to the
+    // listening sockets to put a new connection into the socket indexed by
+    // the cpu receiving it (modulo number of sockets), rather than by hash
+    // of the 4-tuple. Linux only.
+    // Default: false
+    bool reuse_port_cpu_steering;
+
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ServerOptions from being bloated in most cases.
@@ -644,6 +659,10 @@ friend class Controller;
     // Create acceptor with handlers of protocols.
     Acceptor* BuildAcceptor();
 
+    // Open SO_REUSEPORT sockets listening to _listen_addr, one for each
+    // EventDispatcher. `first_fd' is put into `fds' as the first one.
+    int ListenPerEventDispatcher(int first_fd, std::vector<int>* fds);
+
     int StartInternal(const butil::EndPoint& endpoint,
                       const PortRange& port_range,
                       const ServerOptions *opt);
@@ -50,11 +50,15 @@
 #include "brpc/policy/rtmp_protocol.h"  // FIXME
 #include "brpc/periodic_task.h"
 #include "brpc/details/health_check.h"
+#include "brpc/details/hot_peers.h"         // AddHotPeerStats
 #include "brpc/rdma/rdma_endpoint.h"
 #include "brpc/rdma/rdma_helper.h"
 #if defined(OS_MACOSX)
 #include <sys/event.h>
 #endif
+#if defined(OS_LINUX)
+#include <linux/errqueue.h>                       // sock_extended_err
+#endif
 
 namespace bthread {
 size_t BAIDU_WEAK get_sizes(const bthread_id_list_t* list, size_t* cnt, size_t n);
@@ -82,6 +86,24 @@ DEFINE_int32(socket_send_buffer_size, -1,
 
 DEFINE_int32(ssl_bio_buffer_size, 16*1024, "Set buffer size for SSL read/write");
 
+DEFINE_bool(socket_read_into_pooled_blocks, false,
+            "Read non-SSL sockets into blocks picked from the per-thread block "
+            "pool at the time of reading, instead of caching blocks in each "
+            "socket until its messages are consumed. Memory is only held by "
+            "connections which actually received data");
+BRPC_VALIDATE_GFLAG(socket_read_into_pooled_blocks, PassValidate);
+
+DEFINE_bool(socket_enable_zerocopy, false,
+            "Write large data into non-SSL TCP sockets with MSG_ZEROCOPY "
+            "(Linux 4.14+). Written blocks are referenced until the kernel "
+            "notifies completion");
+BRPC_VALIDATE_GFLAG(socket_enable_zerocopy, PassValidate);
+
+DEFINE_int64(socket_zerocopy_min_bytes, 64 * 1024,
+             "Use MSG_ZEROCOPY only when bytes to write in one batch is not "
+             "less than this value, smaller writes are cheaper to copy");
+BRPC_VALIDATE_GFLAG(socket_zerocopy_min_bytes, NonNegativeInteger);
+
 DEFINE_int64(socket_max_unwritten_bytes, 64 * 1024 * 1024,
              "Max unwritten bytes in each socket, if the limit is reached,"
              " Socket.Write fails with EOVERCROWDED");
@@ -484,6 +506,13 @@ Socket::Socket(Forbidden f)
     , _logoff_flag(false)
     , _error_code(0)
     , _pipeline_q(NULL)
+    , _zerocopy_q(NULL)
+    , _zerocopy_seq(0)
+    , _zerocopy_state(0)
+    , _zerocopy_pending_bytes(0)
+    , _zerocopy_bytes(0)
+    , _zerocopy_fallback_bytes(0)
+    , _copied_bytes(0)
     , _last_writetime_us(0)
     , _unwritten_bytes(0)
     , _epollout_butex(NULL)
@@ -572,6 +601,16 @@ int Socket::ResetFileDescriptor(int fd) {
     // Reset message sizes when fd is changed.
     _last_msg_size = 0;
     _avg_msg_size = 0;
+    // Notifications of MSG_ZEROCOPY are per fd. Incomplete writes of the
+    // previous fd (if any) were parked along with the fd when it was closed,
+    // see ParkZeroCopyWrites().
+    {
+        BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+        DCHECK(_zerocopy_q == NULL || _zerocopy_q->empty());
+        _zerocopy_seq = 0;
+        _zerocopy_state = 0;
+        _zerocopy_pending_bytes.store(0, butil::memory_order_relaxed);
+    }
     // MUST store `_fd' before adding itself into epoll device to avoid
     // race conditions with the callback function inside epoll
     _fd.store(fd, butil::memory_order_release);
@@ -720,6 +759,7 @@ int Socket::OnCreated(const SocketOptions& options) {
         return -1;
     }
     _io_event.set_bthread_tag(options.bthread_tag);
+    _io_event.set_event_dispatcher_index(options.event_dispatcher_index);
     auto guard = butil::MakeScopeGuard([this] {
         _io_event.Reset();
     });
@@ -793,6 +833,9 @@ int Socket::OnCreated(const SocketOptions& options) {
     }
     _last_writetime_us.store(cpuwide_now, butil::memory_order_relaxed);
     _unwritten_bytes.store(0, butil::memory_order_relaxed);
+    _zerocopy_bytes.store(0, butil::memory_order_relaxed);
+    _zerocopy_fallback_bytes.store(0, butil::memory_order_relaxed);
+    _copied_bytes.store(0, butil::memory_order_relaxed);
     _keepalive_options = options.keepalive_options;
     _tcp_user_timeout_ms = options.tcp_user_timeout_ms;
     CHECK(NULL == _write_head.load(butil::memory_order_relaxed));
@@ -856,7 +899,9 @@ void Socket::BeforeRecycled() {
         if (_on_edge_triggered_events != NULL) {
             _io_event.RemoveConsumer(prev_fd);
         }
-        close(prev_fd);
+        if (!ParkZeroCopyWrites(prev_fd)) {
+            close(prev_fd);
+        }
         if (create_by_connect) {
             g_vars->channel_conn << -1;
         }
@@ -888,6 +933,12 @@ void Socket::BeforeRecycled() {
     delete _pipeline_q;
     _pipeline_q = NULL;
 
+    // Incomplete writes were parked along with fd above, what's left is
+    // empty.
+    delete _zerocopy_q;
+    _zerocopy_q = NULL;
+    _zerocopy_pending_bytes.store(0, butil::memory_order_relaxed);
+
     delete _auth_context;
     _auth_context = NULL;
 
@@ -1027,7 +1078,9 @@ int Socket::WaitAndReset(int32_t expected_nref) {
         if (_on_edge_triggered_events != NULL) {
             _io_event.RemoveConsumer(prev_fd);
         }
-        close(prev_fd);
+        if (!ParkZeroCopyWrites(prev_fd)) {
+            close(prev_fd);
+        }
         if (CreatedByConnect()) {
             g_vars->channel_conn << -1;
         }
@@ -1767,7 +1820,8 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
 #else
         {
 #endif
-            nw = req->data.cut_into_file_descriptor(fd());
+            butil::IOBuf* data_arr[1] = { &req->data };
+            nw = CutIntoFileDescriptor(data_arr, 1);
         }
     }
     if (nw < 0) {
@@ -1776,6 +1830,7 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
             saved_errno = errno;
             // EPIPE is common in pooled connections + backup requests.
             PLOG_IF(WARNING, errno != EPIPE) << "Fail to write into " << *this;
+            AddHotPeerStats(remote_side(), 0, 0, 0, 1);
             SetFailed(saved_errno, "Fail to write into %s: %s", 
                       description().c_str(), berror(saved_errno));
             goto FAIL_TO_WRITE;
@@ -1837,6 +1892,7 @@ void* Socket::KeepWrite(void* void_arg) {
             if (errno != EAGAIN && errno != EOVERCROWDED) {
                 const int saved_errno = errno;
                 PLOG(WARNING) << "Fail to keep-write into " << *s;
+                AddHotPeerStats(s->remote_side(), 0, 0, 0, 1);
                 s->SetFailed(saved_errno, "Fail to keep-write into %s: %s",
                              s->description().c_str(), berror(saved_errno));
                 break;
@@ -1953,8 +2009,7 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
                 return _rdma_ep->CutFromIOBufList(data_list, ndata);
             }
 #endif
-            return butil::IOBuf::cut_multiple_into_file_descriptor(
-                fd(), data_list, ndata);
+            return CutIntoFileDescriptor(data_list, ndata);
         }
     }
 
@@ -1999,6 +2054,199 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
     return nw;
 }
 
+ssize_t Socket::CutIntoFileDescriptor(butil::IOBuf* const* data_list,
+                                      size_t ndata) {
+    if (FLAGS_socket_enable_zerocopy && _zerocopy_state >= 0) {
+        size_t total = 0;
+        for (size_t i = 0; i < ndata; ++i) {
+            total += data_list[i]->size();
+        }
+        if (total >= (size_t)FLAGS_socket_zerocopy_min_bytes) {
+            const ssize_t nw = DoZeroCopyWrite(data_list, ndata);
+            if (nw >= 0 || errno != ENOBUFS) {
+                return nw;
+            }
+            // Fallback to copying.
+        }
+    }
+    const ssize_t nw = butil::IOBuf::cut_multiple_into_file_descriptor(
+        fd(), data_list, ndata);
+    if (nw > 0) {
+        _copied_bytes.fetch_add(nw, butil::memory_order_relaxed);
+    }
+    return nw;
+}
+
+ssize_t Socket::DoZeroCopyWrite(butil::IOBuf* const* data_list, size_t ndata) {
+#if defined(OS_LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (_zerocopy_state == 0) {
+        int on = 1;
+        if (setsockopt(fd(), SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+            // Not TCP or the kernel is too old.
+            _zerocopy_state = -1;
+            errno = ENOBUFS;
+            return -1;
+        }
+        _zerocopy_state = 1;
+    }
+    if (_zerocopy_pending_bytes.load(butil::memory_order_relaxed) > 0) {
+        // Release completed blocks before pinning more memory.
+        ReapZeroCopyCompletions(fd());
+    }
+    butil::IOBuf sent;
+    // The kernel numbers successful writes with MSG_ZEROCOPY starting from
+    // 0, hold the lock to assign `seq' in the same order and before any
+    // notification of this write can be reaped.
+    BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+    const ssize_t nw = butil::IOBuf::cut_multiple_into_socket(
+        fd(), data_list, ndata, MSG_ZEROCOPY, &sent);
+    if (nw <= 0) {
+        // ENOBUFS if the pinned memory exceeds optmem_max, caller copies.
+        return nw;
+    }
+    if (_zerocopy_q == NULL) {
+        _zerocopy_q = new std::deque<ZeroCopyWrite>;
+    }
+    _zerocopy_q->push_back(ZeroCopyWrite());
+    ZeroCopyWrite& w = _zerocopy_q->back();
+    w.seq = _zerocopy_seq++;
+    w.data.swap(sent);
+    _zerocopy_pending_bytes.fetch_add(nw, butil::memory_order_relaxed);
+    return nw;
+#else
+    errno = ENOBUFS;
+    return -1;
+#endif
+}
+
+void Socket::ReapZeroCopyCompletions(int fd) {
+    int64_t zc_bytes = 0;
+    int64_t copied_bytes = 0;
+    PopCompletedZeroCopyWrites(fd, &_zerocopy_mutex, &_zerocopy_q,
+                               &zc_bytes, &copied_bytes);
+    _zerocopy_pending_bytes.fetch_sub(zc_bytes + copied_bytes,
+                                      butil::memory_order_relaxed);
+    _zerocopy_bytes.fetch_add(zc_bytes, butil::memory_order_relaxed);
+    _zerocopy_fallback_bytes.fetch_add(copied_bytes, butil::memory_order_relaxed);
+}
+
+void Socket::PopCompletedZeroCopyWrites(int fd, butil::Mutex* mutex,
+                                        std::deque<ZeroCopyWrite>** q,
+                                        int64_t* zc_bytes,
+                                        int64_t* copied_bytes) {
+#if defined(OS_LINUX) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    char control[128];
+    while (true) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            // EAGAIN: no more notifications.
+            return;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            const sock_extended_err* serr =
+                (const sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // Writes in [ee_info, ee_data] are completed. Notifications of
+            // TCP arrive in order, everything before ee_data is done.
+            const uint32_t last = serr->ee_data;
+            const bool copied = (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            int64_t nbytes = 0;
+            {
+                std::unique_lock<butil::Mutex> mu;
+                if (mutex) {
+                    mu = std::unique_lock<butil::Mutex>(*mutex);
+                }
+                while (*q && !(*q)->empty() &&
+                       (int32_t)((*q)->front().seq - last) <= 0) {
+                    nbytes += (*q)->front().data.size();
+                    (*q)->pop_front();
+                }
+            }
+            if (copied) {
+                *copied_bytes += nbytes;
+                g_vars->zerocopy_fallback_bytes << nbytes;
+            } else {
+                *zc_bytes += nbytes;
+                g_vars->zerocopy_bytes << nbytes;
+            }
+        }
+    }
+#endif
+}
+
+// Holds a fd closed by its Socket and MSG_ZEROCOPY writes to the fd which
+// are not completed yet, until all of them complete.
+class ZeroCopyReclaimTask : public PeriodicTask {
+public:
+    ZeroCopyReclaimTask(int fd, std::deque<Socket::ZeroCopyWrite>* q)
+        : _fd(fd), _q(q) {}
+
+    bool OnTriggeringTask(timespec* next_abstime) override {
+        int64_t zc_bytes = 0;
+        int64_t copied_bytes = 0;
+        Socket::PopCompletedZeroCopyWrites(_fd, NULL, &_q,
+                                           &zc_bytes, &copied_bytes);
+        if (_q->empty()) {
+            return false;
+        }
+        *next_abstime = butil::milliseconds_from_now(10);
+        return true;
+    }
+
+    void OnDestroyingTask() override {
+        if (_q->empty()) {
+            close(_fd);
+            delete _q;
+        } else {
+            // The task failed to be scheduled. Leak the blocks rather than
+            // reusing them while the kernel may still be transmitting.
+            LOG(ERROR) << "Leak fd=" << _fd << " and " << _q->size()
+                       << " incomplete writes with MSG_ZEROCOPY";
+        }
+        delete this;
+    }
+
+private:
+    int _fd;
+    std::deque<Socket::ZeroCopyWrite>* _q;
+};
+
+bool Socket::ParkZeroCopyWrites(int fd) {
+    {
+        BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+        if (_zerocopy_q == NULL || _zerocopy_q->empty()) {
+            return false;
+        }
+    }
+    ReapZeroCopyCompletions(fd);
+    std::deque<ZeroCopyWrite>* q = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+        if (_zerocopy_q->empty()) {
+            return false;
+        }
+        q = _zerocopy_q;
+        _zerocopy_q = NULL;
+    }
+    _zerocopy_pending_bytes.store(0, butil::memory_order_relaxed);
+    // Disconnect as close() does. Data queued before is still sent.
+    shutdown(fd, SHUT_RDWR);
+    PeriodicTaskManager::StartTaskAt(new ZeroCopyReclaimTask(fd, q),
+                                     butil::milliseconds_from_now(10));
+    return true;
+}
+
 int Socket::SSLHandshake(int fd, bool server_mode) {
     if (_ssl_ctx == NULL) {
         if (server_mode) {
@@ -2139,6 +2387,14 @@ ssize_t Socket::DoRead(size_t size_hint) {
             return -1;
         }
         CHECK(_rdma_state == RDMA_OFF);
+        if (_zerocopy_pending_bytes.load(butil::memory_order_relaxed) > 0) {
+            // Completions of MSG_ZEROCOPY wake up the input event with
+            // EPOLLERR, this is also where they're reaped.
+            ReapZeroCopyCompletions(fd());
+        }
+        if (FLAGS_socket_read_into_pooled_blocks) {
+            return _read_buf.append_from_file_descriptor_pooled(fd(), size_hint);
+        }
         return _read_buf.append_from_file_descriptor(fd(), size_hint);
     }
 
@@ -2403,6 +2659,12 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
        << "\nread_buf=" << ptr->_read_buf.size()
        << "\nlast_read_to_now=" << cpuwide_now - ptr->_last_readtime_us << "us"
        << "\nlast_write_to_now=" << cpuwide_now - ptr->_last_writetime_us << "us"
+       << "\ncopied_bytes=" << ptr->_copied_bytes.load(butil::memory_order_relaxed)
+       << "\nzerocopy_bytes=" << ptr->_zerocopy_bytes.load(butil::memory_order_relaxed)
+       << "\nzerocopy_fallback_bytes="
+       << ptr->_zerocopy_fallback_bytes.load(butil::memory_order_relaxed)
+       << "\nzerocopy_pending_bytes="
+       << ptr->_zerocopy_pending_bytes.load(butil::memory_order_relaxed)
        << "\novercrowded=" << ptr->_overcrowded;
     os << "\nid_wait_list={";
     for (size_t i = 0; i < nidsize; ++i) {
@@ -2986,6 +3248,7 @@ void Socket::CancelUnwrittenBytes(size_t bytes) {
 }
 void Socket::AddOutputBytes(size_t bytes) {
     GetOrNewSharedPart()->out_size.fetch_add(bytes, butil::memory_order_relaxed);
+    AddHotPeerStats(remote_side(), 0, 0, bytes, 0);
     _last_writetime_us.store(butil::cpuwide_time_us(),
                              butil::memory_order_relaxed);
     CancelUnwrittenBytes(bytes);
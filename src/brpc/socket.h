@@ -143,6 +143,8 @@ struct SocketVarsCollector {
         , nkeepwrite_second("rpc_keepwrite_second", &nkeepwrite)
         , nwaitepollout("rpc_waitepollout_count")
         , nwaitepollout_second("rpc_waitepollout_second", &nwaitepollout)
+        , zerocopy_bytes("rpc_socket_zerocopy_bytes")
+        , zerocopy_fallback_bytes("rpc_socket_zerocopy_fallback_bytes")
     {}
 
     bvar::Adder<int64_t> nsocket;
@@ -154,6 +156,8 @@ struct SocketVarsCollector {
     bvar::PerSecond<bvar::Adder<int64_t> > nkeepwrite_second;
     bvar::Adder<int64_t> nwaitepollout;
     bvar::PerSecond<bvar::Adder<int64_t> > nwaitepollout_second;
+    bvar::Adder<int64_t> zerocopy_bytes;
+    bvar::Adder<int64_t> zerocopy_fallback_bytes;
 };
 
 struct PipelinedInfo {
@@ -285,6 +289,9 @@ struct SocketOptions {
     int tcp_user_timeout_ms{ -1};
     // Tag of this socket
     bthread_tag_t bthread_tag{bthread_self_tag()};
+    // Index of the EventDispatcher (in the tag) watching events of this
+    // socket. Negative means that the dispatcher is chosen by hashing fd.
+    int event_dispatcher_index{-1};
 };
 
 // Abstractions on reading from and writing into file descriptors.
@@ -303,6 +310,7 @@ friend class schan::ChannelBalancer;
 friend class rdma::RdmaEndpoint;
 friend class rdma::RdmaConnect;
 friend class HealthCheckTask;
+friend class ZeroCopyReclaimTask;
 friend class OnAppHealthCheckDone;
 friend class HealthCheckManager;
 friend class policy::H2GlobalStreamCreator;
@@ -693,6 +701,39 @@ private:
     // success, -1 otherwise and errno is set
     ssize_t DoWrite(WriteRequest* req);
 
+    // Cut `data_list' into fd, with MSG_ZEROCOPY if it's enabled and the
+    // data is large enough. Returns what DoWrite() returns.
+    ssize_t CutIntoFileDescriptor(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Write `data_list' with MSG_ZEROCOPY. Written blocks are referenced
+    // in `_zerocopy_q' until ReapZeroCopyCompletions() sees the
+    // corresponding notifications. Returns written bytes on success, -1
+    // otherwise and errno is set. errno is ENOBUFS when zero-copy is not
+    // available for this write and the data should be copied instead.
+    ssize_t DoZeroCopyWrite(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Read completion notifications of MSG_ZEROCOPY from the error queue
+    // of `fd' and release blocks no longer used by the kernel.
+    void ReapZeroCopyCompletions(int fd);
+
+    struct ZeroCopyWrite;
+    // Pop writes in `*q' which are completed according to notifications in
+    // the error queue of `fd'. `*q' is accessed with `mutex' locked if it's
+    // not NULL. Bytes of popped writes are added to `*zc_bytes', or to
+    // `*copied_bytes' if the kernel copied them anyway.
+    static void PopCompletedZeroCopyWrites(int fd, butil::Mutex* mutex,
+                                           std::deque<ZeroCopyWrite>** q,
+                                           int64_t* zc_bytes,
+                                           int64_t* copied_bytes);
+
+    // Called before closing `fd'. The kernel keeps transmitting from blocks
+    // written with MSG_ZEROCOPY after fd is closed, while completions can
+    // only be read from fd. If some writes are not completed yet, fd is
+    // shut down and handed to a background task along with the writes, and
+    // closed after all of them complete.
+    // Returns true if `fd' is taken, false if the caller should close it.
+    bool ParkZeroCopyWrites(int fd);
+
     // [Not thread-safe] Wait for EPOLLOUT event on `fd'. If `pollin' is
     // true, EPOLLIN event will also be included and EPOLL_CTL_MOD will
     // be used instead of EPOLL_CTL_ADD. Note that spurious wakeups may
@@ -942,6 +983,28 @@ private:
     butil::Mutex _pipeline_mutex;
     std::deque<PipelinedInfo>* _pipeline_q;
 
+    // Data written with MSG_ZEROCOPY and not completed yet. `seq' is the
+    // counter of the write assigned by the kernel.
+    struct ZeroCopyWrite {
+        uint32_t seq;
+        butil::IOBuf data;
+    };
+    butil::Mutex _zerocopy_mutex;
+    std::deque<ZeroCopyWrite>* _zerocopy_q;
+    // Counter of the next MSG_ZEROCOPY write, protected by _zerocopy_mutex.
+    uint32_t _zerocopy_seq;
+    // 0: not tried, 1: SO_ZEROCOPY is set on fd, -1: not supported.
+    // Only accessed by the writing thread.
+    int _zerocopy_state;
+    butil::atomic<int64_t> _zerocopy_pending_bytes;
+    // Bytes sent without copying
+    butil::atomic<int64_t> _zerocopy_bytes;
+    // Bytes written with MSG_ZEROCOPY but copied by the kernel anyway,
+    // e.g. through loopback.
+    butil::atomic<int64_t> _zerocopy_fallback_bytes;
+    // Bytes copied into the kernel by ordinary writes.
+    butil::atomic<int64_t> _copied_bytes;
+
     // For storing call-id of in-progress RPC.
     pthread_mutex_t _id_wait_list_mutex;
     bthread_id_list_t _id_wait_list;
@@ -112,6 +112,8 @@ public:
     { _start_callback_real_us = tm + _base_real_us; }
     void set_start_send_us(int64_t tm)
     { _start_send_real_us = tm + _base_real_us; }
+    void set_start_write_us(int64_t tm)
+    { _start_write_real_us = tm + _base_real_us; }
     void set_sent_us(int64_t tm)
     { _sent_real_us = tm + _base_real_us; }
 
@@ -136,6 +138,7 @@ public:
     int64_t start_parse_real_us() const { return _start_parse_real_us; }
     int64_t start_callback_real_us() const { return _start_callback_real_us; }
     int64_t start_send_real_us() const { return _start_send_real_us; }
+    int64_t start_write_real_us() const { return _start_write_real_us; }
     int64_t sent_real_us() const { return _sent_real_us; }
     bool async() const { return _async; }
     const std::string& full_method_name() const { return _full_method_name; }
@@ -174,6 +177,7 @@ private:
     int64_t _start_parse_real_us;
     int64_t _start_callback_real_us;
     int64_t _start_send_real_us;
+    int64_t _start_write_real_us;
     int64_t _sent_real_us;
     std::string _full_method_name;
     // Format: 
@@ -0,0 +1,610 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <fcntl.h>                        // open, fallocate
+#include <sys/mman.h>                     // mmap
+#include <unistd.h>                       // pwrite
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/file_util.h"
+#include "butil/string_printf.h"
+#include "brpc/span.h"
+#include "brpc/span_store.h"
+
+namespace brpc {
+
+// Segments are sealed when they hold so many spans or bytes even if the
+// time span is not covered, which also keeps offsets within 32 bits.
+static const size_t MAX_ENTRIES_PER_SEGMENT = 65536;
+static const size_t MAX_DATA_PER_SEGMENT = 64 * 1024 * 1024;
+
+// Memory of an entry and its slot in the trace index.
+const size_t SpanStore::ENTRY_MEMORY =
+    sizeof(SpanStore::Entry) + sizeof(uint64_t) + sizeof(SpanStore::EntryRef);
+
+SpanStoreOptions::SpanStoreOptions()
+    : shard_num(16)
+    , segment_span_us(10000000L)
+    , max_memory_bytes(256 * 1024 * 1024)
+    , remove_spill_files(true) {
+}
+
+struct SpanStore::Segment {
+    uint64_t seq;
+    int64_t bucket_begin_us;
+    int64_t min_start_us;
+    int64_t max_start_us;
+    std::vector<Entry> entries;
+    // Serialized RpczSpan of entries, released after spilling.
+    std::string data;
+    bool spilled;
+    const char* mapped;
+    size_t mapped_len;
+    off_t file_offset;
+
+    Segment(uint64_t seq2, int64_t bucket_begin)
+        : seq(seq2)
+        , bucket_begin_us(bucket_begin)
+        , min_start_us(std::numeric_limits<int64_t>::max())
+        , max_start_us(std::numeric_limits<int64_t>::min())
+        , spilled(false)
+        , mapped(NULL)
+        , mapped_len(0)
+        , file_offset(0) {}
+
+    ~Segment() {
+        if (mapped != NULL) {
+            munmap(const_cast<char*>(mapped), mapped_len);
+        }
+    }
+
+    const char* data_ptr() const { return mapped ? mapped : data.data(); }
+};
+
+struct SpanStore::Shard {
+    // Protects all fields except the spilling file.
+    mutable pthread_mutex_t mutex;
+    // Ascending by seq which is consecutive.
+    std::deque<Segment*> segments;
+    uint64_t next_seq;
+    // trace_id -> latest span of the trace, earlier spans are chained by
+    // Entry::prev. Spans are dropped oldest first, so a chain always ends
+    // at a dropped segment.
+    butil::FlatMap<uint64_t, EntryRef> traces;
+    size_t nspan;
+    size_t nspilled_segment;
+    size_t index;
+
+    // Accessed with SpanStore::_shrink_mutex held.
+    int fd;
+    off_t file_size;
+    std::string file_path;
+
+    explicit Shard(size_t index2)
+        : next_seq(1), nspan(0), nspilled_segment(0), index(index2)
+        , fd(-1), file_size(0) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+    ~Shard() {
+        for (size_t i = 0; i < segments.size(); ++i) {
+            delete segments[i];
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_destroy(&mutex);
+    }
+};
+
+struct SpanStore::CollectedEntry {
+    SpanSummary summary;
+    const std::string* method;
+};
+
+struct StartLater {
+    template <typename T>
+    bool operator()(const T& e1, const T& e2) const {
+        return e1.summary.start_real_us > e2.summary.start_real_us;
+    }
+};
+
+SpanStore::SpanStore()
+    : _shards(NULL)
+    , _memory(0)
+    , _spilled_bytes(0) {
+    pthread_mutex_init(&_shrink_mutex, NULL);
+    pthread_mutex_init(&_method_mutex, NULL);
+}
+
+SpanStore::~SpanStore() {
+    if (_shards) {
+        for (size_t i = 0; i < _options.shard_num; ++i) {
+            Shard* s = _shards[i];
+            const std::string path = s->file_path;
+            delete s;
+            if (!path.empty() && _options.remove_spill_files) {
+                butil::DeleteFile(butil::FilePath(path), false);
+            }
+        }
+        delete [] _shards;
+        _shards = NULL;
+    }
+    pthread_mutex_destroy(&_shrink_mutex);
+    pthread_mutex_destroy(&_method_mutex);
+}
+
+int SpanStore::Init(const SpanStoreOptions& options) {
+    if (_shards != NULL) {
+        LOG(ERROR) << "Already initialized";
+        return -1;
+    }
+    if (options.shard_num == 0 || options.segment_span_us <= 0) {
+        LOG(ERROR) << "Invalid options";
+        return -1;
+    }
+    _options = options;
+    if (!_options.spill_dir.empty()) {
+        butil::File::Error error;
+        const butil::FilePath dir(_options.spill_dir);
+        if (!butil::CreateDirectoryAndGetError(dir, &error)) {
+            LOG(ERROR) << "Fail to create directory=`" << dir.value() << "', "
+                       << error;
+            return -1;
+        }
+    }
+    if (_method_map.init(64) != 0) {
+        LOG(ERROR) << "Fail to init _method_map";
+        return -1;
+    }
+    _shards = new Shard*[_options.shard_num];
+    for (size_t i = 0; i < _options.shard_num; ++i) {
+        _shards[i] = new Shard(i);
+        if (_shards[i]->traces.init(1024) != 0) {
+            LOG(ERROR) << "Fail to init traces";
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const std::string* SpanStore::InternMethod(const butil::StringPiece& method) {
+    BAIDU_SCOPED_LOCK(_method_mutex);
+    const std::string** p = _method_map.seek(method);
+    if (p != NULL) {
+        return *p;
+    }
+    _methods.push_back(method.as_string());
+    const std::string* name = &_methods.back();
+    _method_map.insert(*name, name);
+    return name;
+}
+
+int SpanStore::Add(const SpanSummary& summary, const butil::StringPiece& method,
+                   const butil::StringPiece& data) {
+    if (_shards == NULL) {
+        return -1;
+    }
+    if (data.size() > MAX_DATA_PER_SEGMENT) {
+        LOG(WARNING) << "Span of " << data.size() << " bytes is too large";
+        return -1;
+    }
+    Entry e;
+    e.summary = summary;
+    e.method = InternMethod(method);
+    e.data_len = data.size();
+    const int64_t start_us = summary.start_real_us;
+    Shard* s = shard_of(summary.trace_id);
+    {
+        BAIDU_SCOPED_LOCK(s->mutex);
+        Segment* seg = s->segments.empty() ? NULL : s->segments.back();
+        // Late spans are appended to the latest segment as well, min/max
+        // start time of the segment tell where they are.
+        if (seg == NULL || seg->spilled ||
+            start_us >= seg->bucket_begin_us + _options.segment_span_us ||
+            seg->entries.size() >= MAX_ENTRIES_PER_SEGMENT ||
+            seg->data.size() + data.size() > MAX_DATA_PER_SEGMENT) {
+            const int64_t bucket_begin =
+                start_us - start_us % _options.segment_span_us;
+            seg = new Segment(s->next_seq++, bucket_begin);
+            seg->entries.reserve(1024);
+            s->segments.push_back(seg);
+        }
+        e.data_offset = seg->data.size();
+        EntryRef ref = { seg->seq, (uint32_t)seg->entries.size() };
+        EntryRef* head = s->traces.seek(summary.trace_id);
+        if (head != NULL) {
+            e.prev = *head;
+            *head = ref;
+        } else {
+            e.prev.segment_seq = 0;
+            e.prev.index = 0;
+            s->traces.insert(summary.trace_id, ref);
+        }
+        seg->entries.push_back(e);
+        seg->data.append(data.data(), data.size());
+        seg->min_start_us = std::min(seg->min_start_us, start_us);
+        seg->max_start_us = std::max(seg->max_start_us, start_us);
+        ++s->nspan;
+    }
+    const size_t mem = _memory.fetch_add(ENTRY_MEMORY + data.size(),
+                                         butil::memory_order_relaxed);
+    if (mem > _options.max_memory_bytes) {
+        Shrink();
+    }
+    return 0;
+}
+
+const SpanStore::Entry* SpanStore::GetEntry(
+    const Shard* shard, const EntryRef& ref, const Segment** segment) {
+    if (shard->segments.empty()) {
+        return NULL;
+    }
+    const uint64_t first_seq = shard->segments.front()->seq;
+    if (ref.segment_seq < first_seq ||
+        ref.segment_seq - first_seq >= shard->segments.size()) {
+        return NULL;
+    }
+    const Segment* seg = shard->segments[ref.segment_seq - first_seq];
+    *segment = seg;
+    return &seg->entries[ref.index];
+}
+
+int SpanStore::FindSpan(uint64_t trace_id, uint64_t span_id,
+                        RpczSpan* span) const {
+    if (_shards == NULL) {
+        return -1;
+    }
+    std::string value;
+    const Shard* s = shard_of(trace_id);
+    {
+        BAIDU_SCOPED_LOCK(s->mutex);
+        const EntryRef* head = s->traces.seek(trace_id);
+        if (head == NULL) {
+            return -1;
+        }
+        const Segment* seg = NULL;
+        for (const Entry* e = GetEntry(s, *head, &seg); e != NULL;
+             e = GetEntry(s, e->prev, &seg)) {
+            if (e->summary.trace_id == trace_id &&
+                e->summary.span_id == span_id) {
+                value.assign(seg->data_ptr() + e->data_offset, e->data_len);
+                break;
+            }
+        }
+    }
+    // Parse outside the lock to not block ingestion.
+    if (value.empty() || !span->ParseFromString(value)) {
+        return -1;
+    }
+    return 0;
+}
+
+void SpanStore::FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) const {
+    out->clear();
+    if (_shards == NULL) {
+        return;
+    }
+    std::vector<std::string> values;
+    const Shard* s = shard_of(trace_id);
+    {
+        BAIDU_SCOPED_LOCK(s->mutex);
+        const EntryRef* head = s->traces.seek(trace_id);
+        if (head == NULL) {
+            return;
+        }
+        const Segment* seg = NULL;
+        for (const Entry* e = GetEntry(s, *head, &seg); e != NULL;
+             e = GetEntry(s, e->prev, &seg)) {
+            if (e->summary.trace_id == trace_id) {
+                values.push_back(std::string(seg->data_ptr() + e->data_offset,
+                                             e->data_len));
+            }
+        }
+    }
+    for (size_t i = 0; i < values.size(); ++i) {
+        out->push_back(RpczSpan());
+        if (!out->back().ParseFromString(values[i])) {
+            LOG(ERROR) << "Fail to parse from value";
+            out->pop_back();
+        }
+    }
+}
+
+void SpanStore::ListSpans(int64_t before_this_time, size_t max_scan,
+                          std::deque<BriefSpan>* out, SpanFilter* filter) const {
+    out->clear();
+    if (_shards == NULL || max_scan == 0) {
+        return;
+    }
+    // Keep latest `max_scan' spans in a min-heap on start time.
+    std::vector<CollectedEntry> heap;
+    heap.reserve(std::min(max_scan, (size_t)4096));
+    for (size_t i = 0; i < _options.shard_num; ++i) {
+        const Shard* s = _shards[i];
+        BAIDU_SCOPED_LOCK(s->mutex);
+        for (size_t j = s->segments.size(); j > 0; --j) {
+            const Segment* seg = s->segments[j - 1];
+            if (seg->min_start_us > before_this_time) {
+                continue;
+            }
+            if (heap.size() == max_scan &&
+                seg->max_start_us <= heap.front().summary.start_real_us) {
+                // Segments are not strictly ordered due to late spans,
+                // skip instead of stopping.
+                continue;
+            }
+            for (size_t k = 0; k < seg->entries.size(); ++k) {
+                const Entry& e = seg->entries[k];
+                if (e.summary.start_real_us > before_this_time) {
+                    continue;
+                }
+                if (heap.size() < max_scan) {
+                    CollectedEntry c = { e.summary, e.method };
+                    heap.push_back(c);
+                    std::push_heap(heap.begin(), heap.end(), StartLater());
+                } else if (e.summary.start_real_us >
+                           heap.front().summary.start_real_us) {
+                    std::pop_heap(heap.begin(), heap.end(), StartLater());
+                    heap.back().summary = e.summary;
+                    heap.back().method = e.method;
+                    std::push_heap(heap.begin(), heap.end(), StartLater());
+                }
+            }
+        }
+    }
+    std::sort(heap.begin(), heap.end(), StartLater());
+    BriefSpan brief;
+    for (size_t i = 0; i < heap.size(); ++i) {
+        const SpanSummary& sum = heap[i].summary;
+        brief.Clear();
+        brief.set_trace_id(sum.trace_id);
+        brief.set_span_id(sum.span_id);
+        brief.set_log_id(sum.log_id);
+        brief.set_type((SpanType)sum.type);
+        brief.set_error_code(sum.error_code);
+        brief.set_request_size(sum.request_size);
+        brief.set_response_size(sum.response_size);
+        brief.set_start_real_us(sum.start_real_us);
+        brief.set_latency_us(sum.latency_us);
+        brief.set_full_method_name(*heap[i].method);
+        if (NULL == filter || filter->Keep(brief)) {
+            out->push_back(brief);
+        }
+    }
+}
+
+void SpanStore::DropFrontSegment(Shard* s) {
+    Segment* seg = NULL;
+    {
+        BAIDU_SCOPED_LOCK(s->mutex);
+        if (s->segments.empty()) {
+            return;
+        }
+        seg = s->segments.front();
+        s->segments.pop_front();
+        for (size_t i = 0; i < seg->entries.size(); ++i) {
+            const uint64_t trace_id = seg->entries[i].summary.trace_id;
+            const EntryRef* head = s->traces.seek(trace_id);
+            // All spans of the trace in this shard are gone.
+            if (head != NULL && head->segment_seq <= seg->seq) {
+                s->traces.erase(trace_id);
+            }
+        }
+        s->nspan -= seg->entries.size();
+        if (seg->spilled) {
+            --s->nspilled_segment;
+        }
+    }
+    size_t freed = seg->entries.size() * ENTRY_MEMORY;
+    if (seg->spilled) {
+        _spilled_bytes.fetch_sub(seg->mapped_len, butil::memory_order_relaxed);
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+        // Return the disk space while keeping offsets of other segments.
+        if (seg->mapped_len != 0 &&
+            fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      seg->file_offset, seg->mapped_len) != 0) {
+            PLOG_EVERY_SECOND(WARNING) << "Fail to punch hole in "
+                                       << s->file_path;
+        }
+#endif
+    } else {
+        freed += seg->data.size();
+    }
+    _memory.fetch_sub(freed, butil::memory_order_relaxed);
+    delete seg;
+}
+
+void SpanStore::RemoveSpansBefore(int64_t tm) {
+    if (_shards == NULL) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_shrink_mutex);
+    for (size_t i = 0; i < _options.shard_num; ++i) {
+        Shard* s = _shards[i];
+        while (true) {
+            {
+                BAIDU_SCOPED_LOCK(s->mutex);
+                if (s->segments.empty() ||
+                    s->segments.front()->max_start_us >= tm) {
+                    break;
+                }
+            }
+            // Only this function and Shrink() remove segments, both
+            // are serialized by _shrink_mutex.
+            DropFrontSegment(s);
+        }
+    }
+}
+
+int SpanStore::SpillSegment(Shard* s, Segment* seg) {
+    if (s->fd < 0) {
+        s->file_path = butil::string_printf(
+            "%s/shard_%zu.spans", _options.spill_dir.c_str(), s->index);
+        s->fd = open(s->file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (s->fd < 0) {
+            PLOG(ERROR) << "Fail to open " << s->file_path;
+            s->file_path.clear();
+            return -1;
+        }
+        s->file_size = 0;
+    }
+    // Sealed segments are immutable and only removed with _shrink_mutex
+    // held, so the data can be written without the lock of shard.
+    const size_t len = seg->data.size();
+    const char* mapped = NULL;
+    const long page_size = sysconf(_SC_PAGESIZE);
+    const off_t offset = (s->file_size + page_size - 1) / page_size * page_size;
+    if (len != 0) {
+        size_t nw = 0;
+        while (nw < len) {
+            const ssize_t rc = pwrite(s->fd, seg->data.data() + nw, len - nw,
+                                      offset + nw);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                PLOG(ERROR) << "Fail to write " << s->file_path;
+                return -1;
+            }
+            nw += rc;
+        }
+        void* p = mmap(NULL, len, PROT_READ, MAP_SHARED, s->fd, offset);
+        if (p == MAP_FAILED) {
+            PLOG(ERROR) << "Fail to mmap " << s->file_path;
+            return -1;
+        }
+        mapped = (const char*)p;
+        s->file_size = offset + len;
+    }
+    std::string released;
+    {
+        BAIDU_SCOPED_LOCK(s->mutex);
+        seg->mapped = mapped;
+        seg->mapped_len = len;
+        seg->file_offset = offset;
+        seg->spilled = true;
+        seg->data.swap(released);
+        ++s->nspilled_segment;
+    }
+    _memory.fetch_sub(len, butil::memory_order_relaxed);
+    _spilled_bytes.fetch_add(len, butil::memory_order_relaxed);
+    return 0;
+}
+
+bool SpanStore::SpillOldest() {
+    Shard* oldest_shard = NULL;
+    Segment* oldest = NULL;
+    for (size_t i = 0; i < _options.shard_num; ++i) {
+        Shard* s = _shards[i];
+        BAIDU_SCOPED_LOCK(s->mutex);
+        // The latest segment is still being appended.
+        for (size_t j = 0; j + 1 < s->segments.size(); ++j) {
+            Segment* seg = s->segments[j];
+            if (!seg->spilled) {
+                if (oldest == NULL ||
+                    seg->bucket_begin_us < oldest->bucket_begin_us) {
+                    oldest = seg;
+                    oldest_shard = s;
+                }
+                break;
+            }
+        }
+    }
+    if (oldest == NULL) {
+        return false;
+    }
+    return SpillSegment(oldest_shard, oldest) == 0;
+}
+
+bool SpanStore::DropOldest() {
+    Shard* oldest_shard = NULL;
+    int64_t oldest_begin = 0;
+    for (size_t i = 0; i < _options.shard_num; ++i) {
+        Shard* s = _shards[i];
+        BAIDU_SCOPED_LOCK(s->mutex);
+        if (!s->segments.empty() &&
+            (oldest_shard == NULL ||
+             s->segments.front()->bucket_begin_us < oldest_begin)) {
+            oldest_shard = s;
+            oldest_begin = s->segments.front()->bucket_begin_us;
+        }
+    }
+    if (oldest_shard == NULL) {
+        return false;
+    }
+    DropFrontSegment(oldest_shard);
+    return true;
+}
+
+void SpanStore::Shrink() {
+    // Another thread is shrinking.
+    if (pthread_mutex_trylock(&_shrink_mutex) != 0) {
+        return;
+    }
+    while (_memory.load(butil::memory_order_relaxed) > _options.max_memory_bytes) {
+        if (!_options.spill_dir.empty() && SpillOldest()) {
+            continue;
+        }
+        if (!DropOldest()) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_shrink_mutex);
+}
+
+size_t SpanStore::span_count() const {
+    size_t n = 0;
+    for (size_t i = 0; _shards && i < _options.shard_num; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i]->mutex);
+        n += _shards[i]->nspan;
+    }
+    return n;
+}
+
+void SpanStore::Describe(std::ostream& os) const {
+    if (_shards == NULL) {
+        return;
+    }
+    os << "shards=" << _options.shard_num
+       << " segment_span_us=" << _options.segment_span_us
+       << " memory=" << memory_bytes() << '/' << _options.max_memory_bytes
+       << " spilled_bytes=" << _spilled_bytes.load(butil::memory_order_relaxed);
+    if (!_options.spill_dir.empty()) {
+        os << " spill_dir=" << _options.spill_dir;
+    }
+    os << '\n';
+    for (size_t i = 0; i < _options.shard_num; ++i) {
+        const Shard* s = _shards[i];
+        BAIDU_SCOPED_LOCK(s->mutex);
+        os << "[shard " << i << "] spans=" << s->nspan
+           << " traces=" << s->traces.size()
+           << " segments=" << s->segments.size()
+           << " spilled_segments=" << s->nspilled_segment;
+        if (!s->segments.empty()) {
+            os << " oldest_start_us=" << s->segments.front()->min_start_us
+               << " latest_start_us=" << s->segments.back()->max_start_us;
+        }
+        os << '\n';
+    }
+}
+
+} // namespace brpc
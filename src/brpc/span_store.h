@@ -0,0 +1,168 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SPAN_STORE_H
+#define BRPC_SPAN_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <ostream>
+#include <string>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
+#include "butil/containers/flat_map.h"
+#include "brpc/span.pb.h"
+
+namespace brpc {
+
+class SpanFilter;
+
+struct SpanStoreOptions {
+    SpanStoreOptions();
+
+    // Spans are put into shards by their trace_id.
+    // Default: 16
+    size_t shard_num;
+
+    // A shard appends spans into the latest segment until the segment
+    // covers so many microseconds of start time, then a new segment is
+    // started. Segments are the unit of spilling and eviction.
+    // Default: 10 seconds
+    int64_t segment_span_us;
+
+    // Memory of the index and in-memory data of all shards. When it's
+    // exceeded, oldest segments are spilled (if `spill_dir' is set) or
+    // evicted.
+    // Default: 256MB
+    size_t max_memory_bytes;
+
+    // If non-empty, sealed segments are written into an append-only file
+    // per shard under this directory and read back through mmap, so that
+    // only the index of these segments stays in memory.
+    // Default: "" (no spilling)
+    std::string spill_dir;
+
+    // Remove files under `spill_dir' at destruction.
+    // Default: true
+    bool remove_spill_files;
+};
+
+// Fields of a span to be listed by time, as compact as possible.
+struct SpanSummary {
+    uint64_t trace_id;
+    uint64_t span_id;
+    uint64_t log_id;
+    int64_t start_real_us;
+    int64_t latency_us;
+    int32_t request_size;
+    int32_t response_size;
+    int32_t error_code;
+    int32_t type;
+};
+
+// In-memory storage of spans collected by rpcz, indexed by trace_id and by
+// start time. Each shard keeps a ring of time-bucketed segments holding
+// SpanSummary and serialized RpczSpan of spans, older segments are spilled
+// to disk or evicted to keep memory bounded, and segments out of the time
+// window are dropped in whole without touching their spans one by one.
+// Methods are thread-safe.
+class SpanStore {
+public:
+    SpanStore();
+    ~SpanStore();
+
+    int Init(const SpanStoreOptions& options);
+
+    // Add a span described by `summary', `data' is the serialized RpczSpan.
+    // Returns 0 on success.
+    int Add(const SpanSummary& summary, const butil::StringPiece& method,
+            const butil::StringPiece& data);
+
+    // Drop all segments whose spans all started before `tm'.
+    void RemoveSpansBefore(int64_t tm);
+
+    // Find the span by `trace_id' and `span_id', parse into `span'.
+    int FindSpan(uint64_t trace_id, uint64_t span_id, RpczSpan* span) const;
+
+    // Find all spans of `trace_id', in no particular order.
+    void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) const;
+
+    // Put at most `max_scan' latest spans started not after
+    // `before_this_time' into `out' in descending order of start time, spans
+    // rejected by `filter' are counted in `max_scan' as well.
+    void ListSpans(int64_t before_this_time, size_t max_scan,
+                   std::deque<BriefSpan>* out, SpanFilter* filter) const;
+
+    void Describe(std::ostream& os) const;
+
+    size_t span_count() const;
+    size_t memory_bytes() const { return _memory.load(butil::memory_order_relaxed); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SpanStore);
+
+    struct EntryRef {
+        uint64_t segment_seq;
+        uint32_t index;
+    };
+    struct Entry {
+        SpanSummary summary;
+        const std::string* method;
+        uint32_t data_offset;
+        uint32_t data_len;
+        // Previous span of the same trace in this shard.
+        EntryRef prev;
+    };
+    struct Segment;
+    struct Shard;
+    struct CollectedEntry;
+
+    static const size_t ENTRY_MEMORY;
+
+    const std::string* InternMethod(const butil::StringPiece& method);
+    Shard* shard_of(uint64_t trace_id) const {
+        return _shards[trace_id % _options.shard_num];
+    }
+    // Return the entry referenced by `ref' or NULL when it was dropped.
+    static const Entry* GetEntry(const Shard* shard, const EntryRef& ref,
+                                 const Segment** segment);
+    // Spill or drop oldest segments until memory is within the limit.
+    void Shrink();
+    bool SpillOldest();
+    bool DropOldest();
+    void DropFrontSegment(Shard* shard);
+    int SpillSegment(Shard* shard, Segment* seg);
+
+    SpanStoreOptions _options;
+    Shard** _shards;
+    butil::atomic<size_t> _memory;
+    butil::atomic<size_t> _spilled_bytes;
+    pthread_mutex_t _shrink_mutex;
+
+    mutable pthread_mutex_t _method_mutex;
+    // Interned method names which are never freed until destruction, so
+    // that entries can reference them without locking.
+    std::deque<std::string> _methods;
+    butil::FlatMap<std::string, const std::string*> _method_map;
+};
+
+} // namespace brpc
+
+#endif // BRPC_SPAN_STORE_H
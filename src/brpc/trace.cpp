@@ -0,0 +1,577 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include <memory>
+#include <sstream>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "butil/synchronization/condition_variable.h"
+#include "butil/time/time.h"
+#include "bthread/task_meta.h"                   // LocalStorage
+#include "bvar/reducer.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/protocol.h"
+#include "brpc/builtin/common.h"                 // GetProgramName
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/traced_span_buffer.h"
+#include "brpc/details/tracing.h"
+
+namespace bthread {
+extern __thread bthread::LocalStorage tls_bls;
+}
+
+namespace brpc {
+
+static bool ValidateRatio(const char*, double v) {
+    return v >= 0 && v <= 1;
+}
+DEFINE_double(trace_sample_ratio, 0,
+              "Ratio of requests and RPCs traced when they're not in traces "
+              "of callers, see brpc/trace.h");
+BRPC_VALIDATE_GFLAG(trace_sample_ratio, ValidateRatio);
+
+// String flags are read once when the first span is submitted.
+DEFINE_string(trace_exporter, "",
+              "Export traced spans to: `file' (-trace_export_file) or "
+              "`otlp_http' (-trace_otlp_endpoint), not exported if empty. "
+              "Overridden by the exporter set by brpc::SetSpanExporter()");
+
+DEFINE_string(trace_export_file, "brpc_traces.json",
+              "File that spans are appended to when -trace_exporter=file");
+
+DEFINE_string(trace_otlp_endpoint, "127.0.0.1:4318",
+              "host:port of the OpenTelemetry collector receiving OTLP/HTTP "
+              "when -trace_exporter=otlp_http");
+
+DEFINE_int32(trace_buffer_size, 65536,
+             "Max number of spans waiting to be exported, spans finished when "
+             "the buffer is full are dropped. Read once at the first span");
+
+DEFINE_int32(trace_export_batch_size, 512, "Max number of spans in a batch");
+BRPC_VALIDATE_GFLAG(trace_export_batch_size, PositiveInteger);
+
+DEFINE_int32(trace_export_interval_ms, 500,
+             "Export spans at least once in so many milliseconds");
+BRPC_VALIDATE_GFLAG(trace_export_interval_ms, PositiveInteger);
+
+const char* const TRACEPARENT_HEADER = "traceparent";
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static bool ParseHex64(const char* s, uint64_t* out) {
+    uint64_t v = 0;
+    for (int i = 0; i < 16; ++i) {
+        const char c = s[i];
+        int d = 0;
+        if (c >= '0' && c <= '9') {
+            d = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            d = c - 'a' + 10;
+        } else {
+            return false;
+        }
+        v = (v << 4) | d;
+    }
+    *out = v;
+    return true;
+}
+
+static void PrintHex64(uint64_t v, char* buf) {
+    for (int i = 15; i >= 0; --i) {
+        buf[i] = HEX_DIGITS[v & 0xF];
+        v >>= 4;
+    }
+}
+
+bool ParseTraceParent(const butil::StringPiece& s, TraceContext* ctx) {
+    // Later versions may append fields.
+    if (s.size() < TRACEPARENT_LENGTH ||
+        (s.size() > TRACEPARENT_LENGTH && s[TRACEPARENT_LENGTH] != '-')) {
+        return false;
+    }
+    const char* p = s.data();
+    if (p[2] != '-' || p[35] != '-' || p[52] != '-' ||
+        (p[0] == 'f' && p[1] == 'f')) {
+        return false;
+    }
+    uint64_t flags = 0;
+    char flags_buf[16] = { '0', '0', '0', '0', '0', '0', '0', '0',
+                           '0', '0', '0', '0', '0', '0', p[53], p[54] };
+    TraceContext tmp;
+    if (!ParseHex64(p + 3, &tmp.trace_id_high) ||
+        !ParseHex64(p + 19, &tmp.trace_id_low) ||
+        !ParseHex64(p + 36, &tmp.parent_span_id) ||
+        !ParseHex64(flags_buf, &flags)) {
+        return false;
+    }
+    if ((tmp.trace_id_high | tmp.trace_id_low) == 0 ||
+        tmp.parent_span_id == 0) {
+        return false;
+    }
+    tmp.sampled = (flags & 1);
+    *ctx = tmp;
+    return true;
+}
+
+void PrintTraceParent(const TraceContext& ctx, char* buf) {
+    buf[0] = '0';
+    buf[1] = '0';
+    buf[2] = '-';
+    PrintHex64(ctx.trace_id_high, buf + 3);
+    PrintHex64(ctx.trace_id_low, buf + 19);
+    buf[35] = '-';
+    PrintHex64(ctx.span_id, buf + 36);
+    buf[52] = '-';
+    buf[53] = '0';
+    buf[54] = (ctx.sampled ? '1' : '0');
+    buf[TRACEPARENT_LENGTH] = '\0';
+}
+
+static uint64_t NewId() {
+    uint64_t id = 0;
+    while (id == 0) {
+        id = butil::fast_rand();
+    }
+    return id;
+}
+
+// Set in the thread exporting spans, whose RPCs are not traced, otherwise
+// every export makes new spans.
+static __thread bool tls_exporting = false;
+
+static bool PickRoot() {
+    if (tls_exporting) {
+        return false;
+    }
+    const double ratio = FLAGS_trace_sample_ratio;
+    return ratio > 0 && (ratio >= 1 || butil::fast_rand_double() < ratio);
+}
+
+// ========== Hooks in RPC paths ==========
+
+// The server span in current bthread.
+static const TraceContext* CurrentTrace() {
+    return static_cast<const TraceContext*>(bthread::tls_bls.trace_parent);
+}
+
+static bool InTrace(const TraceContext& ctx) {
+    return ctx.span_id != 0;
+}
+
+void StartServerTrace(Controller* cntl, const std::string* traceparent) {
+    TraceContext* ctx = ControllerPrivateAccessor(cntl).mutable_trace_context();
+    if (traceparent != NULL && ParseTraceParent(*traceparent, ctx)) {
+        ctx->span_id = NewId();
+        return;
+    }
+    if (PickRoot()) {
+        ctx->trace_id_high = NewId();
+        ctx->trace_id_low = NewId();
+        ctx->span_id = NewId();
+        ctx->parent_span_id = 0;
+        ctx->sampled = true;
+    }
+}
+
+void EnterServerTrace(const Controller* cntl) {
+    const TraceContext* ctx =
+        ControllerPrivateAccessor(const_cast<Controller*>(cntl)).trace_context();
+    // Always overwrite, the field may be left by a previous request
+    // processed in this bthread.
+    bthread::tls_bls.trace_parent = (InTrace(*ctx) ? ctx : NULL);
+}
+
+static void FillSpan(Controller* cntl, TracedSpan* span) {
+    const TraceContext* ctx = ControllerPrivateAccessor(cntl).trace_context();
+    span->trace_id_high = ctx->trace_id_high;
+    span->trace_id_low = ctx->trace_id_low;
+    span->span_id = ctx->span_id;
+    span->parent_span_id = ctx->parent_span_id;
+    span->protocol = cntl->request_protocol();
+    span->error_code = cntl->ErrorCode();
+    span->remote_side = cntl->remote_side();
+    const std::string* name = NULL;
+    if (cntl->method()) {
+        name = &cntl->method()->full_name();
+    } else if (cntl->server()) {
+        name = &cntl->http_request().uri().path();
+    }
+    size_t len = 0;
+    if (name) {
+        len = std::min(name->size(), sizeof(span->method) - 1);
+        memcpy(span->method, name->data(), len);
+    }
+    span->method[len] = '\0';
+}
+
+void EndServerTrace(const Controller* c) {
+    Controller* cntl = const_cast<Controller*>(c);
+    ControllerPrivateAccessor accessor(cntl);
+    const TraceContext* ctx = accessor.trace_context();
+    if (bthread::tls_bls.trace_parent == ctx) {
+        bthread::tls_bls.trace_parent = NULL;
+    }
+    if (!ctx->sampled) {
+        return;
+    }
+    TracedSpan span;
+    FillSpan(cntl, &span);
+    span.kind = TRACED_SPAN_SERVER;
+    const RpcPhaseTimes& times = accessor.phase_times();
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        span.phase_us[i] = times.duration_us((RpcPhase)i);
+    }
+    // Timestamps at server-side are from cpuwide_time_us().
+    const int64_t now_us = butil::cpuwide_time_us();
+    const int64_t base_real_us = butil::gettimeofday_us() - now_us;
+    span.start_real_us = accessor.begin_time_us() + base_real_us;
+    span.end_real_us = now_us + base_real_us;
+    SubmitTracedSpan(span);
+}
+
+void StartClientTrace(Controller* cntl) {
+    TraceContext* ctx = ControllerPrivateAccessor(cntl).mutable_trace_context();
+    const TraceContext* parent = CurrentTrace();
+    if (parent != NULL) {
+        ctx->trace_id_high = parent->trace_id_high;
+        ctx->trace_id_low = parent->trace_id_low;
+        ctx->parent_span_id = parent->span_id;
+        ctx->sampled = parent->sampled;
+        ctx->span_id = NewId();
+    } else if (PickRoot()) {
+        ctx->trace_id_high = NewId();
+        ctx->trace_id_low = NewId();
+        ctx->parent_span_id = 0;
+        ctx->sampled = true;
+        ctx->span_id = NewId();
+    }
+}
+
+void EndClientTrace(const Controller* c) {
+    Controller* cntl = const_cast<Controller*>(c);
+    ControllerPrivateAccessor accessor(cntl);
+    if (!accessor.trace_context()->sampled) {
+        return;
+    }
+    TracedSpan span;
+    FillSpan(cntl, &span);
+    span.kind = TRACED_SPAN_CLIENT;
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        span.phase_us[i] = -1;
+    }
+    // Timestamps at client-side are from gettimeofday_us().
+    span.start_real_us = accessor.begin_time_us();
+    span.end_real_us = accessor.end_time_us();
+    SubmitTracedSpan(span);
+}
+
+bool GetTraceParentToSend(const Controller* cntl, char* buf) {
+    const TraceContext* ctx =
+        ControllerPrivateAccessor(const_cast<Controller*>(cntl)).trace_context();
+    if (!InTrace(*ctx)) {
+        return false;
+    }
+    PrintTraceParent(*ctx, buf);
+    return true;
+}
+
+// ========== Exporting ==========
+
+static void PrintJsonString(std::ostream& os, const char* s) {
+    os << '"';
+    for (; *s; ++s) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if (c < 0x20) {
+            os << "\\u00" << HEX_DIGITS[c >> 4] << HEX_DIGITS[c & 0xF];
+        } else {
+            os << c;
+        }
+    }
+    os << '"';
+}
+
+static void PrintJsonHex64(std::ostream& os, uint64_t v) {
+    char buf[16];
+    PrintHex64(v, buf);
+    os.write(buf, sizeof(buf));
+}
+
+static void PrintIntAttribute(std::ostream& os, const char* key, int64_t v) {
+    os << ",{\"key\":\"" << key << "\",\"value\":{\"intValue\":\"" << v
+       << "\"}}";
+}
+
+void PrintOtlpJson(std::ostream& os, const TracedSpan* spans, size_t n) {
+    os << "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+          "{\"key\":\"service.name\",\"value\":{\"stringValue\":";
+    PrintJsonString(os, GetProgramName());
+    os << "}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"brpc\"},\"spans\":[";
+    for (size_t i = 0; i < n; ++i) {
+        const TracedSpan& s = spans[i];
+        if (i) {
+            os << ',';
+        }
+        os << "{\"traceId\":\"";
+        PrintJsonHex64(os, s.trace_id_high);
+        PrintJsonHex64(os, s.trace_id_low);
+        os << "\",\"spanId\":\"";
+        PrintJsonHex64(os, s.span_id);
+        os << '"';
+        if (s.parent_span_id) {
+            os << ",\"parentSpanId\":\"";
+            PrintJsonHex64(os, s.parent_span_id);
+            os << '"';
+        }
+        os << ",\"name\":";
+        PrintJsonString(os, s.method);
+        os << ",\"kind\":" << (int)s.kind
+           << ",\"startTimeUnixNano\":\"" << s.start_real_us << "000\""
+           << ",\"endTimeUnixNano\":\"" << s.end_real_us << "000\""
+           << ",\"attributes\":[{\"key\":\"rpc.system\",\"value\":"
+              "{\"stringValue\":\"brpc\"}}";
+        const Protocol* protocol = FindProtocol(s.protocol);
+        if (protocol) {
+            os << ",{\"key\":\"rpc.brpc.protocol\",\"value\":{\"stringValue\":";
+            PrintJsonString(os, protocol->name);
+            os << "}}";
+        }
+        os << ",{\"key\":\"network.peer.address\",\"value\":{\"stringValue\":";
+        PrintJsonString(os, butil::ip2str(s.remote_side.ip).c_str());
+        os << "}}";
+        PrintIntAttribute(os, "network.peer.port", s.remote_side.port);
+        if (s.error_code) {
+            PrintIntAttribute(os, "rpc.brpc.error_code", s.error_code);
+        }
+        for (int j = 0; j < RPC_PHASE_COUNT; ++j) {
+            if (s.phase_us[j] >= 0) {
+                char key[64];
+                snprintf(key, sizeof(key), "rpc.brpc.phase.%s_us",
+                         RpcPhaseName((RpcPhase)j));
+                PrintIntAttribute(os, key, s.phase_us[j]);
+            }
+        }
+        // STATUS_CODE_ERROR is 2, unset otherwise.
+        os << "],\"status\":{" << (s.error_code ? "\"code\":2" : "") << "}}";
+    }
+    os << "]}]}]}";
+}
+
+FileSpanExporter::FileSpanExporter(const std::string& path)
+    : _path(path), _fp(NULL) {}
+
+FileSpanExporter::~FileSpanExporter() {
+    if (_fp) {
+        fclose(_fp);
+        _fp = NULL;
+    }
+}
+
+void FileSpanExporter::Export(const TracedSpan* spans, size_t n) {
+    if (_fp == NULL) {
+        _fp = fopen(_path.c_str(), "a");
+        if (_fp == NULL) {
+            PLOG_EVERY_SECOND(ERROR) << "Fail to open " << _path;
+            return;
+        }
+    }
+    std::ostringstream os;
+    PrintOtlpJson(os, spans, n);
+    os << '\n';
+    const std::string s = os.str();
+    if (fwrite(s.data(), 1, s.size(), _fp) != s.size() || fflush(_fp) != 0) {
+        PLOG_EVERY_SECOND(ERROR) << "Fail to write into " << _path;
+    }
+}
+
+OtlpHttpSpanExporter::OtlpHttpSpanExporter() : _channel(NULL) {}
+
+OtlpHttpSpanExporter::~OtlpHttpSpanExporter() {
+    delete _channel;
+}
+
+int OtlpHttpSpanExporter::Init(const std::string& endpoint, int timeout_ms) {
+    ChannelOptions options;
+    options.protocol = PROTOCOL_HTTP;
+    options.timeout_ms = timeout_ms;
+    options.max_retry = 0;
+    Channel* channel = new Channel;
+    if (channel->Init(endpoint.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to init channel to " << endpoint;
+        delete channel;
+        return -1;
+    }
+    delete _channel;
+    _channel = channel;
+    return 0;
+}
+
+void OtlpHttpSpanExporter::Export(const TracedSpan* spans, size_t n) {
+    if (_channel == NULL) {
+        return;
+    }
+    Controller cntl;
+    cntl.http_request().uri() = "/v1/traces";
+    cntl.http_request().set_method(HTTP_METHOD_POST);
+    cntl.http_request().set_content_type("application/json");
+    butil::IOBufBuilder os;
+    PrintOtlpJson(os, spans, n);
+    os.move_to(cntl.request_attachment());
+    _channel->CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        LOG_EVERY_SECOND(WARNING) << "Fail to export spans: " << cntl.ErrorText();
+    }
+}
+
+struct TraceExportState {
+    TraceExportState()
+        : cond(&mutex)
+        , user_exporter(NULL)
+        , exporting(0)
+        , nexported("rpc_trace_exported_span_count")
+        , ndropped("rpc_trace_dropped_span_count") {}
+
+    TracedSpanBuffer buffer;
+    butil::Mutex mutex;
+    butil::ConditionVariable cond;
+    SpanExporter* user_exporter;
+    // Number of spans popped and exported(or discarded).
+    butil::atomic<uint64_t> exporting;
+    bvar::Adder<int64_t> nexported;
+    bvar::Adder<int64_t> ndropped;
+};
+
+static TraceExportState* g_trace_state = NULL;
+static pthread_once_t g_trace_once = PTHREAD_ONCE_INIT;
+
+// Make the exporter chosen by -trace_exporter, or NULL.
+static SpanExporter* NewExporterByFlags() {
+    const std::string& type = FLAGS_trace_exporter;
+    if (type == "file") {
+        return new FileSpanExporter(FLAGS_trace_export_file);
+    }
+    if (type == "otlp_http") {
+        OtlpHttpSpanExporter* e = new OtlpHttpSpanExporter;
+        if (e->Init(FLAGS_trace_otlp_endpoint, 1000) != 0) {
+            delete e;
+            return NULL;
+        }
+        return e;
+    }
+    if (!type.empty()) {
+        LOG(ERROR) << "Unknown -trace_exporter=" << type;
+    }
+    return NULL;
+}
+
+static void* ExportThread(void* arg) {
+    TraceExportState* st = static_cast<TraceExportState*>(arg);
+    tls_exporting = true;
+    std::vector<TracedSpan> batch;
+    std::unique_ptr<SpanExporter> flag_exporter(NewExporterByFlags());
+    while (true) {
+        batch.resize(FLAGS_trace_export_batch_size);
+        const size_t n = st->buffer.pop(&batch[0], batch.size());
+        SpanExporter* exporter = NULL;
+        {
+            BAIDU_SCOPED_LOCK(st->mutex);
+            exporter = st->user_exporter;
+        }
+        if (exporter == NULL) {
+            exporter = flag_exporter.get();
+        }
+        // Spans are discarded when there's no exporter.
+        if (n > 0 && exporter != NULL) {
+            exporter->Export(&batch[0], n);
+            st->nexported << n;
+        }
+        {
+            BAIDU_SCOPED_LOCK(st->mutex);
+            st->exporting.fetch_add(n, butil::memory_order_release);
+            st->cond.Broadcast();
+            if (n < batch.size()) {
+                st->cond.TimedWait(butil::TimeDelta::FromMilliseconds(
+                                       FLAGS_trace_export_interval_ms));
+            }
+        }
+    }
+    return NULL;
+}
+
+static void StartExportThread() {
+    TraceExportState* st = new TraceExportState;
+    if (st->buffer.init(std::max(FLAGS_trace_buffer_size, 2)) != 0) {
+        LOG(ERROR) << "Fail to init buffer of traced spans";
+        return;
+    }
+    pthread_t th;
+    const int rc = pthread_create(&th, NULL, ExportThread, st);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create thread exporting spans: " << berror(rc);
+        return;
+    }
+    pthread_detach(th);
+    g_trace_state = st;
+}
+
+static TraceExportState* GetTraceState() {
+    pthread_once(&g_trace_once, StartExportThread);
+    return g_trace_state;
+}
+
+void SubmitTracedSpan(const TracedSpan& span) {
+    if (tls_exporting) {
+        return;
+    }
+    TraceExportState* st = GetTraceState();
+    if (st == NULL) {
+        return;
+    }
+    if (!st->buffer.push(span)) {
+        st->ndropped << 1;
+    }
+}
+
+void SetSpanExporter(SpanExporter* exporter) {
+    TraceExportState* st = GetTraceState();
+    if (st == NULL) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(st->mutex);
+    st->user_exporter = exporter;
+}
+
+void FlushTracedSpans() {
+    TraceExportState* st = GetTraceState();
+    if (st == NULL) {
+        return;
+    }
+    const uint64_t target = st->buffer.pushed();
+    BAIDU_SCOPED_LOCK(st->mutex);
+    while (st->exporting.load(butil::memory_order_acquire) < target) {
+        st->cond.Broadcast();
+        st->cond.TimedWait(butil::TimeDelta::FromMilliseconds(10));
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,153 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_TRACE_H
+#define BRPC_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include "butil/endpoint.h"
+#include "butil/strings/string_piece.h"
+#include "brpc/options.pb.h"                   // ProtocolType
+#include "brpc/details/rpc_phase.h"            // RPC_PHASE_COUNT
+
+namespace brpc {
+
+// Lightweight tracing compatible with W3C Trace Context and OpenTelemetry,
+// independent from rpcz.
+// A request is traced if the caller says so in `traceparent' (a http/h2
+// header, or a field of baidu_std meta), or is picked at the rate of
+// -trace_sample_ratio when it's not from a traced caller. RPCs issued while
+// processing a traced request are traced as children of the request.
+// Finished spans are put into a lock-free buffer and exported in batches by
+// a background thread, to the exporter set by SetSpanExporter() or chosen
+// by -trace_exporter.
+
+struct TraceContext {
+    // 128-bit trace id.
+    uint64_t trace_id_high;
+    uint64_t trace_id_low;
+    // Id of the span of this side, and of the caller(0 for roots).
+    uint64_t span_id;
+    uint64_t parent_span_id;
+    bool sampled;
+
+    TraceContext() { clear(); }
+    void clear() {
+        trace_id_high = 0;
+        trace_id_low = 0;
+        span_id = 0;
+        parent_span_id = 0;
+        sampled = false;
+    }
+};
+
+// Length of "00-<32 hex trace id>-<16 hex span id>-<2 hex flags>".
+const size_t TRACEPARENT_LENGTH = 55;
+
+// Parse `traceparent' in the format of W3C Trace Context. The trace id and
+// the sampled flag are stored into `ctx', the span id is stored as
+// `ctx->parent_span_id'. Returns true on success.
+bool ParseTraceParent(const butil::StringPiece& traceparent,
+                      TraceContext* ctx);
+
+// Print trace id, span id and the sampled flag of `ctx' into `buf' which
+// has at least TRACEPARENT_LENGTH + 1 bytes.
+void PrintTraceParent(const TraceContext& ctx, char* buf);
+
+// Same values as SpanKind of OpenTelemetry.
+enum TracedSpanKind {
+    TRACED_SPAN_SERVER = 2,
+    TRACED_SPAN_CLIENT = 3,
+};
+
+// A finished span. Fixed-size so that it's copied into the buffer without
+// allocations.
+struct TracedSpan {
+    uint64_t trace_id_high;
+    uint64_t trace_id_low;
+    uint64_t span_id;
+    uint64_t parent_span_id;
+    int64_t start_real_us;
+    int64_t end_real_us;
+    TracedSpanKind kind;
+    ProtocolType protocol;
+    int error_code;
+    butil::EndPoint remote_side;
+    // Time spent in phases of server spans, -1 if unknown.
+    int64_t phase_us[RPC_PHASE_COUNT];
+    // Full name of the method, truncated if it's too long.
+    char method[96];
+};
+
+// Print `spans' as a ExportTraceServiceRequest of OTLP in JSON.
+void PrintOtlpJson(std::ostream& os, const TracedSpan* spans, size_t n);
+
+class SpanExporter {
+public:
+    virtual ~SpanExporter() {}
+
+    // Export `n' spans. Called by one background thread, may block.
+    virtual void Export(const TracedSpan* spans, size_t n) = 0;
+};
+
+// Export spans with `exporter' from now on. NULL means the one chosen by
+// -trace_exporter. `exporter' is not owned and must be valid until another
+// one is set and the background thread finished exporting (by calling
+// FlushTracedSpans()).
+void SetSpanExporter(SpanExporter* exporter);
+
+// Wait until spans submitted before are exported.
+void FlushTracedSpans();
+
+// Append spans to a file, one OTLP/JSON request per batch in a line.
+class FileSpanExporter : public SpanExporter {
+public:
+    explicit FileSpanExporter(const std::string& path);
+    ~FileSpanExporter();
+    void Export(const TracedSpan* spans, size_t n) override;
+
+private:
+    std::string _path;
+    FILE* _fp;
+};
+
+class Channel;
+
+// POST spans to http://<endpoint>/v1/traces of an OpenTelemetry collector,
+// as OTLP/HTTP in JSON.
+class OtlpHttpSpanExporter : public SpanExporter {
+public:
+    OtlpHttpSpanExporter();
+    ~OtlpHttpSpanExporter();
+
+    // `endpoint' is "host:port" of the collector.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const std::string& endpoint, int timeout_ms);
+
+    void Export(const TracedSpan* spans, size_t n) override;
+
+private:
+    Channel* _channel;
+};
+
+} // namespace brpc
+
+#endif // BRPC_TRACE_H
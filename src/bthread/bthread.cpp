@@ -30,6 +30,9 @@
 #include "bthread/timer_thread.h"
 #include "bthread/list_of_abafree_id.h"
 #include "bthread/bthread.h"
+#if defined(OS_LINUX)
+#include <ucontext.h>
+#endif
 
 namespace bthread {
 
@@ -179,6 +182,67 @@ std::string stack_trace(bthread_t tid) {
 }
 #endif // BRPC_BTHREAD_TRACER
 
+// Save the interrupted pc and return addresses found by walking frame
+// pointers (brpc is built with -fno-omit-frame-pointer) of the task running
+// in the calling worker into `pcs'. Frames are walked only inside the stack
+// of the bthread so that corrupted frame pointers are never dereferenced,
+// tasks running on the stack of the worker (the scheduling loop and
+// pthread tasks) only have the interrupted pc.
+// Returns number of saved pcs.
+// Caution: This function should be async-signal-safe.
+int sample_current_stack(void* ucontext, void** pcs, int max_depth) {
+    if (ucontext == NULL || max_depth <= 0) {
+        return 0;
+    }
+#if defined(OS_LINUX) && defined(__x86_64__)
+    const mcontext_t& mc = static_cast<ucontext_t*>(ucontext)->uc_mcontext;
+    const uintptr_t pc = mc.gregs[REG_RIP];
+    uintptr_t fp = mc.gregs[REG_RBP];
+    const uintptr_t sp = mc.gregs[REG_RSP];
+#elif defined(OS_LINUX) && defined(__aarch64__)
+    const mcontext_t& mc = static_cast<ucontext_t*>(ucontext)->uc_mcontext;
+    const uintptr_t pc = mc.pc;
+    uintptr_t fp = mc.regs[29];
+    const uintptr_t sp = mc.sp;
+#else
+    return 0;
+#endif
+    pcs[0] = (void*)pc;
+    int depth = 1;
+    TaskGroup* g = tls_task_group;
+    if (NULL == g || g->is_current_pthread_task()) {
+        return depth;
+    }
+    const ContextualStack* stack = g->current_task()->stack;
+    if (NULL == stack || NULL == stack->storage.bottom) {
+        return depth;
+    }
+    const uintptr_t hi = (uintptr_t)stack->storage.bottom;
+    const uintptr_t lo = hi - stack->storage.stacksize;
+    if (sp < lo || sp >= hi) {
+        // Jumping between stacks.
+        return depth;
+    }
+    // A frame record is {previous fp, return address} on both x86_64 and
+    // aarch64.
+    while (depth < max_depth) {
+        if (fp < sp || fp + 2 * sizeof(uintptr_t) > hi ||
+            (fp & (sizeof(uintptr_t) - 1)) != 0) {
+            break;
+        }
+        const uintptr_t* frame = (const uintptr_t*)fp;
+        if (frame[1] == 0) {
+            break;
+        }
+        pcs[depth++] = (void*)frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+    return depth;
+}
+
 static int add_workers_for_each_tag(int num) {
     int added = 0;
     auto c = get_task_control();
@@ -625,6 +689,18 @@ bthread_tag_t bthread_self_tag(void) {
                                               : BTHREAD_TAG_DEFAULT;
 }
 
+int bthread_get_time_stat(bthread_time_stat_t* stat) {
+    if (stat == NULL) {
+        return EINVAL;
+    }
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_pthread_task()) {
+        return EPERM;
+    }
+    g->current_task_time_stat(stat);
+    return 0;
+}
+
 uint64_t bthread_cpu_clock_ns(void) {
      bthread::TaskGroup* g = bthread::tls_task_group;
     if (g != NULL && !g->is_current_main_task()) {
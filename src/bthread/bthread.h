@@ -254,6 +254,14 @@ extern int bthread_rwlock_init(bthread_rwlock_t* __restrict rwlock,
 // Destroy read-write lock `rwlock'.
 extern int bthread_rwlock_destroy(bthread_rwlock_t* rwlock);
 
+// Count readers of `rwlock' in per-worker counters instead of a shared
+// word, so that read locking scales with the number of workers. Writers
+// are preferred: new readers wait once a writer is pending. Locking for
+// writing becomes more expensive, suitable for read-mostly data.
+// Must be called right after bthread_rwlock_init(), before the rwlock is
+// used. Returns 0 on success, ENOMEM if the counters can't be allocated.
+extern int bthread_rwlock_enable_scalable_readers(bthread_rwlock_t* rwlock);
+
 // Acquire read lock for `rwlock'.
 extern int bthread_rwlock_rdlock(bthread_rwlock_t* rwlock);
 
@@ -428,6 +436,13 @@ extern int bthread_once(bthread_once_t* once_control, void (*init_routine)());
  */
 extern uint64_t bthread_cpu_clock_ns(void);
 
+// Get time spent by the calling bthread since its creation: running,
+// waiting in run queues and being blocked. Differences of two calls in the
+// same bthread attribute the time to the code in between.
+// Returns 0 on success, EINVAL if `stat' is NULL, EPERM if the caller is
+// not a bthread.
+extern int bthread_get_time_stat(bthread_time_stat_t* stat);
+
 __END_DECLS
 
 #endif  // BTHREAD_BTHREAD_H
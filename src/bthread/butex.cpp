@@ -19,16 +19,18 @@
 
 // Date: Tue Jul 22 17:30:12 CST 2014
 
+#include <algorithm>                        // std::min
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/macros.h"
 #include "butil/containers/flat_map.h"
 #include "butil/containers/linked_list.h"   // LinkNode
-#ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
 #include "butil/memory/singleton_on_pthread_once.h"
-#endif
 #include "butil/logging.h"
 #include "butil/object_pool.h"
+#include "butil/reloadable_flags.h"
+#include "bvar/reducer.h"
 #include "bthread/errno.h"                 // EWOULDBLOCK
 #include "bthread/sys_futex.h"             // futex_*
 #include "bthread/processor.h"             // cpu_relax
@@ -59,6 +61,22 @@
 
 namespace bthread {
 
+DEFINE_bool(bthread_adaptive_spin, false, "Spin adaptively before "
+            "suspending in butex_wait() and locking of bthread_mutex_t, which "
+            "burns CPU of idle workers for shorter wakeup latency");
+BUTIL_VALIDATE_GFLAG(bthread_adaptive_spin, butil::PassValidate);
+
+struct ButexSpinCount {
+    ButexSpinCount()
+        : success("bthread_butex_spin_success_count")
+        , failure("bthread_butex_spin_failure_count") {}
+    bvar::Adder<int64_t> success;
+    bvar::Adder<int64_t> failure;
+};
+inline ButexSpinCount& butex_spin_count() {
+    return *butil::get_leaky_singleton<ButexSpinCount>();
+}
+
 #ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
 struct ButexWaiterCount : public bvar::Adder<int64_t> {
     ButexWaiterCount() : bvar::Adder<int64_t>("bthread_butex_waiter_count") {}
@@ -115,6 +133,8 @@ struct BAIDU_CACHELINE_ALIGNMENT Butex {
     ~Butex() {}
 
     butil::atomic<int> value;
+    // Learned length of spinning, see butex_adaptive_spin().
+    butil::atomic<int> spin_limit;
     ButexWaiterList waiters;
     FastPthreadMutex waiter_lock;
 };
@@ -251,9 +271,15 @@ inline int unsleep_if_necessary(ButexBthreadWaiter* w,
 // and cause spurious wakeups. According to our observations, the race is 
 // infrequent, even rare. The extra spurious wakeups should be acceptable.
 
+// Spin for twice of the learned length, within [MIN, MAX].
+static const int MIN_SPIN_ITER = 4;
+static const int MAX_SPIN_ITER = 256;
+static const int INITIAL_SPIN_LIMIT = 16;
+
 void* butex_create() {
     Butex* b = butil::get_object<Butex>();
     if (b) {
+        b->spin_limit.store(INITIAL_SPIN_LIMIT, butil::memory_order_relaxed);
         return &b->value;
     }
     return NULL;
@@ -656,9 +682,43 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
+bool butex_adaptive_spin(void* arg, int mask, int expected_value) {
+    if (!FLAGS_bthread_adaptive_spin) {
+        return false;
+    }
+    // Spinning makes sense only when there's nothing else to run.
+    TaskGroup* g = tls_task_group;
+    if (NULL != g && g->rq_size() != 0) {
+        return false;
+    }
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+    // Updates of spin_limit from different threads may overwrite each
+    // other, which is fine since it's just a hint.
+    const int limit = b->spin_limit.load(butil::memory_order_relaxed);
+    const int max_iter =
+        std::min(std::max(limit * 2, MIN_SPIN_ITER), MAX_SPIN_ITER);
+    for (int i = 1; i <= max_iter; ++i) {
+        cpu_relax();
+        if ((b->value.load(butil::memory_order_relaxed) & mask) != expected_value) {
+            // Move towards the length of this spinning.
+            const int diff = i - limit;
+            b->spin_limit.store(limit + (diff > 0 ? (diff + 3) / 4 : diff / 4),
+                                butil::memory_order_relaxed);
+            butex_spin_count().success << 1;
+            butil::atomic_thread_fence(butil::memory_order_acquire);
+            return true;
+        }
+    }
+    b->spin_limit.store(limit - (limit + 3) / 4, butil::memory_order_relaxed);
+    butex_spin_count().failure << 1;
+    return false;
+}
+
 int butex_wait(void* arg, int expected_value, const timespec* abstime, bool prepend) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
-    if (b->value.load(butil::memory_order_relaxed) != expected_value) {
+    if (b->value.load(butil::memory_order_relaxed) != expected_value ||
+        // Short waits are cheaper to spin than to suspend and resume.
+        butex_adaptive_spin(arg, ~0, expected_value)) {
         errno = EWOULDBLOCK;
         // Sometimes we may take actions immediately after unmatched butex,
         // this fence makes sure that we see changes before changing butex.
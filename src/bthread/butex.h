@@ -85,6 +85,14 @@ int butex_wait(void* butex, int expected_value,
                const timespec* abstime,
                bool prepend = false);
 
+// Spin while (*butex & |mask|) equals |expected_value| before suspending in
+// butex_wait(). How long to spin is learned from previous spinnings on the
+// same butex: it grows towards the lengths that succeeded and shrinks after
+// failures. Does not spin if -bthread_adaptive_spin is off or there're
+// other bthreads to run on current worker.
+// Returns true if the value changed during spinning, false otherwise.
+bool butex_adaptive_spin(void* butex, int mask, int expected_value);
+
 }  // namespace bthread
 
 #endif  // BTHREAD_BUTEX_H
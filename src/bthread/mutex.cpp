@@ -23,6 +23,7 @@
 #include <pthread.h>
 #include <dlfcn.h>                               // dlsym
 #include <fcntl.h>                               // O_RDONLY
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"
 #include "bvar/bvar.h"
 #include "bvar/collector.h"
@@ -54,6 +55,8 @@ __END_DECLS
 
 namespace bthread {
 
+DECLARE_bool(bthread_adaptive_spin);
+
 EXTERN_BAIDU_VOLATILE_THREAD_LOCAL(TaskGroup*, tls_task_group);
 
 // Warm up backtrace before main().
@@ -1053,11 +1056,20 @@ inline int mutex_lock_contended_impl(bthread_mutex_t* __restrict m,
                                      const struct timespec* __restrict abstime) {
     BTHREAD_MUTEX_CHECK_OWNER;
     // When a bthread first contends for a lock, active spinning makes sense.
-    // Spin only few times and only if local `rq' is empty.
-    TaskGroup* g = BAIDU_GET_VOLATILE_THREAD_LOCAL(tls_task_group);
-    if (BAIDU_UNLIKELY(NULL == g || g->rq_size() == 0)) {
-        for (int i = 0; i < MAX_SPIN_ITER; ++i) {
-            cpu_relax();
+    if (FLAGS_bthread_adaptive_spin) {
+        // Spin until the lock is released, for the length learned from
+        // previous contentions on this mutex and only if local `rq' is
+        // empty. Time spent in spinning is counted in sampled contentions
+        // as well.
+        bthread::butex_adaptive_spin(m->butex, BTHREAD_MUTEX_LOCKED,
+                                     BTHREAD_MUTEX_LOCKED);
+    } else {
+        // Spin only few times and only if local `rq' is empty.
+        TaskGroup* g = BAIDU_GET_VOLATILE_THREAD_LOCAL(tls_task_group);
+        if (BAIDU_UNLIKELY(NULL == g || g->rq_size() == 0)) {
+            for (int i = 0; i < MAX_SPIN_ITER; ++i) {
+                cpu_relax();
+            }
         }
     }
 
@@ -0,0 +1,222 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <string>
+#include "butil/build_config.h"
+#include "butil/string_printf.h"
+#include "bthread/numa.h"
+
+namespace bthread {
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+struct NumaTopology {
+    // Id of each node given by the kernel, which may be non-contiguous.
+    std::vector<int> node_ids;
+    // cpus of each node.
+    std::vector<std::vector<int> > node_cpus;
+    // node of each cpu.
+    std::vector<int> cpu_node;
+};
+
+// Parse lists like "0-3,8,10-11".
+static void parse_cpu_list(const char* s, std::vector<int>* out) {
+    while (*s) {
+        char* end = NULL;
+        const long first = strtol(s, &end, 10);
+        if (end == s) {
+            break;
+        }
+        long last = first;
+        s = end;
+        if (*s == '-') {
+            ++s;
+            last = strtol(s, &end, 10);
+            if (end == s) {
+                break;
+            }
+            s = end;
+        }
+        for (long i = first; i <= last; ++i) {
+            out->push_back((int)i);
+        }
+        if (*s != ',') {
+            break;
+        }
+        ++s;
+    }
+}
+
+static bool read_cpu_list(const char* path, std::vector<int>* out) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    char buf[4096];
+    const bool ok = (fgets(buf, sizeof(buf), fp) != NULL);
+    fclose(fp);
+    if (ok) {
+        parse_cpu_list(buf, out);
+    }
+    return ok;
+}
+
+static NumaTopology* create_topology() {
+    NumaTopology* t = new NumaTopology;
+#if defined(OS_LINUX)
+    std::vector<int> nodes;
+    if (read_cpu_list("/sys/devices/system/node/online", &nodes)) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const std::string path = butil::string_printf(
+                "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+            std::vector<int> cpus;
+            read_cpu_list(path.c_str(), &cpus);
+            // Nodes are indexed densely, ids of nodes may have holes
+            // (e.g. memory-only or offlined nodes).
+            t->node_ids.push_back(nodes[i]);
+            t->node_cpus.push_back(std::vector<int>());
+            t->node_cpus.back().swap(cpus);
+        }
+    }
+#endif
+    if (t->node_cpus.empty()) {
+        const long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+        t->node_ids.assign(1, 0);
+        t->node_cpus.resize(1);
+        for (long i = 0; i < ncpu; ++i) {
+            t->node_cpus[0].push_back((int)i);
+        }
+    }
+    for (size_t i = 0; i < t->node_cpus.size(); ++i) {
+        const std::vector<int>& cpus = t->node_cpus[i];
+        for (size_t j = 0; j < cpus.size(); ++j) {
+            if ((size_t)cpus[j] >= t->cpu_node.size()) {
+                t->cpu_node.resize(cpus[j] + 1, 0);
+            }
+            t->cpu_node[cpus[j]] = (int)i;
+        }
+    }
+    return t;
+}
+
+static pthread_once_t g_topology_once = PTHREAD_ONCE_INIT;
+static NumaTopology* g_topology = NULL;
+
+static void init_topology() {
+    g_topology = create_topology();
+}
+
+static const NumaTopology& get_topology() {
+    pthread_once(&g_topology_once, init_topology);
+    return *g_topology;
+}
+
+int numa_node_num() {
+    return (int)get_topology().node_cpus.size();
+}
+
+int cpu_numa_node(int cpu) {
+    const NumaTopology& t = get_topology();
+    if (cpu < 0 || (size_t)cpu >= t.cpu_node.size()) {
+        return 0;
+    }
+    return t.cpu_node[cpu];
+}
+
+int current_numa_node() {
+#if defined(OS_LINUX)
+    return cpu_numa_node(sched_getcpu());
+#else
+    return 0;
+#endif
+}
+
+int numa_node_cpus(int node, std::vector<int>* cpus) {
+    const NumaTopology& t = get_topology();
+    if (node < 0 || (size_t)node >= t.node_cpus.size()) {
+        return -1;
+    }
+    *cpus = t.node_cpus[node];
+    return 0;
+}
+
+int bind_current_thread_to_numa_node(int node) {
+#if defined(OS_LINUX)
+    std::vector<int> cpus;
+    if (numa_node_cpus(node, &cpus) != 0 || cpus.empty()) {
+        return -1;
+    }
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        if (cpus[i] < CPU_SETSIZE) {
+            CPU_SET(cpus[i], &cs);
+        }
+    }
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    (void)node;
+    return -1;
+#endif
+}
+
+int bind_memory_to_numa_node(void* addr, size_t len, int node) {
+#if defined(OS_LINUX) && defined(SYS_mbind)
+    const NumaTopology& t = get_topology();
+    if (node < 0 || (size_t)node >= t.node_ids.size()) {
+        errno = EINVAL;
+        return -1;
+    }
+    // mbind() takes the id given by the kernel.
+    const int id = t.node_ids[node];
+    unsigned long mask[16] = { 0 };
+    const size_t bits_per_ulong = sizeof(unsigned long) * 8;
+    if (id < 0 || (size_t)id >= sizeof(mask) * 8) {
+        errno = EINVAL;
+        return -1;
+    }
+    mask[id / bits_per_ulong] = 1UL << (id % bits_per_ulong);
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+                sizeof(mask) * 8, 0) != 0) {
+        return -1;
+    }
+    return 0;
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+    return -1;
+#endif
+}
+
+}  // namespace bthread
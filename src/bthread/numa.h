@@ -0,0 +1,58 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_NUMA_H
+#define BTHREAD_NUMA_H
+
+#include <stddef.h>
+#include <vector>
+
+namespace bthread {
+
+// NUMA topology read from /sys/devices/system/node, so that no libnuma is
+// needed. On platforms without the information, there's a single node
+// holding all cpus.
+// Nodes are indexed from 0 to numa_node_num() - 1 in all functions below,
+// which are not necessarily the ids given by the kernel: ids of online
+// nodes may be non-contiguous, e.g. "0,2", which are indexed as 0 and 1.
+
+// Returns number of NUMA nodes, always >= 1.
+int numa_node_num();
+
+// Returns the node that `cpu' belongs to, 0 if unknown.
+int cpu_numa_node(int cpu);
+
+// Returns the node of the cpu that the calling thread is running on.
+int current_numa_node();
+
+// Put cpus of `node' into `cpus'. Returns 0 on success, -1 otherwise.
+int numa_node_cpus(int node, std::vector<int>* cpus);
+
+// Restrict the calling thread to run on cpus of `node'.
+// Returns 0 on success, -1 otherwise.
+int bind_current_thread_to_numa_node(int node);
+
+// Make pages in [addr, addr + len) prefer memory of `node'. The pages are
+// allocated on the node when they're touched for the first time.
+// Returns 0 on success, -1 otherwise.
+int bind_memory_to_numa_node(void* addr, size_t len, int node);
+
+}  // namespace bthread
+
+#endif  // BTHREAD_NUMA_H
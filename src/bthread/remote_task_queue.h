@@ -22,8 +22,11 @@
 #ifndef BTHREAD_REMOTE_TASK_QUEUE_H
 #define BTHREAD_REMOTE_TASK_QUEUE_H
 
+#include <new>
+#include "butil/atomicops.h"
 #include "butil/containers/bounded_queue.h"
 #include "butil/macros.h"
+#include "bthread/types.h"
 
 namespace bthread {
 
@@ -31,13 +34,40 @@ class TaskGroup;
 
 // A queue for storing bthreads created by non-workers. Since non-workers
 // randomly choose a TaskGroup to push which distributes the contentions,
-// this queue is simply implemented as a queue protected with a lock.
+// this queue is by default simply implemented as a queue protected with a
+// lock. When many pthreads keep waking up bthreads, the lock becomes hot,
+// and the queue can be made lock-free (-bthread_lockfree_remote_queue):
+// a bounded MPMC queue in which each cell has a sequence number telling
+// whether it's ready for the producer or the consumer of current round
+// (See Dmitry Vyukov's bounded MPMC queue). Workers stealing from the
+// queue are also consumers.
 // The function names should be self-explanatory.
 class RemoteTaskQueue {
 public:
-    RemoteTaskQueue() {}
+    RemoteTaskQueue()
+        : _cells(NULL), _mask(0), _enqueue_pos(0), _dequeue_pos(0) {}
 
-    int init(size_t cap) {
+    ~RemoteTaskQueue() {
+        delete [] _cells;
+    }
+
+    // Capacity of the lock-free queue is rounded up to power of 2.
+    int init(size_t cap, bool lockfree) {
+        if (lockfree) {
+            size_t ncell = 2;
+            while (ncell < cap) {
+                ncell <<= 1;
+            }
+            _cells = new (std::nothrow) Cell[ncell];
+            if (_cells == NULL) {
+                return -1;
+            }
+            for (size_t i = 0; i < ncell; ++i) {
+                _cells[i].seq.store(i, butil::memory_order_relaxed);
+            }
+            _mask = ncell - 1;
+            return 0;
+        }
         const size_t memsize = sizeof(bthread_t) * cap;
         void* q_mem = malloc(memsize);
         if (q_mem == NULL) {
@@ -48,7 +78,12 @@ public:
         return 0;
     }
 
+    bool lockfree() const { return _cells != NULL; }
+
     bool pop(bthread_t* task) {
+        if (lockfree()) {
+            return pop_lockfree(task);
+        }
         if (_tasks.empty()) {
             return false;
         }
@@ -59,23 +94,88 @@ public:
     }
 
     bool push(bthread_t task) {
+        if (lockfree()) {
+            return push_lockfree(task);
+        }
         _mutex.lock();
         const bool res = push_locked(task);
         _mutex.unlock();
         return res;
     }
 
+    // Only for the queue protected with the lock.
     bool push_locked(bthread_t task) {
         return _tasks.push(task);
     }
 
-    size_t capacity() const { return _tasks.capacity(); }
+    size_t capacity() const {
+        return lockfree() ? _mask + 1 : _tasks.capacity();
+    }
     
 private:
 friend class TaskGroup;
     DISALLOW_COPY_AND_ASSIGN(RemoteTaskQueue);
+
+    struct Cell {
+        butil::atomic<size_t> seq;
+        bthread_t task;
+    };
+
+    bool push_lockfree(bthread_t task) {
+        size_t pos = _enqueue_pos.load(butil::memory_order_relaxed);
+        Cell* cell = NULL;
+        while (true) {
+            cell = &_cells[pos & _mask];
+            const size_t seq = cell->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (_enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full.
+                return false;
+            } else {
+                pos = _enqueue_pos.load(butil::memory_order_relaxed);
+            }
+        }
+        cell->task = task;
+        cell->seq.store(pos + 1, butil::memory_order_release);
+        return true;
+    }
+
+    bool pop_lockfree(bthread_t* task) {
+        size_t pos = _dequeue_pos.load(butil::memory_order_relaxed);
+        Cell* cell = NULL;
+        while (true) {
+            cell = &_cells[pos & _mask];
+            const size_t seq = cell->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (_dequeue_pos.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Empty.
+                return false;
+            } else {
+                pos = _dequeue_pos.load(butil::memory_order_relaxed);
+            }
+        }
+        *task = cell->task;
+        cell->seq.store(pos + _mask + 1, butil::memory_order_release);
+        return true;
+    }
+
     butil::BoundedQueue<bthread_t> _tasks;
     butil::Mutex _mutex;
+
+    Cell* _cells;
+    size_t _mask;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _enqueue_pos;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _dequeue_pos;
 };
 
 }  // namespace bthread
@@ -15,6 +15,8 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <stdlib.h>                         // posix_memalign
+#include <new>                              // placement new
 #include "bvar/collector.h"
 #include "bthread/rwlock.h"
 #include "bthread/butex.h"
@@ -38,32 +40,198 @@ extern void submit_contention(const bthread_contention_site_t& csite, int64_t no
 // need to use `int64_t' instead of `int'.
 const int RWLockMaxReaders = 1 << 30;
 
+// Scalable readers.
+//
+// Readers increment and decrement the counter owned by current thread(the
+// worker for bthreads), thus rarely touch cachelines of each other. As a
+// bthread may unlock on another worker, a counter alone means nothing and
+// only the sum of all counters is the number of readers.
+// A writer announces itself by setting `writer' and waits for the sum to
+// become 0. A reader checks `writer' after incrementing its counter, and
+// backs off and waits if a writer is pending, so that writers are never
+// starved by incoming readers. All these operations are sequentially
+// consistent: either the reader sees `writer' or the writer sees the reader.
+
+struct BAIDU_CACHELINE_ALIGNMENT ReaderCounter {
+    butil::atomic<int64_t> value;
+};
+
+struct BAIDU_CACHELINE_ALIGNMENT ScalableReaders {
+    // 1 if a writer is pending or holding the lock, 0 otherwise.
+    butil::atomic<int>* writer;
+    // Bumped by departing readers when a writer is pending.
+    butil::atomic<int>* reader_left;
+    size_t mask;
+    // Followed by `mask + 1' counters.
+    ReaderCounter* counters() { return reinterpret_cast<ReaderCounter*>(this + 1); }
+};
+
+// Enough for workers in practice, threads beyond share counters.
+static const size_t MAX_READER_COUNTERS = 64;
+
+static butil::static_atomic<unsigned> g_reader_counter_index =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+// Index of the counter used by this thread plus 1, 0 means unassigned.
+static __thread unsigned tls_reader_counter_index = 0;
+
+static ScalableReaders* create_scalable_readers() {
+    size_t n = 1;
+    while (n < (size_t)bthread_getconcurrency() && n < MAX_READER_COUNTERS) {
+        n <<= 1;
+    }
+    void* mem = NULL;
+    if (posix_memalign(&mem, BAIDU_CACHELINE_SIZE,
+                       sizeof(ScalableReaders) + n * sizeof(ReaderCounter)) != 0) {
+        return NULL;
+    }
+    ScalableReaders* s = new (mem) ScalableReaders;
+    s->mask = n - 1;
+    for (size_t i = 0; i < n; ++i) {
+        new (s->counters() + i) ReaderCounter;
+        s->counters()[i].value.store(0, butil::memory_order_relaxed);
+    }
+    s->writer = butex_create_checked<butil::atomic<int> >();
+    s->reader_left = butex_create_checked<butil::atomic<int> >();
+    if (NULL == s->writer || NULL == s->reader_left) {
+        butex_destroy(s->writer);
+        butex_destroy(s->reader_left);
+        free(mem);
+        return NULL;
+    }
+    s->writer->store(0, butil::memory_order_relaxed);
+    s->reader_left->store(0, butil::memory_order_relaxed);
+    return s;
+}
+
+static void destroy_scalable_readers(ScalableReaders* s) {
+    butex_destroy(s->writer);
+    butex_destroy(s->reader_left);
+    free(s);
+}
+
+// The semaphores are not used by a rwlock with scalable readers, which is
+// marked by NULL `writer_sema.butex' while `reader_sema.butex' points to
+// the ScalableReaders, keeping the layout of bthread_rwlock_t unchanged.
+static inline ScalableReaders* scalable_readers_of(bthread_rwlock_t* rwlock) {
+    if (BAIDU_LIKELY(NULL != rwlock->writer_sema.butex)) {
+        return NULL;
+    }
+    return reinterpret_cast<ScalableReaders*>(rwlock->reader_sema.butex);
+}
+
+static inline ReaderCounter* current_reader_counter(ScalableReaders* s) {
+    unsigned index = tls_reader_counter_index;
+    if (BAIDU_UNLIKELY(0 == index)) {
+        index = g_reader_counter_index.fetch_add(1, butil::memory_order_relaxed) + 1;
+        tls_reader_counter_index = index;
+    }
+    return s->counters() + ((index - 1) & s->mask);
+}
+
+static int64_t scalable_reader_count(ScalableReaders* s) {
+    int64_t n = 0;
+    for (size_t i = 0; i <= s->mask; ++i) {
+        n += s->counters()[i].value.load();
+    }
+    return n;
+}
+
+static inline void scalable_unrdlock(ScalableReaders* s, ReaderCounter* c) {
+    c->value.fetch_sub(1);
+    if (s->writer->load() != 0) {
+        // The pending writer may be waiting for this reader.
+        s->reader_left->fetch_add(1, butil::memory_order_release);
+        butex_wake(s->reader_left);
+    }
+}
+
+static inline bool scalable_tryrdlock(ScalableReaders* s) {
+    ReaderCounter* c = current_reader_counter(s);
+    c->value.fetch_add(1);
+    if (BAIDU_LIKELY(s->writer->load() == 0)) {
+        return true;
+    }
+    // Back off to let the writer proceed.
+    scalable_unrdlock(s, c);
+    return false;
+}
+
+static int scalable_wait_rdlock(ScalableReaders* s,
+                                const struct timespec* abstime) {
+    while (true) {
+        while (s->writer->load(butil::memory_order_acquire) != 0) {
+            if (butex_wait(s->writer, 1, abstime) < 0 && errno == ETIMEDOUT) {
+                return ETIMEDOUT;
+            }
+        }
+        if (scalable_tryrdlock(s)) {
+            return 0;
+        }
+    }
+}
+
+static int scalable_wait_readers(ScalableReaders* s,
+                                 const struct timespec* abstime) {
+    while (true) {
+        const int seq = s->reader_left->load(butil::memory_order_acquire);
+        if (0 == scalable_reader_count(s)) {
+            return 0;
+        }
+        if (butex_wait(s->reader_left, seq, abstime) < 0 && errno == ETIMEDOUT) {
+            return ETIMEDOUT;
+        }
+    }
+}
+
+static void scalable_release_writer(ScalableReaders* s) {
+    s->writer->store(0, butil::memory_order_release);
+    butex_wake_all(s->writer);
+}
+
+// Wait until no writer is pending or holding the lock.
+static inline int rwlock_wait_rdlock(bthread_rwlock_t* __restrict rwlock,
+                                     const struct timespec* __restrict abstime) {
+    ScalableReaders* s = scalable_readers_of(rwlock);
+    if (NULL != s) {
+        return scalable_wait_rdlock(s, abstime);
+    }
+    return bthread_sem_timedwait(&rwlock->reader_sema, abstime);
+}
+
 // For reading.
 static int rwlock_rdlock_impl(bthread_rwlock_t* __restrict rwlock,
                               const struct timespec* __restrict abstime) {
-    int reader_count = ((butil::atomic<int>*)&rwlock->reader_count)
-        ->fetch_add(1, butil::memory_order_acquire) + 1;
-    // Fast path.
-    if (reader_count >= 0) {
-        CHECK_LT(reader_count, RWLockMaxReaders);
-        return 0;
+    ScalableReaders* s = scalable_readers_of(rwlock);
+    if (NULL != s) {
+        // Fast path.
+        if (scalable_tryrdlock(s)) {
+            return 0;
+        }
+    } else {
+        int reader_count = ((butil::atomic<int>*)&rwlock->reader_count)
+            ->fetch_add(1, butil::memory_order_acquire) + 1;
+        // Fast path.
+        if (reader_count >= 0) {
+            CHECK_LT(reader_count, RWLockMaxReaders);
+            return 0;
+        }
     }
 
     // Slow path.
 
     // Don't sample when contention profiler is off.
     if (NULL == bthread::g_cp) {
-        return bthread_sem_timedwait(&rwlock->reader_sema, abstime);
+        return rwlock_wait_rdlock(rwlock, abstime);
     }
     // Ask Collector if this (contended) locking should be sampled.
     const size_t sampling_range = bvar::is_collectable(&bthread::g_cp_sl);
     if (!bvar::is_sampling_range_valid(sampling_range)) { // Don't sample.
-        return bthread_sem_timedwait(&rwlock->reader_sema, abstime);
+        return rwlock_wait_rdlock(rwlock, abstime);
     }
 
     // Sample.
     const int64_t start_ns = butil::cpuwide_time_ns();
-    int rc = bthread_sem_timedwait(&rwlock->reader_sema, abstime);
+    int rc = rwlock_wait_rdlock(rwlock, abstime);
     const int64_t end_ns = butil::cpuwide_time_ns();
     const bthread_contention_site_t csite{end_ns - start_ns, sampling_range};
     // Submit `csite' for each reader immediately after
@@ -84,6 +252,10 @@ static inline int rwlock_timedrdlock(bthread_rwlock_t* __restrict rwlock,
 
 // Returns 0 if the lock was acquired, otherwise errno.
 static  inline int rwlock_tryrdlock(bthread_rwlock_t* rwlock) {
+    ScalableReaders* s = scalable_readers_of(rwlock);
+    if (NULL != s) {
+        return scalable_tryrdlock(s) ? 0 : EBUSY;
+    }
     while (true) {
         int reader_count = ((butil::atomic<int>*)&rwlock->reader_count)
             ->load(butil::memory_order_relaxed);
@@ -101,6 +273,11 @@ static  inline int rwlock_tryrdlock(bthread_rwlock_t* rwlock) {
 }
 
 static inline int rwlock_unrdlock(bthread_rwlock_t* rwlock) {
+    ScalableReaders* s = scalable_readers_of(rwlock);
+    if (NULL != s) {
+        scalable_unrdlock(s, current_reader_counter(s));
+        return 0;
+    }
     int reader_count = ((butil::atomic<int>*)&rwlock->reader_count)
         ->fetch_add(-1, butil::memory_order_relaxed) - 1;
     // Fast path.
@@ -188,26 +365,46 @@ static inline int rwlock_wrlock_impl(bthread_rwlock_t* __restrict rwlock,
         }
     }
 
-    // Announce to readers there is a pending writer.
-    int reader_count = ((butil::atomic<int>*)&rwlock->reader_count)
-        ->fetch_add(-RWLockMaxReaders, butil::memory_order_release);
-    // Wait for active readers.
-    if (reader_count != 0 &&
-        ((butil::atomic<int>*)&rwlock->reader_wait)
-            ->fetch_add(reader_count) + reader_count != 0) {
-        rc = bthread_sem_trywait(&rwlock->writer_sema);
-        if (0 != rc) {
+    ScalableReaders* s = scalable_readers_of(rwlock);
+    if (NULL != s) {
+        // Announce to readers there is a pending writer.
+        s->writer->store(1);
+        // Wait for active readers.
+        if (0 != scalable_reader_count(s)) {
             if (0 == start_ns) {
                 DO_CSITE_IF_NEED;
             }
 
-            rc = bthread_sem_timedwait(&rwlock->writer_sema, abstime);
+            rc = scalable_wait_readers(s, abstime);
             if (0 != rc) {
                 SUBMIT_CSITE_IF_NEED;
+                scalable_release_writer(s);
                 bthread_mutex_unlock(&rwlock->write_queue_mutex);
                 return rc;
             }
         }
+    } else {
+        // Announce to readers there is a pending writer.
+        int reader_count = ((butil::atomic<int>*)&rwlock->reader_count)
+            ->fetch_add(-RWLockMaxReaders, butil::memory_order_release);
+        // Wait for active readers.
+        if (reader_count != 0 &&
+            ((butil::atomic<int>*)&rwlock->reader_wait)
+                ->fetch_add(reader_count) + reader_count != 0) {
+            rc = bthread_sem_trywait(&rwlock->writer_sema);
+            if (0 != rc) {
+                if (0 == start_ns) {
+                    DO_CSITE_IF_NEED;
+                }
+
+                rc = bthread_sem_timedwait(&rwlock->writer_sema, abstime);
+                if (0 != rc) {
+                    SUBMIT_CSITE_IF_NEED;
+                    bthread_mutex_unlock(&rwlock->write_queue_mutex);
+                    return rc;
+                }
+            }
+        }
     }
     if (start_ns > 0) {
         rwlock->writer_csite.duration_ns = butil::cpuwide_time_ns() - start_ns;
@@ -234,6 +431,19 @@ static inline int rwlock_trywrlock(bthread_rwlock_t* rwlock) {
         return rc;
     }
 
+    ScalableReaders* s = scalable_readers_of(rwlock);
+    if (NULL != s) {
+        s->writer->store(1);
+        if (0 != scalable_reader_count(s)) {
+            // Failed to acquire the write lock because there are active readers.
+            scalable_release_writer(s);
+            bthread_mutex_unlock(&rwlock->write_queue_mutex);
+            return EBUSY;
+        }
+        rwlock->wlock_flag = true;
+        return 0;
+    }
+
     int expected = 0;
     if (!((butil::atomic<int>*)&rwlock->reader_count)
             ->compare_exchange_strong(expected, -RWLockMaxReaders,
@@ -249,7 +459,12 @@ static inline int rwlock_trywrlock(bthread_rwlock_t* rwlock) {
 }
 
 static inline void rwlock_unwrlock_slow(bthread_rwlock_t* rwlock, int reader_count) {
-    bthread_sem_post_n(&rwlock->reader_sema, reader_count);
+    ScalableReaders* s = scalable_readers_of(rwlock);
+    if (NULL != s) {
+        scalable_release_writer(s);
+    } else {
+        bthread_sem_post_n(&rwlock->reader_sema, reader_count);
+    }
     // Allow other writers to proceed.
     bthread_mutex_unlock(&rwlock->write_queue_mutex);
 }
@@ -257,12 +472,15 @@ static inline void rwlock_unwrlock_slow(bthread_rwlock_t* rwlock, int reader_cou
 static inline int rwlock_unwrlock(bthread_rwlock_t* rwlock) {
     rwlock->wlock_flag = false;
 
-    // Announce to readers there is no active writer.
-    int reader_count = ((butil::atomic<int>*)&rwlock->reader_count)->fetch_add(
-        RWLockMaxReaders, butil::memory_order_release) + RWLockMaxReaders;
-    if (BAIDU_UNLIKELY(reader_count >= RWLockMaxReaders)) {
-        CHECK(false) << "rwlock_unwlock of unlocked rwlock";
-        return EINVAL;
+    int reader_count = 0;
+    if (NULL == scalable_readers_of(rwlock)) {
+        // Announce to readers there is no active writer.
+        reader_count = ((butil::atomic<int>*)&rwlock->reader_count)->fetch_add(
+            RWLockMaxReaders, butil::memory_order_release) + RWLockMaxReaders;
+        if (BAIDU_UNLIKELY(reader_count >= RWLockMaxReaders)) {
+            CHECK(false) << "rwlock_unwlock of unlocked rwlock";
+            return EINVAL;
+        }
     }
 
     bool is_valid = bthread::is_contention_site_valid(rwlock->writer_csite);
@@ -329,9 +547,30 @@ int bthread_rwlock_init(bthread_rwlock_t* __restrict rwlock,
 }
 
 int bthread_rwlock_destroy(bthread_rwlock_t* rwlock) {
+    bthread::ScalableReaders* s = bthread::scalable_readers_of(rwlock);
+    if (NULL != s) {
+        bthread::destroy_scalable_readers(s);
+        rwlock->reader_sema.butex = NULL;
+    } else {
+        bthread_sem_destroy(&rwlock->reader_sema);
+        bthread_sem_destroy(&rwlock->writer_sema);
+    }
+    bthread_mutex_destroy(&rwlock->write_queue_mutex);
+    return 0;
+}
+
+int bthread_rwlock_enable_scalable_readers(bthread_rwlock_t* rwlock) {
+    if (NULL != bthread::scalable_readers_of(rwlock)) {
+        return 0;
+    }
+    bthread::ScalableReaders* s = bthread::create_scalable_readers();
+    if (NULL == s) {
+        return ENOMEM;
+    }
     bthread_sem_destroy(&rwlock->reader_sema);
     bthread_sem_destroy(&rwlock->writer_sema);
-    bthread_mutex_destroy(&rwlock->write_queue_mutex);
+    rwlock->writer_sema.butex = NULL;
+    rwlock->reader_sema.butex = reinterpret_cast<unsigned*>(s);
     return 0;
 }
 
@@ -365,4 +604,12 @@ int bthread_rwlock_unlock(bthread_rwlock_t* rwlock) {
     return bthread::rwlock_unlock(rwlock);
 }
 
+int bthread_rwlockattr_init(bthread_rwlockattr_t*) {
+    return 0;
+}
+
+int bthread_rwlockattr_destroy(bthread_rwlockattr_t*) {
+    return 0;
+}
+
 __END_DECLS
@@ -37,6 +37,22 @@ public:
         }
     }
 
+    // Create a rwlock with scalable readers if `scalable_readers' is true,
+    // see bthread_rwlock_enable_scalable_readers().
+    explicit RWLock(bool scalable_readers) {
+        int rc = bthread_rwlock_init(&_rwlock, NULL);
+        if (rc == 0 && scalable_readers) {
+            rc = bthread_rwlock_enable_scalable_readers(&_rwlock);
+            if (rc) {
+                bthread_rwlock_destroy(&_rwlock);
+            }
+        }
+        if (rc) {
+            throw std::system_error(std::error_code(rc, std::system_category()),
+                                    "RWLock constructor failed");
+        }
+    }
+
     ~RWLock() {
         CHECK_EQ(0, bthread_rwlock_destroy(&_rwlock));
     }
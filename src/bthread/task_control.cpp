@@ -31,6 +31,7 @@
 #include "bthread/task_group.h"           // TaskGroup
 #include "bthread/task_control.h"
 #include "bthread/timer_thread.h"         // global_timer_thread
+#include "bthread/numa.h"
 #include <gflags/gflags.h>
 #include "bthread/log.h"
 
@@ -41,6 +42,12 @@ DEFINE_int32(task_group_runqueue_capacity, 4096,
 DEFINE_int32(task_group_yield_before_idle, 0,
              "TaskGroup yields so many times before idle");
 DEFINE_int32(task_group_ntags, 1, "TaskGroup will be grouped by number ntags");
+DEFINE_bool(bthread_numa_aware, false, "Bind workers of each tag to NUMA "
+            "nodes evenly and steal tasks from groups in the same node "
+            "before crossing nodes. Must be set before bthread starts");
+DEFINE_bool(bthread_lockfree_remote_queue, false, "Queue bthreads made "
+            "ready by non-workers into lock-free queues instead of queues "
+            "protected with locks. Must be set before bthread starts");
 
 namespace bthread {
 
@@ -83,6 +90,16 @@ void* TaskControl::worker_thread(void* arg) {
     delete dummy;
     run_tagged_worker_startfn(tag);
 
+    if (c->_numa_aware) {
+        // Spread workers of each tag across nodes. create_group() records
+        // the node that the worker is bound to.
+        const int node = c->_tagged_next_numa_worker[tag].fetch_add(
+            1, butil::memory_order_relaxed) % numa_node_num();
+        if (bind_current_thread_to_numa_node(node) != 0) {
+            PLOG(WARNING) << "Fail to bind worker to numa node=" << node;
+        }
+    }
+
     TaskGroup* g = c->create_group(tag);
     TaskStatistics stat;
     if (NULL == g) {
@@ -126,6 +143,9 @@ TaskGroup* TaskControl::create_group(bthread_tag_t tag) {
         delete g;
         return NULL;
     }
+    if (_numa_aware) {
+        g->set_numa_node(current_numa_node());
+    }
     if (_add_group(g, tag) != 0) {
         delete g;
         return NULL;
@@ -171,6 +191,9 @@ TaskControl::TaskControl()
     , _stop(false)
     , _concurrency(0)
     , _next_worker_id(0)
+    , _numa_aware(false)
+    , _tagged_next_numa_worker(FLAGS_task_group_ntags)
+    , _tagged_nhp_task(FLAGS_task_group_ntags)
     , _nworkers("bthread_worker_count")
     , _pending_time(NULL)
       // Delay exposure of following two vars because they rely on TC which
@@ -209,6 +232,20 @@ int TaskControl::init(int concurrency) {
         _tagged_nbthreads.push_back(new bvar::Adder<int64_t>("bthread_count", tag_str));
     }
 
+    _numa_aware = FLAGS_bthread_numa_aware;
+    if (_numa_aware) {
+        for (int i = 0; i < FLAGS_task_group_ntags; ++i) {
+            _tagged_next_numa_worker[i].store(0, butil::memory_order_relaxed);
+        }
+        for (int i = 0; i < numa_node_num(); ++i) {
+            auto node_str = std::to_string(i);
+            _numa_steal_local.push_back(
+                new bvar::Adder<int64_t>("bthread_numa_steal_local", node_str));
+            _numa_steal_remote.push_back(
+                new bvar::Adder<int64_t>("bthread_numa_steal_remote", node_str));
+        }
+    }
+
     // Make sure TimerThread is ready.
     if (get_or_create_global_timer_thread() == NULL) {
         LOG(ERROR) << "Fail to get global_timer_thread";
@@ -287,7 +324,19 @@ TaskGroup* TaskControl::choose_one_group(bthread_tag_t tag) {
     auto& groups = tag_group(tag);
     const auto ngroup = tag_ngroup(tag).load(butil::memory_order_acquire);
     if (ngroup != 0) {
-        return groups[butil::fast_rand_less_than(ngroup)];
+        const size_t index = butil::fast_rand_less_than(ngroup);
+        if (_numa_aware) {
+            // The task probably touches memory prepared by the caller, run
+            // it in the same node.
+            const int node = current_numa_node();
+            for (size_t i = 0; i < ngroup; ++i) {
+                TaskGroup* g = groups[(index + i) % ngroup];
+                if (g && g->numa_node() == node) {
+                    return g;
+                }
+            }
+        }
+        return groups[index];
     }
     CHECK(false) << "Impossible: ngroup is 0";
     return NULL;
@@ -427,8 +476,13 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     return 0;
 }
 
-bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
+bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                             bool high_priority) {
     auto tag = tls_task_group->tag();
+    butil::atomic<int64_t>& nhp_task = tag_nhp_task(tag);
+    if (high_priority && nhp_task.load(butil::memory_order_relaxed) <= 0) {
+        return false;
+    }
     // 1: Acquiring fence is paired with releasing fence in _add_group to
     // avoid accessing uninitialized slot of _groups.
     const size_t ngroup = tag_ngroup(tag).load(butil::memory_order_acquire/*1*/);
@@ -440,19 +494,53 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     bool stolen = false;
     size_t s = *seed;
     auto& groups = tag_group(tag);
-    for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = groups[s % ngroup];
-        // g is possibly NULL because of concurrent _destroy_group
-        if (g) {
-            if (g->_rq.steal(tid)) {
-                stolen = true;
-                break;
+    auto steal_from_group = [high_priority, &nhp_task](TaskGroup* g,
+                                                       bthread_t* t) {
+        if (high_priority) {
+            if (g->_hp_rq.steal(t) || g->_hp_remote_rq.pop(t)) {
+                nhp_task.fetch_sub(1, butil::memory_order_relaxed);
+                return true;
             }
-            if (g->_remote_rq.pop(tid)) {
+            return false;
+        }
+        return g->_rq.steal(t) || g->_remote_rq.pop(t);
+    };
+    if (_numa_aware) {
+        // Steal from groups in the same node first, tasks running across
+        // nodes access memory of the other node, which is much slower.
+        const int node = tls_task_group->numa_node();
+        for (size_t i = 0; i < ngroup; ++i, s += offset) {
+            TaskGroup* g = groups[s % ngroup];
+            // g is possibly NULL because of concurrent _destroy_group
+            if (g && g->numa_node() == node && steal_from_group(g, tid)) {
                 stolen = true;
                 break;
             }
         }
+        if (stolen) {
+            *_numa_steal_local[node] << 1;
+        } else {
+            for (size_t i = 0; i < ngroup; ++i, s += offset) {
+                TaskGroup* g = groups[s % ngroup];
+                if (g && g->numa_node() != node && steal_from_group(g, tid)) {
+                    stolen = true;
+                    break;
+                }
+            }
+            if (stolen) {
+                *_numa_steal_remote[node] << 1;
+            }
+        }
+        *seed = s;
+        return stolen;
+    }
+    for (size_t i = 0; i < ngroup; ++i, s += offset) {
+        TaskGroup* g = groups[s % ngroup];
+        // g is possibly NULL because of concurrent _destroy_group
+        if (g && steal_from_group(g, tid)) {
+            stolen = true;
+            break;
+        }
     }
     *seed = s;
     return stolen;
@@ -503,7 +591,7 @@ void TaskControl::print_rq_sizes(std::ostream& os) {
         // ngroup < _ngroup: just ignore _groups[_ngroup ... ngroup-1]
         int i = 0;
         for_each_task_group([&](TaskGroup* g) {
-            nums[i] = (g ? g->_rq.volatile_size() : 0);
+            nums[i] = (g ? g->rq_size() : 0);
             ++i;
         });
     }
@@ -552,7 +640,8 @@ int64_t TaskControl::get_cumulated_signal_count() {
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
     for_each_task_group([&](TaskGroup* g) {
         if (g) {
-            c += g->_nsignaled + g->_remote_nsignaled;
+            c += g->_nsignaled +
+                g->_remote_nsignaled.load(butil::memory_order_relaxed);
         }
     });
     return c;
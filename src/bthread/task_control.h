@@ -60,8 +60,12 @@ public:
     // Create a TaskGroup in this control.
     TaskGroup* create_group(bthread_tag_t tag);
 
-    // Steal a task from a "random" group.
-    bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
+    // Steal a task from a "random" group. Only bthreads with
+    // BTHREAD_HIGH_PRIORITY are stolen if `high_priority' is true, only
+    // others otherwise. Groups are not visited for high-priority bthreads
+    // when none is queued.
+    bool steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                    bool high_priority);
 
     // Tell other groups that `n' tasks was just added to caller's runqueue
     void signal_task(int num_task, bthread_tag_t tag);
@@ -87,7 +91,8 @@ public:
     // Return the number of workers actually added, which may be less than |num|
     int add_workers(int num, bthread_tag_t tag);
 
-    // Choose one TaskGroup (randomly right now).
+    // Choose one TaskGroup (randomly right now, groups in the NUMA node of
+    // caller are preferred in NUMA-aware mode).
     // If this method is called after init(), it never returns NULL.
     TaskGroup* choose_one_group(bthread_tag_t tag);
 
@@ -115,6 +120,13 @@ private:
     // Tag parking slot
     TaggedParkingLot& tag_pl(bthread_tag_t tag) { return _pl[tag]; }
 
+    // Number of queued bthreads with BTHREAD_HIGH_PRIORITY in groups of the
+    // tag. Incremented before pushing and decremented after popping, so it's
+    // never less than the actual number.
+    butil::atomic<int64_t>& tag_nhp_task(bthread_tag_t tag) {
+        return _tagged_nhp_task[tag];
+    }
+
     static void delete_task_group(void* arg);
 
     static void* worker_thread(void* task_control);
@@ -136,6 +148,10 @@ private:
     butil::atomic<int> _concurrency;
     std::vector<pthread_t> _workers;
     butil::atomic<int> _next_worker_id;
+    // Bind workers to NUMA nodes and steal tasks in the same node first.
+    bool _numa_aware;
+    std::vector<butil::atomic<int>> _tagged_next_numa_worker;
+    std::vector<butil::atomic<int64_t>> _tagged_nhp_task;
 
     bvar::Adder<int64_t> _nworkers;
     butil::Mutex _pending_time_mutex;
@@ -154,6 +170,11 @@ private:
     std::vector<bvar::PerSecond<bvar::PassiveStatus<double>>*> _tagged_worker_usage_second;
     std::vector<bvar::Adder<int64_t>*> _tagged_nbthreads;
 
+    // Successful steals from groups in the same/another NUMA node, indexed
+    // by the node of stealers.
+    std::vector<bvar::Adder<int64_t>*> _numa_steal_local;
+    std::vector<bvar::Adder<int64_t>*> _numa_steal_remote;
+
     std::vector<TaggedParkingLot> _pl;
 
 #ifdef BRPC_BTHREAD_TRACER
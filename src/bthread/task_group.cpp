@@ -37,6 +37,8 @@
 #include "bthread/task_group.h"
 #include "bthread/timer_thread.h"
 
+DECLARE_bool(bthread_lockfree_remote_queue);
+
 namespace bthread {
 
 static const bthread_attr_t BTHREAD_ATTR_TASKGROUP = {
@@ -67,7 +69,7 @@ extern void return_keytable(bthread_keytable_pool_t*, KeyTable*);
 // overhead of creation keytable, may be removed later.
 BAIDU_VOLATILE_THREAD_LOCAL(void*, tls_unique_user_ptr, NULL);
 
-const TaskStatistics EMPTY_STAT = { 0, 0, 0 };
+const TaskStatistics EMPTY_STAT = { 0, 0, 0, 0, 0 };
 
 const size_t OFFSET_TABLE[] = {
 #include "bthread/offset_inl.list"
@@ -191,6 +193,8 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _last_context_remained_arg(NULL)
     , _pl(NULL)
     , _main_stack(NULL)
+    , _rtc_stack(NULL)
+    , _rtc_stack_busy(false)
     , _main_tid(0)
     , _remote_num_nosignal(0)
     , _remote_nsignaled(0)
@@ -198,6 +202,7 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _sched_recursive_guard(0)
 #endif
     , _tag(BTHREAD_TAG_DEFAULT)
+    , _numa_node(0)
     , _tid(-1) {
     _steal_seed = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
@@ -216,6 +221,14 @@ TaskGroup::~TaskGroup() {
         return_resource(get_slot(_main_tid));
         _main_tid = 0;
     }
+    // A task suspended on _rtc_stack has been promoted and owns the stack
+    // already, so the stack kept by the group is never used when the worker
+    // quits.
+    if (_rtc_stack) {
+        return_stack(_rtc_stack);
+        _rtc_stack = NULL;
+        _rtc_stack_busy = false;
+    }
 }
 
 #ifdef BUTIL_USE_ASAN
@@ -246,10 +259,20 @@ int TaskGroup::init(size_t runqueue_capacity) {
         LOG(FATAL) << "Fail to init _rq";
         return -1;
     }
-    if (_remote_rq.init(runqueue_capacity / 2) != 0) {
+    if (_remote_rq.init(runqueue_capacity / 2,
+                        FLAGS_bthread_lockfree_remote_queue) != 0) {
         LOG(FATAL) << "Fail to init _remote_rq";
         return -1;
     }
+    if (_hp_rq.init(runqueue_capacity) != 0) {
+        LOG(FATAL) << "Fail to init _hp_rq";
+        return -1;
+    }
+    if (_hp_remote_rq.init(runqueue_capacity / 2,
+                           FLAGS_bthread_lockfree_remote_queue) != 0) {
+        LOG(FATAL) << "Fail to init _hp_remote_rq";
+        return -1;
+    }
 
 #ifdef BUTIL_USE_ASAN
     void* stack_addr = NULL;
@@ -423,9 +446,44 @@ void TaskGroup::task_runner(intptr_t skip_remained) {
     // tasks to run, quit for more tasks.
 }
 
+ContextualStack* TaskGroup::get_stack_for(TaskMeta* meta) {
+    if ((meta->attr.flags & BTHREAD_RUN_TO_COMPLETION) &&
+        meta->stack_type() == STACK_TYPE_NORMAL && !_rtc_stack_busy) {
+        if (NULL == _rtc_stack) {
+#ifdef BUTIL_USE_ASAN
+            _rtc_stack = get_stack(STACK_TYPE_NORMAL, asan_task_runner);
+#else
+            _rtc_stack = get_stack(STACK_TYPE_NORMAL, task_runner);
+#endif // BUTIL_USE_ASAN
+        }
+        if (_rtc_stack) {
+            _rtc_stack_busy = true;
+            return _rtc_stack;
+        }
+    }
+#ifdef BUTIL_USE_ASAN
+    return get_stack(meta->stack_type(), asan_task_runner);
+#else
+    return get_stack(meta->stack_type(), task_runner);
+#endif // BUTIL_USE_ASAN
+}
+
+void TaskGroup::promote_current_task_if_needed() {
+    if (_rtc_stack_busy && _cur_meta->stack == _rtc_stack) {
+        // The stack will be returned to the pool when the task ends.
+        _rtc_stack = NULL;
+        _rtc_stack_busy = false;
+    }
+}
+
 void TaskGroup::_release_last_context(void* arg) {
     TaskMeta* m = static_cast<TaskMeta*>(arg);
-    if (m->stack_type() != STACK_TYPE_PTHREAD) {
+    TaskGroup* g = tls_task_group;
+    if (m->stack != NULL && m->stack == g->_rtc_stack) {
+        // Keep the stack for later bthreads with BTHREAD_RUN_TO_COMPLETION.
+        m->release_stack();
+        g->_rtc_stack_busy = false;
+    } else if (m->stack_type() != STACK_TYPE_PTHREAD) {
         return_stack(m->release_stack()/*may be NULL*/);
     } else {
         // it's _main_stack, don't return.
@@ -464,6 +522,8 @@ int TaskGroup::start_foreground(TaskGroup** pg,
     }
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
+    m->suspended_ns = 0;
+    m->ready_ns = 0;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
     if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
@@ -524,6 +584,8 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     }
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
+    m->suspended_ns = 0;
+    m->ready_ns = 0;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
     if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
@@ -600,15 +662,7 @@ void TaskGroup::ending_sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
-#ifndef BTHREAD_FAIR_WSQ
-    // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
-    // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
-    // to 2.9%
-    const bool popped = g->_rq.pop(&next_tid);
-#else
-    const bool popped = g->_rq.steal(&next_tid);
-#endif
-    if (!popped && !g->steal_task(&next_tid)) {
+    if (!g->pop_rq(&next_tid) && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
     }
@@ -623,12 +677,7 @@ void TaskGroup::ending_sched(TaskGroup** pg) {
             // transfered stack is just _main_stack.
             next_meta->set_stack(cur_meta->release_stack());
         } else {
-#ifdef BUTIL_USE_ASAN
-            ContextualStack* stk = get_stack(
-                next_meta->stack_type(), asan_task_runner);
-#else
-            ContextualStack* stk = get_stack(next_meta->stack_type(), task_runner);
-#endif // BUTIL_USE_ASAN
+            ContextualStack* stk = g->get_stack_for(next_meta);
             if (stk) {
                 next_meta->set_stack(stk);
             } else {
@@ -648,12 +697,7 @@ void TaskGroup::sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
-#ifndef BTHREAD_FAIR_WSQ
-    const bool popped = g->_rq.pop(&next_tid);
-#else
-    const bool popped = g->_rq.steal(&next_tid);
-#endif
-    if (!popped && !g->steal_task(&next_tid)) {
+    if (!g->pop_rq(&next_tid) && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
     }
@@ -674,6 +718,9 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta, bool cur_ending) {
     const int saved_errno = errno;
     void* saved_unique_user_ptr = tls_unique_user_ptr;
 
+    if (!cur_ending) {
+        g->promote_current_task_if_needed();
+    }
     TaskMeta* const cur_meta = g->_cur_meta;
     const int64_t now = butil::cpuwide_time_ns();
     const int64_t elp_ns = now - g->_last_run_ns;
@@ -695,8 +742,13 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta, bool cur_ending) {
     }
     ++cur_meta->stat.nswitch;
     ++ g->_nswitch;
+    if (next_meta->ready_ns != 0) {
+        next_meta->stat.runqueue_wait_ns += now - next_meta->ready_ns;
+        next_meta->ready_ns = 0;
+    }
     // Switch to the task
     if (__builtin_expect(next_meta != cur_meta, 1)) {
+        cur_meta->suspended_ns = now;
         g->_cur_meta = next_meta;
         // Switch tls_bls
         cur_meta->local_storage = BAIDU_GET_VOLATILE_THREAD_LOCAL(tls_bls);
@@ -777,7 +829,8 @@ void TaskGroup::ready_to_run(TaskMeta* meta, bool nosignal) {
 #ifdef BRPC_BTHREAD_TRACER
     _control->_task_tracer.set_status(TASK_STATUS_READY, meta);
 #endif // BRPC_BTHREAD_TRACER
-    push_rq(meta->tid);
+    set_ready_time(meta);
+    push_rq(meta->tid, is_high_priority(meta));
     if (nosignal) {
         ++_num_nosignal;
     } else {
@@ -801,38 +854,72 @@ void TaskGroup::ready_to_run_remote(TaskMeta* meta, bool nosignal) {
 #ifdef BRPC_BTHREAD_TRACER
     _control->_task_tracer.set_status(TASK_STATUS_READY, meta);
 #endif // BRPC_BTHREAD_TRACER
-    _remote_rq._mutex.lock();
-    while (!_remote_rq.push_locked(meta->tid)) {
-        flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
-        LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
-                                << _remote_rq.capacity();
+    set_ready_time(meta);
+    RemoteTaskQueue& rq =
+        (is_high_priority(meta) ? _hp_remote_rq : _remote_rq);
+    if (is_high_priority(meta)) {
+        _control->tag_nhp_task(_tag).fetch_add(1, butil::memory_order_relaxed);
+    }
+    if (rq.lockfree()) {
+        while (!rq.push(meta->tid)) {
+            flush_nosignal_tasks_remote_lockfree();
+            LOG_EVERY_SECOND(ERROR) << "remote runqueue is full, capacity="
+                                    << rq.capacity();
+            ::usleep(1000);
+        }
+        if (nosignal) {
+            _remote_num_nosignal.fetch_add(1, butil::memory_order_relaxed);
+        } else {
+            // Signal for tasks pushed with nosignal as well, in one batch.
+            const int additional_signal =
+                _remote_num_nosignal.exchange(0, butil::memory_order_relaxed);
+            _remote_nsignaled.fetch_add(1 + additional_signal,
+                                        butil::memory_order_relaxed);
+            _control->signal_task(1 + additional_signal, _tag);
+        }
+        return;
+    }
+    rq._mutex.lock();
+    while (!rq.push_locked(meta->tid)) {
+        flush_nosignal_tasks_remote_locked(rq._mutex);
+        LOG_EVERY_SECOND(ERROR) << "remote runqueue is full, capacity="
+                                << rq.capacity();
         ::usleep(1000);
-        _remote_rq._mutex.lock();
+        rq._mutex.lock();
     }
     if (nosignal) {
-        ++_remote_num_nosignal;
-        _remote_rq._mutex.unlock();
+        _remote_num_nosignal.fetch_add(1, butil::memory_order_relaxed);
+        rq._mutex.unlock();
     } else {
-        const int additional_signal = _remote_num_nosignal;
-        _remote_num_nosignal = 0;
-        _remote_nsignaled += 1 + additional_signal;
-        _remote_rq._mutex.unlock();
+        const int additional_signal =
+            _remote_num_nosignal.exchange(0, butil::memory_order_relaxed);
+        _remote_nsignaled.fetch_add(1 + additional_signal,
+                                    butil::memory_order_relaxed);
+        rq._mutex.unlock();
         _control->signal_task(1 + additional_signal, _tag);
     }
 }
 
 void TaskGroup::flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex) {
-    const int val = _remote_num_nosignal;
+    const int val = _remote_num_nosignal.exchange(0, butil::memory_order_relaxed);
     if (!val) {
         locked_mutex.unlock();
         return;
     }
-    _remote_num_nosignal = 0;
-    _remote_nsignaled += val;
+    _remote_nsignaled.fetch_add(val, butil::memory_order_relaxed);
     locked_mutex.unlock();
     _control->signal_task(val, _tag);
 }
 
+void TaskGroup::flush_nosignal_tasks_remote_lockfree() {
+    const int val =
+        _remote_num_nosignal.exchange(0, butil::memory_order_relaxed);
+    if (val) {
+        _remote_nsignaled.fetch_add(val, butil::memory_order_relaxed);
+        _control->signal_task(val, _tag);
+    }
+}
+
 void TaskGroup::ready_to_run_general(TaskMeta* meta, bool nosignal) {
     if (tls_task_group == this) {
         return ready_to_run(meta, nosignal);
@@ -858,7 +945,9 @@ void TaskGroup::ready_to_run_in_worker_ignoresignal(void* args_in) {
     tls_task_group->_control->_task_tracer.set_status(
         TASK_STATUS_READY, args->meta);
 #endif // BRPC_BTHREAD_TRACER
-    return tls_task_group->push_rq(args->meta->tid);
+    set_ready_time(args->meta);
+    return tls_task_group->push_rq(args->meta->tid,
+                                   is_high_priority(args->meta));
 }
 
 struct SleepArgs {
@@ -1056,7 +1145,7 @@ void print_task(std::ostream& os, bthread_t tid) {
     bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
     bool has_tls = false;
     int64_t cpuwide_start_ns = 0;
-    TaskStatistics stat = {0, 0, 0};
+    TaskStatistics stat = {0, 0, 0, 0, 0};
     TaskStatus status = TASK_STATUS_UNKNOWN;
     bool traced = false;
     pid_t worker_tid = 0;
@@ -1092,6 +1181,8 @@ void print_task(std::ostream& os, bthread_t tid) {
            << "}\nhas_tls=" << has_tls
            << "\nuptime_ns=" << butil::cpuwide_time_ns() - cpuwide_start_ns
            << "\ncputime_ns=" << stat.cputime_ns
+           << "\nrunqueue_wait_ns=" << stat.runqueue_wait_ns
+           << "\nblocked_ns=" << stat.blocked_ns
            << "\nnswitch=" << stat.nswitch
 #ifdef BRPC_BTHREAD_TRACER
            << "\nstatus=" << status
@@ -158,6 +158,7 @@ public:
     // Push a bthread into the runqueue from another non-worker thread.
     void ready_to_run_remote(TaskMeta* meta, bool nosignal = false);
     void flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex);
+    void flush_nosignal_tasks_remote_lockfree();
     void flush_nosignal_tasks_remote();
 
     // Automatically decide the caller is remote or local, and call
@@ -178,19 +179,33 @@ public:
     // Get the meta associate with the task.
     static TaskMeta* address_meta(bthread_t tid);
 
-    // Push a task into _rq, if _rq is full, retry after some time. This
-    // process make go on indefinitely.
-    void push_rq(bthread_t tid);
+    // Push a task into _rq(or _hp_rq if `high_priority' is true), if the
+    // queue is full, retry after some time. This process make go on
+    // indefinitely.
+    void push_rq(bthread_t tid, bool high_priority = false);
 
-    // Returns size of local run queue.
+    // Returns size of local run queues.
     size_t rq_size() const {
-        return _rq.volatile_size();
+        return _rq.volatile_size() + _hp_rq.volatile_size();
     }
 
     bthread_tag_t tag() const { return _tag; }
 
+    // NUMA node that the worker of this group is bound to.
+    int numa_node() const { return _numa_node; }
+
     pid_t tid() const { return _tid; }
 
+    // Time stats of the running task, including the time of current run.
+    void current_task_time_stat(bthread_time_stat_t* stat) const {
+        const TaskMeta* m = _cur_meta;
+        stat->tid = m->tid;
+        stat->on_cpu_ns = m->stat.cputime_ns + butil::cpuwide_time_ns() - _last_run_ns;
+        stat->runqueue_wait_ns = m->stat.runqueue_wait_ns;
+        stat->blocked_ns = m->stat.blocked_ns;
+        stat->nswitch = m->stat.nswitch;
+    }
+
     int64_t current_task_cpu_clock_ns() {
         if (_last_cpu_clock_ns == 0) {
             return 0;
@@ -203,6 +218,17 @@ public:
 private:
 friend class TaskControl;
 
+    // Account the time that `meta' was suspended and stamp the time it's
+    // put into a run queue, called before the task is visible to others.
+    static void set_ready_time(TaskMeta* meta) {
+        const int64_t now = butil::cpuwide_time_ns();
+        if (meta->suspended_ns != 0) {
+            meta->stat.blocked_ns += now - meta->suspended_ns;
+            meta->suspended_ns = 0;
+        }
+        meta->ready_ns = now;
+    }
+
     // You shall use TaskControl::create_group to create new instance.
     explicit TaskGroup(TaskControl* c);
 
@@ -217,6 +243,12 @@ friend class TaskControl;
 #endif // BUTIL_USE_ASAN
     static void task_runner(intptr_t skip_remained);
 
+    // Get a stack for `meta' which is going to run for the first time.
+    ContextualStack* get_stack_for(TaskMeta* meta);
+    // Give the stack of this worker for BTHREAD_RUN_TO_COMPLETION to
+    // current task if it's going to be switched out before ending.
+    void promote_current_task_if_needed();
+
     // Callbacks for set_remained()
     static void _release_last_context(void*);
     static void _add_sleep_event(void*);
@@ -233,17 +265,67 @@ friend class TaskControl;
     bool wait_task(bthread_t* tid);
 
     bool steal_task(bthread_t* tid) {
-        if (_remote_rq.pop(tid)) {
+        if (pop_hp_remote_rq(tid)) {
             return true;
         }
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         _last_pl_state = _pl->get_state();
 #endif
-        return _control->steal_task(tid, &_steal_seed, _steal_offset);
+        // High-priority bthreads of all groups go before others, skipped
+        // without visiting groups when none is queued.
+        if (_control->steal_task(tid, &_steal_seed, _steal_offset, true)) {
+            return true;
+        }
+        if (_remote_rq.pop(tid)) {
+            return true;
+        }
+        return _control->steal_task(tid, &_steal_seed, _steal_offset, false);
+    }
+
+    // Pop a task from local run queues. High-priority ones, including the
+    // ones from non-workers, go first.
+    bool pop_rq(bthread_t* tid) {
+#ifndef BTHREAD_FAIR_WSQ
+        // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
+        // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
+        // to 2.9%
+        return pop_hp_rq(tid) || pop_hp_remote_rq(tid) || _rq.pop(tid);
+#else
+        return pop_hp_rq(tid) || pop_hp_remote_rq(tid) || _rq.steal(tid);
+#endif
+    }
+
+    // Pop from high-priority queues of this group and keep the count of
+    // queued high-priority bthreads in TaskControl.
+    bool pop_hp_rq(bthread_t* tid) {
+#ifndef BTHREAD_FAIR_WSQ
+        const bool popped = _hp_rq.pop(tid);
+#else
+        const bool popped = _hp_rq.steal(tid);
+#endif
+        if (popped) {
+            _control->tag_nhp_task(_tag).fetch_sub(
+                1, butil::memory_order_relaxed);
+        }
+        return popped;
+    }
+    bool pop_hp_remote_rq(bthread_t* tid) {
+        if (_hp_remote_rq.pop(tid)) {
+            _control->tag_nhp_task(_tag).fetch_sub(
+                1, butil::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    static bool is_high_priority(const TaskMeta* meta) {
+        return meta->attr.flags & BTHREAD_HIGH_PRIORITY;
     }
 
     void set_tag(bthread_tag_t tag) { _tag = tag; }
 
+    void set_numa_node(int node) { _numa_node = node; }
+
     void set_pl(ParkingLot* pl) { _pl = pl; }
 
     TaskMeta* _cur_meta;
@@ -269,15 +351,27 @@ friend class TaskControl;
     size_t _steal_seed;
     size_t _steal_offset;
     ContextualStack* _main_stack;
+    // Stack for running bthreads with BTHREAD_RUN_TO_COMPLETION, owned by
+    // this worker until a bthread blocks on it.
+    ContextualStack* _rtc_stack;
+    // True if a bthread is running on _rtc_stack.
+    bool _rtc_stack_busy;
     bthread_t _main_tid;
     WorkStealingQueue<bthread_t> _rq;
     RemoteTaskQueue _remote_rq;
-    int _remote_num_nosignal;
-    int _remote_nsignaled;
+    // Queues of bthreads with BTHREAD_HIGH_PRIORITY.
+    WorkStealingQueue<bthread_t> _hp_rq;
+    RemoteTaskQueue _hp_remote_rq;
+    // Count bthreads pushed into both _remote_rq and _hp_remote_rq, which
+    // have their own mutexes(or none when lock-free), so they're atomic and
+    // not protected by any of the mutexes.
+    butil::atomic<int> _remote_num_nosignal;
+    butil::atomic<int> _remote_nsignaled;
 
     int _sched_recursive_guard;
     // tag of this taskgroup
     bthread_tag_t _tag;
+    int _numa_node;
 
     // Worker thread id.
     pid_t _tid;
@@ -62,11 +62,10 @@ inline void TaskGroup::exchange(TaskGroup** pg, TaskMeta* next_meta) {
 inline void TaskGroup::sched_to(TaskGroup** pg, bthread_t next_tid) {
     TaskMeta* next_meta = address_meta(next_tid);
     if (next_meta->stack == NULL) {
-#ifdef BUTIL_USE_ASAN
-        ContextualStack* stk = get_stack(next_meta->stack_type(), asan_task_runner);
-#else
-        ContextualStack* stk = get_stack(next_meta->stack_type(), task_runner);
-#endif // BUTIL_USE_ASAN
+        // Current task is switched out before ending, it can't share the
+        // stack with `next_meta'.
+        (*pg)->promote_current_task_if_needed();
+        ContextualStack* stk = (*pg)->get_stack_for(next_meta);
         if (stk) {
             next_meta->set_stack(stk);
         } else {
@@ -82,8 +81,12 @@ inline void TaskGroup::sched_to(TaskGroup** pg, bthread_t next_tid) {
     sched_to(pg, next_meta, false);
 }
 
-inline void TaskGroup::push_rq(bthread_t tid) {
-    while (!_rq.push(tid)) {
+inline void TaskGroup::push_rq(bthread_t tid, bool high_priority) {
+    WorkStealingQueue<bthread_t>& rq = (high_priority ? _hp_rq : _rq);
+    if (high_priority) {
+        _control->tag_nhp_task(_tag).fetch_add(1, butil::memory_order_relaxed);
+    }
+    while (!rq.push(tid)) {
         // Created too many bthreads: a promising approach is to insert the
         // task into another TaskGroup, but we don't use it because:
         // * There're already many bthreads to run, inserting the bthread
@@ -92,7 +95,8 @@ inline void TaskGroup::push_rq(bthread_t tid) {
         //   are busy at creating bthreads (proved by test_input_messenger in
         //   brpc)
         flush_nosignal_tasks();
-        LOG_EVERY_SECOND(ERROR) << "_rq is full, capacity=" << _rq.capacity();
+        LOG_EVERY_SECOND(ERROR) << (high_priority ? "_hp_rq" : "_rq")
+                                << " is full, capacity=" << rq.capacity();
         // TODO(gejun): May cause deadlock when all workers are spinning here.
         // A better solution is to pop and run existing bthreads, however which
         // make set_remained()-callbacks do context switches and need extensive
@@ -101,8 +105,13 @@ inline void TaskGroup::push_rq(bthread_t tid) {
     }
 }
 
+// _remote_num_nosignal counts bthreads in _hp_remote_rq as well and is
+// atomic, flushing it under _remote_rq._mutex covers both queues.
 inline void TaskGroup::flush_nosignal_tasks_remote() {
-    if (_remote_num_nosignal) {
+    if (_remote_num_nosignal.load(butil::memory_order_relaxed)) {
+        if (_remote_rq.lockfree()) {
+            return flush_nosignal_tasks_remote_lockfree();
+        }
         _remote_rq._mutex.lock();
         flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
     }
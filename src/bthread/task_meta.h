@@ -35,6 +35,8 @@ struct TaskStatistics {
     int64_t cputime_ns;
     int64_t nswitch;
     int64_t cpu_usage_ns;
+    int64_t runqueue_wait_ns;
+    int64_t blocked_ns;
 };
 
 class KeyTable;
@@ -44,9 +46,16 @@ struct LocalStorage {
     KeyTable* keytable;
     void* assigned_data;
     void* rpcz_parent_span;
+    // Tag of the work being done by the bthread, attached to samples of
+    // the continuous profiler. brpc sets it to the MethodStatus of the
+    // request being processed.
+    const void* sampling_tag;
+    // brpc::TraceContext of the request being processed, parent of spans
+    // of RPCs issued by the bthread.
+    const void* trace_parent;
 };
 
-#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL }
+#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL, NULL, NULL }
 
 const static LocalStorage LOCAL_STORAGE_INIT = BTHREAD_LOCAL_STORAGE_INITIALIZER;
 
@@ -101,6 +110,10 @@ struct TaskMeta {
     // Statistics
     int64_t cpuwide_start_ns{0};
     TaskStatistics stat{};
+    // When the task was switched out and when it was put into a run queue,
+    // 0 if not applicable.
+    int64_t suspended_ns{0};
+    int64_t ready_ns{0};
 
     // bthread local storage, sync with tls_bls (defined in task_group.cpp)
     // when the bthread is created or destroyed.
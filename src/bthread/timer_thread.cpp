@@ -18,7 +18,9 @@
 // bthread - An M:N threading library to make applications more concurrent.
 
 
+#include <string.h>                        // memset
 #include <queue>                           // heap functions
+#include <gflags/gflags.h>
 #include "butil/scoped_lock.h"
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
@@ -31,13 +33,19 @@
 
 namespace bthread {
 
+DEFINE_bool(bthread_timer_use_timing_wheel, false,
+            "Keep tasks of the global TimerThread in a hierarchical timing "
+            "wheel which is scheduled without locks. Must be set before "
+            "bthread starts");
+
 // Defined in task_control.cpp
 void run_worker_startfn();
 
 const TimerThread::TaskId TimerThread::INVALID_TASK_ID = 0;
 
 TimerThreadOptions::TimerThreadOptions()
-    : num_buckets(13) {
+    : num_buckets(13)
+    , use_timing_wheel(false) {
 }
 
 // A task contains the necessary information for running fn(arg).
@@ -117,6 +125,116 @@ inline bool task_greater(const TimerThread::Task* a, const TimerThread::Task* b)
     return a->run_time > b->run_time;
 }
 
+// Create a task to run fn(arg) at abstime. Returns NULL on error.
+static TimerThread::Task* create_task(void (*fn)(void*), void* arg,
+                                      const timespec& abstime) {
+    butil::ResourceId<TimerThread::Task> slot_id;
+    TimerThread::Task* task = butil::get_resource<TimerThread::Task>(&slot_id);
+    if (task == NULL) {
+        return NULL;
+    }
+    task->next = NULL;
+    task->fn = fn;
+    task->arg = arg;
+    task->run_time = butil::timespec_to_microseconds(abstime);
+    uint32_t version = task->version.load(butil::memory_order_relaxed);
+    if (version == 0) {  // skip 0.
+        task->version.fetch_add(2, butil::memory_order_relaxed);
+        version = 2;
+    }
+    task->task_id = make_task_id(slot_id, version);
+    return task;
+}
+
+// Newly scheduled tasks of threads hashed to this inbox.
+struct BAIDU_CACHELINE_ALIGNMENT TimerThread::Inbox {
+    butil::atomic<Task*> head;
+    Inbox() : head(NULL) {}
+};
+
+// Hierarchical timing wheel with 1us ticks. Each level has 64 slots and a
+// slot in level l covers 64^l ticks. A task is put into the level of the
+// highest 6-bit group in which its run_time differs from _now, thus tasks
+// in lower levels are always due earlier. When _now reaches a slot in
+// level l > 0, tasks inside are moved into lower levels. Bitmaps of
+// non-empty slots locate the next slot to process without scanning.
+// Not thread-safe, only accessed by the timer thread.
+class TimerThread::TimingWheel {
+public:
+    explicit TimingWheel(int64_t now) : _now(now) {
+        memset(_bitmaps, 0, sizeof(_bitmaps));
+        memset(_slots, 0, sizeof(_slots));
+    }
+
+    // Put `task' into the wheel or append it to `due' if it's due.
+    void add(Task* task, std::vector<Task*>* due) {
+        if (task->run_time <= _now) {
+            due->push_back(task);
+            return;
+        }
+        const uint64_t diff = (uint64_t)task->run_time ^ (uint64_t)_now;
+        const int level = (63 - __builtin_clzll(diff)) / BITS;
+        const int slot = (task->run_time >> (level * BITS)) & (SLOTS - 1);
+        task->next = _slots[level][slot];
+        _slots[level][slot] = task;
+        _bitmaps[level] |= (1ULL << slot);
+    }
+
+    // Move time forward to `now' and append due tasks to `due'.
+    void advance(int64_t now, std::vector<Task*>* due) {
+        int level = 0;
+        for (int64_t t = next_time(&level); t <= now; t = next_time(&level)) {
+            _now = t;
+            const int slot = (t >> (level * BITS)) & (SLOTS - 1);
+            Task* p = _slots[level][slot];
+            _slots[level][slot] = NULL;
+            _bitmaps[level] &= ~(1ULL << slot);
+            while (p != NULL) {
+                Task* next_task = p->next;
+                // Unscheduled tasks are removed when they're cascaded.
+                if (!p->try_delete()) {
+                    add(p, due);
+                }
+                p = next_task;
+            }
+        }
+        if (now > _now) {
+            _now = now;
+        }
+    }
+
+    // Returns the time that the wheel needs to be advanced to, which may
+    // be earlier than the earliest task, max of int64_t if it's empty.
+    int64_t next_time() const {
+        int level = 0;
+        return next_time(&level);
+    }
+
+private:
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+    // 66 bits cover all possible run_time.
+    static const int LEVELS = 11;
+
+    int64_t next_time(int* level) const {
+        for (int l = 0; l < LEVELS; ++l) {
+            if (_bitmaps[l]) {
+                *level = l;
+                const int higher_shift = (l + 1) * BITS;
+                const uint64_t higher = (higher_shift >= 64) ? 0 :
+                    ((uint64_t)_now >> higher_shift) << higher_shift;
+                const uint64_t slot = __builtin_ctzll(_bitmaps[l]);
+                return higher | (slot << (l * BITS));
+            }
+        }
+        return std::numeric_limits<int64_t>::max();
+    }
+
+    int64_t _now;
+    uint64_t _bitmaps[LEVELS];
+    Task* _slots[LEVELS][SLOTS];
+};
+
 void* TimerThread::run_this(void* arg) {
     butil::PlatformThread::SetName("brpc_timer");
     static_cast<TimerThread*>(arg)->run();
@@ -129,13 +247,18 @@ TimerThread::TimerThread()
     , _buckets(NULL)
     , _nearest_run_time(std::numeric_limits<int64_t>::max())
     , _nsignals(0)
-    , _thread(0) {
+    , _thread(0)
+    , _inboxes(NULL)
+    , _wheel_nearest_run_time(std::numeric_limits<int64_t>::max())
+    , _wheel_nsignals(0) {
 }
 
 TimerThread::~TimerThread() {
     stop_and_join();
     delete [] _buckets;
     _buckets = NULL;
+    delete [] _inboxes;
+    _inboxes = NULL;
 }
 
 int TimerThread::start(const TimerThreadOptions* options_in) {
@@ -158,6 +281,13 @@ int TimerThread::start(const TimerThreadOptions* options_in) {
         LOG(ERROR) << "Fail to new _buckets";
         return ENOMEM;
     }        
+    if (_options.use_timing_wheel) {
+        _inboxes = new (std::nothrow) Inbox[_options.num_buckets];
+        if (NULL == _inboxes) {
+            LOG(ERROR) << "Fail to new _inboxes";
+            return ENOMEM;
+        }
+    }
     const int ret = pthread_create(&_thread, NULL, TimerThread::run_this, this);
     if (ret) {
         return ret;
@@ -185,23 +315,12 @@ TimerThread::Task* TimerThread::Bucket::consume_tasks() {
 TimerThread::Bucket::ScheduleResult
 TimerThread::Bucket::schedule(void (*fn)(void*), void* arg,
                               const timespec& abstime) {
-    butil::ResourceId<Task> slot_id;
-    Task* task = butil::get_resource<Task>(&slot_id);
+    Task* task = create_task(fn, arg, abstime);
     if (task == NULL) {
         ScheduleResult result = { INVALID_TASK_ID, false };
         return result;
     }
-    task->next = NULL;
-    task->fn = fn;
-    task->arg = arg;
-    task->run_time = butil::timespec_to_microseconds(abstime);
-    uint32_t version = task->version.load(butil::memory_order_relaxed);
-    if (version == 0) {  // skip 0.
-        task->version.fetch_add(2, butil::memory_order_relaxed);
-        version = 2;
-    }
-    const TaskId id = make_task_id(slot_id, version);
-    task->task_id = id;
+    const TaskId id = task->task_id;
     bool earlier = false;
     {
         BAIDU_SCOPED_LOCK(_mutex);
@@ -222,6 +341,9 @@ TimerThread::TaskId TimerThread::schedule(
         // Not add tasks when TimerThread is about to stop.
         return INVALID_TASK_ID;
     }
+    if (_inboxes) {
+        return schedule_to_wheel(fn, arg, abstime);
+    }
     // Hashing by pthread id is better for cache locality.
     const Bucket::ScheduleResult result = 
         _buckets[butil::fmix64(pthread_numeric_id()) % _options.num_buckets]
@@ -244,6 +366,36 @@ TimerThread::TaskId TimerThread::schedule(
     return result.task_id;
 }
 
+TimerThread::TaskId TimerThread::schedule_to_wheel(
+    void (*fn)(void*), void* arg, const timespec& abstime) {
+    Task* task = create_task(fn, arg, abstime);
+    if (task == NULL) {
+        return INVALID_TASK_ID;
+    }
+    // The task may be run and recycled once it's pushed.
+    const TaskId id = task->task_id;
+    const int64_t run_time = task->run_time;
+    // Hashing by pthread id is better for cache locality.
+    Inbox& inbox = _inboxes[butil::fmix64(pthread_numeric_id()) % _options.num_buckets];
+    Task* head = inbox.head.load(butil::memory_order_relaxed);
+    do {
+        task->next = head;
+    } while (!inbox.head.compare_exchange_weak(head, task));
+    // Pushing the task and checking _wheel_nearest_run_time are sequentially
+    // consistent with resetting _wheel_nearest_run_time and consuming inboxes
+    // in run_timing_wheel(), so that either the timer thread sees the task
+    // or we see the time that it's going to wait for.
+    int64_t nearest = _wheel_nearest_run_time.load();
+    while (run_time < nearest) {
+        if (_wheel_nearest_run_time.compare_exchange_weak(nearest, run_time)) {
+            _wheel_nsignals.fetch_add(1);
+            futex_wake_private(&_wheel_nsignals, 1);
+            break;
+        }
+    }
+    return id;
+}
+
 // Notice that we don't recycle the Task in this function, let TimerThread::run
 // do it. The side effect is that we may allocate many unscheduled tasks before
 // TimerThread wakes up. The number is approximately qps * timeout_s. Under the
@@ -340,6 +492,11 @@ void TimerThread::run() {
         ntriggered_second.expose_as(_options.bvar_prefix, "triggered_second");
         busy_seconds_second.expose_as(_options.bvar_prefix, "usage");
     }
+    if (_options.use_timing_wheel) {
+        run_timing_wheel(&nscheduled, &ntriggered, &busy_seconds);
+        BT_VLOG << "Ended TimerThread=" << pthread_self();
+        return;
+    }
     
     while (!_stop.load(butil::memory_order_relaxed)) {
         // Clear _nearest_run_time before consuming tasks from buckets.
@@ -436,6 +593,61 @@ void TimerThread::run() {
     BT_VLOG << "Ended TimerThread=" << pthread_self();
 }
 
+void TimerThread::run_timing_wheel(size_t* nscheduled, size_t* ntriggered,
+                                   double* busy_seconds) {
+    int64_t last_sleep_time = butil::gettimeofday_us();
+    TimingWheel wheel(last_sleep_time);
+    std::vector<Task*> due;
+    due.reserve(4096);
+
+    while (!_stop.load(butil::memory_order_relaxed)) {
+        // Clear _wheel_nearest_run_time before consuming inboxes, tasks
+        // scheduled after this point lower it if they're the earliest.
+        _wheel_nearest_run_time.store(std::numeric_limits<int64_t>::max());
+
+        for (size_t i = 0; i < _options.num_buckets; ++i) {
+            Task* p = _inboxes[i].head.exchange(NULL);
+            for (; p != NULL; ++*nscheduled) {
+                Task* next_task = p->next;
+                if (!p->try_delete()) {
+                    wheel.add(p, &due);
+                }
+                p = next_task;
+            }
+        }
+
+        wheel.advance(butil::gettimeofday_us(), &due);
+        for (size_t i = 0; i < due.size(); ++i) {
+            if (due[i]->run_and_delete()) {
+                ++*ntriggered;
+            }
+        }
+        due.clear();
+
+        const int64_t next_run_time = wheel.next_time();
+        const int expected_nsignals = _wheel_nsignals.load();
+        int64_t nearest = _wheel_nearest_run_time.load();
+        if (next_run_time > nearest ||
+            !_wheel_nearest_run_time.compare_exchange_strong(nearest, next_run_time)) {
+            // A task earlier than what we would wait for was scheduled.
+            continue;
+        }
+        timespec* ptimeout = NULL;
+        timespec next_timeout = { 0, 0 };
+        const int64_t now = butil::gettimeofday_us();
+        if (next_run_time != std::numeric_limits<int64_t>::max()) {
+            if (next_run_time <= now) {
+                continue;
+            }
+            next_timeout = butil::microseconds_to_timespec(next_run_time - now);
+            ptimeout = &next_timeout;
+        }
+        *busy_seconds += (now - last_sleep_time) / 1000000.0;
+        futex_wait_private(&_wheel_nsignals, expected_nsignals, ptimeout);
+        last_sleep_time = butil::gettimeofday_us();
+    }
+}
+
 void TimerThread::stop_and_join() {
     _stop.store(true, butil::memory_order_relaxed);
     if (_started) {
@@ -445,10 +657,12 @@ void TimerThread::stop_and_join() {
             _nearest_run_time = 0;
             ++_nsignals;
         }
+        _wheel_nsignals.fetch_add(1);
         if (pthread_self() != _thread) {
             // stop_and_join was not called from a running task.
             // wake up the timer thread in case it is sleeping.
             futex_wake_private(&_nsignals, 1);
+            futex_wake_private(&_wheel_nsignals, 1);
             pthread_join(_thread, NULL);
         }
     }
@@ -464,6 +678,7 @@ static void init_global_timer_thread() {
     }
     TimerThreadOptions options;
     options.bvar_prefix = "bthread_timer";
+    options.use_timing_wheel = FLAGS_bthread_timer_use_timing_wheel;
     const int rc = g_timer_thread->start(&options);
     if (rc != 0) {
         LOG(FATAL) << "Fail to start timer_thread, " << berror(rc);
@@ -43,6 +43,13 @@ struct TimerThreadOptions {
     // Default: ""
     std::string bvar_prefix;
 
+    // Keep tasks in a hierarchical timing wheel instead of a heap. Tasks
+    // are pushed into lock-free per-thread inboxes (hashed into num_buckets
+    // shards) and only the timer thread touches the wheel, so schedule()
+    // never locks unless the task is earlier than all others.
+    // Default: false
+    bool use_timing_wheel;
+
     // Constructed with default options.
     TimerThreadOptions();
 };
@@ -54,6 +61,8 @@ class TimerThread {
 public:
     struct Task;
     class Bucket;
+    class TimingWheel;
+    struct Inbox;
 
     typedef uint64_t TaskId;
     const static TaskId INVALID_TASK_ID;
@@ -90,6 +99,11 @@ private:
     void run();
     static void* run_this(void* arg);
 
+    TaskId schedule_to_wheel(void (*fn)(void*), void* arg,
+                             const timespec& abstime);
+    void run_timing_wheel(size_t* nscheduled, size_t* ntriggered,
+                          double* busy_seconds);
+
     bool _started;            // whether the timer thread was started successfully.
     butil::atomic<bool> _stop;
 
@@ -101,6 +115,11 @@ private:
     // it's 64-bit.
     int _nsignals;
     pthread_t _thread;       // all scheduled task will be run on this thread
+
+    // Fields used when _options.use_timing_wheel is true.
+    Inbox* _inboxes;         // newly scheduled tasks, consumed by timer thread
+    butil::atomic<int64_t> _wheel_nearest_run_time;
+    butil::atomic<int> _wheel_nsignals;
 };
 
 // Get the global TimerThread which never quits.
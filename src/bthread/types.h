@@ -53,6 +53,17 @@ static const bthread_attrflags_t BTHREAD_LOG_CONTEXT_SWITCH = 16;
 static const bthread_attrflags_t BTHREAD_NOSIGNAL = 32;
 static const bthread_attrflags_t BTHREAD_NEVER_QUIT = 64;
 static const bthread_attrflags_t BTHREAD_INHERIT_SPAN = 128;
+// Latency-critical bthreads, which are put into separate run queues that
+// workers run and steal before queues of other bthreads, whenever the
+// bthreads become ready.
+static const bthread_attrflags_t BTHREAD_HIGH_PRIORITY = 256;
+// Short bthreads which are unlikely to block, such as ones parsing a message
+// and writing the response. They run on a stack owned by the worker instead
+// of one from the stack pool, and consecutive ones run on the stack in turn
+// without switching contexts. If such a bthread blocks anyway, it's promoted
+// to an ordinary bthread by taking the stack away from the worker.
+// Only effective for bthreads with BTHREAD_STACKTYPE_NORMAL.
+static const bthread_attrflags_t BTHREAD_RUN_TO_COMPLETION = 512;
 
 // Key of thread-local data, created by bthread_key_create.
 typedef struct {
@@ -160,6 +171,18 @@ typedef struct {
     unsigned conflict_size;
 } bthread_list_t;
 
+// Time spent by a bthread since its creation, see bthread_get_time_stat().
+typedef struct {
+    bthread_t tid;
+    // Running on a worker.
+    int64_t on_cpu_ns;
+    // Ready to run but waiting in run queues.
+    int64_t runqueue_wait_ns;
+    // Suspended for butex, sleeping, IO etc.
+    int64_t blocked_ns;
+    int64_t nswitch;
+} bthread_time_stat_t;
+
 // TODO: bthread_contention_site_t should be put into butex.
 typedef struct {
     int64_t duration_ns;
@@ -537,6 +537,10 @@ int tcp_connect(const EndPoint& server, int* self_port, int connect_timeout_ms)
 }
 
 int tcp_listen(EndPoint point) {
+    return tcp_listen(point, false);
+}
+
+int tcp_listen(EndPoint point, bool reuse_port) {
     struct sockaddr_storage serv_addr;
     socklen_t serv_addr_size = 0;
     if (endpoint2sockaddr(point, &serv_addr, &serv_addr_size) != 0) {
@@ -560,7 +564,7 @@ int tcp_listen(EndPoint point) {
 #endif
     }
 
-    if (FLAGS_reuse_port) {
+    if (FLAGS_reuse_port || reuse_port) {
 #if defined(SO_REUSEPORT)
         const int on = 1;
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
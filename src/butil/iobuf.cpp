@@ -27,6 +27,7 @@
 #include <mesalink/openssl/err.h>
 #endif
 #include <sys/syscall.h>                   // syscall
+#include <sys/socket.h>                    // sendmsg
 #include <fcntl.h>                         // O_RDONLY
 #include <errno.h>                         // errno
 #include <limits.h>                        // CHAR_BIT
@@ -1148,6 +1149,41 @@ ssize_t IOBuf::pcut_multiple_into_file_descriptor(
     return nw;
 }
 
+ssize_t IOBuf::cut_multiple_into_socket(
+    int fd, IOBuf* const* pieces, size_t count, int flags, IOBuf* sent) {
+    if (BAIDU_UNLIKELY(count == 0)) {
+        return 0;
+    }
+    struct iovec vec[IOBUF_IOV_MAX];
+    size_t nvec = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const IOBuf* p = pieces[i];
+        const size_t nref = p->_ref_num();
+        for (size_t j = 0; j < nref && nvec < IOBUF_IOV_MAX; ++j, ++nvec) {
+            IOBuf::BlockRef const& r = p->_ref_at(j);
+            vec[nvec].iov_base = r.block->data + r.offset;
+            vec[nvec].iov_len = r.length;
+        }
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = nvec;
+    const ssize_t nw = ::sendmsg(fd, &msg, flags);
+    if (nw <= 0) {
+        return nw;
+    }
+    size_t ncut_all = nw;
+    for (size_t i = 0; i < count; ++i) {
+        ncut_all -= pieces[i]->cutn(sent, ncut_all);
+        if (ncut_all == 0) {
+            break;
+        }
+    }
+    return nw;
+}
+
 ssize_t IOBuf::cut_multiple_into_writer(
         IWriter* writer, IOBuf* const* pieces, size_t count) {
     if (BAIDU_UNLIKELY(count == 0)) {
@@ -1633,6 +1669,28 @@ void IOPortal::clear() {
     return_cached_blocks();
 }
 
+void IOPortal::set_block_size_class(BlockSizeClass size_class) {
+    if (size_class != _block_size_class) {
+        return_cached_blocks();
+        _block_size_class = size_class;
+    }
+}
+
+IOBuf::Block* IOPortal::acquire_block() {
+    if (_block_size_class == DEFAULT_BLOCK) {
+        return iobuf::acquire_tls_block();
+    }
+    return iobuf::create_block(block_size_of(_block_size_class));
+}
+
+void IOPortal::release_block(Block* b) {
+    if (_block_size_class == DEFAULT_BLOCK) {
+        iobuf::release_tls_block(b);
+    } else {
+        b->dec_ref();
+    }
+}
+
 const int MAX_APPEND_IOVEC = 64;
 
 ssize_t IOPortal::pappend_from_file_descriptor(
@@ -1645,7 +1703,7 @@ ssize_t IOPortal::pappend_from_file_descriptor(
     // Prepare at most MAX_APPEND_IOVEC blocks or space of blocks >= max_count
     do {
         if (p == NULL) {
-            p = iobuf::acquire_tls_block();
+            p = acquire_block();
             if (BAIDU_UNLIKELY(!p)) {
                 errno = ENOMEM;
                 return -1;
@@ -1697,6 +1755,55 @@ ssize_t IOPortal::pappend_from_file_descriptor(
     return nr;
 }
 
+ssize_t IOPortal::append_from_file_descriptor_pooled(int fd, size_t max_count) {
+    // Blocks cached by previous append_xxx() go back to the pool first.
+    return_cached_blocks();
+
+    iovec vec[MAX_APPEND_IOVEC];
+    Block* blocks[MAX_APPEND_IOVEC];
+    // Don't read into more blocks than the pool can hold, otherwise unfilled
+    // blocks would be freed right after reading and allocated again in the
+    // next reading. Callers read until EAGAIN anyway.
+    const int max_nvec = std::max(
+        1, std::min(MAX_APPEND_IOVEC, iobuf::max_blocks_per_thread()));
+    int nvec = 0;
+    size_t space = 0;
+    // Blocks returned from acquire_tls_block() are owned by us until being
+    // released below. Notice that no bthread switching happens in-between,
+    // thus they're always released to the pool of the same thread.
+    do {
+        Block* p = acquire_block();
+        if (BAIDU_UNLIKELY(!p)) {
+            for (int i = nvec - 1; i >= 0; --i) {
+                release_block(blocks[i]);
+            }
+            errno = ENOMEM;
+            return -1;
+        }
+        blocks[nvec] = p;
+        vec[nvec].iov_base = p->data + p->size;
+        vec[nvec].iov_len = std::min(p->left_space(), max_count - space);
+        space += vec[nvec].iov_len;
+        ++nvec;
+    } while (space < max_count && nvec < max_nvec);
+
+    const ssize_t nr = readv(fd, vec, nvec);
+    size_t total_len = (nr > 0 ? nr : 0);
+    for (int i = 0; i < nvec && total_len; ++i) {
+        const size_t len = std::min(total_len, vec[i].iov_len);
+        total_len -= len;
+        const IOBuf::BlockRef r = { blocks[i]->size, (uint32_t)len, blocks[i] };
+        _push_back_ref(r);
+        blocks[i]->size += len;
+    }
+    // Release in reverse order so that the first non-full block is at the
+    // head of the pool and continues to be filled by the next reading.
+    for (int i = nvec - 1; i >= 0; --i) {
+        release_block(blocks[i]);
+    }
+    return nr;
+}
+
 ssize_t IOPortal::append_from_reader(IReader* reader, size_t max_count) {
     iovec vec[MAX_APPEND_IOVEC];
     int nvec = 0;
@@ -1706,7 +1813,7 @@ ssize_t IOPortal::append_from_reader(IReader* reader, size_t max_count) {
     // Prepare at most MAX_APPEND_IOVEC blocks or space of blocks >= max_count
     do {
         if (p == NULL) {
-            p = iobuf::acquire_tls_block();
+            p = acquire_block();
             if (BAIDU_UNLIKELY(!p)) {
                 errno = ENOMEM;
                 return -1;
@@ -1758,7 +1865,7 @@ ssize_t IOPortal::append_from_SSL_channel(
     size_t nr = 0;
     do {
         if (!_block) {
-            _block = iobuf::acquire_tls_block();
+            _block = acquire_block();
             if (BAIDU_UNLIKELY(!_block)) {
                 errno = ENOMEM;
                 *ssl_error = SSL_ERROR_SYSCALL;
@@ -1799,7 +1906,15 @@ ssize_t IOPortal::append_from_SSL_channel(
 }
 
 void IOPortal::return_cached_blocks_impl(Block* b) {
-    iobuf::release_tls_block_chain(b);
+    if (_block_size_class == DEFAULT_BLOCK) {
+        iobuf::release_tls_block_chain(b);
+        return;
+    }
+    do {
+        Block* const saved_next = b->u.portal_next;
+        b->dec_ref();
+        b = saved_next;
+    } while (b);
 }
 
 IOBuf::Area IOReserveAlignedBuf::reserve(size_t count) {
@@ -2221,6 +2336,13 @@ IOBufAppender::IOBufAppender()
     , _zc_stream(&_buf) {
 }
 
+IOBufAppender::IOBufAppender(IOBuf::BlockSizeClass size_class)
+    : _data(NULL)
+    , _data_end(NULL)
+    , _zc_stream(&_buf, size_class == IOBuf::DEFAULT_BLOCK ? 0 :
+                 IOBuf::block_size_of(size_class)) {
+}
+
 size_t IOBufBytesIterator::append_and_forward(butil::IOBuf* buf, size_t n) {
     size_t nc = 0;
     while (nc < n && _bytes_left != 0) {
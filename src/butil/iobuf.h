@@ -68,6 +68,20 @@ public:
     static const size_t DEFAULT_BLOCK_SIZE = 8192;
     static const size_t INITIAL_CAP = 32; // must be power of 2
 
+    // Size classes of blocks that IOPortal and IOBufAppender can be asked
+    // to allocate. Block sizes include the header of Block.
+    enum BlockSizeClass {
+        SMALL_BLOCK,    // SMALL_BLOCK_SIZE, for lots of tiny messages.
+        DEFAULT_BLOCK,  // DEFAULT_BLOCK_SIZE, shared in TLS.
+        LARGE_BLOCK,    // LARGE_BLOCK_SIZE, for bulk data.
+    };
+    static const size_t SMALL_BLOCK_SIZE = 1024;
+    static const size_t LARGE_BLOCK_SIZE = 65536;
+    static size_t block_size_of(BlockSizeClass size_class) {
+        return size_class == SMALL_BLOCK ? SMALL_BLOCK_SIZE :
+            (size_class == LARGE_BLOCK ? LARGE_BLOCK_SIZE : DEFAULT_BLOCK_SIZE);
+    }
+
     struct Block;
 
     // can't directly use `struct iovec' here because we also need to access the
@@ -195,6 +209,14 @@ public:
     static ssize_t pcut_multiple_into_file_descriptor(
         int fd, off_t offset, IOBuf* const* pieces, size_t count);
 
+    // Cut `count' number of `pieces' into socket `fd' with sendmsg(2) and
+    // `flags' (e.g. MSG_ZEROCOPY). Instead of being released, references
+    // to the written bytes are moved into `sent' so that the underlying
+    // blocks stay alive as long as `sent' is not cleared.
+    // Returns bytes cut on success, -1 otherwise and errno is set.
+    static ssize_t cut_multiple_into_socket(
+        int fd, IOBuf* const* pieces, size_t count, int flags, IOBuf* sent);
+
     // Cut `count' number of `pieces' into SSL channel `ssl'.
     // Returns bytes cut on success, -1 otherwise and errno is set.
     static ssize_t cut_multiple_into_SSL_channel(
@@ -447,10 +469,16 @@ inline bool operator!=(const butil::IOBuf& b1, const butil::IOBuf& b2)
 // Typically used as the buffer to store bytes from sockets.
 class IOPortal : public IOBuf {
 public:
-    IOPortal() : _block(NULL) { }
-    IOPortal(const IOPortal& rhs) : IOBuf(rhs), _block(NULL) { } 
+    IOPortal() : _block(NULL), _block_size_class(DEFAULT_BLOCK) { }
+    IOPortal(const IOPortal& rhs)
+        : IOBuf(rhs), _block(NULL), _block_size_class(rhs._block_size_class) { }
     ~IOPortal();
     IOPortal& operator=(const IOPortal& rhs);
+
+    // Read into blocks of `size_class' rather than DEFAULT_BLOCK. Blocks of
+    // other classes are not shared with appending functions in TLS.
+    void set_block_size_class(BlockSizeClass size_class);
+    BlockSizeClass block_size_class() const { return _block_size_class; }
         
     // Read at most `max_count' bytes from the reader and append to self.
     ssize_t append_from_reader(IReader* reader, size_t max_count);
@@ -464,6 +492,16 @@ public:
     // If `offset' is negative, does exactly what append_from_file_descriptor does.
     ssize_t pappend_from_file_descriptor(int fd, off_t offset, size_t max_count);
 
+    // Read at most `max_count' bytes from file descriptor `fd' and append to
+    // self like append_from_file_descriptor(), but buffers are picked from
+    // the block pool of the calling thread at the time of reading and
+    // unfilled blocks are given back to the pool right after reading rather
+    // than being cached in this IOPortal. Thus memory held by this IOPortal
+    // is proportional to bytes actually read, and partially filled blocks
+    // are shared by all IOPortals reading in the same thread. Suitable for
+    // servers holding lots of connections which are mostly idle.
+    ssize_t append_from_file_descriptor_pooled(int fd, size_t max_count);
+
     // Read as many bytes as possible from SSL channel `ssl', and stop until `max_count'.
     // Returns total bytes read and the ssl error code will be filled into `ssl_error'
     ssize_t append_from_SSL_channel(struct ssl_st* ssl, int* ssl_error,
@@ -480,13 +518,18 @@ public:
     void return_cached_blocks();
 
 private:
-    static void return_cached_blocks_impl(Block*);
+    void return_cached_blocks_impl(Block*);
+    // Get a block of _block_size_class to read into.
+    Block* acquire_block();
+    // Give back a block got from acquire_block() if it's not full.
+    void release_block(Block*);
 
     // Cached blocks for appending. Notice that the blocks are released
     // until return_cached_blocks()/clear()/dtor() are called, rather than
     // released after each append_xxx(), which makes messages read from one
     // file descriptor more likely to share blocks and have less BlockRefs.
     Block* _block;
+    BlockSizeClass _block_size_class;
 };
 
 class IOReserveAlignedBuf : public IOBuf {
@@ -682,6 +725,8 @@ public:
 class IOBufAppender {
 public:
     IOBufAppender();
+    // Append into blocks of `size_class'.
+    explicit IOBufAppender(IOBuf::BlockSizeClass size_class);
     
     // Append `n' bytes starting from `data' to back side of the internal buffer
     // Costs 2/3 time of IOBuf.append for short data/strings on Intel(R) Xeon(R)
@@ -0,0 +1,187 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <limits>
+#include "butil/logging.h"
+#include "bvar/detail/histogram.h"
+
+namespace bvar {
+namespace detail {
+
+const int HistogramLayout::SUB_BUCKET_BITS;
+const int64_t HistogramLayout::SUB_BUCKET_COUNT;
+const int HistogramLayout::MAX_VALUE_BITS;
+const int64_t HistogramLayout::MAX_VALUE;
+const size_t HistogramLayout::NUM_BUCKETS;
+
+uint64_t HistogramBuckets::count() const {
+    uint64_t n = 0;
+    for (size_t i = 0; i < HistogramLayout::NUM_BUCKETS; ++i) {
+        n += counts[i];
+    }
+    return n;
+}
+
+int64_t HistogramBuckets::get_number(double ratio) const {
+    const uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    if (ratio <= 0) {
+        ratio = 0;
+    } else if (ratio > 1) {
+        ratio = 1;
+    }
+    const double rank = ratio * n;
+    uint64_t acc = 0;
+    for (size_t i = 0; i < HistogramLayout::NUM_BUCKETS; ++i) {
+        const uint64_t c = counts[i];
+        if (c == 0) {
+            continue;
+        }
+        if (acc + c >= rank) {
+            const int64_t lower = HistogramLayout::lower_of(i);
+            const int64_t upper = HistogramLayout::upper_of(i);
+            if (upper - lower <= 1) {
+                return upper;
+            }
+            const double frac = (rank - acc) / c;
+            return lower + (int64_t)(frac * (upper - lower) + 0.5);
+        }
+        acc += c;
+    }
+    return HistogramLayout::MAX_VALUE;
+}
+
+uint64_t HistogramBuckets::count_le(int64_t value) const {
+    const size_t last = HistogramLayout::index_of(value);
+    uint64_t n = 0;
+    for (size_t i = 0; i <= last; ++i) {
+        n += counts[i];
+    }
+    return n;
+}
+
+void HistogramBuckets::describe(std::ostream& os) const {
+    // Only non-empty buckets are printed, as "upper:count".
+    os << "{count=" << count() << " sum=" << sum << " buckets=[";
+    bool first = true;
+    for (size_t i = 0; i < HistogramLayout::NUM_BUCKETS; ++i) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        if (!first) {
+            os << ' ';
+        }
+        first = false;
+        os << HistogramLayout::upper_of(i) << ':' << counts[i];
+    }
+    os << "]}";
+}
+
+void Histogram::AddHistogramBuckets::operator()(
+    HistogramBuckets& b1, const HistogramBuckets& b2) const {
+    for (size_t i = 0; i < HistogramLayout::NUM_BUCKETS; ++i) {
+        b1.counts[i] += b2.counts[i];
+    }
+    b1.sum += b2.sum;
+}
+
+void Histogram::AddHistogramBuckets::operator()(
+    HistogramBuckets& b1, const ThreadLocalHistogramBuckets& b2) const {
+    for (size_t i = 0; i < HistogramLayout::NUM_BUCKETS; ++i) {
+        b1.counts[i] += b2.counts[i];
+    }
+    b1.sum += b2.sum;
+}
+
+void Histogram::MinusHistogramBuckets::operator()(
+    HistogramBuckets& b1, const HistogramBuckets& b2) const {
+    for (size_t i = 0; i < HistogramLayout::NUM_BUCKETS; ++i) {
+        b1.counts[i] -= b2.counts[i];
+    }
+    b1.sum -= b2.sum;
+}
+
+class AddToHistogram {
+public:
+    explicit AddToHistogram(int64_t value) : _value(value) {}
+
+    void operator()(GlobalValue<Histogram::combiner_type>& global_value,
+                    ThreadLocalHistogramBuckets& local_value) const {
+        const size_t index = HistogramLayout::index_of(_value);
+        uint16_t& c = local_value.counts[index];
+        if (c == std::numeric_limits<uint16_t>::max()) {
+            // Flush the bucket before overflowing. combine_agents() and
+            // reset_all_agents() read agents with the combiner locked, so
+            // moving the count while holding that lock is atomic to them.
+            // The count is read after locking since reset_all_agents() may
+            // clear it when the tls element is unlocked inside lock().
+            HistogramBuckets* g = global_value.lock();
+            g->counts[index] += c;
+            c = 0;
+            global_value.unlock();
+        }
+        ++c;
+        local_value.sum += _value;
+    }
+private:
+    int64_t _value;
+};
+
+Histogram::Histogram()
+    : _combiner(std::make_shared<combiner_type>()), _sampler(NULL) {}
+
+Histogram::~Histogram() {
+    // Have to destroy sampler first to avoid the race between destruction and
+    // sampler
+    if (_sampler != NULL) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+}
+
+Histogram::value_type Histogram::reset() {
+    return _combiner->reset_all_agents();
+}
+
+Histogram::value_type Histogram::get_value() const {
+    return _combiner->combine_agents();
+}
+
+Histogram& Histogram::operator<<(int64_t value) {
+    agent_type* agent = _combiner->get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        LOG(FATAL) << "Fail to create agent";
+        return *this;
+    }
+    if (value < 0) {
+        if (!_debug_name.empty()) {
+            LOG(WARNING) << "Input=" << value << " to `" << _debug_name
+                       << "' is negative, drop";
+        } else {
+            LOG(WARNING) << "Input=" << value << " to Histogram("
+                       << (void*)this << ") is negative, drop";
+        }
+        return *this;
+    }
+    agent->merge_global(AddToHistogram(value), _combiner);
+    return *this;
+}
+
+}  // namespace detail
+}  // namespace bvar
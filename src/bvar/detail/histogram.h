@@ -0,0 +1,182 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef  BVAR_DETAIL_HISTOGRAM_H
+#define  BVAR_DETAIL_HISTOGRAM_H
+
+#include <string.h>                     // memset
+#include <stdint.h>                     // uint64_t
+#include <ostream>                      // std::ostream
+#include <string>
+#include "butil/macros.h"
+#include "bvar/window.h"                // Window
+#include "bvar/detail/combiner.h"       // AgentCombiner
+#include "bvar/detail/sampler.h"        // ReducerSampler
+
+namespace bvar {
+namespace detail {
+
+// Log-linear buckets in the spirit of HdrHistogram: values in [0, 16] have
+// their own buckets, larger values are put into 16 linear sub-buckets of each
+// power-of-2 range, which bounds the relative error of a percentile to
+// 1/16. Values larger than 2^32 are clamped to 2^32.
+// A bucket covers (lower, upper], powers of 2 are always upper bounds of
+// buckets so that buckets can be merged into coarser ones exactly.
+struct HistogramLayout {
+    static const int SUB_BUCKET_BITS = 4;
+    static const int64_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int MAX_VALUE_BITS = 32;
+    static const int64_t MAX_VALUE = (int64_t)1 << MAX_VALUE_BITS;
+    static const size_t NUM_BUCKETS =
+        SUB_BUCKET_COUNT + 1 + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT;
+
+    static size_t index_of(int64_t value) {
+        if (value <= SUB_BUCKET_COUNT) {
+            return value < 0 ? 0 : (size_t)value;
+        }
+        if (value > MAX_VALUE) {
+            value = MAX_VALUE;
+        }
+        const uint64_t u = value - 1;
+        const int k = 63 - __builtin_clzll(u);
+        const size_t sub = (u >> (k - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1);
+        return SUB_BUCKET_COUNT + 1 + (k - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT + sub;
+    }
+
+    // Values in bucket `index' are in (lower_of(index), upper_of(index)].
+    static int64_t upper_of(size_t index) {
+        if (index <= (size_t)SUB_BUCKET_COUNT) {
+            return index;
+        }
+        const size_t i = index - SUB_BUCKET_COUNT - 1;
+        const int shift = i / SUB_BUCKET_COUNT;
+        return (SUB_BUCKET_COUNT + 1 + (int64_t)(i % SUB_BUCKET_COUNT)) << shift;
+    }
+    static int64_t lower_of(size_t index) {
+        if (index <= (size_t)SUB_BUCKET_COUNT) {
+            return index == 0 ? 0 : (int64_t)index - 1;
+        }
+        const size_t i = index - SUB_BUCKET_COUNT - 1;
+        const int shift = i / SUB_BUCKET_COUNT;
+        return (SUB_BUCKET_COUNT + (int64_t)(i % SUB_BUCKET_COUNT)) << shift;
+    }
+};
+
+// Counts of all buckets. Fixed-size and flat so that copying in samplers is
+// cheap and merging(or diffing) two of them is exact.
+struct HistogramBuckets {
+    uint64_t counts[HistogramLayout::NUM_BUCKETS];
+    int64_t sum;
+
+    HistogramBuckets() { memset(this, 0, sizeof(*this)); }
+
+    uint64_t count() const;
+
+    // Get the value at `ratio' (in [0, 1]) of the distribution by linear
+    // interpolation inside the bucket.
+    int64_t get_number(double ratio) const;
+
+    // Count of values not larger than `value', which must be a bucket bound
+    // (e.g. powers of 2) to be exact.
+    uint64_t count_le(int64_t value) const;
+
+    void describe(std::ostream& os) const;
+};
+
+// Buckets of each thread, counts are narrower and flushed into the global
+// buckets before overflowing, which halves the memory of thread-local agents
+// and keeps them in fewer cachelines.
+struct ThreadLocalHistogramBuckets {
+    uint16_t counts[HistogramLayout::NUM_BUCKETS];
+    int64_t sum;
+
+    ThreadLocalHistogramBuckets() { memset(this, 0, sizeof(*this)); }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const HistogramBuckets& b) {
+    b.describe(os);
+    return os;
+}
+
+// A reducer of latency-like values into log-linear buckets, as a cheaper and
+// exactly mergeable alternative to Percentile. The value is cumulative and
+// the operator can be inversed, so windows are computed by diffing the
+// latest and oldest samples without resetting.
+// NOTE: DON'T use it directly, use LatencyRecorder instead.
+class Histogram {
+public:
+    struct AddHistogramBuckets {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const;
+        void operator()(HistogramBuckets& b1,
+                        const ThreadLocalHistogramBuckets& b2) const;
+    };
+    struct MinusHistogramBuckets {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const;
+    };
+
+    typedef HistogramBuckets                                value_type;
+    typedef ReducerSampler<Histogram,
+                           HistogramBuckets,
+                           AddHistogramBuckets,
+                           MinusHistogramBuckets>           sampler_type;
+    typedef AgentCombiner <HistogramBuckets,
+                           ThreadLocalHistogramBuckets,
+                           AddHistogramBuckets>             combiner_type;
+    typedef combiner_type::self_shared_type                 shared_combiner_type;
+    typedef combiner_type::Agent                            agent_type;
+    Histogram();
+    ~Histogram();
+
+    AddHistogramBuckets op() const { return AddHistogramBuckets(); }
+    MinusHistogramBuckets inv_op() const { return MinusHistogramBuckets(); }
+
+    // The sampler for windows over histogram.
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+    value_type reset();
+
+    value_type get_value() const;
+
+    Histogram& operator<<(int64_t value);
+
+    bool valid() const { return _combiner != NULL && _combiner->valid(); }
+
+    // This name is useful for warning negative values in operator<<
+    void set_debug_name(const butil::StringPiece& name) {
+        _debug_name.assign(name.data(), name.size());
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Histogram);
+
+    shared_combiner_type _combiner;
+    sampler_type* _sampler;
+    std::string _debug_name;
+};
+
+typedef Window<Histogram, SERIES_IN_SECOND> HistogramWindow;
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  //BVAR_DETAIL_HISTOGRAM_H
@@ -17,7 +17,13 @@
 
 // Date: Tue Jul 28 18:14:40 CST 2015
 
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/reloadable_flags.h"
+#include "butil/synchronization/lock.h"
 #include "butil/threading/platform_thread.h"
 #include "butil/time.h"
 #include "butil/memory/singleton_on_pthread_once.h"
@@ -49,6 +55,19 @@ struct CombineSampler {
 // of child as well, no need to register in the child again.
 static bool registered_atfork = false;
 
+DEFINE_int32(bvar_sampler_thread_start_delay_us, 10000, "bvar sampler thread start delay us");
+
+// Max number of sampling threads.
+const int MAX_SAMPLER_THREADS = 32;
+
+static bool validate_sampler_thread_num(const char*, int32_t v);
+DEFINE_int32(bvar_sampler_thread_num, 1,
+             "Number of threads calling take_sample() of samplers, which are "
+             "distributed to the threads evenly. Each thread samples at a "
+             "different offset within the second. Can only be increased at "
+             "runtime and samplers created before are not moved");
+BUTIL_VALIDATE_GFLAG(bvar_sampler_thread_num, validate_sampler_thread_num);
+
 // Call take_sample() of all scheduled samplers.
 // This can be done with regular timer thread, but it's way too slow(global
 // contention + log(N) heap manipulations). We need it to be super fast so that
@@ -60,12 +79,18 @@ static bool registered_atfork = false;
 // list of Samplers. Waking through the list and call take_sample().
 // If a Sampler needs to be deleted, we just mark it as unused and the
 // deletion is taken place in the thread as well.
+// A SamplerCollector drives one shard of all samplers, see
+// SamplerCollectorGroup below.
 class SamplerCollector : public bvar::Reducer<Sampler*, CombineSampler> {
 public:
-    SamplerCollector()
-        : _created(false)
+    SamplerCollector(int index, const butil::atomic<int>* nshard)
+        : _index(index)
+        , _nshard(nshard)
+        , _created(false)
         , _stop(false)
-        , _cumulated_time_us(0) {
+        , _cumulated_time_us(0)
+        , _lag_us(0)
+        , _nsampler(0) {
         create_sampling_thread();
     }
     ~SamplerCollector() {
@@ -76,61 +101,185 @@ public:
         }
     }
 
-private:
-    // Support for fork:
-    // * The singleton can be null before forking, the child callback will not
-    //   be registered.
-    // * If the singleton is not null before forking, the child callback will
-    //   be registered and the sampling thread will be re-created.
-    // * A forked program can be forked again.
+    int64_t cumulated_time_us() const {
+        return _cumulated_time_us.load(butil::memory_order_relaxed);
+    }
+    int64_t lag_us() const {
+        return _lag_us.load(butil::memory_order_relaxed);
+    }
+    int64_t nsampler() const {
+        return _nsampler.load(butil::memory_order_relaxed);
+    }
 
-    static void child_callback_atfork() {
-        butil::get_leaky_singleton<SamplerCollector>()->after_forked_as_child();
+    void after_forked_as_child() {
+        _created = false;
+        create_sampling_thread();
     }
 
+private:
     void create_sampling_thread() {
         const int rc = pthread_create(&_tid, NULL, sampling_thread, this);
         if (rc != 0) {
             LOG(FATAL) << "Fail to create sampling_thread, " << berror(rc);
         } else {
             _created = true;
-            if (!registered_atfork) {
-                registered_atfork = true;
-                pthread_atfork(NULL, NULL, child_callback_atfork);
-            }
         }
     }
 
-    void after_forked_as_child() {
-        _created = false;
-        create_sampling_thread();
+    // Offset within the second that this collector samples at. Collectors
+    // are spread evenly so that they don't wake up and fight for CPU (and
+    // locks of samplers) at the same time.
+    int64_t offset_us() const {
+        const int n = _nshard->load(butil::memory_order_relaxed);
+        return n > 1 ? _index * 1000000L / n : 0;
     }
 
     void run();
 
     static void* sampling_thread(void* arg) {
-        butil::PlatformThread::SetName("bvar_sampler");
-        static_cast<SamplerCollector*>(arg)->run();
+        SamplerCollector* c = static_cast<SamplerCollector*>(arg);
+        if (c->_index == 0) {
+            butil::PlatformThread::SetName("bvar_sampler");
+        } else {
+            char name[16];
+            snprintf(name, sizeof(name), "bvar_sampler_%d", c->_index);
+            butil::PlatformThread::SetName(name);
+        }
+        c->run();
         return NULL;
     }
 
-    static double get_cumulated_time(void* arg) {
-        return static_cast<SamplerCollector*>(arg)->_cumulated_time_us / 1000.0 / 1000.0;
-    }
-
 private:
+    int _index;
+    const butil::atomic<int>* _nshard;
     bool _created;
     bool _stop;
-    int64_t _cumulated_time_us;
+    butil::atomic<int64_t> _cumulated_time_us;
+    // Time between the moment that the last pass was scheduled to start and
+    // the moment it ended, namely the max staleness of samples in the pass.
+    butil::atomic<int64_t> _lag_us;
+    butil::atomic<int64_t> _nsampler;
     pthread_t _tid;
 };
 
+// Samplers are scheduled to collectors in round-robin.
+class SamplerCollectorGroup {
+public:
+    SamplerCollectorGroup() : _nshard(0), _next(0) {
+        memset(_shards, 0, sizeof(_shards));
+        grow(FLAGS_bvar_sampler_thread_num);
+        if (!registered_atfork) {
+            registered_atfork = true;
+            pthread_atfork(NULL, NULL, child_callback_atfork);
+        }
+    }
+
+    void schedule(Sampler* s) {
+        const int n = _nshard.load(butil::memory_order_acquire);
+        const uint32_t i = _next.fetch_add(1, butil::memory_order_relaxed);
+        *_shards[i % n] << s;
+    }
+
+    // Create collectors until there're `n'.
+    void grow(int n) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        n = std::min(n, MAX_SAMPLER_THREADS);
+        for (int i = _nshard.load(butil::memory_order_relaxed); i < n; ++i) {
+            _shards[i] = new SamplerCollector(i, &_nshard);
+            _nshard.store(i + 1, butil::memory_order_release);
+        }
+    }
+
+    int nshard() const { return _nshard.load(butil::memory_order_acquire); }
+    SamplerCollector* shard(int i) const { return _shards[i]; }
+
+private:
+    // Support for fork:
+    // * The singleton can be null before forking, the child callback will not
+    //   be registered.
+    // * If the singleton is not null before forking, the child callback will
+    //   be registered and the sampling threads will be re-created.
+    // * A forked program can be forked again.
+    static void child_callback_atfork() {
+        SamplerCollectorGroup* g =
+            butil::get_leaky_singleton<SamplerCollectorGroup>();
+        for (int i = 0; i < g->nshard(); ++i) {
+            g->_shards[i]->after_forked_as_child();
+        }
+    }
+
+    butil::Mutex _mutex;
+    butil::atomic<int> _nshard;
+    butil::atomic<uint32_t> _next;
+    SamplerCollector* _shards[MAX_SAMPLER_THREADS];
+};
+
+static bool validate_sampler_thread_num(const char*, int32_t v) {
+    if (v <= 0 || v > MAX_SAMPLER_THREADS) {
+        return false;
+    }
+    // Collectors are created along with the group if it's not created yet.
+    SamplerCollectorGroup* g =
+        butil::has_leaky_singleton<SamplerCollectorGroup>();
+    if (g != NULL) {
+        // Collectors can't be removed, reject decreasing so that the flag
+        // always shows the number of sampling threads.
+        if (v < g->nshard()) {
+            return false;
+        }
+        g->grow(v);
+    }
+    return true;
+}
+
 #ifndef UNIT_TEST
+static double get_cumulated_time(void*) {
+    SamplerCollectorGroup* g =
+        butil::get_leaky_singleton<SamplerCollectorGroup>();
+    int64_t total = 0;
+    for (int i = 0; i < g->nshard(); ++i) {
+        total += g->shard(i)->cumulated_time_us();
+    }
+    return total / 1000.0 / 1000.0;
+}
+
+static int64_t get_max_lag(void*) {
+    SamplerCollectorGroup* g =
+        butil::get_leaky_singleton<SamplerCollectorGroup>();
+    int64_t max_lag = 0;
+    for (int i = 0; i < g->nshard(); ++i) {
+        max_lag = std::max(max_lag, g->shard(i)->lag_us());
+    }
+    return max_lag;
+}
+
+static int64_t get_sampler_count(void*) {
+    SamplerCollectorGroup* g =
+        butil::get_leaky_singleton<SamplerCollectorGroup>();
+    int64_t n = 0;
+    for (int i = 0; i < g->nshard(); ++i) {
+        n += g->shard(i)->nsampler();
+    }
+    return n;
+}
+
+static pthread_once_t s_create_bvars_once = PTHREAD_ONCE_INIT;
 static PassiveStatus<double>* s_cumulated_time_bvar = NULL;
 static bvar::PerSecond<bvar::PassiveStatus<double> >* s_sampling_thread_usage_bvar = NULL;
-#endif
+static PassiveStatus<int64_t>* s_sampling_lag_bvar = NULL;
+static PassiveStatus<int64_t>* s_sampler_count_bvar = NULL;
 
-DEFINE_int32(bvar_sampler_thread_start_delay_us, 10000, "bvar sampler thread start delay us");
+static void create_sampler_bvars() {
+    s_cumulated_time_bvar = new PassiveStatus<double>(get_cumulated_time, NULL);
+    s_sampling_thread_usage_bvar =
+        new bvar::PerSecond<bvar::PassiveStatus<double> >(
+            "bvar_sampler_collector_usage", s_cumulated_time_bvar, 10);
+    s_sampling_lag_bvar = new PassiveStatus<int64_t>(
+        "bvar_sampler_collector_lag_us", get_max_lag, NULL);
+    s_sampler_count_bvar = new PassiveStatus<int64_t>(
+        "bvar_sampler_collector_sampler_count", get_sampler_count, NULL);
+}
+#endif
 
 void SamplerCollector::run() {
     ::usleep(FLAGS_bvar_sampler_thread_start_delay_us);
@@ -141,25 +290,20 @@ void SamplerCollector::run() {
     //   may be abandoned at any time after forking.
     // * They can't created inside the constructor of SamplerCollector as well,
     //   which results in deadlock.
-    if (s_cumulated_time_bvar == NULL) {
-        s_cumulated_time_bvar =
-            new PassiveStatus<double>(get_cumulated_time, this);
-    }
-    if (s_sampling_thread_usage_bvar == NULL) {
-        s_sampling_thread_usage_bvar =
-            new bvar::PerSecond<bvar::PassiveStatus<double> >(
-                    "bvar_sampler_collector_usage", s_cumulated_time_bvar, 10);
-    }
+    pthread_once(&s_create_bvars_once, create_sampler_bvars);
 #endif
 
     butil::LinkNode<Sampler> root;
-    int consecutive_nosleep = 0;
+    int consecutive_busy = 0;
+    // When current pass should start, 0 for the first pass.
+    int64_t expected_us = 0;
     while (!_stop) {
-        int64_t abstime = butil::gettimeofday_us();
+        const int64_t start_us = butil::gettimeofday_us();
         Sampler* s = this->reset();
         if (s) {
             s->InsertBeforeAsList(&root);
         }
+        int64_t nsampler = 0;
         for (butil::LinkNode<Sampler>* p = root.next(); p != &root;) {
             // We may remove p from the list, save next first.
             butil::LinkNode<Sampler>* saved_next = p->next();
@@ -172,26 +316,34 @@ void SamplerCollector::run() {
             } else {
                 s->take_sample();
                 s->_mutex.unlock();
+                ++nsampler;
             }
             p = saved_next;
         }
-        bool slept = false;
         int64_t now = butil::gettimeofday_us();
-        _cumulated_time_us += now - abstime;
-        abstime += 1000000L;
-        while (abstime > now) {
-            ::usleep(abstime - now);
-            slept = true;
-            now = butil::gettimeofday_us();
-        }
-        if (slept) {
-            consecutive_nosleep = 0;
-        } else {            
-            if (++consecutive_nosleep >= WARN_NOSLEEP_THRESHOLD) {
-                consecutive_nosleep = 0;
+        _cumulated_time_us.fetch_add(now - start_us, butil::memory_order_relaxed);
+        _nsampler.store(nsampler, butil::memory_order_relaxed);
+        _lag_us.store(now - (expected_us ? expected_us : start_us),
+                      butil::memory_order_relaxed);
+        // The pass is busy if it did not end before the next one should start,
+        // in which case the next one is skipped.
+        if (expected_us && now >= expected_us + 1000000L) {
+            if (++consecutive_busy >= WARN_NOSLEEP_THRESHOLD) {
+                consecutive_busy = 0;
                 LOG(WARNING) << "bvar is busy at sampling for "
                              << WARN_NOSLEEP_THRESHOLD << " seconds!";
             }
+        } else {
+            consecutive_busy = 0;
+        }
+        // Passes are aligned to the offset of this collector within the
+        // second, rather than to the end of last pass, so that collectors
+        // keep staggered.
+        const int64_t offset = offset_us();
+        expected_us = (now - offset) / 1000000L * 1000000L + 1000000L + offset;
+        while (expected_us > now && !_stop) {
+            ::usleep(expected_us - now);
+            now = butil::gettimeofday_us();
         }
     }
 }
@@ -206,7 +358,7 @@ void Sampler::schedule() {
     // since the SamplerCollector is initialized before the program starts
     // flags will not take effect if used in the SamplerCollector constructor
     if (FLAGS_bvar_enable_sampling) {
-        *butil::get_leaky_singleton<SamplerCollector>() << this;
+        butil::get_leaky_singleton<SamplerCollectorGroup>()->schedule(this);
     }
 }
 
@@ -39,11 +39,16 @@ BUTIL_VALIDATE_GFLAG(bvar_latency_p2, valid_percentile);
 DEFINE_int32(bvar_latency_p3, 99, "Third latency percentile");
 BUTIL_VALIDATE_GFLAG(bvar_latency_p3, valid_percentile);
 
+DEFINE_bool(bvar_latency_recorder_use_histogram, false,
+            "Compute percentiles of LatencyRecorders created afterwards from "
+            "log-linear histograms which use less memory, merge exactly and are "
+            "exported as native prometheus histograms");
+
 namespace detail {
 
 typedef PercentileSamples<1022> CombinedPercentileSamples;
 
-CDF::CDF(PercentileWindow* w) : _w(w) {}
+CDF::CDF(PercentileWindow* w, HistogramWindow* hw) : _w(w), _hw(hw) {}
 
 CDF::~CDF() {
     hide();
@@ -53,31 +58,38 @@ void CDF::describe(std::ostream& os, bool) const {
     os << "\"click to view\"";
 }
 
+static void get_numbers(PercentileWindow* w, HistogramWindow* hw,
+                        const double* ratios, int64_t* values, size_t n);
+
 int CDF::describe_series(
     std::ostream& os, const SeriesOptions& options) const {
-    if (_w == NULL) {
+    if (_w == NULL && _hw == NULL) {
         return 1;
     }
     if (options.test_only) {
         return 0;
     }
-    std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
-    std::vector<GlobalPercentileSamples> buckets;
-    _w->get_samples(&buckets);
-    for (size_t i = 0; i < buckets.size(); ++i) {
-        cb->combine_of(buckets.begin(), buckets.end());
-    }
     std::pair<int, int> values[20];
+    double ratios[arraysize(values)];
+    int64_t numbers[arraysize(values)];
     size_t n = 0;
     for (int i = 1; i < 10; ++i) {
-        values[n++] = std::make_pair(i*10, cb->get_number(i * 0.1));
+        values[n].first = i * 10;
+        ratios[n++] = i * 0.1;
     }
     for (int i = 91; i < 100; ++i) {
-        values[n++] = std::make_pair(i, cb->get_number(i * 0.01));
+        values[n].first = i;
+        ratios[n++] = i * 0.01;
     }
-    values[n++] = std::make_pair(100, cb->get_number(0.999));
-    values[n++] = std::make_pair(101, cb->get_number(0.9999));
+    values[n].first = 100;
+    ratios[n++] = 0.999;
+    values[n].first = 101;
+    ratios[n++] = 0.9999;
     CHECK_EQ(n, arraysize(values));
+    get_numbers(_w, _hw, ratios, numbers, n);
+    for (size_t i = 0; i < n; ++i) {
+        values[i].second = numbers[i];
+    }
     os << "{\"label\":\"cdf\",\"data\":[";
     for (size_t i = 0; i < n; ++i) {
         if (i) {
@@ -89,6 +101,23 @@ int CDF::describe_series(
     return 0;
 }
 
+void HistogramBucketsStatus::describe(std::ostream& os, bool) const {
+    const HistogramBuckets b = _h->get_value();
+    os << "{\"buckets\":[";
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (int64_t le = 1; le <= HistogramLayout::MAX_VALUE; le *= 2) {
+        for (; i <= HistogramLayout::index_of(le); ++i) {
+            acc += b.counts[i];
+        }
+        if (le != 1) {
+            os << ',';
+        }
+        os << '[' << le << ',' << acc << ']';
+    }
+    os << "],\"sum\":" << b.sum << ",\"count\":" << acc << '}';
+}
+
 // Return random int value with expectation = `dval'
 static int64_t double_to_random_int(double dval) {
     int64_t ival = static_cast<int64_t>(dval);
@@ -121,6 +150,22 @@ static CombinedPercentileSamples* combine(PercentileWindow* w) {
     return cb;
 }
 
+static void get_numbers(PercentileWindow* w, HistogramWindow* hw,
+                        const double* ratios, int64_t* values, size_t n) {
+    if (hw != NULL) {
+        // Diff of two cumulative samples, no merging is needed.
+        const HistogramBuckets b = hw->get_value();
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = b.get_number(ratios[i]);
+        }
+        return;
+    }
+    std::unique_ptr<CombinedPercentileSamples> cb(combine(w));
+    for (size_t i = 0; i < n; ++i) {
+        values[i] = cb->get_number(ratios[i]);
+    }
+}
+
 template <int64_t numerator, int64_t denominator>
 static int64_t get_percetile(void* arg) {
     return ((LatencyRecorder*)arg)->latency_percentile(
@@ -141,41 +186,67 @@ static int64_t get_p3(void* arg) {
 }
 
 static Vector<int64_t, 4> get_latencies(void *arg) {
-    std::unique_ptr<CombinedPercentileSamples> cb(
-        combine((PercentileWindow*)arg));
-    // NOTE: We don't show 99.99% since it's often significantly larger than
-    // other values and make other curves on the plotted graph small and
-    // hard to read.
-    Vector<int64_t, 4> result;
-    result[0] = cb->get_number(FLAGS_bvar_latency_p1 / 100.0);
-    result[1] = cb->get_number(FLAGS_bvar_latency_p2 / 100.0);
-    result[2] = cb->get_number(FLAGS_bvar_latency_p3 / 100.0);
-    result[3] = cb->get_number(0.999);
-    return result;
+    return static_cast<LatencyRecorder*>(arg)->latency_percentiles();
+}
+
+void LatencyRecorderBase::get_latency_percentiles(
+    const double* ratios, int64_t* values, size_t n) const {
+    get_numbers(_latency_percentile_window.get(),
+                _latency_histogram_window.get(), ratios, values, n);
+}
+
+static Histogram* new_histogram_if_needed() {
+    if (!FLAGS_bvar_latency_recorder_use_histogram) {
+        return NULL;
+    }
+    return new Histogram;
 }
 
 LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
     : _max_latency(0)
+    , _latency_histogram(new_histogram_if_needed())
+    , _latency_percentile(_latency_histogram != NULL ? NULL : new Percentile)
     , _latency_window(&_latency, window_size)
     , _max_latency_window(&_max_latency, window_size)
     , _count(get_recorder_count, &_latency)
     , _qps(get_window_recorder_qps, &_latency_window)
-    , _latency_percentile_window(&_latency_percentile, window_size)
+    , _latency_percentile_window(_latency_percentile == NULL ? NULL :
+          new PercentileWindow(_latency_percentile.get(), window_size))
     , _latency_p1(get_p1, this)
     , _latency_p2(get_p2, this)
     , _latency_p3(get_p3, this)
     , _latency_999(get_percetile<999, 1000>, this)
     , _latency_9999(get_percetile<9999, 10000>, this)
-    , _latency_cdf(&_latency_percentile_window)
-    , _latency_percentiles(get_latencies, &_latency_percentile_window)
+    , _latency_histogram_window(_latency_histogram == NULL ? NULL :
+          new HistogramWindow(_latency_histogram.get(), window_size))
+    , _latency_histogram_buckets(_latency_histogram == NULL ? NULL :
+          new HistogramBucketsStatus(_latency_histogram.get()))
+    , _latency_cdf(_latency_percentile_window.get(),
+                   _latency_histogram_window.get())
+    , _latency_percentiles(get_latencies, this)
 {}
 
 }  // namespace detail
 
 Vector<int64_t, 4> LatencyRecorder::latency_percentiles() const {
-    // const_cast here is just to adapt parameter type and safe.
-    return detail::get_latencies(
-        const_cast<detail::PercentileWindow*>(&_latency_percentile_window));
+    // NOTE: We don't show 99.99% since it's often significantly larger than
+    // other values and make other curves on the plotted graph small and
+    // hard to read.
+    const double ratios[4] = { FLAGS_bvar_latency_p1 / 100.0,
+                               FLAGS_bvar_latency_p2 / 100.0,
+                               FLAGS_bvar_latency_p3 / 100.0, 0.999 };
+    int64_t values[4];
+    get_latency_percentiles(ratios, values, 4);
+    Vector<int64_t, 4> result;
+    for (size_t i = 0; i < 4; ++i) {
+        result[i] = values[i];
+    }
+    return result;
+}
+
+const std::string& LatencyRecorder::latency_histogram_name() const {
+    static const std::string empty;
+    return _latency_histogram_buckets ? _latency_histogram_buckets->name() : empty;
 }
 
 int64_t LatencyRecorder::qps(time_t window_size) const {
@@ -214,7 +285,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 
     // set debug names for printing helpful error log.
     _latency.set_debug_name(prefix);
-    _latency_percentile.set_debug_name(prefix);
+    if (_latency_histogram) {
+        _latency_histogram->set_debug_name(prefix);
+    } else {
+        _latency_percentile->set_debug_name(prefix);
+    }
 
     if (_latency_window.expose_as(prefix, "latency") != 0) {
         return -1;
@@ -253,6 +328,10 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
     if (_latency_percentiles.expose_as(prefix, "latency_percentiles", DISPLAY_ON_HTML) != 0) {
         return -1;
     }
+    if (_latency_histogram_buckets &&
+        _latency_histogram_buckets->expose_as(prefix, "latency_histogram") != 0) {
+        return -1;
+    }
     snprintf(namebuf, sizeof(namebuf), "%d%%,%d%%,%d%%,99.9%%",
              (int)FLAGS_bvar_latency_p1, (int)FLAGS_bvar_latency_p2,
              (int)FLAGS_bvar_latency_p3);
@@ -261,9 +340,9 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 }
 
 int64_t LatencyRecorder::latency_percentile(double ratio) const {
-    std::unique_ptr<detail::CombinedPercentileSamples> cb(
-        combine((detail::PercentileWindow*)&_latency_percentile_window));
-    return cb->get_number(ratio);
+    int64_t value = 0;
+    get_latency_percentiles(&ratio, &value, 1);
+    return value;
 }
 
 void LatencyRecorder::hide() {
@@ -278,6 +357,9 @@ void LatencyRecorder::hide() {
     _latency_9999.hide();
     _latency_cdf.hide();
     _latency_percentiles.hide();
+    if (_latency_histogram_buckets) {
+        _latency_histogram_buckets->hide();
+    }
 }
 
 DEFINE_uint64(latency_scale_factor, 1, "latency scale factor, used by method status, etc., latency_us = latency * latency_scale_factor");
@@ -286,7 +368,11 @@ LatencyRecorder& LatencyRecorder::operator<<(int64_t latency) {
     latency = latency / FLAGS_latency_scale_factor;
     _latency << latency;
     _max_latency << latency;
-    _latency_percentile << latency;
+    if (_latency_histogram) {
+        *_latency_histogram << latency;
+    } else {
+        *_latency_percentile << latency;
+    }
     return *this;
 }
 
@@ -20,10 +20,12 @@
 #ifndef  BVAR_LATENCY_RECORDER_H
 #define  BVAR_LATENCY_RECORDER_H
 
+#include <memory>
 #include "bvar/recorder.h"
 #include "bvar/reducer.h"
 #include "bvar/passive_status.h"
 #include "bvar/detail/percentile.h"
+#include "bvar/detail/histogram.h"
 
 namespace bvar {
 namespace detail {
@@ -37,12 +39,27 @@ typedef Window<Percentile, SERIES_IN_SECOND> PercentileWindow;
 
 class CDF : public Variable {
 public:
-    explicit CDF(PercentileWindow* w);
+    // Values are from `hw' if it's not NULL, from `w' otherwise.
+    explicit CDF(PercentileWindow* w, HistogramWindow* hw = NULL);
     ~CDF();
     void describe(std::ostream& os, bool quote_string) const override;
     int describe_series(std::ostream& os, const SeriesOptions& options) const override;
 private:
     PercentileWindow* _w; 
+    HistogramWindow* _hw;
+};
+
+// Cumulative counts of latencies not larger than powers of 2, plus sum and
+// count of all latencies, in the form of:
+//   {"buckets":[[1,c1],[2,c2],[4,c4],...],"sum":S,"count":C}
+// Prometheus service exports it as a native histogram.
+class HistogramBucketsStatus : public Variable {
+public:
+    explicit HistogramBucketsStatus(Histogram* h) : _h(h) {}
+    ~HistogramBucketsStatus() { hide(); }
+    void describe(std::ostream& os, bool quote_string) const override;
+private:
+    Histogram* _h;
 };
 
 // For mimic constructor inheritance.
@@ -53,20 +70,31 @@ public:
 protected:
     IntRecorder _latency;
     Maxer<int64_t> _max_latency;
-    Percentile _latency_percentile;
+    // Not NULL iff -bvar_latency_recorder_use_histogram was on when this
+    // recorder was created, in which case percentiles are computed from
+    // log-linear buckets and _latency_percentile is not created.
+    std::unique_ptr<Histogram> _latency_histogram;
+    std::unique_ptr<Percentile> _latency_percentile;
 
     RecorderWindow _latency_window;
     MaxWindow _max_latency_window;
     PassiveStatus<int64_t> _count;
     PassiveStatus<int64_t> _qps;
-    PercentileWindow _latency_percentile_window;
+    std::unique_ptr<PercentileWindow> _latency_percentile_window;
     PassiveStatus<int64_t> _latency_p1;
     PassiveStatus<int64_t> _latency_p2;
     PassiveStatus<int64_t> _latency_p3;
     PassiveStatus<int64_t> _latency_999;  // 99.9%
     PassiveStatus<int64_t> _latency_9999; // 99.99%
+    std::unique_ptr<HistogramWindow> _latency_histogram_window;
+    std::unique_ptr<HistogramBucketsStatus> _latency_histogram_buckets;
     CDF _latency_cdf;
     PassiveStatus<Vector<int64_t, 4> > _latency_percentiles;
+
+    // Fill `values' with `ratios'-ile latencies in recent window_size-to-ctor
+    // seconds.
+    void get_latency_percentiles(const double* ratios, int64_t* values,
+                                 size_t n) const;
 };
 } // namespace detail
 
@@ -111,6 +139,8 @@ public:
     //                                    // foo_bar_read_max_latency
     //                                    // foo_bar_read_count
     //                                    // foo_bar_read_qps
+    // foo_bar_write_latency_histogram is exposed as well when the recorder
+    // was created with -bvar_latency_recorder_use_histogram on.
     int expose(const butil::StringPiece& prefix) {
         return expose(butil::StringPiece(), prefix);
     }
@@ -155,6 +185,8 @@ public:
     { return _max_latency_window.name(); }
     const std::string& count_name() const { return _count.name(); }
     const std::string& qps_name() const { return _qps.name(); }
+    // Empty when histogram is not used.
+    const std::string& latency_histogram_name() const;
 };
 
 std::ostream& operator<<(std::ostream& os, const LatencyRecorder&);
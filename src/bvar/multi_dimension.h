@@ -20,15 +20,51 @@
 #ifndef BVAR_MULTI_DIMENSION_H
 #define BVAR_MULTI_DIMENSION_H
 
+#include <algorithm>                                 // std::equal
+#include <unordered_map>
+#include <vector>
 #include "butil/logging.h"                           // LOG
 #include "butil/macros.h"                            // BAIDU_CASSERT
 #include "butil/scoped_lock.h"                       // BAIDU_SCOPE_LOCK
 #include "butil/containers/doubly_buffered_data.h"   // DBD
 #include "butil/containers/flat_map.h"               // butil::FlatMap
+#include "butil/atomicops.h"                         // butil::atomic
+#include "butil/synchronization/lock.h"              // butil::Mutex
 #include "bvar/mvariable.h"
 
 namespace bvar {
 
+// Label values of a MultiDimension with precomputed hash. Build it once and
+// pass it to MultiDimension::get_stats()/get_handle() to avoid building a
+// std::list and hashing all values on each call.
+class LabelsKey {
+public:
+    LabelsKey() : _hash(0) {}
+    explicit LabelsKey(const std::list<std::string>& values)
+        : _values(values.begin(), values.end()) { compute_hash(); }
+    explicit LabelsKey(const std::vector<std::string>& values)
+        : _values(values) { compute_hash(); }
+
+    // Same as MultiDimension::KeyHash of the std::list
+    size_t hash() const { return _hash; }
+    size_t size() const { return _values.size(); }
+    const std::vector<std::string>& values() const { return _values; }
+    std::list<std::string> to_list() const {
+        return std::list<std::string>(_values.begin(), _values.end());
+    }
+
+private:
+    void compute_hash() {
+        _hash = 0;
+        for (auto& v : _values) {
+            _hash += std::hash<std::string>()(v);
+        }
+    }
+
+    std::vector<std::string> _values;
+    size_t _hash;
+};
+
 template <typename  T>
 class MultiDimension : public MVariable {
 public:
@@ -51,10 +87,23 @@ public:
             }
             return hash_value;
         }
+        size_t operator() (const LabelsKey& key) const {
+            return key.hash();
+        }
+    };
+
+    struct KeyEqualTo {
+        bool operator() (const key_type& k1, const key_type& k2) const {
+            return k1 == k2;
+        }
+        bool operator() (const key_type& k1, const LabelsKey& k2) const {
+            return k1.size() == k2.size() &&
+                std::equal(k1.begin(), k1.end(), k2.values().begin());
+        }
     };
     
     typedef value_ptr_type op_value_type;
-    typedef typename butil::FlatMap<key_type, op_value_type, KeyHash> MetricMap;
+    typedef typename butil::FlatMap<key_type, op_value_type, KeyHash, KeyEqualTo> MetricMap;
 
     typedef typename MetricMap::const_iterator MetricMapConstIterator;
     typedef typename butil::DoublyBufferedData<MetricMap> MetricMapDBD;
@@ -82,6 +131,51 @@ public:
     T* get_stats(const key_type& labels_value) {
         return get_stats_impl(labels_value, READ_OR_INSERT);
     }
+    T* get_stats(const LabelsKey& labels_value);
+
+    // A label tuple resolved once. get() returns the bvar without any lookup
+    // or locking until a stat is deleted from the MultiDimension, after which
+    // the tuple is resolved again on next get().
+    // Not thread-safe, each thread should have its own handle. Same as
+    // pointers returned by get_stats(), the bvar must not be used while it's
+    // being deleted by delete_stats() or clear_stats().
+    // Example:
+    //   thread_local auto h = madder.get_handle({"tenant1", "Echo"});
+    //   *h.get() << 1;
+    class Handle {
+    public:
+        Handle() : _md(NULL), _stats(NULL), _version(0) {}
+
+        // Return real bvar pointer on success, NULL otherwise.
+        T* get() {
+            if (_md == NULL) {
+                return NULL;
+            }
+            const uint64_t version = _md->_version.load(butil::memory_order_acquire);
+            if (_stats == NULL || version != _version) {
+                _stats = _md->get_stats(_key);
+                _version = version;
+            }
+            return _stats;
+        }
+
+    private:
+    friend class MultiDimension;
+        Handle(MultiDimension* md, const LabelsKey& key)
+            : _md(md), _key(key), _stats(NULL), _version(0) {}
+
+        MultiDimension* _md;
+        LabelsKey _key;
+        T* _stats;
+        uint64_t _version;
+    };
+
+    Handle get_handle(const key_type& labels_value) {
+        return Handle(this, LabelsKey(labels_value));
+    }
+    Handle get_handle(const LabelsKey& labels_value) {
+        return Handle(this, labels_value);
+    }
 
     // Remove stat so those not count and dump
     void delete_stats(const key_type& labels_value);
@@ -119,9 +213,11 @@ private:
 
     T* get_stats_impl(const key_type& labels_value, STATS_OP stats_op, bool* do_write = NULL);
 
-    void make_dump_key(std::ostream& os, 
-                       const key_type& labels_value, 
-                       const std::string& suffix = "", 
+    // Set `key' to name, `suffix' and formatted labels of the stat, say
+    // foo_latency{idc="gz",method="post",quantile="99"}.
+    void make_dump_key(std::string* key,
+                       const key_type& labels_value,
+                       const std::string& suffix = "",
                        const int quantile = 0);
 
     void make_labels_kvpair_string(std::ostream& os, 
@@ -142,6 +238,17 @@ private:
 private:
     size_t _max_stats_count;
     MetricMapDBD _metric_map;
+    // Increased after stats are deleted, to invalidate handles.
+    butil::atomic<uint64_t> _version;
+
+    // Formatted labels of stats, which are built once instead of in every
+    // dump(), namely every scrape of prometheus. Cleared when _version
+    // changes so that labels of deleted stats do not stay.
+    typedef std::unordered_map<key_type, std::string, KeyHash, KeyEqualTo>
+        LabelsStringMap;
+    butil::Mutex _labels_string_mutex;
+    LabelsStringMap _labels_string_cache;
+    uint64_t _labels_string_version;
 };
 
 } // namespace bvar
@@ -39,6 +39,8 @@ inline
 MultiDimension<T>::MultiDimension(const key_type& labels)
     : Base(labels)
     , _max_stats_count(FLAGS_max_multi_dimension_stats_count)
+    , _version(0)
+    , _labels_string_version(0)
 {
     _metric_map.Modify(init_flatmap);
 }
@@ -105,6 +107,7 @@ void MultiDimension<T>::delete_stats(const key_type& labels_value) {
         };
         _metric_map.Modify(erase_fn);
         if (tmp_metric) {
+            _version.fetch_add(1, butil::memory_order_release);
             delete tmp_metric;
         }
     }
@@ -128,6 +131,7 @@ void MultiDimension<T>::delete_stats() {
     };
     int ret = _metric_map.Modify(clear_fn);
     CHECK_EQ(1, ret);
+    _version.fetch_add(1, butil::memory_order_release);
     for (auto &kv : tmp_map) {
         delete kv.second;
     }
@@ -222,6 +226,27 @@ T* MultiDimension<T>::get_stats_impl(const key_type& labels_value, STATS_OP stat
     return cache_metric;
 }
 
+template <typename T>
+inline
+T* MultiDimension<T>::get_stats(const LabelsKey& labels_value) {
+    if (count_labels() != labels_value.size()) {
+        LOG(ERROR) << "Invalid labels count";
+        return nullptr;
+    }
+    {
+        MetricMapScopedPtr metric_map_ptr;
+        if (_metric_map.Read(&metric_map_ptr) != 0) {
+            LOG(ERROR) << "Fail to read dbd";
+            return nullptr;
+        }
+        auto it = metric_map_ptr->seek(labels_value);
+        if (it != NULL) {
+            return (*it);
+        }
+    }
+    return get_stats_impl(labels_value.to_list(), READ_OR_INSERT);
+}
+
 template <typename T>
 inline
 void MultiDimension<T>::clear_stats() {
@@ -243,16 +268,18 @@ size_t MultiDimension<T>::dump(Dumper* dumper, const DumpOptions* options) {
         return 0;
     }
     size_t n = 0;
+    // Reused for all stats to save allocations.
+    std::ostringstream oss;
+    std::string key;
     for (auto &label_name : label_names) {
         T* bvar = get_stats_impl(label_name);
         if (!bvar) {
             continue;
         }
-        std::ostringstream oss;
+        oss.str("");
         bvar->describe(oss, options->quote_string);
-        std::ostringstream oss_key;
-        make_dump_key(oss_key, label_name);
-        if (!dumper->dump_mvar(oss_key.str(), oss.str())) {
+        make_dump_key(&key, label_name);
+        if (!dumper->dump_mvar(key, oss.str())) {
             continue;
         }
         n++;
@@ -269,6 +296,7 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
         return 0;
     }
     size_t n = 0;
+    std::string key;
     // To meet prometheus specification, we must guarantee no second TYPE line for one metric name
 
     // latency comment
@@ -280,31 +308,27 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
         }
 
         // latency
-        std::ostringstream oss_latency_key;
-        make_dump_key(oss_latency_key, label_name, "_latency");
-        if (dumper->dump_mvar(oss_latency_key.str(), std::to_string(bvar->latency()))) {
+        make_dump_key(&key, label_name, "_latency");
+        if (dumper->dump_mvar(key, std::to_string(bvar->latency()))) {
             n++;
         }
         // latency_percentiles
         // p1/p2/p3
         int latency_percentiles[3] {FLAGS_bvar_latency_p1, FLAGS_bvar_latency_p2, FLAGS_bvar_latency_p3};
         for (auto lp : latency_percentiles) {
-            std::ostringstream oss_lp_key;
-            make_dump_key(oss_lp_key, label_name, "_latency", lp);
-            if (dumper->dump_mvar(oss_lp_key.str(), std::to_string(bvar->latency_percentile(lp / 100.0)))) {
+            make_dump_key(&key, label_name, "_latency", lp);
+            if (dumper->dump_mvar(key, std::to_string(bvar->latency_percentile(lp / 100.0)))) {
                 n++;
             }
         }
         // 999
-        std::ostringstream oss_p999_key;
-        make_dump_key(oss_p999_key, label_name, "_latency", 999);
-        if (dumper->dump_mvar(oss_p999_key.str(), std::to_string(bvar->latency_percentile(0.999)))) {
+        make_dump_key(&key, label_name, "_latency", 999);
+        if (dumper->dump_mvar(key, std::to_string(bvar->latency_percentile(0.999)))) {
             n++;
         }
         // 9999
-        std::ostringstream oss_p9999_key;
-        make_dump_key(oss_p9999_key, label_name, "_latency", 9999);
-        if (dumper->dump_mvar(oss_p9999_key.str(), std::to_string(bvar->latency_percentile(0.9999)))) {
+        make_dump_key(&key, label_name, "_latency", 9999);
+        if (dumper->dump_mvar(key, std::to_string(bvar->latency_percentile(0.9999)))) {
             n++;
         }
     }
@@ -316,9 +340,8 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
         if (!bvar) {
             continue;
         }
-        std::ostringstream oss_max_latency_key;
-        make_dump_key(oss_max_latency_key, label_name, "_max_latency");
-        if (dumper->dump_mvar(oss_max_latency_key.str(), std::to_string(bvar->max_latency()))) {
+        make_dump_key(&key, label_name, "_max_latency");
+        if (dumper->dump_mvar(key, std::to_string(bvar->max_latency()))) {
             n++;
         }
     }
@@ -330,9 +353,8 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
         if (!bvar) {
             continue;
         }
-        std::ostringstream oss_qps_key;
-        make_dump_key(oss_qps_key, label_name, "_qps");
-        if (dumper->dump_mvar(oss_qps_key.str(), std::to_string(bvar->qps()))) {
+        make_dump_key(&key, label_name, "_qps");
+        if (dumper->dump_mvar(key, std::to_string(bvar->qps()))) {
             n++;
         }
     }
@@ -344,9 +366,8 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
         if (!bvar) {
             continue;
         }
-        std::ostringstream oss_count_key;
-        make_dump_key(oss_count_key, label_name, "_count");
-        if (dumper->dump_mvar(oss_count_key.str(), std::to_string(bvar->count()))) {
+        make_dump_key(&key, label_name, "_count");
+        if (dumper->dump_mvar(key, std::to_string(bvar->count()))) {
             n++;
         }
     }
@@ -355,15 +376,37 @@ size_t MultiDimension<bvar::LatencyRecorder>::dump(Dumper* dumper, const DumpOpt
 
 template <typename T>
 inline
-void MultiDimension<T>::make_dump_key(std::ostream& os, 
+void MultiDimension<T>::make_dump_key(std::string* key,
                                       const key_type& labels_value,
                                       const std::string& suffix,
                                       const int quantile) {
-    os << name();
-    if (!suffix.empty()) {
-        os << suffix;
+    key->assign(name());
+    key->append(suffix);
+    {
+        BAIDU_SCOPED_LOCK(_labels_string_mutex);
+        const uint64_t version = _version.load(butil::memory_order_acquire);
+        if (version != _labels_string_version) {
+            _labels_string_cache.clear();
+            _labels_string_version = version;
+        }
+        auto it = _labels_string_cache.find(labels_value);
+        if (it == _labels_string_cache.end()) {
+            std::ostringstream os;
+            make_labels_kvpair_string(os, labels_value, 0);
+            it = _labels_string_cache.emplace(labels_value, os.str()).first;
+        }
+        key->append(it->second);
+    }
+    if (quantile > 0) {
+        // Put quantile before the closing brace.
+        key->resize(key->size() - 1);
+        if (key->back() != '{') {
+            key->push_back(',');
+        }
+        key->append("quantile=\"");
+        key->append(std::to_string(quantile));
+        key->append("\"}");
     }
-    make_labels_kvpair_string(os, labels_value, quantile);
 }
 
 template <typename T>
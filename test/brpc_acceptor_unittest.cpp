@@ -0,0 +1,191 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/endpoint.h"
+#include "butil/fd_guard.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "brpc/acceptor.h"
+#include "brpc/server.h"
+#include "brpc/socket.h"
+
+namespace brpc {
+DECLARE_int32(event_dispatcher_num);
+}
+
+namespace {
+
+const int NDISPATCHER = 4;
+
+class AcceptorTest : public ::testing::Test {
+protected:
+    void StartServer(brpc::Server* server, bool per_dispatcher,
+                     bool cpu_steering) {
+        brpc::ServerOptions options;
+        options.listen_per_event_dispatcher = per_dispatcher;
+        options.reuse_port_cpu_steering = cpu_steering;
+        ASSERT_EQ(0, server->Start("127.0.0.1:0", &options));
+        ASSERT_EQ(per_dispatcher ? (size_t)NDISPATCHER : 1u,
+                  server->_am->listened_fd_count());
+    }
+
+    // Open `n' connections to `server' and returns dispatcher indexes of
+    // the accepted sockets.
+    std::set<int> DispatchersOfConnections(brpc::Server* server, size_t n) {
+        std::vector<butil::fd_guard> fds(n);
+        for (size_t i = 0; i < n; ++i) {
+            fds[i].reset(butil::tcp_connect(server->listen_address(), NULL));
+            EXPECT_GE(fds[i], 0);
+        }
+        for (int i = 0; i < 1000 && server->_am->ConnectionCount() < n; ++i) {
+            usleep(1000);
+        }
+        EXPECT_EQ(n, server->_am->ConnectionCount());
+        std::vector<brpc::SocketId> conns;
+        server->_am->ListConnections(&conns);
+        std::set<int> indexes;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            brpc::SocketUniquePtr ptr;
+            if (brpc::Socket::Address(conns[i], &ptr) == 0) {
+                indexes.insert(ptr->_io_event.event_dispatcher_index());
+            }
+        }
+        return indexes;
+    }
+};
+
+TEST_F(AcceptorTest, single_listener) {
+    brpc::Server server;
+    StartServer(&server, false, false);
+    const std::set<int> indexes = DispatchersOfConnections(&server, 16);
+    // Dispatchers are chosen by hash of fds.
+    ASSERT_EQ(1u, indexes.size());
+    ASSERT_EQ(-1, *indexes.begin());
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(AcceptorTest, listen_per_event_dispatcher) {
+    brpc::Server server;
+    StartServer(&server, true, false);
+    // The kernel distributes connections among listeners by hash of the
+    // 4-tuple, all listeners should be hit.
+    const std::set<int> indexes = DispatchersOfConnections(&server, 64);
+    ASSERT_LT(1u, indexes.size());
+    for (std::set<int>::const_iterator it = indexes.begin();
+         it != indexes.end(); ++it) {
+        ASSERT_TRUE(*it >= 0 && *it < NDISPATCHER) << *it;
+    }
+    server.Stop(0);
+    server.Join();
+    ASSERT_EQ(-1, server._am->listened_fd());
+    // Restart on the same port.
+    brpc::ServerOptions options;
+    options.listen_per_event_dispatcher = true;
+    ASSERT_EQ(0, server.Start(server.listen_address(), &options));
+    ASSERT_EQ((size_t)NDISPATCHER, server._am->listened_fd_count());
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(AcceptorTest, cpu_steering) {
+    brpc::Server server;
+    StartServer(&server, true, true);
+    const std::set<int> indexes = DispatchersOfConnections(&server, 16);
+    if (sysconf(_SC_NPROCESSORS_ONLN) == 1) {
+        // All SYNs are received by cpu 0.
+        ASSERT_EQ(1u, indexes.size());
+        ASSERT_EQ(0, *indexes.begin());
+    }
+    server.Stop(0);
+    server.Join();
+}
+
+struct ConnectArg {
+    butil::EndPoint server;
+    size_t nconn;
+    size_t nfail;
+    pthread_t th;
+};
+
+// Connect, send a tiny http request and close, which is what short
+// connections do.
+static void* connect_and_request(void* arg) {
+    ConnectArg* a = static_cast<ConnectArg*>(arg);
+    const char req[] = "GET /health HTTP/1.1\r\n\r\n";
+    char buf[256];
+    a->nfail = 0;
+    for (size_t i = 0; i < a->nconn; ++i) {
+        butil::fd_guard fd(butil::tcp_connect(a->server, NULL));
+        if (fd < 0 ||
+            write(fd, req, sizeof(req) - 1) != (ssize_t)sizeof(req) - 1 ||
+            read(fd, buf, sizeof(buf)) <= 0) {
+            ++a->nfail;
+        }
+    }
+    return NULL;
+}
+
+TEST_F(AcceptorTest, connect_rate) {
+    const size_t nthreads[] = { 1, 4 };
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        double rate[2];
+        for (int per_dispatcher = 0; per_dispatcher < 2; ++per_dispatcher) {
+            brpc::Server server;
+            StartServer(&server, per_dispatcher, false);
+            std::vector<ConnectArg> args(nthreads[i]);
+            butil::Timer tm;
+            tm.start();
+            for (size_t j = 0; j < args.size(); ++j) {
+                args[j].server = server.listen_address();
+                args[j].nconn = 2000 / nthreads[i];
+                ASSERT_EQ(0, pthread_create(&args[j].th, NULL,
+                                            connect_and_request, &args[j]));
+            }
+            size_t nconn = 0;
+            for (size_t j = 0; j < args.size(); ++j) {
+                pthread_join(args[j].th, NULL);
+                ASSERT_EQ(0u, args[j].nfail);
+                nconn += args[j].nconn;
+            }
+            tm.stop();
+            rate[per_dispatcher] = nconn * 1000000.0 / tm.u_elapsed();
+            server.Stop(0);
+            server.Join();
+        }
+        LOG(INFO) << "nthread=" << nthreads[i]
+                  << " single_listener=" << (int64_t)rate[0]
+                  << "/s listen_per_event_dispatcher=" << (int64_t)rate[1] << "/s";
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    // Must be set before dispatchers are created.
+    brpc::FLAGS_event_dispatcher_num = NDISPATCHER;
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,225 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/file_util.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/channel.h"
+#include "brpc/server.h"
+#include "brpc/details/continuous_profiler.h"
+#include "brpc/details/server_private_accessor.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_int32(continuous_profiler_hz);
+}
+
+namespace {
+
+const char* PROF_FILE = "continuous_profiler_unittest.prof";
+
+// Not inlined so that it shows up in stacks.
+__attribute__((noinline)) int64_t BurnCpu(int64_t us) {
+    const int64_t end_us = butil::cpuwide_time_us() + us;
+    int64_t n = 0;
+    while (butil::cpuwide_time_us() < end_us) {
+        ++n;
+    }
+    return n;
+}
+
+class BurnEchoService : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        BurnCpu(request->sleep_us());
+        response->set_message(request->message());
+    }
+};
+
+struct Profile {
+    size_t nrecord;
+    int64_t nsample;
+    size_t max_depth;
+    uintptr_t period_us;
+};
+
+// Parse a CPU profile in the format of gperftools.
+bool ParseProfile(const std::string& content, Profile* p) {
+    const uintptr_t* w = (const uintptr_t*)content.data();
+    const size_t n = content.size() / sizeof(uintptr_t);
+    if (n < 5 || w[0] != 0 || w[1] != 3 || w[2] != 0 || w[4] != 0) {
+        return false;
+    }
+    *p = Profile();
+    p->period_us = w[3];
+    size_t i = 5;
+    while (i + 2 < n) {
+        const uintptr_t count = w[i];
+        const uintptr_t depth = w[i + 1];
+        if (count == 0 && depth == 1 && w[i + 2] == 0) {
+            // Trailer, followed by /proc/self/maps.
+            return content.find("r-xp", (i + 3) * sizeof(uintptr_t)) !=
+                std::string::npos;
+        }
+        ++p->nrecord;
+        p->nsample += count;
+        p->max_depth = std::max(p->max_depth, (size_t)depth);
+        i += 2 + depth;
+    }
+    return false;
+}
+
+void* do_nothing(void*) {
+    return NULL;
+}
+
+class ContinuousProfilerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        // Only bthread workers are sampled, make sure they're created.
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, do_nothing, NULL));
+        bthread_join(th, NULL);
+        ASSERT_FALSE(GFLAGS_NAMESPACE::SetCommandLineOption(
+            "continuous_profiler_hz", "100").empty());
+        // Wait for workers to be armed.
+        for (int i = 0; i < 30 && !brpc::IsContinuousProfilerRunning(); ++i) {
+            usleep(100000);
+        }
+        ASSERT_TRUE(brpc::IsContinuousProfilerRunning());
+    }
+    void TearDown() override {
+        GFLAGS_NAMESPACE::SetCommandLineOption("continuous_profiler_hz", "0");
+        butil::DeleteFile(butil::FilePath(PROF_FILE), false);
+    }
+};
+
+TEST_F(ContinuousProfilerTest, invalid_hz) {
+    ASSERT_TRUE(GFLAGS_NAMESPACE::SetCommandLineOption(
+        "continuous_profiler_hz", "-1").empty());
+    ASSERT_TRUE(GFLAGS_NAMESPACE::SetCommandLineOption(
+        "continuous_profiler_hz", "100000").empty());
+    ASSERT_EQ(100, brpc::FLAGS_continuous_profiler_hz);
+}
+
+TEST_F(ContinuousProfilerTest, attribute_samples_to_methods) {
+    BurnEchoService service;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8624, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8624", NULL));
+    test::EchoService_Stub stub(&channel);
+    const int64_t begin_s = brpc::ContinuousProfilerNow();
+    // Burn 1.5 seconds of CPU in the method.
+    for (int i = 0; i < 30; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("hello");
+        req.set_sleep_us(50000);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+    // Wait for samples to be drained.
+    usleep(300000);
+    const int64_t end_s = brpc::ContinuousProfilerNow() + 1;
+
+    const brpc::Server::MethodProperty* mp =
+        brpc::ServerPrivateAccessor(&server).FindMethodPropertyByFullName(
+            "test.EchoService.Echo");
+    ASSERT_TRUE(mp != NULL);
+    ASSERT_EQ("test.EchoService.Echo",
+              *brpc::ServerPrivateAccessor(&server).FindMethodNameByStatus(mp->status));
+    std::map<const void*, int64_t> ntag;
+    brpc::CountContinuousProfile(begin_s, end_s, &ntag);
+    LOG(INFO) << "samples of method=" << ntag[mp->status]
+              << " others=" << ntag[NULL];
+    // 100 samples per CPU second, allow much jitter of timing.
+    ASSERT_GT(ntag[mp->status], 50);
+
+    std::map<const void*, int64_t> ntag2;
+    const int64_t n = brpc::DumpContinuousProfile(
+        PROF_FILE, begin_s, end_s, mp->status, &ntag2);
+    ASSERT_EQ(ntag[mp->status], n);
+    ASSERT_EQ(ntag[mp->status], ntag2[mp->status]);
+    std::string content;
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath(PROF_FILE), &content));
+    Profile prof;
+    ASSERT_TRUE(ParseProfile(content, &prof));
+    ASSERT_EQ(n, prof.nsample);
+    ASSERT_EQ(10000u, prof.period_us);
+    // Frames of Echo, the protocol and the bthread entry are walked.
+    ASSERT_GT(prof.max_depth, 3u);
+    LOG(INFO) << "records=" << prof.nrecord << " max_depth=" << prof.max_depth;
+
+    // Nothing in a window in the future.
+    ntag.clear();
+    brpc::CountContinuousProfile(end_s + 10, end_s + 20, &ntag);
+    ASSERT_TRUE(ntag.empty());
+    server.Stop(0);
+    server.Join();
+}
+
+void* burn_thread(void* arg) {
+    *(int64_t*)arg = BurnCpu(200000);
+    return NULL;
+}
+
+// Loops done in a fixed time by bthreads as many as workers, the profiler
+// slows them down by stealing CPU in signal handlers.
+static int64_t BurnAll() {
+    const int n = bthread_getconcurrency();
+    std::vector<bthread_t> th(n);
+    std::vector<int64_t> loops(n);
+    for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(0, bthread_start_background(&th[i], NULL, burn_thread, &loops[i]));
+    }
+    int64_t total = 0;
+    for (int i = 0; i < n; ++i) {
+        bthread_join(th[i], NULL);
+        total += loops[i];
+    }
+    return total;
+}
+
+TEST_F(ContinuousProfilerTest, overhead) {
+    const char* hzs[] = { "0", "19", "100", "1000" };
+    for (size_t i = 0; i < ARRAY_SIZE(hzs); ++i) {
+        GFLAGS_NAMESPACE::SetCommandLineOption("continuous_profiler_hz", hzs[i]);
+        // Let the profiler thread re-arm workers.
+        usleep(300000);
+        int64_t loops = 0;
+        for (int j = 0; j < 5; ++j) {
+            loops += BurnAll();
+        }
+        LOG(INFO) << "hz=" << hzs[i] << " loops=" << loops;
+    }
+}
+
+} // namespace
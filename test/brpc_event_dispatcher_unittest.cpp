@@ -515,3 +515,206 @@ TEST_F(EventDispatcherTest, customize_dispatch_task) {
     ASSERT_EQ(nullptr, ptr);
     ASSERT_NE(0, EventPipe::Address(id, &ptr));
 }
+
+namespace brpc {
+DECLARE_bool(event_dispatcher_use_io_uring);
+}
+
+struct PollerCounter {
+    int fd;
+    butil::atomic<int> ninput;
+    butil::atomic<int> noutput;
+    butil::atomic<size_t> nread;
+};
+
+static int CountInputEvent(void* user_data, uint32_t,
+                           const bthread_attr_t&) {
+    PollerCounter* c = static_cast<PollerCounter*>(user_data);
+    c->ninput.fetch_add(1, butil::memory_order_relaxed);
+    char buf[1024];
+    ssize_t nr;
+    while ((nr = read(c->fd, buf, sizeof(buf))) > 0) {
+        c->nread.fetch_add(nr, butil::memory_order_relaxed);
+    }
+    return 0;
+}
+
+static int CountOutputEvent(void* user_data, uint32_t,
+                            const bthread_attr_t&) {
+    PollerCounter* c = static_cast<PollerCounter*>(user_data);
+    c->noutput.fetch_add(1, butil::memory_order_relaxed);
+    return 0;
+}
+
+TEST_F(EventDispatcherTest, io_uring_dispatcher) {
+    brpc::FLAGS_event_dispatcher_use_io_uring = true;
+    brpc::EventDispatcher d;
+    brpc::FLAGS_event_dispatcher_use_io_uring = false;
+    if (d._io_uring == NULL) {
+        LOG(WARNING) << "io_uring is not supported, skip";
+        return;
+    }
+    ASSERT_EQ(0, d.Start(NULL));
+
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    butil::make_non_blocking(fds[0]);
+    PollerCounter c;
+    c.fd = fds[0];
+    c.ninput = 0;
+    c.noutput = 0;
+    c.nread = 0;
+    brpc::IOEventDataOptions options{ CountInputEvent, CountOutputEvent, &c };
+    brpc::IOEventDataId id;
+    ASSERT_EQ(0, brpc::IOEventData::Create(&id, options));
+
+    ASSERT_EQ(0, d.AddConsumer(id, fds[0]));
+    ASSERT_EQ(-1, d.AddConsumer(id, fds[0]));
+    ASSERT_EQ(EEXIST, errno);
+    const size_t N = 1000;
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(1, write(fds[1], "a", 1));
+    }
+    usleep(50 * 1000);
+    ASSERT_EQ(N, c.nread.load());
+    ASSERT_LT(0, c.ninput.load());
+    ASSERT_EQ(0, c.noutput.load());
+
+    // Writable socket triggers the output event once.
+    ASSERT_EQ(0, d.RegisterEvent(id, fds[0], true));
+    usleep(50 * 1000);
+    ASSERT_EQ(1, c.noutput.load());
+    ASSERT_EQ(0, d.UnregisterEvent(id, fds[0], true));
+    ASSERT_EQ(1, write(fds[1], "b", 1));
+    usleep(50 * 1000);
+    ASSERT_EQ(N + 1, c.nread.load());
+    ASSERT_EQ(1, c.noutput.load());
+
+    // No more events after removal.
+    ASSERT_EQ(0, d.RemoveConsumer(fds[0]));
+    ASSERT_EQ(-1, d.RemoveConsumer(fds[0]));
+    const int ninput = c.ninput.load();
+    ASSERT_EQ(1, write(fds[1], "c", 1));
+    usleep(50 * 1000);
+    ASSERT_EQ(ninput, c.ninput.load());
+    ASSERT_EQ(-1, d.UnregisterEvent(id, fds[0], true));
+    ASSERT_EQ(ENOENT, errno);
+
+    d.Stop();
+    d.Join();
+    ASSERT_EQ(0, brpc::IOEventData::SetFailedById(id));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+struct EchoPeer {
+    int fd;
+};
+
+static int EchoInputEvent(void* user_data, uint32_t,
+                          const bthread_attr_t&) {
+    EchoPeer* p = static_cast<EchoPeer*>(user_data);
+    char buf[256];
+    ssize_t nr;
+    while ((nr = read(p->fd, buf, sizeof(buf))) > 0) {
+        if (write(p->fd, buf, nr) != nr) {
+            PLOG(ERROR) << "Fail to write";
+        }
+    }
+    return 0;
+}
+
+static int IgnoreOutputEvent(void*, uint32_t, const bthread_attr_t&) {
+    return 0;
+}
+
+struct EchoClient {
+    int fd;
+    volatile bool* stop;
+    std::vector<int64_t> latencies;
+};
+
+static void* echo_client_thread(void* arg) {
+    EchoClient* c = static_cast<EchoClient*>(arg);
+    char buf[16] = "ping";
+    while (!*c->stop) {
+        const int64_t start_ns = butil::cpuwide_time_ns();
+        if (write(c->fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+            break;
+        }
+        size_t nr = 0;
+        while (nr < sizeof(buf)) {
+            const ssize_t n = read(c->fd, buf + nr, sizeof(buf) - nr);
+            if (n <= 0) {
+                return NULL;
+            }
+            nr += n;
+        }
+        c->latencies.push_back(butil::cpuwide_time_ns() - start_ns);
+    }
+    return NULL;
+}
+
+static void RunEchoBenchmark(bool use_io_uring) {
+    brpc::FLAGS_event_dispatcher_use_io_uring = use_io_uring;
+    brpc::EventDispatcher d;
+    brpc::FLAGS_event_dispatcher_use_io_uring = false;
+    if (use_io_uring && d._io_uring == NULL) {
+        LOG(WARNING) << "io_uring is not supported, skip";
+        return;
+    }
+    ASSERT_EQ(0, d.Start(NULL));
+
+    const size_t NCLIENT = 16;
+    volatile bool stop = false;
+    EchoPeer peers[NCLIENT];
+    EchoClient clients[NCLIENT];
+    brpc::IOEventDataId ids[NCLIENT];
+    pthread_t th[NCLIENT];
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        butil::make_non_blocking(fds[0]);
+        peers[i].fd = fds[0];
+        clients[i].fd = fds[1];
+        clients[i].stop = &stop;
+        brpc::IOEventDataOptions options{
+            EchoInputEvent, IgnoreOutputEvent, &peers[i] };
+        ASSERT_EQ(0, brpc::IOEventData::Create(&ids[i], options));
+        ASSERT_EQ(0, d.AddConsumer(ids[i], fds[0]));
+    }
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, echo_client_thread, &clients[i]));
+    }
+    sleep(2);
+    stop = true;
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        pthread_join(th[i], NULL);
+    }
+    tm.stop();
+
+    std::vector<int64_t> all;
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        all.insert(all.end(), clients[i].latencies.begin(),
+                   clients[i].latencies.end());
+        d.RemoveConsumer(peers[i].fd);
+        brpc::IOEventData::SetFailedById(ids[i]);
+        close(peers[i].fd);
+        close(clients[i].fd);
+    }
+    d.Stop();
+    d.Join();
+    ASSERT_FALSE(all.empty());
+    std::sort(all.begin(), all.end());
+    LOG(INFO) << (use_io_uring ? "io_uring" : "epoll")
+              << ": qps=" << all.size() * 1000000L / tm.u_elapsed()
+              << " p50=" << all[all.size() / 2] / 1000 << "us"
+              << " p99=" << all[all.size() * 99 / 100] / 1000 << "us";
+}
+
+TEST_F(EventDispatcherTest, echo_performance) {
+    RunEchoBenchmark(false);
+    RunEchoBenchmark(true);
+}
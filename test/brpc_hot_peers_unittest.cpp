@@ -0,0 +1,257 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <map>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/fast_rand.h"
+#include "brpc/channel.h"
+#include "brpc/server.h"
+#include "brpc/details/hot_peers.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(enable_hot_peers);
+DECLARE_int32(hot_peers_window_s);
+}
+
+namespace {
+
+butil::EndPoint PeerOf(int i) {
+    return butil::EndPoint(butil::int2ip(0x0a000000 + i), 8000 + i);
+}
+
+int64_t CountOf(const std::vector<brpc::HotPeer>& peers,
+                const butil::EndPoint& peer) {
+    for (size_t i = 0; i < peers.size(); ++i) {
+        if (peers[i].peer.ip == peer.ip) {
+            return peers[i].count;
+        }
+    }
+    return -1;
+}
+
+TEST(HotPeersTest, space_saving) {
+    brpc::SpaceSavingSketch s;
+    ASSERT_EQ(0, s.init(10));
+    // 5 heavy keys among many light ones.
+    std::map<int, int64_t> real;
+    for (int round = 0; round < 1000; ++round) {
+        for (int i = 0; i < 5; ++i) {
+            s.add(PeerOf(i), 10);
+            real[i] += 10;
+        }
+        const int light = 100 + butil::fast_rand_less_than(1000);
+        s.add(PeerOf(light), 1);
+        real[light] += 1;
+    }
+    ASSERT_EQ(1000 * 51, s.total());
+    ASSERT_EQ(10u, s.items().size());
+    int nheavy = 0;
+    for (auto& item : s.items()) {
+        const int i = butil::ip2int(item.key.ip) - 0x0a000000;
+        // Never underestimate, and overestimate at most `error'.
+        ASSERT_GE(item.count, real[i]);
+        ASSERT_LE(item.count - item.error, real[i]);
+        if (i < 5) {
+            ++nheavy;
+            // Bounded by total/capacity.
+            ASSERT_LE(item.count - real[i], s.total() / 10);
+        }
+    }
+    ASSERT_EQ(5, nheavy);
+
+    brpc::SpaceSavingSketch s2;
+    ASSERT_EQ(0, s2.init(10));
+    s2.add(PeerOf(0), 7);
+    s2.merge(s);
+    ASSERT_EQ(s.total() + 7, s2.total());
+    for (auto& item : s2.items()) {
+        if (item.key.ip == PeerOf(0).ip) {
+            ASSERT_EQ(real[0] + 7, item.count);
+        }
+    }
+    s2.clear();
+    ASSERT_EQ(0, s2.total());
+    ASSERT_TRUE(s2.items().empty());
+}
+
+struct AddArg {
+    int base;
+    int n;
+};
+
+void* add_peers(void* arg) {
+    AddArg* a = static_cast<AddArg*>(arg);
+    for (int i = 0; i < a->n; ++i) {
+        brpc::AddHotPeerStats(PeerOf(a->base), 1, 100, 10, 0);
+        brpc::AddHotPeerStats(PeerOf(a->base + 1 + i % 10), 1, 1, 1, 1);
+    }
+    return NULL;
+}
+
+TEST(HotPeersTest, top_k_across_threads) {
+    brpc::FLAGS_enable_hot_peers = true;
+    brpc::FLAGS_hot_peers_window_s = 1000;
+    // Threads exit before reading, stats of them are kept.
+    pthread_t th[4];
+    AddArg args[4];
+    for (int i = 0; i < 4; ++i) {
+        args[i].base = 1000 * (i + 1);
+        args[i].n = 1000 * (i + 1);
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_peers, &args[i]));
+    }
+    for (int i = 0; i < 4; ++i) {
+        pthread_join(th[i], NULL);
+    }
+    // Ports of the same client are counted together.
+    brpc::AddHotPeerStats(butil::EndPoint(PeerOf(4000).ip, 1), 1000, 0, 0, 0);
+
+    std::vector<brpc::HotPeer> peers;
+    brpc::GetHotPeers(brpc::HOT_PEERS_MESSAGES, true, 3, &peers);
+    ASSERT_EQ(3u, peers.size());
+    ASSERT_EQ(PeerOf(4000).ip, peers[0].peer.ip);
+    ASSERT_EQ(5000, peers[0].count);
+    ASSERT_EQ(PeerOf(3000).ip, peers[1].peer.ip);
+    ASSERT_EQ(PeerOf(2000).ip, peers[2].peer.ip);
+
+    brpc::GetHotPeers(brpc::HOT_PEERS_BYTES_IN, true, 10, &peers);
+    ASSERT_EQ(400000, CountOf(peers, PeerOf(4000)));
+    brpc::GetHotPeers(brpc::HOT_PEERS_BYTES_OUT, true, 10, &peers);
+    ASSERT_EQ(10000, CountOf(peers, PeerOf(1000)));
+    // Light peers are the only ones with errors.
+    brpc::GetHotPeers(brpc::HOT_PEERS_ERRORS, true, 10, &peers);
+    ASSERT_EQ(-1, CountOf(peers, PeerOf(4000)));
+    // Nothing in the last window.
+    brpc::GetHotPeers(brpc::HOT_PEERS_MESSAGES, false, 10, &peers);
+    ASSERT_EQ(-1, CountOf(peers, PeerOf(4000)));
+}
+
+TEST(HotPeersTest, windows) {
+    brpc::FLAGS_enable_hot_peers = true;
+    brpc::FLAGS_hot_peers_window_s = 1;
+    // Wait for the beginning of a window.
+    const int64_t now_s = butil::cpuwide_time_s();
+    while (butil::cpuwide_time_s() == now_s) {
+        usleep(1000);
+    }
+    brpc::AddHotPeerStats(PeerOf(7), 3, 0, 0, 0);
+    std::vector<brpc::HotPeer> peers;
+    brpc::GetHotPeers(brpc::HOT_PEERS_MESSAGES, true, 10, &peers);
+    ASSERT_EQ(3, CountOf(peers, PeerOf(7)));
+    usleep(1100000);
+    brpc::GetHotPeers(brpc::HOT_PEERS_MESSAGES, true, 10, &peers);
+    ASSERT_EQ(-1, CountOf(peers, PeerOf(7)));
+    brpc::GetHotPeers(brpc::HOT_PEERS_MESSAGES, false, 10, &peers);
+    ASSERT_EQ(3, CountOf(peers, PeerOf(7)));
+    usleep(1000000);
+    brpc::GetHotPeers(brpc::HOT_PEERS_MESSAGES, false, 10, &peers);
+    ASSERT_EQ(-1, CountOf(peers, PeerOf(7)));
+    brpc::FLAGS_hot_peers_window_s = 10;
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        response->set_message(request->message());
+    }
+};
+
+TEST(HotPeersTest, builtin_service) {
+    brpc::FLAGS_enable_hot_peers = true;
+    brpc::FLAGS_hot_peers_window_s = 1000;
+    EchoServiceImpl service;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8625, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8625", NULL));
+    test::EchoService_Stub stub(&channel);
+    for (int i = 0; i < 100; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(std::string(1000, 'a'));
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+    std::vector<brpc::HotPeer> peers;
+    brpc::GetHotPeers(brpc::HOT_PEERS_MESSAGES, true, 1, &peers);
+    ASSERT_EQ(1u, peers.size());
+    ASSERT_EQ("127.0.0.1", brpc::HotPeerName(peers[0].peer));
+    // Requests at server side and responses at client side.
+    ASSERT_GE(peers[0].count, 200);
+    brpc::GetHotPeers(brpc::HOT_PEERS_BYTES_OUT, true, 1, &peers);
+    ASSERT_GE(peers[0].count, 200 * 1000);
+
+    brpc::ChannelOptions opt;
+    opt.protocol = "http";
+    brpc::Channel http_channel;
+    ASSERT_EQ(0, http_channel.Init("127.0.0.1:8625", &opt));
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/hot_peers?k=3&current";
+    http_channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    const std::string page = cntl.response_attachment().to_string();
+    LOG(INFO) << page;
+    ASSERT_NE(std::string::npos, page.find("# messages"));
+    ASSERT_NE(std::string::npos, page.find("127.0.0.1 | "));
+
+    brpc::Controller cntl2;
+    cntl2.http_request().uri() = "/hot_peers?k=x";
+    http_channel.CallMethod(NULL, &cntl2, NULL, NULL, NULL);
+    ASSERT_TRUE(cntl2.Failed());
+
+    std::ostringstream os;
+    ASSERT_EQ(0, bvar::Variable::describe_exposed("rpc_hot_peers_by_messages", os));
+    server.Stop(0);
+    server.Join();
+    brpc::FLAGS_hot_peers_window_s = 10;
+}
+
+TEST(HotPeersTest, add_perf) {
+    const int N = 1000000;
+    const bool enabled[] = { false, true };
+    for (bool e : enabled) {
+        brpc::FLAGS_enable_hot_peers = e;
+        butil::Timer tm;
+        tm.start();
+        for (int i = 0; i < N; ++i) {
+            brpc::AddHotPeerStats(PeerOf(i % 16), 1, 100, 0, 0);
+        }
+        tm.stop();
+        LOG(INFO) << "enable_hot_peers=" << e << " AddHotPeerStats takes "
+                  << tm.n_elapsed() / N << "ns";
+    }
+    // Many distinct peers, every add evicts the minimum.
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        brpc::AddHotPeerStats(PeerOf(i), 1, 100, 0, 0);
+    }
+    tm.stop();
+    LOG(INFO) << "AddHotPeerStats with distinct peers takes "
+              << tm.n_elapsed() / N << "ns";
+}
+
+} // namespace
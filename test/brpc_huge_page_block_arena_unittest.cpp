@@ -0,0 +1,259 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/iobuf.h"
+#include "butil/fast_rand.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "bvar/bvar.h"
+#include "brpc/huge_page_block_arena.h"
+
+namespace butil {
+namespace iobuf {
+extern void* (*blockmem_allocate)(size_t);
+extern void  (*blockmem_deallocate)(void*);
+extern void remove_tls_block_chain();
+}
+}
+
+namespace {
+
+using namespace brpc::arena;
+
+const size_t ARENA_SIZE = 64 * 1024 * 1024;
+
+std::string GetVar(const std::string& name) {
+    return bvar::Variable::describe_exposed(name);
+}
+
+void InstallArena() {
+    if (butil::iobuf::blockmem_allocate != AllocateBlock) {
+        // Blocks cached in TLS were allocated by malloc.
+        butil::iobuf::remove_tls_block_chain();
+        butil::iobuf::blockmem_allocate = AllocateBlock;
+        butil::iobuf::blockmem_deallocate = DeallocateBlock;
+    }
+}
+
+class HugePageBlockArenaTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        ASSERT_EQ(0, InitBlockArena(ARENA_SIZE, false));
+    }
+};
+
+struct BenchArg {
+    size_t nbytes;
+    pthread_t th;
+};
+
+// Append small pieces and cut them into messages, which is what a server
+// does to requests and responses.
+static void* append_and_cut(void* arg) {
+    BenchArg* a = static_cast<BenchArg*>(arg);
+    char piece[100];
+    memset(piece, 'x', sizeof(piece));
+    butil::IOBuf buf;
+    butil::IOBuf msg;
+    a->nbytes = 0;
+    for (int i = 0; i < 2000; ++i) {
+        for (size_t n = 0; n < 65536; n += sizeof(piece)) {
+            buf.append(piece, sizeof(piece));
+        }
+        while (buf.cutn(&msg, 1000) != 0) {
+            a->nbytes += msg.size();
+            msg.clear();
+        }
+        buf.clear();
+    }
+    return NULL;
+}
+
+static double RunAppendAndCut(size_t nthread) {
+    std::vector<BenchArg> args(nthread);
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < nthread; ++i) {
+        EXPECT_EQ(0, pthread_create(&args[i].th, NULL, append_and_cut, &args[i]));
+    }
+    size_t nbytes = 0;
+    for (size_t i = 0; i < nthread; ++i) {
+        pthread_join(args[i].th, NULL);
+        nbytes += args[i].nbytes;
+    }
+    tm.stop();
+    return nbytes / (double)tm.u_elapsed();
+}
+
+// Must be the first test since blocks allocated by malloc can't be freed by
+// the arena after the arena is installed.
+TEST_F(HugePageBlockArenaTest, append_and_cut_performance) {
+    ASSERT_EQ(::malloc, butil::iobuf::blockmem_allocate);
+    const size_t nthreads[] = { 1, 4 };
+    double malloc_tp[ARRAY_SIZE(nthreads)];
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        malloc_tp[i] = RunAppendAndCut(nthreads[i]);
+    }
+    InstallArena();
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        const double arena_tp = RunAppendAndCut(nthreads[i]);
+        LOG(INFO) << "nthread=" << nthreads[i] << " malloc=" << malloc_tp[i]
+                  << "MB/s arena=" << arena_tp << "MB/s";
+    }
+}
+
+TEST_F(HugePageBlockArenaTest, size_classes) {
+    const size_t sizes[] = { 100, butil::IOBuf::SMALL_BLOCK_SIZE, 2000,
+                             butil::IOBuf::DEFAULT_BLOCK_SIZE,
+                             butil::IOBuf::LARGE_BLOCK_SIZE };
+    const int classes[] = { butil::IOBuf::SMALL_BLOCK, butil::IOBuf::SMALL_BLOCK,
+                            butil::IOBuf::DEFAULT_BLOCK, butil::IOBuf::DEFAULT_BLOCK,
+                            butil::IOBuf::LARGE_BLOCK };
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); ++i) {
+        std::vector<void*> blocks;
+        for (int j = 0; j < 100; ++j) {
+            void* p = AllocateBlock(sizes[i]);
+            ASSERT_TRUE(p);
+            ASSERT_EQ(classes[i], SizeClassOfBlock(p));
+            memset(p, j, sizes[i]);
+            blocks.push_back(p);
+        }
+        ASSERT_EQ(blocks.size(), std::set<void*>(blocks.begin(), blocks.end()).size());
+        void* last = blocks.back();
+        for (size_t j = 0; j < blocks.size(); ++j) {
+            DeallocateBlock(blocks[j]);
+        }
+        // Reused from the thread-local cache.
+        void* p = AllocateBlock(sizes[i]);
+        ASSERT_EQ(last, p);
+        DeallocateBlock(p);
+    }
+    // Not in any class.
+    const size_t other_sizes[] = { butil::IOBuf::LARGE_BLOCK_SIZE / 2,
+                                   butil::IOBuf::LARGE_BLOCK_SIZE + 1 };
+    for (size_t i = 0; i < ARRAY_SIZE(other_sizes); ++i) {
+        void* p = AllocateBlock(other_sizes[i]);
+        ASSERT_TRUE(p);
+        ASSERT_EQ(-1, SizeClassOfBlock(p));
+        DeallocateBlock(p);
+    }
+}
+
+TEST_F(HugePageBlockArenaTest, occupancy) {
+    std::vector<void*> blocks;
+    for (int i = 0; i < 100; ++i) {
+        blocks.push_back(AllocateBlock(butil::IOBuf::LARGE_BLOCK_SIZE));
+    }
+    ASSERT_LE(100, atoi(GetVar("iobuf_arena_block_count_large").c_str()));
+    // 32 large blocks per huge page.
+    ASSERT_LE(4, atoi(GetVar("iobuf_arena_page_count_large").c_str()));
+    ASSERT_LT(0, atof(GetVar("iobuf_arena_occupancy").c_str()));
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        DeallocateBlock(blocks[i]);
+    }
+    ASSERT_EQ("0", GetVar("iobuf_arena_block_count_large"));
+    ASSERT_FALSE(GetVar("iobuf_arena_fallback").empty());
+}
+
+TEST_F(HugePageBlockArenaTest, portal_with_size_class) {
+    InstallArena();
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    std::string data(60000, 'a');
+    const butil::IOBuf::BlockSizeClass classes[] = {
+        butil::IOBuf::SMALL_BLOCK, butil::IOBuf::DEFAULT_BLOCK,
+        butil::IOBuf::LARGE_BLOCK };
+    for (size_t i = 0; i < ARRAY_SIZE(classes); ++i) {
+        butil::IOPortal portal;
+        portal.set_block_size_class(classes[i]);
+        ASSERT_EQ(classes[i], portal.block_size_class());
+        size_t nread = 0;
+        while (nread < data.size()) {
+            const ssize_t nw = write(fds[1], data.data() + nread,
+                                     std::min((size_t)16384, data.size() - nread));
+            ASSERT_GT(nw, 0);
+            while (portal.size() < nread + nw) {
+                ASSERT_GT(portal.append_from_file_descriptor(fds[0], 65536), 0);
+            }
+            nread += nw;
+        }
+        ASSERT_EQ(data, portal.to_string());
+        const size_t nblock = portal.backing_block_num();
+        const size_t block_size = butil::IOBuf::block_size_of(classes[i]);
+        ASSERT_GE(nblock, data.size() / block_size);
+        ASSERT_LE(nblock, data.size() / (block_size / 2) + 1);
+        for (size_t j = 0; j < nblock; ++j) {
+            ASSERT_EQ((int)classes[i],
+                      SizeClassOfBlock(portal.backing_block(j).data()));
+        }
+        portal.clear();
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(HugePageBlockArenaTest, appender_with_size_class) {
+    InstallArena();
+    butil::IOBufAppender appender(butil::IOBuf::SMALL_BLOCK);
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_EQ(0, appender.push_back('a' + i % 26));
+    }
+    butil::IOBuf& buf = appender.buf();
+    ASSERT_EQ(10000u, buf.size());
+    ASSERT_LE(10u, buf.backing_block_num());
+    for (size_t i = 0; i < buf.backing_block_num(); ++i) {
+        ASSERT_EQ((int)butil::IOBuf::SMALL_BLOCK,
+                  SizeClassOfBlock(buf.backing_block(i).data()));
+    }
+    std::string s = buf.to_string();
+    for (size_t i = 0; i < s.size(); ++i) {
+        ASSERT_EQ('a' + (int)(i % 26), s[i]);
+    }
+}
+
+struct RemoteFreeArg {
+    std::vector<butil::IOBuf> bufs;
+};
+
+static void* free_bufs(void* arg) {
+    static_cast<RemoteFreeArg*>(arg)->bufs.clear();
+    return NULL;
+}
+
+TEST_F(HugePageBlockArenaTest, free_in_other_threads) {
+    InstallArena();
+    RemoteFreeArg arg;
+    for (int i = 0; i < 1000; ++i) {
+        butil::IOBuf buf;
+        buf.append(std::string(butil::fast_rand_less_than(20000) + 1, 'b'));
+        arg.bufs.push_back(buf);
+    }
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, free_bufs, &arg));
+    ASSERT_EQ(0, pthread_join(th, NULL));
+    ASSERT_TRUE(arg.bufs.empty());
+}
+
+} // namespace
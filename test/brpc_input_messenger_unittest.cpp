@@ -19,9 +19,11 @@
 
 // Date: Sun Jul 13 15:04:18 CST 2014
 
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <vector>
 #include <gtest/gtest.h>
 #include "gperftools_helper.h"
 #include "butil/time.h"
@@ -29,13 +31,48 @@
 #include "butil/fd_utility.h"
 #include "butil/fd_guard.h"
 #include "butil/unix_socket.h"
+#include "bthread/bthread.h"
 #include "brpc/acceptor.h"
 #include "brpc/policy/hulu_pbrpc_protocol.h"
+#include "brpc/policy/most_common_message.h"
 
 void EmptyProcessHuluRequest(brpc::InputMessageBase* msg_base) {
     brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
 }
 
+butil::atomic<size_t> nprocessed(0);
+butil::atomic<size_t> nout_of_order(0);
+uint32_t next_seq = 0;
+
+// Sequence number is the first 4 bytes of the payload.
+static uint32_t SeqOfMessage(brpc::InputMessageBase* msg_base) {
+    brpc::policy::MostCommonMessage* msg =
+        static_cast<brpc::policy::MostCommonMessage*>(msg_base);
+    uint32_t seq = 0;
+    msg->payload.copy_to(&seq, sizeof(seq));
+    return seq;
+}
+
+void OrderedProcessHuluRequest(brpc::InputMessageBase* msg_base) {
+    brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
+    if (SeqOfMessage(msg_base) != next_seq) {
+        nout_of_order.fetch_add(1, butil::memory_order_relaxed);
+    }
+    next_seq = SeqOfMessage(msg_base) + 1;
+    nprocessed.fetch_add(1, butil::memory_order_release);
+}
+
+void CountingProcessHuluRequest(brpc::InputMessageBase* msg_base) {
+    brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
+    nprocessed.fetch_add(1, butil::memory_order_release);
+}
+
+void SlowProcessHuluRequest(brpc::InputMessageBase* msg_base) {
+    brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
+    bthread_usleep(5000);
+    nprocessed.fetch_add(1, butil::memory_order_release);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     brpc::Protocol dummy_protocol = 
@@ -46,6 +83,15 @@ int main(int argc, char* argv[]) {
                                NULL, NULL, NULL,
                                brpc::CONNECTION_TYPE_ALL, "dummy_hulu" };
     EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)30, dummy_protocol));
+    dummy_protocol.process_request = OrderedProcessHuluRequest;
+    dummy_protocol.name = "ordered_hulu";
+    EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)31, dummy_protocol));
+    dummy_protocol.process_request = CountingProcessHuluRequest;
+    dummy_protocol.name = "counting_hulu";
+    EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)32, dummy_protocol));
+    dummy_protocol.process_request = SlowProcessHuluRequest;
+    dummy_protocol.name = "slow_hulu";
+    EXPECT_EQ(0,  RegisterProtocol((brpc::ProtocolType)33, dummy_protocol));
     return RUN_ALL_TESTS();
 }
 
@@ -219,3 +265,168 @@ TEST_F(MessengerTest, dispatch_tasks) {
     sleep(1);
     LOG(WARNING) << "begin to exit!!!!";
 }
+
+// Fill `buf' with `n' hulu messages of MESSAGE_SIZE bytes numbered from
+// `first_seq'.
+static void FillMessages(char* buf, size_t n, uint32_t first_seq) {
+    for (size_t i = 0; i < n; ++i) {
+        char* p = buf + i * MESSAGE_SIZE;
+        memcpy(p, "HULU", 4);
+        *(uint32_t*)(p + 4) = MESSAGE_SIZE - 12;
+        *(uint32_t*)(p + 8) = 4;
+        *(uint32_t*)(p + 16) = first_seq + i;
+    }
+}
+
+static int StartMessenger(brpc::Acceptor* messenger, const char* socket_name,
+                          const brpc::InputMessageHandler& handler) {
+    int listening_fd = butil::unix_socket_listen(socket_name);
+    if (listening_fd < 0) {
+        return -1;
+    }
+    butil::make_non_blocking(listening_fd);
+    if (messenger->AddHandler(handler) != 0) {
+        return -1;
+    }
+    return messenger->StartAccept(listening_fd, -1, NULL, false);
+}
+
+static bool WriteAll(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        const ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void WaitProcessed(size_t n, int64_t timeout_ms) {
+    const int64_t deadline = butil::gettimeofday_ms() + timeout_ms;
+    while (nprocessed.load(butil::memory_order_acquire) < n &&
+           butil::gettimeofday_ms() < deadline) {
+        usleep(1000);
+    }
+}
+
+TEST_F(MessengerTest, process_inline_in_order) {
+    const char* socket_name = "input_messenger.inline";
+    const brpc::InputMessageHandler handler =
+        { brpc::policy::ParseHuluMessage, OrderedProcessHuluRequest,
+          NULL, NULL, "ordered_hulu", brpc::INPUT_PROCESS_INLINE };
+    brpc::Acceptor messenger;
+    ASSERT_EQ(0, StartMessenger(&messenger, socket_name, handler));
+    nprocessed.store(0);
+    nout_of_order.store(0);
+    next_seq = 0;
+
+    butil::fd_guard fd(butil::unix_socket_connect(socket_name));
+    ASSERT_GE(fd, 0);
+    const size_t NBATCH = 64;
+    const size_t NROUND = 200;
+    std::vector<char> buf(NBATCH * MESSAGE_SIZE);
+    for (size_t i = 0; i < NROUND; ++i) {
+        FillMessages(&buf[0], NBATCH, i * NBATCH);
+        ASSERT_TRUE(WriteAll(fd, &buf[0], buf.size()));
+    }
+    WaitProcessed(NBATCH * NROUND, 10000);
+    ASSERT_EQ(NBATCH * NROUND, nprocessed.load());
+    ASSERT_EQ(0u, nout_of_order.load());
+    messenger.StopAccept(0);
+}
+
+TEST_F(MessengerTest, fall_back_to_bthreads_when_blocked) {
+    const char* socket_name = "input_messenger.slow";
+    const brpc::InputMessageHandler handler =
+        { brpc::policy::ParseHuluMessage, SlowProcessHuluRequest,
+          NULL, NULL, "slow_hulu", brpc::INPUT_PROCESS_INLINE };
+    brpc::Acceptor messenger;
+    ASSERT_EQ(0, StartMessenger(&messenger, socket_name, handler));
+    nprocessed.store(0);
+
+    butil::fd_guard fd(butil::unix_socket_connect(socket_name));
+    ASSERT_GE(fd, 0);
+    const size_t N = 32;
+    std::vector<char> buf(N * MESSAGE_SIZE);
+    FillMessages(&buf[0], N, 0);
+    butil::Timer tm;
+    tm.start();
+    ASSERT_TRUE(WriteAll(fd, &buf[0], buf.size()));
+    WaitProcessed(N, 10000);
+    tm.stop();
+    ASSERT_EQ(N, nprocessed.load());
+    // Processing all messages one by one takes at least N * 5ms.
+    ASSERT_LT(tm.m_elapsed(), (int64_t)(N * 5 / 2));
+    messenger.StopAccept(0);
+}
+
+struct PipelineClient {
+    const char* socket_name;
+    volatile bool stop;
+    size_t nsent;
+};
+
+static void* pipeline_client_thread(void* arg) {
+    PipelineClient* c = static_cast<PipelineClient*>(arg);
+    butil::fd_guard fd(butil::unix_socket_connect(c->socket_name));
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to connect to " << c->socket_name;
+        return NULL;
+    }
+    // Pipeline 32 requests, wait for the server to catch up.
+    const size_t NPIPELINE = 32;
+    std::vector<char> buf(NPIPELINE * MESSAGE_SIZE);
+    FillMessages(&buf[0], NPIPELINE, 0);
+    while (!c->stop) {
+        if (!WriteAll(fd, &buf[0], buf.size())) {
+            break;
+        }
+        c->nsent += NPIPELINE;
+        while (!c->stop && nprocessed.load(butil::memory_order_acquire)
+               + NPIPELINE * 4 < c->nsent) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+TEST_F(MessengerTest, pipelined_small_requests) {
+    const brpc::InputProcessMode modes[] = {
+        brpc::INPUT_PROCESS_SPAWN,
+        brpc::INPUT_PROCESS_INLINE,
+        brpc::INPUT_PROCESS_BATCH,
+    };
+    const char* mode_names[] = { "spawn", "inline", "batch" };
+    for (size_t i = 0; i < ARRAY_SIZE(modes); ++i) {
+        char socket_name[64];
+        snprintf(socket_name, sizeof(socket_name),
+                 "input_messenger.pipeline%lu", i);
+        const brpc::InputMessageHandler handler =
+            { brpc::policy::ParseHuluMessage, CountingProcessHuluRequest,
+              NULL, NULL, "counting_hulu", modes[i] };
+        brpc::Acceptor messenger;
+        ASSERT_EQ(0, StartMessenger(&messenger, socket_name, handler));
+        nprocessed.store(0);
+
+        PipelineClient c = { socket_name, false, 0 };
+        pthread_t th;
+        ASSERT_EQ(0, pthread_create(&th, NULL, pipeline_client_thread, &c));
+        butil::Timer tm;
+        tm.start();
+        usleep(2000000);
+        const size_t n = nprocessed.load();
+        tm.stop();
+        c.stop = true;
+        pthread_join(th, NULL);
+        WaitProcessed(c.nsent, 10000);
+        ASSERT_EQ(c.nsent, nprocessed.load());
+        LOG(INFO) << "mode=" << mode_names[i] << " processed "
+                  << n * 1000000L / tm.u_elapsed() << " requests/s";
+        messenger.StopAccept(0);
+    }
+}
@@ -0,0 +1,252 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <string.h>
+#include <set>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/iobuf.h"
+#include "butil/macros.h"
+#include "bvar/bvar.h"
+#include "bthread/bthread.h"
+#include "bthread/numa.h"
+#include "brpc/numa_block_pool.h"
+
+DECLARE_bool(bthread_numa_aware);
+
+namespace {
+
+using namespace brpc::numa;
+
+const int NNODE = 2;
+const size_t BLOCK_SIZE = butil::IOBuf::DEFAULT_BLOCK_SIZE;
+const size_t BLOCKS_PER_NODE = 128;
+
+int64_t GetVar(const std::string& name) {
+    const std::string value = bvar::Variable::describe_exposed(name);
+    if (value.empty()) {
+        return -1;
+    }
+    return strtoll(value.c_str(), NULL, 10);
+}
+
+class NumaBlockPoolTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        ASSERT_EQ(0, InitNumaBlockPool(NNODE, BLOCKS_PER_NODE * BLOCK_SIZE));
+    }
+};
+
+TEST_F(NumaBlockPoolTest, topology) {
+    const int nnode = bthread::numa_node_num();
+    ASSERT_GE(nnode, 1);
+    size_t ncpu = 0;
+    for (int i = 0; i < nnode; ++i) {
+        std::vector<int> cpus;
+        ASSERT_EQ(0, bthread::numa_node_cpus(i, &cpus));
+        for (size_t j = 0; j < cpus.size(); ++j) {
+            ASSERT_EQ(i, bthread::cpu_numa_node(cpus[j]));
+        }
+        ncpu += cpus.size();
+    }
+    ASSERT_GE(ncpu, 1u);
+    std::vector<int> cpus;
+    ASSERT_EQ(-1, bthread::numa_node_cpus(nnode, &cpus));
+    const int node = bthread::current_numa_node();
+    ASSERT_TRUE(node >= 0 && node < nnode) << node;
+}
+
+static void* bind_and_check(void*) {
+    if (bthread::bind_current_thread_to_numa_node(0) != 0) {
+        return (void*)"bind";
+    }
+    if (bthread::current_numa_node() != 0) {
+        return (void*)"node";
+    }
+    return NULL;
+}
+
+TEST_F(NumaBlockPoolTest, bind_thread) {
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, bind_and_check, NULL));
+    void* ret = NULL;
+    ASSERT_EQ(0, pthread_join(th, &ret));
+    ASSERT_TRUE(ret == NULL) << (const char*)ret;
+}
+
+TEST_F(NumaBlockPoolTest, allocate_and_reuse) {
+    for (int node = 0; node < NNODE; ++node) {
+        std::vector<void*> blocks;
+        for (int i = 0; i < 16; ++i) {
+            void* p = AllocateBlockOnNode(BLOCK_SIZE, node);
+            ASSERT_TRUE(p);
+            ASSERT_EQ(node, NodeOfBlock(p));
+            memset(p, node, BLOCK_SIZE);
+            blocks.push_back(p);
+        }
+        ASSERT_EQ(blocks.size(), std::set<void*>(blocks.begin(), blocks.end()).size());
+        void* last = blocks.back();
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            DeallocateBlockOnNode(blocks[i], node);
+        }
+        // Served from the thread-local cache.
+        void* p = AllocateBlockOnNode(100, node);
+        ASSERT_EQ(last, p);
+        DeallocateBlockOnNode(p, node);
+    }
+    // Large blocks are not pooled.
+    void* p = AllocateBlockOnNode(BLOCK_SIZE + 1, 0);
+    ASSERT_TRUE(p);
+    ASSERT_EQ(-1, NodeOfBlock(p));
+    DeallocateBlockOnNode(p, 0);
+    int dummy = 0;
+    ASSERT_EQ(-1, NodeOfBlock(&dummy));
+}
+
+TEST_F(NumaBlockPoolTest, remote_free) {
+    const int64_t remote0 = GetVar("iobuf_numa_remote_free_0");
+    const int64_t remote1 = GetVar("iobuf_numa_remote_free_1");
+    ASSERT_GE(remote0, 0);
+    ASSERT_GE(remote1, 0);
+    void* p = AllocateBlockOnNode(BLOCK_SIZE, 1);
+    ASSERT_EQ(1, NodeOfBlock(p));
+    DeallocateBlockOnNode(p, 0);
+    ASSERT_EQ(remote1 + 1, GetVar("iobuf_numa_remote_free_1"));
+    ASSERT_EQ(remote0, GetVar("iobuf_numa_remote_free_0"));
+    // The block went back to the pool of node 1.
+    p = AllocateBlockOnNode(BLOCK_SIZE, 1);
+    ASSERT_EQ(1, NodeOfBlock(p));
+    DeallocateBlockOnNode(p, 1);
+}
+
+TEST_F(NumaBlockPoolTest, exhausted) {
+    const int64_t fallback = GetVar("iobuf_numa_fallback_1");
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < BLOCKS_PER_NODE + 2; ++i) {
+        void* p = AllocateBlockOnNode(BLOCK_SIZE, 1);
+        ASSERT_TRUE(p);
+        blocks.push_back(p);
+    }
+    size_t npooled = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        npooled += (NodeOfBlock(blocks[i]) == 1);
+    }
+    ASSERT_EQ(BLOCKS_PER_NODE, npooled);
+    ASSERT_EQ(fallback + 2, GetVar("iobuf_numa_fallback_1"));
+    ASSERT_EQ((int64_t)BLOCKS_PER_NODE, GetVar("iobuf_numa_block_count_1"));
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        DeallocateBlockOnNode(blocks[i], 1);
+    }
+}
+
+struct BlockOwner {
+    int node;
+    pthread_t th;
+};
+
+static void* allocate_and_free_randomly(void* arg) {
+    BlockOwner* o = static_cast<BlockOwner*>(arg);
+    std::vector<std::pair<void*, size_t> > mine;
+    for (int i = 0; i < 100000; ++i) {
+        if (mine.size() < 16 && butil::fast_rand_less_than(2) == 0) {
+            void* p = AllocateBlockOnNode(BLOCK_SIZE, o->node);
+            memset(p, i & 0xFF, BLOCK_SIZE);
+            mine.push_back(std::make_pair(p, (size_t)(i & 0xFF)));
+        } else if (!mine.empty()) {
+            const size_t idx = butil::fast_rand_less_than(mine.size());
+            const unsigned char* p = (const unsigned char*)mine[idx].first;
+            if (p[0] != mine[idx].second || p[BLOCK_SIZE - 1] != mine[idx].second) {
+                return (void*)"corrupted";
+            }
+            // Free blocks in both nodes.
+            DeallocateBlockOnNode(mine[idx].first, i % NNODE);
+            mine[idx] = mine.back();
+            mine.pop_back();
+        }
+    }
+    for (size_t i = 0; i < mine.size(); ++i) {
+        DeallocateBlockOnNode(mine[i].first, o->node);
+    }
+    return NULL;
+}
+
+TEST_F(NumaBlockPoolTest, multiple_threads) {
+    BlockOwner owners[4];
+    for (size_t i = 0; i < ARRAY_SIZE(owners); ++i) {
+        owners[i].node = i % NNODE;
+        ASSERT_EQ(0, pthread_create(&owners[i].th, NULL,
+                                    allocate_and_free_randomly, &owners[i]));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(owners); ++i) {
+        void* ret = NULL;
+        ASSERT_EQ(0, pthread_join(owners[i].th, &ret));
+        ASSERT_TRUE(ret == NULL) << (const char*)ret;
+    }
+    // All blocks are back to the pool after threads quit.
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < BLOCKS_PER_NODE; ++i) {
+        blocks.push_back(AllocateBlockOnNode(BLOCK_SIZE, 0));
+        ASSERT_EQ(0, NodeOfBlock(blocks.back()));
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        DeallocateBlockOnNode(blocks[i], 0);
+    }
+}
+
+static void* small_task(void*) {
+    bthread_usleep(10);
+    return NULL;
+}
+
+static void* spawn_tasks(void*) {
+    std::vector<bthread_t> tids(1000);
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_start_background(&tids[i], NULL, small_task, NULL);
+    }
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    return NULL;
+}
+
+TEST_F(NumaBlockPoolTest, steal_in_numa_mode) {
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, spawn_tasks, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    int64_t nsteal = 0;
+    for (int i = 0; i < bthread::numa_node_num(); ++i) {
+        const int64_t local = GetVar("bthread_numa_steal_local_" + std::to_string(i));
+        const int64_t remote = GetVar("bthread_numa_steal_remote_" + std::to_string(i));
+        ASSERT_GE(local, 0);
+        ASSERT_GE(remote, 0);
+        nsteal += local + remote;
+    }
+    ASSERT_GT(nsteal, 0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    // Must be set before any bthread is created.
+    FLAGS_bthread_numa_aware = true;
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
@@ -22,8 +22,11 @@
 #include "brpc/channel.h"
 #include "brpc/controller.h"
 #include "butil/strings/string_piece.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"
 #include "echo.pb.h"
 #include "bvar/multi_dimension.h"
+#include "brpc/builtin/prometheus_metrics_service.h"
 
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
@@ -195,3 +198,153 @@ TEST(PrometheusMetrics, sanity) {
     ASSERT_EQ(0, server.Stop(0));
     ASSERT_EQ(0, server.Join());
 }
+
+namespace bvar {
+DECLARE_bool(bvar_latency_recorder_use_histogram);
+}
+
+TEST(PrometheusMetrics, latency_histogram) {
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = true;
+    bvar::LatencyRecorder rec("prometheus_histogram_test");
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = false;
+    for (int i = 1; i <= 100; ++i) {
+        rec << i;
+    }
+    butil::IOBuf buf;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+    const std::string res = buf.to_string();
+    const std::string name = "prometheus_histogram_test_latency_histogram";
+    ASSERT_NE(std::string::npos, res.find("# TYPE " + name + " histogram\n")) << res;
+    ASSERT_NE(std::string::npos, res.find(name + "_bucket{le=\"1\"} 1\n"));
+    ASSERT_NE(std::string::npos, res.find(name + "_bucket{le=\"64\"} 64\n"));
+    ASSERT_NE(std::string::npos, res.find(name + "_bucket{le=\"128\"} 100\n"));
+    ASSERT_NE(std::string::npos, res.find(name + "_bucket{le=\"+Inf\"} 100\n"));
+    ASSERT_NE(std::string::npos, res.find(name + "_sum 5050\n"));
+    ASSERT_NE(std::string::npos, res.find(name + "_count 100\n"));
+}
+
+namespace brpc {
+DECLARE_int32(prometheus_metrics_chunk_size);
+}
+
+static std::string ScrapeMetrics(int port, const char* accept,
+                                 std::string* content_type) {
+    brpc::Channel channel;
+    brpc::ChannelOptions channel_opts;
+    channel_opts.protocol = "http";
+    channel_opts.timeout_ms = 10000;
+    EXPECT_EQ(0, channel.Init("127.0.0.1", port, &channel_opts));
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/brpc_metrics";
+    if (accept) {
+        cntl.http_request().SetHeader("Accept", accept);
+    }
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    if (content_type) {
+        *content_type = cntl.http_response().content_type();
+    }
+    return cntl.response_attachment().to_string();
+}
+
+TEST(PrometheusMetrics, openmetrics) {
+    brpc::Server server;
+    DummyEchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8615, NULL));
+    bvar::MultiDimension<bvar::LatencyRecorder> my_mlat(
+        "openmetrics_mlat", std::list<std::string>{"label1"});
+    *my_mlat.get_stats({"val1"}) << 1 << 2;
+
+    std::string content_type;
+    const std::string res = ScrapeMetrics(
+        8615, "application/openmetrics-text; version=1.0.0,text/plain;q=0.5",
+        &content_type);
+    ASSERT_EQ(0u, content_type.find("application/openmetrics-text")) << content_type;
+    ASSERT_TRUE(butil::StringPiece(res).ends_with("\n# EOF\n"));
+    ASSERT_EQ(std::string::npos, res.find("# HELP"));
+    ASSERT_EQ(std::string::npos, res.find("quantile=\"avg\""));
+    ASSERT_NE(std::string::npos, res.find("# TYPE openmetrics_mlat_count counter\n"));
+    ASSERT_NE(std::string::npos,
+              res.find("\nopenmetrics_mlat_count_total{label1=\"val1\"} 2\n"));
+    ASSERT_NE(std::string::npos,
+              res.find("\nopenmetrics_mlat_qps{label1=\"val1\"} "));
+
+    // The text format is still the default.
+    const std::string res2 = ScrapeMetrics(8615, NULL, &content_type);
+    ASSERT_EQ("text/plain", content_type);
+    ASSERT_EQ(std::string::npos, res2.find("# EOF"));
+    ASSERT_NE(std::string::npos,
+              res2.find("\nopenmetrics_mlat_count{label1=\"val1\"} 2\n"));
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+TEST(PrometheusMetrics, chunked) {
+    brpc::Server server;
+    DummyEchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8616, NULL));
+    const int N = 1000;
+    std::vector<std::unique_ptr<bvar::Adder<int> > > adders;
+    for (int i = 0; i < N; ++i) {
+        adders.emplace_back(new bvar::Adder<int>);
+        adders.back()->expose(butil::string_printf("chunked_adder_%04d", i));
+        *adders.back() << i;
+    }
+    bvar::MultiDimension<bvar::Adder<int> > my_madder(
+        "chunked_madder", std::list<std::string>{"label1"});
+    for (int i = 0; i < N; ++i) {
+        *my_madder.get_stats({std::to_string(i)}) << i;
+    }
+
+    const int32_t saved_chunk_size = brpc::FLAGS_prometheus_metrics_chunk_size;
+    // Output of whole page and small chunks are same.
+    std::string res[2];
+    brpc::FLAGS_prometheus_metrics_chunk_size = 0;
+    res[0] = ScrapeMetrics(8616, NULL, NULL);
+    brpc::FLAGS_prometheus_metrics_chunk_size = 1024;
+    res[1] = ScrapeMetrics(8616, NULL, NULL);
+    brpc::FLAGS_prometheus_metrics_chunk_size = saved_chunk_size;
+    for (int k = 0; k < 2; ++k) {
+        for (int i = 0; i < N; ++i) {
+            const std::string s = butil::string_printf(
+                "\nchunked_adder_%04d %d\n", i, i);
+            ASSERT_NE(std::string::npos, res[k].find(s)) << s;
+            const std::string s2 = butil::string_printf(
+                "\nchunked_madder{label1=\"%d\"} %d\n", i, i);
+            ASSERT_NE(std::string::npos, res[k].find(s2)) << s2;
+        }
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+TEST(PrometheusMetrics, scrape_perf) {
+    brpc::Server server;
+    DummyEchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8617, NULL));
+    bvar::MultiDimension<bvar::LatencyRecorder> my_mlat(
+        "scrape_perf_mlat", std::list<std::string>{"tenant", "method"});
+    for (int i = 0; i < 2000; ++i) {
+        *my_mlat.get_stats({std::to_string(i), "Echo"}) << i;
+    }
+    const int32_t saved_chunk_size = brpc::FLAGS_prometheus_metrics_chunk_size;
+    const int32_t chunk_sizes[] = { 0, saved_chunk_size };
+    for (int32_t chunk_size : chunk_sizes) {
+        brpc::FLAGS_prometheus_metrics_chunk_size = chunk_size;
+        butil::Timer tm;
+        size_t nbytes = 0;
+        tm.start();
+        for (int i = 0; i < 5; ++i) {
+            nbytes += ScrapeMetrics(8617, NULL, NULL).size();
+        }
+        tm.stop();
+        LOG(INFO) << "chunk_size=" << chunk_size << " scrape "
+                  << nbytes / 5 << " bytes in " << tm.u_elapsed() / 5 << "us";
+    }
+    brpc::FLAGS_prometheus_metrics_chunk_size = saved_chunk_size;
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
@@ -0,0 +1,248 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/file_util.h"
+#include "butil/files/file_enumerator.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/channel.h"
+#include "brpc/server.h"
+#include "brpc/rpc_dump.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_string(rpc_dump_dir);
+DECLARE_int32(rpc_dump_max_files);
+DECLARE_int32(rpc_dump_max_requests_in_one_file);
+DECLARE_int32(rpc_dump_compress_type);
+extern bvar::CollectorSpeedLimit g_rpc_dump_sl;
+}
+
+namespace {
+
+const char* DUMP_DIR = "rpc_dump_unittest_dir";
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* req,
+              test::EchoResponse* res,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        if (req->message() == "fail") {
+            static_cast<brpc::Controller*>(cntl_base)->SetFailed(
+                EINVAL, "asked to fail");
+            return;
+        }
+        res->set_message(req->message());
+    }
+};
+
+class RpcDumpTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_EQ(0, _server.AddService(&_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+        ASSERT_EQ(0, _server.Start("127.0.0.1:0", NULL));
+        brpc::ChannelOptions options;
+        options.timeout_ms = 2000;
+        ASSERT_EQ(0, _channel.Init(_server.listen_address(), &options));
+    }
+
+    void TearDown() override {
+        brpc::FLAGS_rpc_dump = false;
+        _server.Stop(0);
+        _server.Join();
+    }
+
+    static void EnableDump() {
+        brpc::FLAGS_rpc_dump_dir = DUMP_DIR;
+        brpc::FLAGS_rpc_dump_max_requests_in_one_file = 10;
+        brpc::FLAGS_rpc_dump_compress_type = brpc::COMPRESS_TYPE_SNAPPY;
+        // Sample all requests.
+        brpc::g_rpc_dump_sl.ever_grabbed = true;
+        brpc::g_rpc_dump_sl.sampling_range = bvar::COLLECTOR_SAMPLING_BASE;
+        brpc::FLAGS_rpc_dump = true;
+    }
+
+    EchoServiceImpl _svc;
+    brpc::Server _server;
+    brpc::Channel _channel;
+};
+
+static std::vector<brpc::SampledRequest*> ReadSamples() {
+    std::vector<brpc::SampledRequest*> samples;
+    brpc::SampleIterator it(DUMP_DIR);
+    for (brpc::SampledRequest* s = it.Next(); s != NULL; s = it.Next()) {
+        samples.push_back(s);
+    }
+    return samples;
+}
+
+TEST_F(RpcDumpTest, dump_with_response_meta) {
+    EnableDump();
+    const int N = 50;
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < N; ++i) {
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(i % 10 == 9 ? "fail" : "hello");
+        brpc::Controller cntl;
+        test::EchoService_Stub(&_channel).Echo(&cntl, &req, &res, NULL);
+        ASSERT_EQ(i % 10 == 9, cntl.Failed()) << cntl.ErrorText();
+        usleep(1000);
+    }
+    const int64_t end_us = butil::gettimeofday_us();
+
+    // Files are written by the collecting thread and the writer in batch.
+    std::vector<brpc::SampledRequest*> samples;
+    for (int i = 0; i < 100 && (int)samples.size() < N; ++i) {
+        usleep(100000);
+        for (size_t j = 0; j < samples.size(); ++j) {
+            delete samples[j];
+        }
+        samples = ReadSamples();
+    }
+    ASSERT_EQ((size_t)N, samples.size());
+    int nfailed = 0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const brpc::RpcDumpMeta& meta = samples[i]->meta;
+        ASSERT_EQ(brpc::PROTOCOL_BAIDU_STD, meta.protocol_type());
+        ASSERT_EQ("Echo", meta.method_name());
+        ASSERT_GE(meta.arrival_time_us(), start_us);
+        ASSERT_LE(meta.arrival_time_us(), end_us);
+        ASSERT_TRUE(meta.has_latency_us());
+        ASSERT_GE(meta.latency_us(), 0);
+        ASSERT_LT(0, meta.response_size());
+        test::EchoRequest req;
+        ASSERT_TRUE(req.ParseFromString(samples[i]->request.to_string()));
+        if (req.message() == "fail") {
+            ASSERT_EQ(EINVAL, meta.error_code());
+            ++nfailed;
+        } else {
+            ASSERT_EQ(0, meta.error_code());
+        }
+        delete samples[i];
+    }
+    ASSERT_EQ(N / 10, nfailed);
+
+    // All files are compressed.
+    butil::FileEnumerator e(butil::FilePath(DUMP_DIR), false,
+                            butil::FileEnumerator::FILES);
+    int nfile = 0;
+    for (butil::FilePath name = e.Next(); !name.empty(); name = e.Next()) {
+        char magic[4];
+        ASSERT_EQ(4, butil::ReadFile(name, magic, sizeof(magic)));
+        ASSERT_EQ(0, memcmp(magic, "PRPZ", 4));
+        ++nfile;
+    }
+    ASSERT_EQ(N / 10, nfile);
+    butil::DeleteFile(butil::FilePath(DUMP_DIR), true);
+}
+
+struct CallerArg {
+    brpc::Channel* channel;
+    int64_t stop_us;
+    int64_t ncall;
+};
+
+static void* call_echo(void* arg) {
+    CallerArg* a = static_cast<CallerArg*>(arg);
+    test::EchoRequest req;
+    req.set_message(std::string(200, 'a'));
+    while (butil::gettimeofday_us() < a->stop_us) {
+        test::EchoResponse res;
+        brpc::Controller cntl;
+        test::EchoService_Stub(a->channel).Echo(&cntl, &req, &res, NULL);
+        if (!cntl.Failed()) {
+            ++a->ncall;
+        }
+    }
+    return NULL;
+}
+
+// Returns qps, number of successful calls is stored in `ncall_out'.
+static double RunEcho(brpc::Channel* channel, int64_t* ncall_out) {
+    CallerArg args[8];
+    bthread_t tids[ARRAY_SIZE(args)];
+    const int64_t start_us = butil::gettimeofday_us();
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        args[i].channel = channel;
+        args[i].stop_us = start_us + 1000000;
+        args[i].ncall = 0;
+        EXPECT_EQ(0, bthread_start_background(&tids[i], NULL, call_echo, &args[i]));
+    }
+    int64_t ncall = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        bthread_join(tids[i], NULL);
+        ncall += args[i].ncall;
+    }
+    *ncall_out = ncall;
+    return ncall * 1000000.0 / (butil::gettimeofday_us() - start_us);
+}
+
+TEST_F(RpcDumpTest, dump_overhead) {
+    int64_t ncall_without_dump = 0;
+    const double qps_without_dump = RunEcho(&_channel, &ncall_without_dump);
+    ASSERT_LT(0, ncall_without_dump);
+    EnableDump();
+    int64_t ncall = 0;
+    const double qps_with_dump = RunEcho(&_channel, &ncall);
+    ASSERT_LT(0, ncall);
+    LOG(INFO) << "qps without dump=" << (int64_t)qps_without_dump
+              << " dump all requests=" << (int64_t)qps_with_dump;
+    brpc::FLAGS_rpc_dump = false;
+
+    // The collector may drop samples under load and old files are removed
+    // beyond -rpc_dump_max_files, so only a subset of calls is dumped.
+    // Wait until the writer stops adding samples.
+    std::vector<brpc::SampledRequest*> samples;
+    size_t last_size = 0;
+    for (int i = 0; i < 100; ++i) {
+        usleep(100000);
+        for (size_t j = 0; j < samples.size(); ++j) {
+            delete samples[j];
+        }
+        samples = ReadSamples();
+        if (!samples.empty() && samples.size() == last_size) {
+            break;
+        }
+        last_size = samples.size();
+    }
+    ASSERT_FALSE(samples.empty());
+    ASSERT_GE(ncall, (int64_t)samples.size());
+    ASSERT_GE((size_t)brpc::FLAGS_rpc_dump_max_files *
+              brpc::FLAGS_rpc_dump_max_requests_in_one_file, samples.size());
+    // Every dumped request is replayable.
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const brpc::RpcDumpMeta& meta = samples[i]->meta;
+        EXPECT_EQ(brpc::PROTOCOL_BAIDU_STD, meta.protocol_type());
+        EXPECT_EQ("Echo", meta.method_name());
+        EXPECT_EQ(0, meta.error_code());
+        test::EchoRequest req;
+        EXPECT_TRUE(req.ParseFromString(samples[i]->request.to_string()));
+        EXPECT_EQ(std::string(200, 'a'), req.message());
+        delete samples[i];
+    }
+    butil::DeleteFile(butil::FilePath(DUMP_DIR), true);
+}
+
+} // namespace
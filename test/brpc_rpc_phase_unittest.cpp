@@ -0,0 +1,221 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/string_printf.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bvar/detail/histogram.h"
+#include "brpc/channel.h"
+#include "brpc/server.h"
+#include "brpc/details/method_status.h"
+#include "brpc/details/rpc_phase.h"
+#include "brpc/details/server_private_accessor.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(enable_rpcz);
+DECLARE_bool(rpc_phase_breakdown);
+}
+
+namespace {
+
+TEST(RpcPhaseTest, duration) {
+    brpc::RpcPhaseTimes t;
+    for (int i = 0; i < brpc::RPC_PHASE_COUNT; ++i) {
+        ASSERT_EQ(-1, t.duration_us((brpc::RpcPhase)i));
+    }
+    t.begin_us[brpc::RPC_PHASE_QUEUE] = 100;
+    t.begin_us[brpc::RPC_PHASE_PARSE] = 110;
+    t.begin_us[brpc::RPC_PHASE_HANDLER] = 130;
+    ASSERT_EQ(10, t.duration_us(brpc::RPC_PHASE_QUEUE));
+    ASSERT_EQ(20, t.duration_us(brpc::RPC_PHASE_PARSE));
+    // The request failed before responding.
+    ASSERT_EQ(-1, t.duration_us(brpc::RPC_PHASE_HANDLER));
+    t.begin_us[brpc::RPC_PHASE_SERIALIZE] = 1130;
+    t.begin_us[brpc::RPC_PHASE_WRITE] = 1135;
+    t.end_us = 1200;
+    ASSERT_EQ(1000, t.duration_us(brpc::RPC_PHASE_HANDLER));
+    ASSERT_EQ(5, t.duration_us(brpc::RPC_PHASE_SERIALIZE));
+    ASSERT_EQ(65, t.duration_us(brpc::RPC_PHASE_WRITE));
+    t.clear();
+    ASSERT_EQ(-1, t.duration_us(brpc::RPC_PHASE_QUEUE));
+    ASSERT_STREQ("handler", brpc::RpcPhaseName(brpc::RPC_PHASE_HANDLER));
+}
+
+class SleepyEchoService : public test::EchoService {
+public:
+    SleepyEchoService() : last_trace_id(0) {}
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        // Span of the client is submitted when the call ends, record the
+        // trace at server side.
+        last_trace_id = cntl->trace_id();
+        bthread_usleep(request->sleep_us());
+        response->set_message(request->message());
+    }
+
+    uint64_t last_trace_id;
+};
+
+uint64_t PhaseCount(const brpc::MethodStatus* status, brpc::RpcPhase phase) {
+    bvar::detail::HistogramBuckets buckets;
+    status->_phase_rec->GetCumulatedPhase(phase, &buckets);
+    return buckets.count();
+}
+
+class RpcPhaseServerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        // Only methods added while the flag is on are recorded.
+        brpc::FLAGS_rpc_phase_breakdown = true;
+        ASSERT_EQ(0, _server.AddService(&_service,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+        brpc::FLAGS_rpc_phase_breakdown = false;
+        ASSERT_EQ(0, _server.Start(8626, NULL));
+        const brpc::Server::MethodProperty* mp =
+            brpc::ServerPrivateAccessor(&_server).FindMethodPropertyByFullName(
+                "test.EchoService.Echo");
+        ASSERT_TRUE(mp != NULL);
+        _status = mp->status;
+        ASSERT_TRUE(_status->_phase_rec != NULL);
+    }
+    void TearDown() override {
+        _server.Stop(0);
+        _server.Join();
+    }
+
+    void CallEcho(const char* protocol, int n) {
+        brpc::ChannelOptions opt;
+        opt.protocol = protocol;
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init("127.0.0.1:8626", &opt));
+        test::EchoService_Stub stub(&channel);
+        for (int i = 0; i < n; ++i) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message("hello");
+            req.set_sleep_us(20000);
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        }
+    }
+
+    SleepyEchoService _service;
+    brpc::Server _server;
+    brpc::MethodStatus* _status;
+};
+
+TEST_F(RpcPhaseServerTest, record_phases) {
+    const char* protocols[] = { "baidu_std", "http", "h2:grpc" };
+    for (size_t i = 0; i < ARRAY_SIZE(protocols); ++i) {
+        CallEcho(protocols[i], 10);
+        // Phases are recorded after the response is handed to the socket,
+        // which may be later than the client receives it.
+        for (int k = 0; k < 100 && PhaseCount(_status, brpc::RPC_PHASE_WRITE)
+                 < 10 * (i + 1); ++k) {
+            usleep(10000);
+        }
+        for (int j = 0; j < brpc::RPC_PHASE_COUNT; ++j) {
+            ASSERT_EQ(10 * (i + 1), PhaseCount(_status, (brpc::RpcPhase)j))
+                << protocols[i] << " phase=" << j;
+        }
+    }
+    bvar::detail::HistogramBuckets handler;
+    _status->_phase_rec->GetCumulatedPhase(brpc::RPC_PHASE_HANDLER, &handler);
+    ASSERT_GE(handler.sum / (int64_t)handler.count(), 20000);
+    ASSERT_GE(handler.get_number(0.01), 20000 * 15 / 16);
+
+    // Values in windows are visible after being sampled.
+    usleep(1100000);
+    double avg_us = 0;
+    int64_t p99_us = 0;
+    _status->_phase_rec->GetPhase(brpc::RPC_PHASE_HANDLER, 0.99, &avg_us, &p99_us);
+    ASSERT_GE(avg_us, 20000);
+    ASSERT_GE(p99_us, 20000);
+    _status->_phase_rec->GetPhase(brpc::RPC_PHASE_QUEUE, 0.99, &avg_us, &p99_us);
+    LOG(INFO) << "queue avg=" << avg_us << " p99=" << p99_us;
+    ASSERT_LT(avg_us, 20000);
+
+    std::ostringstream os;
+    brpc::DescribeOptions opt;
+    _status->Describe(os, opt);
+    LOG(INFO) << os.str();
+    ASSERT_NE(std::string::npos, os.str().find("phases(avg/p99 us): queue="));
+    ASSERT_NE(std::string::npos, os.str().find(" handler=2"));
+    opt.use_html = true;
+    os.str("");
+    _status->Describe(os, opt);
+    ASSERT_NE(std::string::npos, os.str().find("title=\"handler avg="));
+}
+
+TEST_F(RpcPhaseServerTest, rpcz) {
+    brpc::FLAGS_enable_rpcz = true;
+    CallEcho("baidu_std", 1);
+    const uint64_t trace_id = _service.last_trace_id;
+    ASSERT_NE(0u, trace_id);
+
+    brpc::ChannelOptions opt;
+    opt.protocol = "http";
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8626", &opt));
+    std::string page;
+    // Spans are collected in background.
+    for (int i = 0; i < 30; ++i) {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = butil::string_printf(
+            "/rpcz?trace=%llx", (unsigned long long)trace_id);
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        page = cntl.response_attachment().to_string();
+        if (page.find("Phases:") != std::string::npos) {
+            break;
+        }
+        usleep(100000);
+    }
+    brpc::FLAGS_enable_rpcz = false;
+    LOG(INFO) << page;
+    ASSERT_NE(std::string::npos, page.find("Writing response"));
+    ASSERT_NE(std::string::npos, page.find("Phases: queue="));
+    ASSERT_NE(std::string::npos, page.find(" write="));
+}
+
+TEST_F(RpcPhaseServerTest, overhead) {
+    // Cost of timestamps and recording of all phases.
+    const int N = 1000000;
+    brpc::RpcPhaseTimes t;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < brpc::RPC_PHASE_COUNT; ++j) {
+            t.begin_us[j] = butil::cpuwide_time_us();
+        }
+        t.end_us = butil::cpuwide_time_us();
+        _status->OnPhases(t);
+    }
+    tm.stop();
+    LOG(INFO) << "Timestamping and recording phases takes "
+              << tm.n_elapsed() / N << "ns per request";
+}
+
+} // namespace
@@ -53,6 +53,7 @@
 #include "brpc/socket_map.h"
 #include "brpc/controller.h"
 #include "brpc/compress.h"
+#include "brpc/details/method_status.h"
 #include "echo.pb.h"
 #include "v1.pb.h"
 #include "v2.pb.h"
@@ -1421,6 +1422,40 @@ TEST_F(ServerTest, serving_requests) {
     ASSERT_EQ(0, server.Join());
 }
 
+TEST_F(ServerTest, method_task_time) {
+    EchoServiceImpl echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8613, NULL));
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("127.0.0.1:8613", NULL));
+    test::EchoService_Stub stub(&chan);
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        req.set_sleep_us(50000);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+    // Wait for windows to be sampled.
+    usleep(1100000);
+    const brpc::Server::MethodProperty* mp =
+        server.FindMethodPropertyByFullName("test.EchoService.Echo");
+    ASSERT_TRUE(mp != NULL);
+    brpc::MethodStatus* st = mp->status;
+    EXPECT_GE(st->_blocked_us_bvar.get_value(), 50000);
+    EXPECT_GT(st->_on_cpu_us_bvar.get_value(), 0);
+    EXPECT_LT(st->_on_cpu_us_bvar.get_value(), 50000);
+    std::ostringstream os;
+    st->Describe(os, brpc::DescribeOptions());
+    ASSERT_NE(std::string::npos, os.str().find("blocked_us: ")) << os.str();
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
 TEST_F(ServerTest, create_pid_file) {
     {
         brpc::Server server;
@@ -1713,7 +1748,10 @@ public:
         content_type = (brpc::ContentType)_content_type_index;
         compress_type = (brpc::CompressType)_compress_type_index;
         ++_compress_type_index;
-        if (_compress_type_index == brpc::COMPRESS_TYPE_LZ4) {
+        // Skip types not compiled in, e.g. lz4 and zstd.
+        while (_compress_type_index <= brpc::CompressType_MAX &&
+               brpc::FindCompressHandler(
+                   (brpc::CompressType)_compress_type_index) == NULL) {
             ++_compress_type_index;
         }
         if (_compress_type_index > brpc::CompressType_MAX) {
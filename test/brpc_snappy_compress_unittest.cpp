@@ -28,6 +28,10 @@
 #include "snappy_message.pb.h"
 #include "brpc/policy/snappy_compress.h"
 #include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/compress.h"
+#include "brpc/global.h"
 
 typedef bool (*Compress)(const google::protobuf::Message&, butil::IOBuf*);
 typedef bool (*Decompress)(const butil::IOBuf&, google::protobuf::Message*);
@@ -253,3 +257,159 @@ TEST_F(test_compress_method, mass_snappy_iobuf) {
     ASSERT_TRUE(strcmp(check_str.c_str(), text) == 0);
     delete [] text;
 }
+
+// Builds a message looking like real payloads: words from a small
+// vocabulary and integers of various magnitudes, instead of repeated
+// patterns which are compressed unrealistically well.
+static void MakeRepresentativeMessage(size_t len, unsigned seed,
+                                      snappy_message::SnappyMessageProto* msg) {
+    static const char* const words[] = {
+        "user_id", "item", "score", "timestamp", "feature", "click",
+        "region", "beijing", "shanghai", "true", "false", "null", "{", "}",
+        "\"name\":", "\"value\":", "0.75", "category", "sports", "news",
+    };
+    std::string text;
+    while (text.size() + 6 * sizeof(int32_t) < len / 2) {
+        seed = seed * 1103515245 + 12345;
+        text.append(words[(seed >> 16) % ARRAY_SIZE(words)]);
+        text.push_back(' ');
+    }
+    msg->set_text(text);
+    msg->clear_numbers();
+    for (size_t i = 0; text.size() + msg->numbers_size() * 3 < len; ++i) {
+        seed = seed * 1103515245 + 12345;
+        msg->add_numbers((seed >> 8) % (1 << (i % 24 + 1)));
+    }
+}
+
+// Builds an IOBuf with many blocks of various sizes.
+static void MakeMultiBlockData(size_t len, butil::IOBuf* buf, std::string* str) {
+    snappy_message::SnappyMessageProto msg;
+    MakeRepresentativeMessage(len, 1, &msg);
+    std::string data;
+    msg.SerializeToString(&data);
+    for (size_t i = 0, n = 1; i < data.size(); i += n, n = n * 2 % 100000 + 1) {
+        butil::IOBuf piece;
+        piece.append(data.data() + i, std::min(n, data.size() - i));
+        buf->append(piece);
+    }
+    *str = data;
+}
+
+static void TestIOBufRoundTrip(bool (*compress)(const butil::IOBuf&, butil::IOBuf*),
+                               bool (*decompress)(const butil::IOBuf&, butil::IOBuf*)) {
+    const size_t lens[] = { 0, 1, 100, 8192, 65536 + 3, 1024 * 1024 };
+    for (size_t i = 0; i < ARRAY_SIZE(lens); ++i) {
+        butil::IOBuf in;
+        std::string expected;
+        MakeMultiBlockData(lens[i], &in, &expected);
+        butil::IOBuf compressed;
+        ASSERT_TRUE(compress(in, &compressed));
+        ASSERT_EQ(expected, in.to_string());
+        butil::IOBuf out;
+        ASSERT_TRUE(decompress(compressed, &out));
+        ASSERT_EQ(expected, out.to_string());
+
+        // Compressed data split into blocks of 1 byte.
+        butil::IOBuf split;
+        const std::string compressed_str = compressed.to_string();
+        for (size_t j = 0; j < compressed_str.size(); ++j) {
+            butil::IOBuf b;
+            b.push_back(compressed_str[j]);
+            split.append(b);
+        }
+        out.clear();
+        ASSERT_TRUE(decompress(split, &out));
+        ASSERT_EQ(expected, out.to_string());
+
+        // Truncated
+        butil::IOBuf truncated;
+        compressed.append_to(&truncated, compressed.size() - 1);
+        out.clear();
+        ASSERT_FALSE(decompress(truncated, &out));
+    }
+    butil::IOBuf garbage;
+    garbage.append("this is not compressed");
+    butil::IOBuf out;
+    ASSERT_FALSE(decompress(garbage, &out));
+}
+
+static void TestMessageRoundTrip(Compress compress, Decompress decompress) {
+    snappy_message::SnappyMessageProto old_msg;
+    MakeRepresentativeMessage(12435, 2, &old_msg);
+    butil::IOBuf buf;
+    ASSERT_TRUE(compress(old_msg, &buf));
+    ASSERT_LT(buf.size(), old_msg.ByteSizeLong());
+    snappy_message::SnappyMessageProto new_msg;
+    ASSERT_TRUE(decompress(buf, &new_msg));
+    ASSERT_EQ(old_msg.SerializeAsString(), new_msg.SerializeAsString());
+}
+
+#if BRPC_WITH_LZ4
+TEST_F(test_compress_method, lz4) {
+    TestMessageRoundTrip(brpc::policy::Lz4Compress, brpc::policy::Lz4Decompress);
+}
+
+TEST_F(test_compress_method, lz4_iobuf) {
+    TestIOBufRoundTrip(brpc::policy::Lz4Compress, brpc::policy::Lz4Decompress);
+}
+#endif  // BRPC_WITH_LZ4
+
+#if BRPC_WITH_ZSTD
+TEST_F(test_compress_method, zstd) {
+    TestMessageRoundTrip(brpc::policy::ZstdCompress, brpc::policy::ZstdDecompress);
+}
+
+TEST_F(test_compress_method, zstd_iobuf) {
+    TestIOBufRoundTrip(brpc::policy::ZstdCompress, brpc::policy::ZstdDecompress);
+}
+
+TEST_F(test_compress_method, zstd_dictionary) {
+    std::string dict;
+    for (unsigned i = 0; i < 16; ++i) {
+        snappy_message::SnappyMessageProto sample;
+        MakeRepresentativeMessage(256, 100 + i, &sample);
+        dict.append(sample.SerializeAsString());
+    }
+    snappy_message::SnappyMessageProto msg;
+    MakeRepresentativeMessage(256, 3, &msg);
+
+    butil::IOBuf without_dict;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(msg, &without_dict));
+    ASSERT_EQ(0, brpc::policy::SetZstdDictionary(dict));
+    butil::IOBuf with_dict;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(msg, &with_dict));
+    ASSERT_LT(with_dict.size(), without_dict.size());
+    snappy_message::SnappyMessageProto new_msg;
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(with_dict, &new_msg));
+    ASSERT_EQ(msg.SerializeAsString(), new_msg.SerializeAsString());
+    TestIOBufRoundTrip(brpc::policy::ZstdCompress, brpc::policy::ZstdDecompress);
+
+    ASSERT_EQ(0, brpc::policy::SetZstdDictionary(""));
+    new_msg.Clear();
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(without_dict, &new_msg));
+    ASSERT_EQ(msg.SerializeAsString(), new_msg.SerializeAsString());
+}
+#endif  // BRPC_WITH_ZSTD
+
+TEST_F(test_compress_method, registered_handlers_throughput) {
+    brpc::GlobalInitializeOrDie();
+    std::vector<brpc::CompressHandler> handlers;
+    brpc::ListCompressHandler(&handlers);
+    ASSERT_FALSE(handlers.empty());
+    const int lens[] = {128, 1024, 16*1024, 512*1024};
+    printf("%20s%20s%20s%20s%30s%30s%30s\n", "Compress method", "Compress size(B)",
+           "Compress time(us)", "Decompress time(us)", "Compress throughput(MB/s)",
+           "Decompress throughput(MB/s)", "Compress ratio");
+    for (size_t i = 0; i < ARRAY_SIZE(lens); ++i) {
+        snappy_message::SnappyMessageProto msg;
+        MakeRepresentativeMessage(lens[i], i, &msg);
+        const int len = msg.ByteSizeLong();
+        const int k = std::min(32*1024*1024/len, 5000);
+        for (size_t j = 0; j < handlers.size(); ++j) {
+            CompressMessage(handlers[j].name, k, msg, len,
+                            handlers[j].Compress, handlers[j].Decompress);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,408 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/file_util.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/channel.h"
+#include "brpc/server.h"
+#include "brpc/span.h"
+#include "brpc/span_store.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(enable_rpcz);
+extern bvar::CollectorSpeedLimit g_span_sl;
+}
+
+namespace {
+
+const char* SPILL_DIR = "span_store_unittest_dir";
+const int64_t BASE_US = 1700000000000000L;
+
+brpc::SpanSummary MakeSummary(uint64_t trace_id, uint64_t span_id,
+                              int64_t start_us) {
+    brpc::SpanSummary s;
+    s.trace_id = trace_id;
+    s.span_id = span_id;
+    s.log_id = span_id * 10;
+    s.start_real_us = start_us;
+    s.latency_us = span_id % 100;
+    s.request_size = 100;
+    s.response_size = 200;
+    s.error_code = 0;
+    s.type = brpc::SPAN_TYPE_SERVER;
+    return s;
+}
+
+std::string MakeData(uint64_t trace_id, uint64_t span_id, int64_t start_us) {
+    brpc::RpczSpan span;
+    span.set_trace_id(trace_id);
+    span.set_span_id(span_id);
+    span.set_parent_span_id(0);
+    span.set_log_id(span_id * 10);
+    span.set_base_cid(0);
+    span.set_ending_cid(0);
+    span.set_remote_ip(0x7f000001);
+    span.set_remote_port(8000);
+    span.set_type(brpc::SPAN_TYPE_SERVER);
+    span.set_async(false);
+    span.set_protocol(brpc::PROTOCOL_BAIDU_STD);
+    span.set_request_size(100);
+    span.set_response_size(200);
+    span.set_received_real_us(start_us);
+    span.set_start_parse_real_us(start_us + 1);
+    span.set_start_callback_real_us(start_us + 2);
+    span.set_start_send_real_us(start_us + 3);
+    span.set_sent_real_us(start_us + 4);
+    span.set_full_method_name("test.EchoService.Echo");
+    span.set_info(std::string(64, 'i'));
+    std::string data;
+    span.SerializeToString(&data);
+    return data;
+}
+
+void AddSpan(brpc::SpanStore* store, uint64_t trace_id, uint64_t span_id,
+             int64_t start_us) {
+    ASSERT_EQ(0, store->Add(MakeSummary(trace_id, span_id, start_us),
+                            "test.EchoService.Echo",
+                            MakeData(trace_id, span_id, start_us)));
+}
+
+class LatencyFilter : public brpc::SpanFilter {
+public:
+    explicit LatencyFilter(int64_t min_latency) : _min_latency(min_latency) {}
+    bool Keep(const brpc::BriefSpan& span) override {
+        return span.latency_us() >= _min_latency;
+    }
+private:
+    int64_t _min_latency;
+};
+
+TEST(SpanStoreTest, find_spans) {
+    brpc::SpanStore store;
+    ASSERT_EQ(0, store.Init(brpc::SpanStoreOptions()));
+    // 100 traces of 5 spans spread over 100 seconds.
+    for (int i = 0; i < 500; ++i) {
+        AddSpan(&store, i % 100 + 1, i + 1, BASE_US + i * 200000L);
+    }
+    ASSERT_EQ(500u, store.span_count());
+    brpc::RpczSpan span;
+    ASSERT_EQ(0, store.FindSpan(8, 108, &span));
+    ASSERT_EQ(8u, span.trace_id());
+    ASSERT_EQ(108u, span.span_id());
+    ASSERT_EQ(1080u, span.log_id());
+    ASSERT_EQ(BASE_US + 107 * 200000L, span.received_real_us());
+    ASSERT_EQ(-1, store.FindSpan(8, 109, &span));
+    ASSERT_EQ(-1, store.FindSpan(101, 1, &span));
+
+    std::deque<brpc::RpczSpan> spans;
+    store.FindSpans(8, &spans);
+    ASSERT_EQ(5u, spans.size());
+    std::vector<uint64_t> ids;
+    for (size_t i = 0; i < spans.size(); ++i) {
+        ASSERT_EQ(8u, spans[i].trace_id());
+        ids.push_back(spans[i].span_id());
+    }
+    std::sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(8 + i * 100, ids[i]);
+    }
+    store.FindSpans(101, &spans);
+    ASSERT_TRUE(spans.empty());
+}
+
+TEST(SpanStoreTest, list_spans) {
+    brpc::SpanStore store;
+    ASSERT_EQ(0, store.Init(brpc::SpanStoreOptions()));
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        AddSpan(&store, i + 1, i + 1, BASE_US + i * 100000L);
+    }
+    // A late span is appended to the latest segment of its shard.
+    AddSpan(&store, N + 1, N + 1, BASE_US + 50 * 100000L + 1);
+
+    std::deque<brpc::BriefSpan> spans;
+    store.ListSpans(BASE_US + 60 * 100000L, 20, &spans, NULL);
+    ASSERT_EQ(20u, spans.size());
+    ASSERT_EQ(61u, spans[0].span_id());
+    ASSERT_EQ(BASE_US + 60 * 100000L, spans[0].start_real_us());
+    ASSERT_EQ("test.EchoService.Echo", spans[0].full_method_name());
+    ASSERT_EQ(610u, spans[0].log_id());
+    for (size_t i = 1; i < spans.size(); ++i) {
+        ASSERT_GE(spans[i - 1].start_real_us(), spans[i].start_real_us());
+    }
+    ASSERT_EQ(N + 1u, spans[10].span_id());
+    ASSERT_EQ(51u, spans[11].span_id());
+
+    // Spans rejected by the filter are counted as well.
+    LatencyFilter filter(50);
+    store.ListSpans(BASE_US + N * 100000L, 100, &spans, &filter);
+    ASSERT_EQ(50u, spans.size());
+    ASSERT_EQ(N - 1u, spans[0].span_id());
+
+    store.ListSpans(BASE_US - 1, 100, &spans, NULL);
+    ASSERT_TRUE(spans.empty());
+    store.ListSpans(BASE_US + N * 100000L, 0, &spans, NULL);
+    ASSERT_TRUE(spans.empty());
+}
+
+TEST(SpanStoreTest, remove_spans_before) {
+    brpc::SpanStoreOptions options;
+    options.segment_span_us = 1000000;
+    brpc::SpanStore store;
+    ASSERT_EQ(0, store.Init(options));
+    for (int i = 0; i < 100; ++i) {
+        // Trace 1 spans over all segments.
+        AddSpan(&store, i % 2 ? 1 : i + 2, i + 1, BASE_US + i * 100000L);
+    }
+    const size_t mem = store.memory_bytes();
+    store.RemoveSpansBefore(BASE_US + 5000000L);
+    ASSERT_EQ(50u, store.span_count());
+    ASSERT_GT(mem, store.memory_bytes());
+    brpc::RpczSpan span;
+    ASSERT_EQ(-1, store.FindSpan(2, 1, &span));
+    ASSERT_EQ(-1, store.FindSpan(1, 2, &span));
+    ASSERT_EQ(0, store.FindSpan(1, 52, &span));
+    std::deque<brpc::RpczSpan> spans;
+    store.FindSpans(1, &spans);
+    ASSERT_EQ(25u, spans.size());
+    std::deque<brpc::BriefSpan> briefs;
+    store.ListSpans(BASE_US + 100 * 100000L, 1000, &briefs, NULL);
+    ASSERT_EQ(50u, briefs.size());
+    ASSERT_EQ(BASE_US + 5000000L, briefs.back().start_real_us());
+
+    store.RemoveSpansBefore(BASE_US + 100 * 100000L);
+    ASSERT_EQ(0u, store.span_count());
+    ASSERT_EQ(0u, store.memory_bytes());
+    store.FindSpans(1, &spans);
+    ASSERT_TRUE(spans.empty());
+    // Still writable.
+    AddSpan(&store, 1, 1000, BASE_US + 200 * 100000L);
+    ASSERT_EQ(0, store.FindSpan(1, 1000, &span));
+}
+
+TEST(SpanStoreTest, bounded_memory) {
+    brpc::SpanStoreOptions options;
+    options.segment_span_us = 1000000;
+    options.max_memory_bytes = 1024 * 1024;
+    brpc::SpanStore store;
+    ASSERT_EQ(0, store.Init(options));
+    const int N = 100000;
+    for (int i = 0; i < N; ++i) {
+        AddSpan(&store, i + 1, i + 1, BASE_US + i * 1000L);
+        ASSERT_LE(store.memory_bytes(), options.max_memory_bytes + 1024);
+    }
+    const size_t n = store.span_count();
+    ASSERT_LT(n, (size_t)N);
+    ASSERT_GT(n, 0u);
+    // Latest spans are kept.
+    brpc::RpczSpan span;
+    ASSERT_EQ(0, store.FindSpan(N, N, &span));
+    ASSERT_EQ(-1, store.FindSpan(1, 1, &span));
+    std::ostringstream os;
+    store.Describe(os);
+    ASSERT_NE(std::string::npos, os.str().find("[shard 15]")) << os.str();
+}
+
+TEST(SpanStoreTest, spill_to_disk) {
+    butil::DeleteFile(butil::FilePath(SPILL_DIR), true);
+    brpc::SpanStoreOptions options;
+    options.segment_span_us = 1000000;
+    options.max_memory_bytes = 1024 * 1024;
+    options.spill_dir = SPILL_DIR;
+    const int N = 5000;
+    {
+        brpc::SpanStore store;
+        ASSERT_EQ(0, store.Init(options));
+        for (int i = 0; i < N; ++i) {
+            AddSpan(&store, i % 1000 + 1, i + 1, BASE_US + i * 1000L);
+            ASSERT_LE(store.memory_bytes(), options.max_memory_bytes + 1024);
+        }
+        // Spans are still readable after being spilled.
+        ASSERT_EQ((size_t)N, store.span_count());
+        brpc::RpczSpan span;
+        ASSERT_EQ(0, store.FindSpan(1, 1, &span));
+        ASSERT_EQ(BASE_US, span.received_real_us());
+        ASSERT_EQ(std::string(64, 'i'), span.info());
+        std::deque<brpc::RpczSpan> spans;
+        store.FindSpans(7, &spans);
+        ASSERT_EQ((size_t)N / 1000, spans.size());
+        std::deque<brpc::BriefSpan> briefs;
+        store.ListSpans(BASE_US + 1000, 10, &briefs, NULL);
+        ASSERT_EQ(2u, briefs.size());
+        ASSERT_EQ(2u, briefs[0].span_id());
+        std::ostringstream os;
+        store.Describe(os);
+        ASSERT_EQ(std::string::npos, os.str().find("spilled_bytes=0 "))
+            << os.str();
+
+        store.RemoveSpansBefore(BASE_US + N * 1000L / 2);
+        ASSERT_EQ(-1, store.FindSpan(1, 1, &span));
+        ASSERT_EQ(0, store.FindSpan(1, 3001, &span));
+        ASSERT_TRUE(butil::PathExists(butil::FilePath(
+            std::string(SPILL_DIR) + "/shard_1.spans")));
+    }
+    ASSERT_FALSE(butil::PathExists(butil::FilePath(
+        std::string(SPILL_DIR) + "/shard_1.spans")));
+    butil::DeleteFile(butil::FilePath(SPILL_DIR), true);
+}
+
+struct IngestArg {
+    brpc::SpanStore* store;
+    uint64_t base_id;
+    int n;
+    pthread_t th;
+};
+
+// Serialize and add spans, which is what the collecting thread does.
+static void* ingest_spans(void* arg) {
+    IngestArg* a = static_cast<IngestArg*>(arg);
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < a->n; ++i) {
+        const uint64_t id = a->base_id + i;
+        const int64_t t = start_us + i;
+        a->store->Add(MakeSummary(id / 4, id, t), "test.EchoService.Echo",
+                      MakeData(id / 4, id, t));
+    }
+    return NULL;
+}
+
+TEST(SpanStoreTest, ingest_performance) {
+    const size_t nthreads[] = { 1, 2, 4 };
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        brpc::SpanStore store;
+        ASSERT_EQ(0, store.Init(brpc::SpanStoreOptions()));
+        std::vector<IngestArg> args(nthreads[i]);
+        butil::Timer tm;
+        tm.start();
+        for (size_t j = 0; j < args.size(); ++j) {
+            args[j].store = &store;
+            args[j].base_id = (j + 1) * 10000000UL;
+            args[j].n = 400000 / nthreads[i];
+            ASSERT_EQ(0, pthread_create(&args[j].th, NULL, ingest_spans, &args[j]));
+        }
+        for (size_t j = 0; j < args.size(); ++j) {
+            pthread_join(args[j].th, NULL);
+        }
+        tm.stop();
+        LOG(INFO) << "nthread=" << nthreads[i] << " ingested "
+                  << (int64_t)(store.span_count() * 1000000.0 / tm.u_elapsed())
+                  << " spans/s, memory=" << store.memory_bytes() / store.span_count()
+                  << "B/span";
+    }
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* req,
+              test::EchoResponse* res,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        res->set_message(req->message());
+    }
+};
+
+struct CallerArg {
+    brpc::Channel* channel;
+    int64_t stop_us;
+    int64_t ncall;
+};
+
+static void* call_echo(void* arg) {
+    CallerArg* a = static_cast<CallerArg*>(arg);
+    test::EchoRequest req;
+    req.set_message("hello");
+    while (butil::gettimeofday_us() < a->stop_us) {
+        test::EchoResponse res;
+        brpc::Controller cntl;
+        test::EchoService_Stub(a->channel).Echo(&cntl, &req, &res, NULL);
+        if (!cntl.Failed()) {
+            ++a->ncall;
+        }
+    }
+    return NULL;
+}
+
+static int64_t CountIndexedSpans(int64_t since_us) {
+    std::deque<brpc::BriefSpan> spans;
+    brpc::ListSpans(butil::gettimeofday_us(), 10000000, &spans, NULL);
+    int64_t n = 0;
+    for (size_t i = 0; i < spans.size(); ++i) {
+        n += (spans[i].start_real_us() >= since_us);
+    }
+    return n;
+}
+
+TEST(SpanStoreTest, rpcz_ingest_performance) {
+    EchoServiceImpl svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(server.listen_address(), NULL));
+
+    // Sample all RPCs.
+    brpc::g_span_sl.ever_grabbed = true;
+    brpc::g_span_sl.sampling_range = bvar::COLLECTOR_SAMPLING_BASE;
+    brpc::FLAGS_enable_rpcz = true;
+    CallerArg args[8];
+    bthread_t tids[ARRAY_SIZE(args)];
+    const int64_t start_us = butil::gettimeofday_us();
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        args[i].channel = &channel;
+        args[i].stop_us = start_us + 1000000;
+        args[i].ncall = 0;
+        ASSERT_EQ(0, bthread_start_background(&tids[i], NULL, call_echo, &args[i]));
+    }
+    int64_t ncall = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        bthread_join(tids[i], NULL);
+        ncall += args[i].ncall;
+    }
+    const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+    brpc::FLAGS_enable_rpcz = false;
+    // Wait for the collecting thread.
+    int64_t nspan = 0;
+    for (int i = 0; i < 30; ++i) {
+        usleep(200000);
+        const int64_t n = CountIndexedSpans(start_us);
+        if (n == nspan && n != 0) {
+            break;
+        }
+        nspan = n;
+    }
+    ASSERT_GT(nspan, 0);
+    LOG(INFO) << "qps=" << ncall * 1000000 / elapsed_us
+              << " indexed " << nspan * 1000000 / elapsed_us
+              << " spans/s with rpcz enabled";
+    std::ostringstream os;
+    brpc::DescribeSpanDB(os);
+    LOG(INFO) << os.str();
+    server.Stop(0);
+    server.Join();
+}
+
+} // namespace
@@ -0,0 +1,439 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <fstream>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/files/temp_file.h"
+#include "bthread/bthread.h"
+#include "brpc/global.h"
+#include "brpc/channel.h"
+#include "brpc/server.h"
+#include "brpc/trace.h"
+#include "brpc/details/traced_span_buffer.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_double(trace_sample_ratio);
+}
+
+namespace {
+
+const char* const TRACEPARENT =
+    "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01";
+
+TEST(TraceTest, traceparent) {
+    brpc::TraceContext ctx;
+    ASSERT_TRUE(brpc::ParseTraceParent(TRACEPARENT, &ctx));
+    ASSERT_EQ(0x0af7651916cd43ddULL, ctx.trace_id_high);
+    ASSERT_EQ(0x8448eb211c80319cULL, ctx.trace_id_low);
+    ASSERT_EQ(0xb7ad6b7169203331ULL, ctx.parent_span_id);
+    ASSERT_EQ(0u, ctx.span_id);
+    ASSERT_TRUE(ctx.sampled);
+
+    ctx.span_id = ctx.parent_span_id;
+    char buf[brpc::TRACEPARENT_LENGTH + 1];
+    brpc::PrintTraceParent(ctx, buf);
+    ASSERT_STREQ(TRACEPARENT, buf);
+    ctx.sampled = false;
+    brpc::PrintTraceParent(ctx, buf);
+    ASSERT_STREQ("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00", buf);
+
+    // Fields appended by later versions are ignored.
+    ASSERT_TRUE(brpc::ParseTraceParent(std::string(TRACEPARENT) + "-xyz", &ctx));
+    const char* const bad[] = {
+        "",
+        "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331",
+        "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01x",
+        "00-0AF7651916CD43DD8448EB211C80319C-b7ad6b7169203331-01",
+        "ff-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01",
+        "00-00000000000000000000000000000000-b7ad6b7169203331-01",
+        "00-0af7651916cd43dd8448eb211c80319c-0000000000000000-01",
+        "00_0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01",
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(bad); ++i) {
+        ASSERT_FALSE(brpc::ParseTraceParent(bad[i], &ctx)) << bad[i];
+    }
+}
+
+TEST(TraceTest, otlp_json) {
+    // Register protocols for printing their names.
+    brpc::GlobalInitializeOrDie();
+    brpc::TracedSpan span;
+    memset(&span, 0, sizeof(span));
+    span.trace_id_high = 1;
+    span.trace_id_low = 2;
+    span.span_id = 3;
+    span.start_real_us = 1000;
+    span.end_real_us = 2500;
+    span.kind = brpc::TRACED_SPAN_SERVER;
+    span.protocol = brpc::PROTOCOL_BAIDU_STD;
+    span.error_code = 1008;
+    for (int i = 0; i < brpc::RPC_PHASE_COUNT; ++i) {
+        span.phase_us[i] = -1;
+    }
+    span.phase_us[brpc::RPC_PHASE_HANDLER] = 1200;
+    strcpy(span.method, "test.EchoService.\"Echo\"");
+    std::ostringstream os;
+    brpc::PrintOtlpJson(os, &span, 1);
+    const std::string json = os.str();
+    LOG(INFO) << json;
+    ASSERT_NE(std::string::npos, json.find(
+        "\"traceId\":\"00000000000000010000000000000002\""));
+    ASSERT_NE(std::string::npos, json.find("\"spanId\":\"0000000000000003\""));
+    ASSERT_EQ(std::string::npos, json.find("parentSpanId"));
+    ASSERT_NE(std::string::npos, json.find(
+        "\"name\":\"test.EchoService.\\\"Echo\\\"\""));
+    ASSERT_NE(std::string::npos, json.find("\"kind\":2,"));
+    ASSERT_NE(std::string::npos, json.find("\"startTimeUnixNano\":\"1000000\""));
+    ASSERT_NE(std::string::npos, json.find("\"endTimeUnixNano\":\"2500000\""));
+    ASSERT_NE(std::string::npos, json.find("\"stringValue\":\"baidu_std\""));
+    ASSERT_NE(std::string::npos, json.find(
+        "\"key\":\"rpc.brpc.phase.handler_us\",\"value\":{\"intValue\":\"1200\"}"));
+    ASSERT_EQ(std::string::npos, json.find("phase.queue_us"));
+    ASSERT_NE(std::string::npos, json.find("\"status\":{\"code\":2}"));
+}
+
+TEST(TraceTest, span_buffer) {
+    brpc::TracedSpanBuffer buf;
+    ASSERT_EQ(0, buf.init(3));
+    ASSERT_EQ(4u, buf.capacity());
+    brpc::TracedSpan span;
+    memset(&span, 0, sizeof(span));
+    for (int i = 0; i < 4; ++i) {
+        span.span_id = i;
+        ASSERT_TRUE(buf.push(span));
+    }
+    ASSERT_FALSE(buf.push(span));
+    brpc::TracedSpan out[8];
+    ASSERT_EQ(3u, buf.pop(out, 3));
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ((uint64_t)i, out[i].span_id);
+    }
+    span.span_id = 4;
+    ASSERT_TRUE(buf.push(span));
+    ASSERT_EQ(2u, buf.pop(out, 8));
+    ASSERT_EQ(3u, out[0].span_id);
+    ASSERT_EQ(4u, out[1].span_id);
+    ASSERT_EQ(0u, buf.pop(out, 8));
+    ASSERT_EQ(5u, buf.pushed());
+    ASSERT_EQ(5u, buf.popped());
+}
+
+struct PushArgs {
+    brpc::TracedSpanBuffer* buf;
+    uint64_t id_base;
+    int n;
+    int nfull;
+};
+
+void* PushSpans(void* void_args) {
+    PushArgs* args = (PushArgs*)void_args;
+    brpc::TracedSpan span;
+    memset(&span, 0, sizeof(span));
+    for (int i = 0; i < args->n; ++i) {
+        span.span_id = args->id_base + i;
+        while (!args->buf->push(span)) {
+            ++args->nfull;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+TEST(TraceTest, span_buffer_concurrent) {
+    brpc::TracedSpanBuffer buf;
+    ASSERT_EQ(0, buf.init(1024));
+    const int NTHREAD = 4;
+    const int N = 200000;
+    pthread_t th[NTHREAD];
+    PushArgs args[NTHREAD];
+    for (int i = 0; i < NTHREAD; ++i) {
+        args[i].buf = &buf;
+        args[i].id_base = (uint64_t)i << 32;
+        args[i].n = N;
+        args[i].nfull = 0;
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, PushSpans, &args[i]));
+    }
+    // Spans of each producer are popped in the order of being pushed.
+    std::vector<uint64_t> next(NTHREAD, 0);
+    brpc::TracedSpan out[256];
+    int total = 0;
+    while (total < NTHREAD * N) {
+        const size_t n = buf.pop(out, ARRAY_SIZE(out));
+        for (size_t i = 0; i < n; ++i) {
+            const uint64_t t = out[i].span_id >> 32;
+            ASSERT_LT(t, (uint64_t)NTHREAD);
+            ASSERT_EQ(next[t], (out[i].span_id & 0xFFFFFFFF));
+            ++next[t];
+        }
+        total += n;
+    }
+    int nfull = 0;
+    for (int i = 0; i < NTHREAD; ++i) {
+        pthread_join(th[i], NULL);
+        nfull += args[i].nfull;
+    }
+    ASSERT_EQ(0u, buf.pop(out, ARRAY_SIZE(out)));
+    LOG(INFO) << "Found the buffer full for " << nfull << " times";
+}
+
+class CollectingExporter : public brpc::SpanExporter {
+public:
+    void Export(const brpc::TracedSpan* spans, size_t n) override {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _spans.insert(_spans.end(), spans, spans + n);
+    }
+    // Server spans are submitted after responses are written, wait for
+    // at least `expected' spans for a while.
+    std::vector<brpc::TracedSpan> TakeAll(size_t expected) {
+        std::vector<brpc::TracedSpan> spans;
+        for (int i = 0; i < 100; ++i) {
+            brpc::FlushTracedSpans();
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_spans.size() >= expected) {
+                break;
+            }
+            usleep(10000);
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        spans.swap(_spans);
+        return spans;
+    }
+
+private:
+    butil::Mutex _mutex;
+    std::vector<brpc::TracedSpan> _spans;
+};
+
+class BackendService : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        response->set_message(request->message());
+    }
+};
+
+// Forwards requests to the backend.
+class FrontendService : public test::EchoService {
+public:
+    FrontendService() {
+        CHECK_EQ(0, _channel.Init("127.0.0.1:8628", NULL));
+    }
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        brpc::Controller sub_cntl;
+        test::EchoService_Stub stub(&_channel);
+        stub.Echo(&sub_cntl, request, response, NULL);
+        if (sub_cntl.Failed()) {
+            cntl->SetFailed(sub_cntl.ErrorCode(), "%s",
+                            sub_cntl.ErrorText().c_str());
+        }
+    }
+
+private:
+    brpc::Channel _channel;
+};
+
+class TraceServerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        brpc::FLAGS_trace_sample_ratio = 0;
+        brpc::SetSpanExporter(&_exporter);
+        ASSERT_EQ(0, _backend.AddService(&_backend_service,
+                                         brpc::SERVER_DOESNT_OWN_SERVICE));
+        ASSERT_EQ(0, _frontend.AddService(&_frontend_service,
+                                          brpc::SERVER_DOESNT_OWN_SERVICE));
+        ASSERT_EQ(0, _backend.Start(8628, NULL));
+        ASSERT_EQ(0, _frontend.Start(8627, NULL));
+        _exporter.TakeAll(0);
+    }
+    void TearDown() override {
+        brpc::FLAGS_trace_sample_ratio = 0;
+        _frontend.Stop(0);
+        _backend.Stop(0);
+        _frontend.Join();
+        _backend.Join();
+        brpc::FlushTracedSpans();
+        brpc::SetSpanExporter(NULL);
+    }
+
+    void CallFrontend(const char* protocol, const char* traceparent) {
+        brpc::ChannelOptions opt;
+        opt.protocol = protocol;
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init("127.0.0.1:8627", &opt));
+        test::EchoService_Stub stub(&channel);
+        brpc::Controller cntl;
+        if (traceparent) {
+            cntl.http_request().SetHeader("traceparent", traceparent);
+        }
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("hello");
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("hello", res.message());
+    }
+
+    const brpc::TracedSpan* FindSpan(const std::vector<brpc::TracedSpan>& spans,
+                                     brpc::TracedSpanKind kind,
+                                     uint64_t parent_span_id) {
+        for (size_t i = 0; i < spans.size(); ++i) {
+            if (spans[i].kind == kind &&
+                spans[i].parent_span_id == parent_span_id) {
+                return &spans[i];
+            }
+        }
+        return NULL;
+    }
+
+    BackendService _backend_service;
+    FrontendService _frontend_service;
+    brpc::Server _backend;
+    brpc::Server _frontend;
+    CollectingExporter _exporter;
+};
+
+TEST_F(TraceServerTest, propagate_from_http_header) {
+    CallFrontend("http", TRACEPARENT);
+    const std::vector<brpc::TracedSpan> spans = _exporter.TakeAll(3);
+    ASSERT_EQ(3u, spans.size());
+    // Spans of the frontend, the RPC to the backend and the backend.
+    const brpc::TracedSpan* front = FindSpan(
+        spans, brpc::TRACED_SPAN_SERVER, 0xb7ad6b7169203331ULL);
+    ASSERT_TRUE(front != NULL);
+    const brpc::TracedSpan* client = FindSpan(
+        spans, brpc::TRACED_SPAN_CLIENT, front->span_id);
+    ASSERT_TRUE(client != NULL);
+    const brpc::TracedSpan* back = FindSpan(
+        spans, brpc::TRACED_SPAN_SERVER, client->span_id);
+    ASSERT_TRUE(back != NULL);
+    for (size_t i = 0; i < spans.size(); ++i) {
+        ASSERT_EQ(0x0af7651916cd43ddULL, spans[i].trace_id_high);
+        ASSERT_EQ(0x8448eb211c80319cULL, spans[i].trace_id_low);
+        ASSERT_STREQ("test.EchoService.Echo", spans[i].method);
+        ASSERT_EQ(0, spans[i].error_code);
+        ASSERT_LE(spans[i].start_real_us, spans[i].end_real_us);
+    }
+    ASSERT_EQ(brpc::PROTOCOL_HTTP, front->protocol);
+    ASSERT_EQ(brpc::PROTOCOL_BAIDU_STD, client->protocol);
+    ASSERT_EQ(brpc::PROTOCOL_BAIDU_STD, back->protocol);
+    ASSERT_EQ(8628, client->remote_side.port);
+    // The frontend span covers the others.
+    ASSERT_LE(front->start_real_us, client->start_real_us);
+    ASSERT_GE(front->end_real_us, client->end_real_us);
+    ASSERT_GE(front->phase_us[brpc::RPC_PHASE_HANDLER],
+              back->phase_us[brpc::RPC_PHASE_HANDLER]);
+    ASSERT_EQ(-1, client->phase_us[brpc::RPC_PHASE_HANDLER]);
+}
+
+TEST_F(TraceServerTest, not_sampled) {
+    // The context is still propagated but no spans are exported.
+    CallFrontend("http",
+                 "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00");
+    CallFrontend("baidu_std", NULL);
+    CallFrontend("h2:grpc", NULL);
+    usleep(100000);
+    ASSERT_EQ(0u, _exporter.TakeAll(0).size());
+}
+
+TEST_F(TraceServerTest, sample_roots) {
+    brpc::FLAGS_trace_sample_ratio = 1;
+    const char* protocols[] = { "baidu_std", "h2:grpc" };
+    for (size_t i = 0; i < ARRAY_SIZE(protocols); ++i) {
+        CallFrontend(protocols[i], NULL);
+        const std::vector<brpc::TracedSpan> spans = _exporter.TakeAll(4);
+        ASSERT_EQ(4u, spans.size()) << protocols[i];
+        const brpc::TracedSpan* root = FindSpan(spans, brpc::TRACED_SPAN_CLIENT, 0);
+        ASSERT_TRUE(root != NULL);
+        const brpc::TracedSpan* front = FindSpan(
+            spans, brpc::TRACED_SPAN_SERVER, root->span_id);
+        ASSERT_TRUE(front != NULL);
+        const brpc::TracedSpan* client = FindSpan(
+            spans, brpc::TRACED_SPAN_CLIENT, front->span_id);
+        ASSERT_TRUE(client != NULL);
+        ASSERT_TRUE(FindSpan(spans, brpc::TRACED_SPAN_SERVER, client->span_id));
+        for (size_t j = 0; j < spans.size(); ++j) {
+            ASSERT_EQ(root->trace_id_high, spans[j].trace_id_high);
+            ASSERT_EQ(root->trace_id_low, spans[j].trace_id_low);
+        }
+    }
+}
+
+TEST_F(TraceServerTest, overhead) {
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8628", NULL));
+    test::EchoService_Stub stub(&channel);
+    const double ratios[] = { 0, 0.01, 1 };
+    const int N = 20000;
+    for (size_t i = 0; i < ARRAY_SIZE(ratios); ++i) {
+        brpc::FLAGS_trace_sample_ratio = ratios[i];
+        butil::Timer tm;
+        tm.start();
+        for (int j = 0; j < N; ++j) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message("hello");
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed());
+        }
+        tm.stop();
+        const size_t nspan = _exporter.TakeAll(0).size();
+        LOG(INFO) << "trace_sample_ratio=" << ratios[i] << ": "
+                  << tm.u_elapsed() / N << "us per RPC, " << nspan << " spans";
+    }
+}
+
+TEST(TraceTest, file_exporter) {
+    butil::TempFile tmp;
+    {
+        brpc::FileSpanExporter exporter(tmp.fname());
+        brpc::TracedSpan spans[2];
+        memset(spans, 0, sizeof(spans));
+        for (int i = 0; i < 2; ++i) {
+            spans[i].trace_id_low = 1;
+            spans[i].span_id = i + 1;
+            spans[i].kind = brpc::TRACED_SPAN_CLIENT;
+            for (int j = 0; j < brpc::RPC_PHASE_COUNT; ++j) {
+                spans[i].phase_us[j] = -1;
+            }
+        }
+        exporter.Export(spans, 2);
+        exporter.Export(spans, 1);
+    }
+    std::ifstream in(tmp.fname());
+    std::string line;
+    std::vector<std::string> lines;
+    while (std::getline(in, line)) {
+        lines.push_back(line);
+    }
+    ASSERT_EQ(2u, lines.size());
+    ASSERT_NE(std::string::npos, lines[0].find("\"spanId\":\"0000000000000002\""));
+    ASSERT_EQ(std::string::npos, lines[1].find("\"spanId\":\"0000000000000002\""));
+}
+
+} // namespace
@@ -28,6 +28,7 @@
 #include "bthread/interrupt_pthread.h"
 
 namespace bthread {
+DECLARE_bool(bthread_adaptive_spin);
 extern butil::atomic<TaskControl*> g_task_control;
 inline TaskControl* get_task_control() {
     return g_task_control.load(butil::memory_order_consume);
@@ -443,4 +444,90 @@ TEST(ButexTest, wait_with_signal_triggered) {
     bthread::butex_destroy(butex);
 }
 
+struct PingPongArg {
+    butil::atomic<int>* butex;
+    int parity;
+    int rounds;
+};
+
+// Bthreads take turns to increase the butex, waiting for each other.
+void* ping_pong(void* void_arg) {
+    PingPongArg* arg = static_cast<PingPongArg*>(void_arg);
+    while (true) {
+        const int v = arg->butex->load(butil::memory_order_acquire);
+        if (v >= arg->rounds) {
+            break;
+        }
+        if (v % 2 == arg->parity) {
+            arg->butex->store(v + 1, butil::memory_order_release);
+            bthread::butex_wake(arg->butex);
+            continue;
+        }
+        // A lost wakeup ends in timeout.
+        const timespec abstime = butil::seconds_from_now(5);
+        if (bthread::butex_wait(arg->butex, v, &abstime) < 0) {
+            if (errno == ETIMEDOUT) {
+                ADD_FAILURE() << "Lost wakeup, butex=" << v;
+                break;
+            }
+            EXPECT_TRUE(errno == EWOULDBLOCK || errno == EINTR) << berror();
+        }
+    }
+    return NULL;
+}
+
+TEST(ButexTest, wake_and_timeout_with_adaptive_spin) {
+    const bool saved_adaptive_spin = bthread::FLAGS_bthread_adaptive_spin;
+    bthread::FLAGS_bthread_adaptive_spin = true;
+    butil::atomic<int>* butex =
+        bthread::butex_create_checked<butil::atomic<int> >();
+    ASSERT_TRUE(butex);
+
+    // Short waits, which are likely ended by spinning.
+    const int ROUNDS = 20000;
+    for (int i = 0; i < 2; ++i) {
+        const bthread_attr_t attr =
+            (i == 0 ? BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL);
+        butex->store(0);
+        PingPongArg args[2] = { { butex, 0, ROUNDS }, { butex, 1, ROUNDS } };
+        bthread_t th[2];
+        ASSERT_EQ(0, bthread_start_background(&th[0], &attr, ping_pong, &args[0]));
+        ASSERT_EQ(0, bthread_start_background(&th[1], &attr, ping_pong, &args[1]));
+        ASSERT_EQ(0, bthread_join(th[0], NULL));
+        ASSERT_EQ(0, bthread_join(th[1], NULL));
+        ASSERT_EQ(ROUNDS, butex->load());
+    }
+
+    // Long waits, which suspend after spinning.
+    *butex = 7;
+    WaiterArg waiter_arg;
+    waiter_arg.expected_value = 7;
+    waiter_arg.butex = butex;
+    waiter_arg.expected_result = 0;
+    waiter_arg.ptimeout = NULL;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, waiter, &waiter_arg));
+    usleep(10000);
+    *butex = 8;
+    ASSERT_EQ(1, bthread::butex_wake(butex));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+
+    // Spinning does not change timing of timeouts.
+    butil::Timer tm;
+    const long WAIT_MSEC = 100;
+    for (int i = 0; i < 2; ++i) {
+        const bthread_attr_t attr =
+            (i == 0 ? BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL);
+        ButexWaitArg arg = { (int*)butex, 8, WAIT_MSEC, ETIMEDOUT };
+        tm.start();
+        ASSERT_EQ(0, bthread_start_urgent(&th, &attr, wait_butex, &arg));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        tm.stop();
+        ASSERT_LT(labs(tm.m_elapsed() - WAIT_MSEC), 50);
+    }
+
+    bthread::butex_destroy(butex);
+    bthread::FLAGS_bthread_adaptive_spin = saved_adaptive_spin;
+}
+
 } // namespace
@@ -16,6 +16,7 @@
 // under the License.
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/compat.h"
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -27,6 +28,10 @@
 #include "bthread/mutex.h"
 #include "gperftools_helper.h"
 
+namespace bthread {
+DECLARE_bool(bthread_adaptive_spin);
+}
+
 namespace {
 inline unsigned* get_butex(bthread_mutex_t & m) {
     return m.butex;
@@ -240,6 +245,66 @@ TEST(MutexTest, performance) {
     PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+struct BAIDU_CACHELINE_ALIGNMENT ShortSectionArgs {
+    bthread::Mutex* mutex;
+    int64_t* shared;
+    int64_t counter;
+};
+
+void* run_short_sections(void* void_arg) {
+    ShortSectionArgs* args = (ShortSectionArgs*)void_arg;
+    while (!g_stopped) {
+        BAIDU_SCOPED_LOCK(*args->mutex);
+        // A critical section lasting about a hundred nanoseconds.
+        for (int i = 0; i < 32; ++i) {
+            ++*(volatile int64_t*)args->shared;
+        }
+        ++args->counter;
+    }
+    return NULL;
+}
+
+TEST(MutexTest, adaptive_spin_perf) {
+    const bool saved_adaptive_spin = bthread::FLAGS_bthread_adaptive_spin;
+    const int thread_nums[] = { 2, 4, 8, 16, 32, 64 };
+    for (size_t i = 0; i < ARRAY_SIZE(thread_nums); ++i) {
+        const int thread_num = thread_nums[i];
+        int64_t locks_per_second[2] = { 0, 0 };
+        for (int spin = 0; spin < 2; ++spin) {
+            bthread::FLAGS_bthread_adaptive_spin = spin;
+            bthread::Mutex mutex;
+            int64_t shared = 0;
+            std::vector<ShortSectionArgs> args(thread_num);
+            std::vector<bthread_t> threads(thread_num);
+            g_stopped = false;
+            butil::Timer tm;
+            tm.start();
+            for (int j = 0; j < thread_num; ++j) {
+                args[j].mutex = &mutex;
+                args[j].shared = &shared;
+                args[j].counter = 0;
+                ASSERT_EQ(0, bthread_start_background(
+                              &threads[j], NULL, run_short_sections, &args[j]));
+            }
+            usleep(200 * 1000);
+            g_stopped = true;
+            int64_t count = 0;
+            for (int j = 0; j < thread_num; ++j) {
+                bthread_join(threads[j], NULL);
+                count += args[j].counter;
+            }
+            tm.stop();
+            ASSERT_EQ(count * 32, shared);
+            locks_per_second[spin] = count * 1000000L / tm.u_elapsed();
+        }
+        LOG(INFO) << "bthread::Mutex with " << thread_num
+                  << " contending bthreads: " << locks_per_second[0]
+                  << " locks/s without spinning, " << locks_per_second[1]
+                  << " locks/s with adaptive spinning";
+    }
+    bthread::FLAGS_bthread_adaptive_spin = saved_adaptive_spin;
+}
+
 template <typename Mutex>
 void* loop_until_stopped(void* arg) {
     auto m = (Mutex*)arg;
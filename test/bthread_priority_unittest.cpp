@@ -0,0 +1,171 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <limits.h>
+#include <algorithm>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "bthread/bthread.h"
+
+namespace {
+
+butil::atomic<int> g_order(0);
+
+struct OrderArgs {
+    int order;
+    pthread_t worker;
+};
+
+void* record_order(void* void_args) {
+    OrderArgs* args = static_cast<OrderArgs*>(void_args);
+    args->order = g_order.fetch_add(1);
+    args->worker = pthread_self();
+    return NULL;
+}
+
+struct StartArgs {
+    pthread_t worker;
+    OrderArgs low[20];
+    OrderArgs high[20];
+    bthread_t tids[40];
+};
+
+void* start_mixed(void* void_args) {
+    StartArgs* args = static_cast<StartArgs*>(void_args);
+    bthread_attr_t low_attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+    bthread_attr_t high_attr =
+        BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL | BTHREAD_HIGH_PRIORITY;
+    // Queued in the run queues of this worker without waking up others.
+    args->worker = pthread_self();
+    for (size_t i = 0; i < ARRAY_SIZE(args->low); ++i) {
+        bthread_start_background(&args->tids[i], &low_attr, record_order,
+                                 &args->low[i]);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(args->high); ++i) {
+        bthread_start_background(&args->tids[ARRAY_SIZE(args->low) + i],
+                                 &high_attr, record_order, &args->high[i]);
+    }
+    // Switch to the queued bthreads without signaling other workers.
+    bthread_usleep(1000);
+    for (size_t i = 0; i < ARRAY_SIZE(args->tids); ++i) {
+        bthread_join(args->tids[i], NULL);
+    }
+    return NULL;
+}
+
+TEST(PriorityTest, high_priority_runs_first) {
+    StartArgs args;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, start_mixed, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Workers which are awake may steal some of the bthreads, check the
+    // ones run by the worker queuing them.
+    int max_high = -1;
+    int min_low = INT_MAX;
+    for (size_t i = 0; i < ARRAY_SIZE(args.high); ++i) {
+        if (pthread_equal(args.high[i].worker, args.worker)) {
+            max_high = std::max(max_high, args.high[i].order);
+        }
+        if (pthread_equal(args.low[i].worker, args.worker)) {
+            min_low = std::min(min_low, args.low[i].order);
+        }
+    }
+    ASSERT_LT(max_high, min_low);
+}
+
+// Keep workers busy with low-priority bthreads.
+butil::atomic<bool> g_stop(false);
+butil::atomic<int64_t> g_nlow_slice(0);
+
+void* busy_low(void*) {
+    while (!g_stop.load(butil::memory_order_relaxed)) {
+        const int64_t end_us = butil::cpuwide_time_us() + 100;
+        while (butil::cpuwide_time_us() < end_us) {}
+        g_nlow_slice.fetch_add(1, butil::memory_order_relaxed);
+        // Sleep rather than yield: bthread_yield() puts the bthread into
+        // the local runqueue which is always non-empty then, and bthreads
+        // queued by non-workers would never be run.
+        bthread_usleep(100);
+    }
+    return NULL;
+}
+
+struct LatencyArgs {
+    int64_t start_us;
+    int64_t latency_us;
+};
+
+void* record_latency(void* arg) {
+    LatencyArgs* a = static_cast<LatencyArgs*>(arg);
+    a->latency_us = butil::cpuwide_time_us() - a->start_us;
+    return NULL;
+}
+
+// Start bthreads with `attr' from this pthread periodically and returns
+// 99th percentile of the delays before they ran.
+int64_t MeasureDelay(const bthread_attr_t& attr, int n) {
+    std::vector<LatencyArgs> args(n);
+    std::vector<bthread_t> tids(n);
+    for (int i = 0; i < n; ++i) {
+        args[i].start_us = butil::cpuwide_time_us();
+        bthread_start_background(&tids[i], &attr, record_latency, &args[i]);
+        usleep(500);
+    }
+    std::vector<int64_t> latencies(n);
+    for (int i = 0; i < n; ++i) {
+        bthread_join(tids[i], NULL);
+        latencies[i] = args[i].latency_us;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return latencies[n * 99 / 100];
+}
+
+TEST(PriorityTest, mixed_load_perf) {
+    const int nworker = bthread_getconcurrency();
+    const int nlow = nworker * 8;
+    const int N = 2000;
+    const bthread_attr_t high_attr =
+        BTHREAD_ATTR_NORMAL | BTHREAD_HIGH_PRIORITY;
+    const int64_t idle_high_p99 = MeasureDelay(high_attr, N);
+
+    g_stop = false;
+    std::vector<bthread_t> lows(nlow);
+    for (int i = 0; i < nlow; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&lows[i], NULL, busy_low, NULL));
+    }
+    usleep(100000);
+    const int64_t nslice0 = g_nlow_slice.load();
+    butil::Timer tm;
+    tm.start();
+    const int64_t normal_p99 = MeasureDelay(BTHREAD_ATTR_NORMAL, N);
+    const int64_t high_p99 = MeasureDelay(high_attr, N);
+    tm.stop();
+    const int64_t nslice = g_nlow_slice.load() - nslice0;
+    g_stop = true;
+    for (int i = 0; i < nlow; ++i) {
+        bthread_join(lows[i], NULL);
+    }
+    LOG(INFO) << "With " << nlow << " busy bthreads on " << nworker
+              << " workers(using " << nslice * 100 * 100 / std::max(tm.u_elapsed(), 1L)
+              << "% cpu), p99 delay of starting bthreads:"
+              << " normal=" << normal_p99 << "us high_priority=" << high_p99
+              << "us (" << idle_high_p99 << "us when idle)";
+}
+
+} // namespace
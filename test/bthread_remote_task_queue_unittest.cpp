@@ -0,0 +1,216 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <algorithm>                        // std::sort
+#include <sys/wait.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "bthread/bthread.h"
+#include "bthread/remote_task_queue.h"
+
+DECLARE_bool(bthread_lockfree_remote_queue);
+
+namespace {
+
+TEST(RemoteTaskQueueTest, sanity) {
+    for (int lockfree = 0; lockfree < 2; ++lockfree) {
+        bthread::RemoteTaskQueue q;
+        ASSERT_EQ(0, q.init(6, lockfree));
+        ASSERT_EQ((bool)lockfree, q.lockfree());
+        const size_t cap = q.capacity();
+        ASSERT_EQ(lockfree ? 8u : 6u, cap);
+        bthread_t t = 0;
+        ASSERT_FALSE(q.pop(&t));
+        // Wrap around for several rounds.
+        for (int round = 0; round < 3; ++round) {
+            for (size_t i = 0; i < cap; ++i) {
+                ASSERT_TRUE(q.push(round * 100 + i));
+            }
+            ASSERT_FALSE(q.push(12345));
+            for (size_t i = 0; i < cap; ++i) {
+                ASSERT_TRUE(q.pop(&t));
+                ASSERT_EQ(round * 100 + i, t);
+            }
+            ASSERT_FALSE(q.pop(&t));
+        }
+    }
+}
+
+const size_t NPUSH_PER_THREAD = 200000;
+butil::atomic<int> g_nproducer(0);
+
+struct QueueArgs {
+    bthread::RemoteTaskQueue* q;
+    size_t index;
+    std::vector<bthread_t> popped;
+};
+
+void* push_thread(void* void_args) {
+    QueueArgs* args = (QueueArgs*)void_args;
+    for (size_t i = 0; i < NPUSH_PER_THREAD; ++i) {
+        const bthread_t t = (args->index << 32) | i;
+        while (!args->q->push(t)) {
+            sched_yield();
+        }
+    }
+    g_nproducer.fetch_sub(1);
+    return NULL;
+}
+
+void* pop_thread(void* void_args) {
+    QueueArgs* args = (QueueArgs*)void_args;
+    bthread_t t;
+    while (true) {
+        if (args->q->pop(&t)) {
+            args->popped.push_back(t);
+        } else if (g_nproducer.load() == 0) {
+            // Producers ended, drain the queue.
+            while (args->q->pop(&t)) {
+                args->popped.push_back(t);
+            }
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Non-workers push and the owner and thieves pop concurrently.
+TEST(RemoteTaskQueueTest, multiple_producers_and_consumers) {
+    const size_t NPRODUCER = 4;
+    const size_t NCONSUMER = 2;
+    for (int lockfree = 0; lockfree < 2; ++lockfree) {
+        bthread::RemoteTaskQueue q;
+        ASSERT_EQ(0, q.init(2048, lockfree));
+        g_nproducer.store(NPRODUCER);
+        QueueArgs pargs[NPRODUCER];
+        QueueArgs cargs[NCONSUMER];
+        pthread_t pth[NPRODUCER];
+        pthread_t cth[NCONSUMER];
+        butil::Timer tm;
+        tm.start();
+        for (size_t i = 0; i < NCONSUMER; ++i) {
+            cargs[i].q = &q;
+            cargs[i].index = i;
+            ASSERT_EQ(0, pthread_create(&cth[i], NULL, pop_thread, &cargs[i]));
+        }
+        for (size_t i = 0; i < NPRODUCER; ++i) {
+            pargs[i].q = &q;
+            pargs[i].index = i;
+            ASSERT_EQ(0, pthread_create(&pth[i], NULL, push_thread, &pargs[i]));
+        }
+        for (size_t i = 0; i < NPRODUCER; ++i) {
+            pthread_join(pth[i], NULL);
+        }
+        std::vector<bthread_t> values;
+        for (size_t i = 0; i < NCONSUMER; ++i) {
+            pthread_join(cth[i], NULL);
+            // Values from one producer are popped in order by each consumer.
+            std::vector<bthread_t> last(NPRODUCER, 0);
+            for (size_t j = 0; j < cargs[i].popped.size(); ++j) {
+                const bthread_t t = cargs[i].popped[j];
+                ASSERT_LT(t >> 32, NPRODUCER);
+                if (last[t >> 32]) {
+                    ASSERT_LT(last[t >> 32], t);
+                }
+                last[t >> 32] = t;
+            }
+            values.insert(values.end(), cargs[i].popped.begin(),
+                          cargs[i].popped.end());
+        }
+        tm.stop();
+        ASSERT_EQ(NPRODUCER * NPUSH_PER_THREAD, values.size());
+        std::sort(values.begin(), values.end());
+        ASSERT_TRUE(std::unique(values.begin(), values.end()) == values.end());
+        LOG(INFO) << (lockfree ? "lock-free" : "locked") << " queue: "
+                  << values.size() * 1000000L / std::max(tm.u_elapsed(), 1L)
+                  << " push+pop/s with " << NPRODUCER << " producers and "
+                  << NCONSUMER << " consumers";
+    }
+}
+
+butil::atomic<int64_t> g_nrun(0);
+
+void* run_nothing(void*) {
+    g_nrun.fetch_add(1, butil::memory_order_relaxed);
+    return NULL;
+}
+
+struct StartArgs {
+    int n;
+};
+
+void* start_from_pthread(void* void_args) {
+    StartArgs* args = (StartArgs*)void_args;
+    for (int i = 0; i < args->n; ++i) {
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, run_nothing, NULL) != 0) {
+            LOG(FATAL) << "Fail to start bthread";
+        }
+    }
+    return NULL;
+}
+
+// Returns bthreads started per second by `nthread' pthreads.
+int64_t StartRemotely(int nthread, int n) {
+    g_nrun.store(0);
+    std::vector<pthread_t> th(nthread);
+    StartArgs args = { n };
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < nthread; ++i) {
+        pthread_create(&th[i], NULL, start_from_pthread, &args);
+    }
+    for (int i = 0; i < nthread; ++i) {
+        pthread_join(th[i], NULL);
+    }
+    while (g_nrun.load(butil::memory_order_relaxed) < (int64_t)nthread * n) {
+        usleep(100);
+    }
+    tm.stop();
+    return (int64_t)nthread * n * 1000000L / std::max(tm.u_elapsed(), 1L);
+}
+
+TEST(RemoteTaskQueueTest, start_from_pthreads_perf) {
+    // The kind of queues is fixed after workers are created, run each in
+    // a forked process.
+    for (int lockfree = 0; lockfree < 2; ++lockfree) {
+        const pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            FLAGS_bthread_lockfree_remote_queue = lockfree;
+            const int nthreads[] = { 1, 2, 4, 8 };
+            for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+                const int64_t qps = StartRemotely(nthreads[i], 100000);
+                LOG(INFO) << (lockfree ? "lock-free" : "locked")
+                          << " remote queues: " << nthreads[i]
+                          << " pthreads start " << qps << " bthreads/s";
+            }
+            _exit(0);
+        }
+        int status = 0;
+        ASSERT_EQ(pid, waitpid(pid, &status, 0));
+        ASSERT_TRUE(WIFEXITED(status));
+        ASSERT_EQ(0, WEXITSTATUS(status));
+    }
+}
+
+} // namespace
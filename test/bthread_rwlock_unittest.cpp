@@ -209,6 +209,116 @@ TEST(RWLockTest, cpp_wrapper) {
 bool g_started = false;
 bool g_stopped = false;
 
+struct PairArgs {
+    bthread_rwlock_t* rw;
+    int64_t* a;
+    int64_t* b;
+};
+
+void* check_pair_until_stopped(void* arg) {
+    auto args = (PairArgs*)arg;
+    while (!g_stopped) {
+        bthread::RWLockRdGuard guard(*args->rw);
+        EXPECT_EQ(*args->a, *args->b);
+    }
+    return NULL;
+}
+
+void* update_pair_until_stopped(void* arg) {
+    auto args = (PairArgs*)arg;
+    while (!g_stopped) {
+        {
+            bthread::RWLockWrGuard guard(*args->rw);
+            ++*args->a;
+            bthread_usleep(10);
+            ++*args->b;
+        }
+        bthread_usleep(100);
+    }
+    return NULL;
+}
+
+TEST(RWLockTest, scalable_readers) {
+    bthread_rwlock_t rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw, NULL));
+    ASSERT_EQ(0, bthread_rwlock_enable_scalable_readers(&rw));
+
+    // Readers share the lock, writers exclude everyone else.
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+    bthread_t th;
+    TrylockArgs args{&rw, EBUSY};
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, do_trywrlock, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, do_timedwrlock, &rw));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+    ASSERT_EQ(0, bthread_rwlock_wrlock(&rw));
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, do_tryrdlock, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, do_timedrdlock, &rw));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, do_trywrlock, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+    // A pending writer blocks new readers.
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+    bthread_t wrth;
+    ASSERT_EQ(0, bthread_start_background(&wrth, NULL, wrlocker, &rw));
+    // The writer can't get the lock held by the reader. Wait until it's
+    // pending, after which new readers are rejected.
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, do_trywrlock, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    int rc = 0;
+    while ((rc = bthread_rwlock_tryrdlock(&rw)) == 0) {
+        ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+        bthread_usleep(1000);
+    }
+    ASSERT_EQ(EBUSY, rc);
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, do_tryrdlock, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_join(wrth, NULL));
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+    // Readers never see partial updates of writers, wherever they run.
+    g_stopped = false;
+    int64_t a = 0;
+    int64_t b = 0;
+    PairArgs pair_args{&rw, &a, &b};
+    const int N = 8;
+    pthread_t pthreads[N];
+    bthread_t bthreads[N];
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, pthread_create(&pthreads[i], NULL,
+                                    check_pair_until_stopped, &pair_args));
+        ASSERT_EQ(0, bthread_start_background(&bthreads[i], NULL,
+                                              i % 2 ? check_pair_until_stopped :
+                                              update_pair_until_stopped, &pair_args));
+    }
+    bthread_usleep(500L * 1000);
+    g_stopped = true;
+    for (int i = 0; i < N; ++i) {
+        pthread_join(pthreads[i], NULL);
+        bthread_join(bthreads[i], NULL);
+    }
+    ASSERT_GT(a, 0);
+    ASSERT_EQ(a, b);
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+
+    bthread::RWLock scalable_rw(true);
+    {
+        bthread::RWLockRdGuard guard(scalable_rw);
+    }
+    {
+        bthread::RWLockWrGuard guard(scalable_rw);
+    }
+}
+
 void read_op(bthread_rwlock_t* rw, int64_t sleep_us) {
     ASSERT_EQ(0, bthread_rwlock_rdlock(rw));
     if (0 != sleep_us) {
@@ -402,6 +512,68 @@ TEST(RWLockTest, performance) {
     PerfTest(100, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+void* read_until_stopped(void* void_arg) {
+    auto args = (PerfArgs*)void_arg;
+    args->ready = true;
+    while (!g_stopped && !g_started) {
+        bthread_usleep(10);
+    }
+    while (!g_stopped) {
+        bthread_rwlock_rdlock(args->rw);
+        ++args->counter;
+        bthread_rwlock_unlock(args->rw);
+    }
+    return NULL;
+}
+
+// Returns read locks per second by `thread_num' bthreads.
+int64_t ReadThroughput(bthread_rwlock_t* rw, int thread_num) {
+    g_started = false;
+    g_stopped = false;
+    std::vector<bthread_t> threads(thread_num);
+    std::vector<PerfArgs> args(thread_num);
+    for (int i = 0; i < thread_num; ++i) {
+        args[i].rw = rw;
+        bthread_start_background(&threads[i], NULL, read_until_stopped, &args[i]);
+    }
+    for (int i = 0; i < thread_num; ++i) {
+        while (!args[i].ready) {
+            usleep(1000);
+        }
+    }
+    butil::Timer tm;
+    tm.start();
+    g_started = true;
+    usleep(200 * 1000);
+    g_stopped = true;
+    int64_t count = 0;
+    for (int i = 0; i < thread_num; ++i) {
+        bthread_join(threads[i], NULL);
+        count += args[i].counter;
+    }
+    tm.stop();
+    return count * 1000000L / tm.u_elapsed();
+}
+
+TEST(RWLockTest, scalable_readers_performance) {
+    const int nworker = std::max(bthread_getconcurrency(), 16);
+    bthread_setconcurrency(nworker);
+    bthread_rwlock_t rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw, NULL));
+    bthread_rwlock_t scalable_rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&scalable_rw, NULL));
+    ASSERT_EQ(0, bthread_rwlock_enable_scalable_readers(&scalable_rw));
+    for (int thread_num = 1; thread_num <= nworker; thread_num *= 2) {
+        const int64_t qps = ReadThroughput(&rw, thread_num);
+        const int64_t scalable_qps = ReadThroughput(&scalable_rw, thread_num);
+        LOG(INFO) << "Read locking by " << thread_num << " bthreads: "
+                  << qps << "/s with shared reader count, "
+                  << scalable_qps << "/s with scalable readers";
+    }
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+    ASSERT_EQ(0, bthread_rwlock_destroy(&scalable_rw));
+}
+
 
 void* read_thread(void* arg) {
     const size_t N = 10000;
@@ -15,8 +15,11 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <pthread.h>
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/macros.h"
 #include "bthread/sys_futex.h"
 #include "bthread/timer_thread.h"
 #include "bthread/bthread.h"
@@ -104,9 +107,20 @@ private:
     std::vector<timespec> _run_times;
 };
 
-TEST(TimerThreadTest, RunTasks) {
+// Run all tests with both the default buckets and the timing wheel.
+class TimerThreadTest : public ::testing::TestWithParam<bool> {
+protected:
+    TimerThreadTest() {
+        _options.use_timing_wheel = GetParam();
+    }
+    bthread::TimerThreadOptions _options;
+};
+
+INSTANTIATE_TEST_CASE_P(TimingWheel, TimerThreadTest, ::testing::Bool());
+
+TEST_P(TimerThreadTest, RunTasks) {
     bthread::TimerThread timer_thread;
-    ASSERT_EQ(0, timer_thread.start(NULL));
+    ASSERT_EQ(0, timer_thread.start(&_options));
 
     timespec _2s_later = butil::seconds_from_now(2);
     TimeKeeper keeper1(_2s_later, "keeper1");
@@ -158,13 +172,13 @@ TEST(TimerThreadTest, RunTasks) {
 
 // If the scheduled time is before start time, then should run it
 // immediately.
-TEST(TimerThreadTest, start_after_schedule) {
+TEST_P(TimerThreadTest, start_after_schedule) {
     bthread::TimerThread timer_thread;
     timespec past_time = { 0, 0 };
     TimeKeeper keeper(past_time, "keeper1");
     keeper.schedule(&timer_thread);
     ASSERT_EQ(bthread::TimerThread::INVALID_TASK_ID, keeper._task_id);
-    ASSERT_EQ(0, timer_thread.start(NULL));
+    ASSERT_EQ(0, timer_thread.start(&_options));
     keeper.schedule(&timer_thread);
     ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, keeper._task_id);
     timespec current_time = butil::seconds_from_now(0);
@@ -206,7 +220,7 @@ private:
 };
 
 // Perform schedule and unschedule inside a running task
-TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
+TEST_P(TimerThreadTest, schedule_and_unschedule_in_task) {
     bthread::TimerThread timer_thread;
     timespec past_time = { 0, 0 };
     timespec future_time = { std::numeric_limits<int>::max(), 0 };
@@ -218,7 +232,7 @@ TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
     TimeKeeper keeper4(past_time, "keeper4");
     TimeKeeper keeper5(_500ms_after, "keeper5", 10000/*10s*/);
 
-    ASSERT_EQ(0, timer_thread.start(NULL));
+    ASSERT_EQ(0, timer_thread.start(&_options));
     keeper1.schedule(&timer_thread);  // start keeper1
     keeper3.schedule(&timer_thread);  // start keeper3
     timespec keeper3_addtime = butil::seconds_from_now(0);
@@ -254,4 +268,110 @@ TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
     keeper5.expect_first_run();
 }
 
+struct RunRecord {
+    int64_t expected_us;
+    butil::atomic<int64_t> run_us;
+};
+
+static void record_run_time(void* arg) {
+    RunRecord* r = static_cast<RunRecord*>(arg);
+    r->run_us.store(butil::gettimeofday_us(), butil::memory_order_relaxed);
+}
+
+// Tasks spread over levels of the timing wheel run in time and only once.
+TEST_P(TimerThreadTest, many_tasks_at_different_times) {
+    bthread::TimerThread timer_thread;
+    ASSERT_EQ(0, timer_thread.start(&_options));
+    const int N = 2000;
+    std::vector<RunRecord> records(N);
+    std::vector<bthread::TimerThread::TaskId> ids(N);
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < N; ++i) {
+        // From 0 to ~1.5s, hitting the first 4 levels.
+        const int64_t delay_us = (i % 4 == 0) ? butil::fast_rand_less_than(100) :
+            butil::fast_rand_less_than(1500000);
+        records[i].expected_us = start_us + delay_us;
+        records[i].run_us.store(0, butil::memory_order_relaxed);
+        ids[i] = timer_thread.schedule(
+            record_run_time, &records[i],
+            butil::microseconds_to_timespec(records[i].expected_us));
+        ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, ids[i]);
+    }
+    // Unschedule every third task.
+    int nunscheduled = 0;
+    for (int i = 0; i < N; i += 3) {
+        if (timer_thread.unschedule(ids[i]) == 0) {
+            records[i].expected_us = 0;
+            ++nunscheduled;
+        }
+    }
+    ASSERT_GT(nunscheduled, N / 6);
+    usleep(2000000);
+    timer_thread.stop_and_join();
+    for (int i = 0; i < N; ++i) {
+        const int64_t run_us = records[i].run_us.load(butil::memory_order_relaxed);
+        if (records[i].expected_us == 0) {
+            ASSERT_EQ(0, run_us) << "i=" << i;
+        } else {
+            ASSERT_GE(run_us, records[i].expected_us) << "i=" << i;
+            ASSERT_LT(run_us, records[i].expected_us + 50000) << "i=" << i;
+        }
+    }
+}
+
+struct BenchmarkArgs {
+    bthread::TimerThread* timer_thread;
+    int npairs;
+    int64_t elapsed_ns;
+};
+
+static void dummy_task(void*) {}
+
+static void* schedule_and_unschedule(void* arg) {
+    BenchmarkArgs* a = static_cast<BenchmarkArgs*>(arg);
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < a->npairs; ++i) {
+        // Like timeouts of RPC, which are unscheduled before running.
+        const bthread::TimerThread::TaskId id = a->timer_thread->schedule(
+            dummy_task, NULL, butil::milliseconds_from_now(1000 + i % 100));
+        a->timer_thread->unschedule(id);
+    }
+    tm.stop();
+    a->elapsed_ns = tm.n_elapsed();
+    return NULL;
+}
+
+TEST_P(TimerThreadTest, schedule_unschedule_performance) {
+    const int thread_nums[] = { 1, 2, 4, 8, 16, 32, 64 };
+    const int NPAIRS = 20000;
+    for (size_t i = 0; i < ARRAY_SIZE(thread_nums); ++i) {
+        bthread::TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(&_options));
+        std::vector<pthread_t> threads(thread_nums[i]);
+        std::vector<BenchmarkArgs> args(thread_nums[i]);
+        butil::Timer tm;
+        tm.start();
+        for (int j = 0; j < thread_nums[i]; ++j) {
+            args[j].timer_thread = &timer_thread;
+            args[j].npairs = NPAIRS;
+            ASSERT_EQ(0, pthread_create(&threads[j], NULL,
+                                        schedule_and_unschedule, &args[j]));
+        }
+        int64_t total_ns = 0;
+        for (int j = 0; j < thread_nums[i]; ++j) {
+            pthread_join(threads[j], NULL);
+            total_ns += args[j].elapsed_ns;
+        }
+        tm.stop();
+        timer_thread.stop_and_join();
+        const int64_t npairs = (int64_t)NPAIRS * thread_nums[i];
+        LOG(INFO) << (GetParam() ? "timing_wheel" : "buckets")
+                  << " nthread=" << thread_nums[i]
+                  << " " << total_ns / npairs << "ns/pair per thread, "
+                  << npairs * 1000 / std::max(tm.u_elapsed(), (int64_t)1)
+                  << "K pairs/s in total";
+    }
+}
+
 } // end namespace
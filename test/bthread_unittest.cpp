@@ -628,6 +628,38 @@ TEST_F(BthreadTest, yield_single_thread) {
     ASSERT_EQ(0, bthread_join(tid, NULL));
 }
 
+void* time_stat_thread(void* arg) {
+    bthread_time_stat_t* stats = (bthread_time_stat_t*)arg;
+    EXPECT_EQ(EINVAL, bthread_get_time_stat(NULL));
+    EXPECT_EQ(0, bthread_get_time_stat(&stats[0]));
+    const int64_t deadline = butil::gettimeofday_us() + 20000;
+    while (butil::gettimeofday_us() < deadline) {}
+    bthread_usleep(50000);
+    EXPECT_EQ(0, bthread_get_time_stat(&stats[1]));
+    bthread_yield();
+    EXPECT_EQ(0, bthread_get_time_stat(&stats[2]));
+    return NULL;
+}
+
+TEST_F(BthreadTest, time_stat) {
+    bthread_time_stat_t stat;
+    ASSERT_EQ(EPERM, bthread_get_time_stat(&stat));
+
+    bthread_time_stat_t stats[3];
+    bthread_t tid;
+    ASSERT_EQ(0, bthread_start_background(&tid, NULL, time_stat_thread, stats));
+    ASSERT_EQ(0, bthread_join(tid, NULL));
+    for (size_t i = 0; i < ARRAY_SIZE(stats); ++i) {
+        ASSERT_EQ(tid, stats[i].tid);
+    }
+    ASSERT_GE(stats[1].on_cpu_ns - stats[0].on_cpu_ns, 20000000);
+    ASSERT_GE(stats[1].blocked_ns - stats[0].blocked_ns, 50000000);
+    ASSERT_GT(stats[1].nswitch, stats[0].nswitch);
+    // Being yielded, the bthread waited in the runqueue.
+    ASSERT_GT(stats[2].runqueue_wait_ns, stats[1].runqueue_wait_ns);
+    ASSERT_LT(stats[2].blocked_ns - stats[1].blocked_ns, 1000000);
+}
+
 #ifdef BRPC_BTHREAD_TRACER
 void spin_and_log_trace() {
     bool ok = false;
@@ -0,0 +1,274 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include "butil/fast_rand.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "bvar/detail/histogram.h"
+#include "bvar/detail/percentile.h"
+#include "bvar/latency_recorder.h"
+
+namespace bvar {
+DECLARE_bool(bvar_latency_recorder_use_histogram);
+}
+
+namespace {
+
+using bvar::detail::HistogramLayout;
+using bvar::detail::HistogramBuckets;
+using bvar::detail::Histogram;
+
+TEST(HistogramTest, layout) {
+    ASSERT_EQ(465u, HistogramLayout::NUM_BUCKETS);
+    size_t last_index = 0;
+    for (int64_t v = 0; v <= 1000000; ++v) {
+        const size_t index = HistogramLayout::index_of(v);
+        ASSERT_LT(index, HistogramLayout::NUM_BUCKETS);
+        ASSERT_TRUE(index == last_index || index == last_index + 1) << v;
+        last_index = index;
+        ASSERT_LE(v, HistogramLayout::upper_of(index)) << v;
+        if (v != 0) {
+            ASSERT_GT(v, HistogramLayout::lower_of(index)) << v;
+        }
+    }
+    for (int k = 0; k <= HistogramLayout::MAX_VALUE_BITS; ++k) {
+        const int64_t v = (int64_t)1 << k;
+        ASSERT_EQ(v, HistogramLayout::upper_of(HistogramLayout::index_of(v)));
+    }
+    ASSERT_EQ(HistogramLayout::NUM_BUCKETS - 1,
+              HistogramLayout::index_of(HistogramLayout::MAX_VALUE));
+    ASSERT_EQ(HistogramLayout::NUM_BUCKETS - 1,
+              HistogramLayout::index_of(HistogramLayout::MAX_VALUE * 4));
+}
+
+TEST(HistogramTest, add) {
+    Histogram h;
+    for (int i = 0; i < 10000; ++i) {
+        h << (i + 1);
+    }
+    const HistogramBuckets b = h.get_value();
+    ASSERT_EQ(10000u, b.count());
+    ASSERT_EQ(10000 * 10001 / 2, b.sum);
+    for (int k = 1; k <= 10; ++k) {
+        const int64_t value = b.get_number(k / 10.0);
+        EXPECT_NEAR(k * 1000, value, k * 1000 / 16.0) << "k=" << k;
+    }
+    ASSERT_EQ(1024u, b.count_le(1024));
+    ASSERT_EQ(4096u, b.count_le(4096));
+    ASSERT_EQ(10000u, b.count_le(HistogramLayout::MAX_VALUE));
+    // Small values are exact.
+    Histogram h2;
+    for (int i = 0; i < 100; ++i) {
+        h2 << (i % 10);
+    }
+    ASSERT_EQ(4, h2.get_value().get_number(0.5));
+    ASSERT_EQ(9, h2.get_value().get_number(1));
+}
+
+TEST(HistogramTest, flush_thread_local_counts) {
+    Histogram h;
+    const int N = 200000;
+    for (int i = 0; i < N; ++i) {
+        h << 100;
+    }
+    const HistogramBuckets b = h.get_value();
+    ASSERT_EQ((uint64_t)N, b.count());
+    ASSERT_EQ((uint64_t)N, b.counts[HistogramLayout::index_of(100)]);
+    ASSERT_EQ(100 * N, b.sum);
+}
+
+struct AddArg {
+    Histogram* h;
+    int64_t base;
+};
+
+static void* add_values(void* arg) {
+    AddArg* a = static_cast<AddArg*>(arg);
+    for (int64_t i = 0; i < 100000; ++i) {
+        *a->h << a->base + i % 1000;
+    }
+    return NULL;
+}
+
+TEST(HistogramTest, merge_exactly) {
+    Histogram h;
+    pthread_t th[4];
+    AddArg args[ARRAY_SIZE(th)];
+    HistogramBuckets expected;
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        args[i].h = &h;
+        args[i].base = i * 1000;
+        for (int64_t j = 0; j < 100000; ++j) {
+            const int64_t v = args[i].base + j % 1000;
+            ++expected.counts[HistogramLayout::index_of(v)];
+            expected.sum += v;
+        }
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_values, &args[i]));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    // Agents of quitted threads are committed into the global buckets.
+    const HistogramBuckets b = h.get_value();
+    ASSERT_EQ(0, memcmp(&expected, &b, sizeof(b)));
+}
+
+TEST(HistogramTest, window) {
+    Histogram h;
+    bvar::detail::HistogramWindow w(&h, 10);
+    for (int i = 0; i < 1000; ++i) {
+        h << i;
+    }
+    usleep(1100000);
+    // The window is the diff of two cumulative samples, which is exact.
+    const HistogramBuckets b = w.get_value();
+    ASSERT_EQ(1000u, b.count());
+    const HistogramBuckets all = h.get_value();
+    ASSERT_EQ(0, memcmp(&all, &b, sizeof(b)));
+}
+
+TEST(HistogramTest, latency_recorder) {
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = true;
+    bvar::LatencyRecorder rec("histogram_test", 2);
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = false;
+    ASSERT_EQ("histogram_test_latency_histogram", rec.latency_histogram_name());
+    for (int i = 1; i <= 10000; ++i) {
+        rec << i;
+    }
+    usleep(1100000);
+    EXPECT_NEAR(9000, rec.latency_percentile(0.9), 9000 / 16);
+    EXPECT_NEAR(9900, rec.latency_percentiles()[2], 9900 / 16);
+    const std::string desc = bvar::Variable::describe_exposed(
+        "histogram_test_latency_histogram");
+    ASSERT_NE(std::string::npos, desc.find("[1024,1024]")) << desc;
+    ASSERT_NE(std::string::npos, desc.find("\"count\":10000}")) << desc;
+
+    bvar::LatencyRecorder rec2("histogram_test2");
+    ASSERT_TRUE(rec2.latency_histogram_name().empty());
+    ASSERT_TRUE(bvar::Variable::describe_exposed(
+        "histogram_test2_latency_histogram").empty());
+}
+
+// Draw from a log-normal distribution whose median is 1000.
+static int64_t random_latency() {
+    double u1 = butil::fast_rand_double();
+    const double u2 = butil::fast_rand_double();
+    if (u1 < 1e-12) {
+        u1 = 1e-12;
+    }
+    const double z = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+    return (int64_t)exp(log(1000.0) + z);
+}
+
+TEST(HistogramTest, accuracy_and_memory_against_percentile) {
+    const size_t N = 1000000;
+    std::vector<int64_t> values(N);
+    Histogram h;
+    bvar::detail::Percentile p;
+    for (size_t i = 0; i < N; ++i) {
+        values[i] = random_latency();
+        h << values[i];
+        p << values[i];
+    }
+    std::sort(values.begin(), values.end());
+    const HistogramBuckets hb = h.get_value();
+    bvar::detail::GlobalPercentileSamples pb = p.get_value();
+    const double ratios[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    for (size_t i = 0; i < ARRAY_SIZE(ratios); ++i) {
+        const double exact = values[(size_t)(ratios[i] * N) - 1];
+        const double herr = fabs(hb.get_number(ratios[i]) - exact) / exact;
+        const double perr = fabs(pb.get_number(ratios[i]) - exact) / exact;
+        LOG(INFO) << ratios[i] << "-ile exact=" << exact
+                  << " histogram_error=" << herr
+                  << " percentile_error=" << perr;
+        EXPECT_LT(herr, 1.0 / 16);
+    }
+    size_t ninterval = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(pb._intervals); ++i) {
+        if (pb._intervals[i] != NULL) {
+            ++ninterval;
+        }
+    }
+    // Memory of one sample kept by windows and one thread-local agent.
+    LOG(INFO) << "histogram: global="
+              << sizeof(HistogramBuckets) << "B thread_local="
+              << sizeof(bvar::detail::ThreadLocalHistogramBuckets) << "B"
+              << " percentile: global="
+              << sizeof(bvar::detail::GlobalPercentileSamples) + ninterval *
+                 sizeof(bvar::detail::PercentileInterval<
+                        bvar::detail::GlobalPercentileSamples::SAMPLE_SIZE>)
+              << "B thread_local="
+              << sizeof(bvar::detail::ThreadLocalPercentileSamples) + ninterval *
+                 sizeof(bvar::detail::PercentileInterval<
+                        bvar::detail::ThreadLocalPercentileSamples::SAMPLE_SIZE>)
+              << "B";
+}
+
+template <typename R>
+struct BenchArg {
+    R* r;
+    int64_t elapsed_ns;
+    pthread_t th;
+};
+
+template <typename R>
+static void* add_latencies(void* arg) {
+    BenchArg<R>* a = static_cast<BenchArg<R>*>(arg);
+    const int N = 1000000;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        *a->r << (int64_t)(1000 + (i & 1023));
+    }
+    tm.stop();
+    a->elapsed_ns = tm.n_elapsed() / N;
+    return NULL;
+}
+
+template <typename R>
+static int64_t RunAdd(size_t nthread) {
+    R r;
+    std::vector<BenchArg<R> > args(nthread);
+    for (size_t i = 0; i < nthread; ++i) {
+        args[i].r = &r;
+        EXPECT_EQ(0, pthread_create(&args[i].th, NULL, add_latencies<R>, &args[i]));
+    }
+    int64_t total = 0;
+    for (size_t i = 0; i < nthread; ++i) {
+        pthread_join(args[i].th, NULL);
+        total += args[i].elapsed_ns;
+    }
+    return total / nthread;
+}
+
+TEST(HistogramTest, add_performance) {
+    const size_t nthreads[] = { 1, 2, 4, 8 };
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        const int64_t hns = RunAdd<Histogram>(nthreads[i]);
+        const int64_t pns = RunAdd<bvar::detail::Percentile>(nthreads[i]);
+        LOG(INFO) << "nthread=" << nthreads[i] << " histogram=" << hns
+                  << "ns percentile=" << pns << "ns";
+    }
+}
+
+} // namespace
@@ -497,3 +497,150 @@ TEST_F(MultiDimensionTest, test_hash) {
     LOG(INFO) << "Hash fun performance:\n" << oss.str();
 }
 
+
+TEST_F(MultiDimensionTest, labels_key_and_handle) {
+    bvar::MultiDimension<bvar::Adder<int> > my_madder("test_handle", labels);
+    const std::list<std::string> labels_value = {"bj", "get", "200"};
+    const bvar::LabelsKey key(labels_value);
+    ASSERT_EQ(bvar::MultiDimension<bvar::Adder<int> >::KeyHash()(labels_value), key.hash());
+    const std::vector<std::string> vec_value = {"bj", "get", "200"};
+    ASSERT_EQ(key.hash(), bvar::LabelsKey(vec_value).hash());
+    // Created by the key.
+    bvar::Adder<int>* adder = my_madder.get_stats(key);
+    ASSERT_TRUE(adder);
+    ASSERT_EQ(adder, my_madder.get_stats(labels_value));
+    ASSERT_EQ(adder, my_madder.get_stats(key));
+    ASSERT_EQ(1u, my_madder.count_stats());
+    ASSERT_FALSE(my_madder.get_stats(bvar::LabelsKey(std::list<std::string>{"bj", "get"})));
+
+    bvar::MultiDimension<bvar::Adder<int> >::Handle h = my_madder.get_handle(key);
+    ASSERT_EQ(adder, h.get());
+    *h.get() << 1 << 2;
+    ASSERT_EQ(3, adder->get_value());
+
+    // Handles are resolved again after stats are deleted.
+    my_madder.delete_stats(labels_value);
+    ASSERT_EQ(0u, my_madder.count_stats());
+    bvar::Adder<int>* adder2 = h.get();
+    ASSERT_TRUE(adder2);
+    ASSERT_EQ(0, adder2->get_value());
+    ASSERT_EQ(adder2, my_madder.get_stats(labels_value));
+    my_madder.clear_stats();
+    ASSERT_TRUE(h.get());
+    ASSERT_EQ(1u, my_madder.count_stats());
+
+    bvar::MultiDimension<bvar::Adder<int> >::Handle empty;
+    ASSERT_FALSE(empty.get());
+}
+
+enum LookupMode {
+    LOOKUP_BY_LIST,
+    LOOKUP_BY_LABELS_KEY,
+    LOOKUP_BY_HANDLE,
+};
+
+struct LookupArg {
+    bvar::MultiDimension<bvar::Adder<uint64_t> >* madder;
+    LookupMode mode;
+    int64_t elapsed_ns;
+    pthread_t th;
+};
+
+static void* lookup_and_add(void* arg) {
+    LookupArg* a = static_cast<LookupArg*>(arg);
+    const size_t N = 100000;
+    const bvar::LabelsKey key(std::list<std::string>{"bj", "get", "200"});
+    bvar::MultiDimension<bvar::Adder<uint64_t> >::Handle h = a->madder->get_handle(key);
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < N; ++i) {
+        switch (a->mode) {
+        case LOOKUP_BY_LIST:
+            // What callers do without a cached key: build labels each time.
+            *a->madder->get_stats({"bj", "get", "200"}) << 1;
+            break;
+        case LOOKUP_BY_LABELS_KEY:
+            *a->madder->get_stats(key) << 1;
+            break;
+        case LOOKUP_BY_HANDLE:
+            *h.get() << 1;
+            break;
+        }
+    }
+    timer.stop();
+    a->elapsed_ns = timer.n_elapsed() / N;
+    return NULL;
+}
+
+static int64_t run_lookup(bvar::MultiDimension<bvar::Adder<uint64_t> >* madder,
+                          LookupMode mode, size_t nthread) {
+    std::vector<LookupArg> args(nthread);
+    for (size_t i = 0; i < nthread; ++i) {
+        args[i].madder = madder;
+        args[i].mode = mode;
+        EXPECT_EQ(0, pthread_create(&args[i].th, NULL, lookup_and_add, &args[i]));
+    }
+    int64_t total = 0;
+    for (size_t i = 0; i < nthread; ++i) {
+        pthread_join(args[i].th, NULL);
+        total += args[i].elapsed_ns;
+    }
+    return total / nthread;
+}
+
+TEST_F(MultiDimensionTest, lookup_perf) {
+    bvar::MultiDimension<bvar::Adder<uint64_t> > my_madder("test_lookup_perf", labels);
+    // Fill the map with other stats.
+    for (int i = 0; i < idc_count; ++i) {
+        for (int j = 0; j < method_count; ++j) {
+            ASSERT_TRUE(my_madder.get_stats({std::to_string(i), std::to_string(j), "200"}));
+        }
+    }
+    std::ostringstream oss;
+    oss << "nthread\tlist\tlabels_key\thandle(ns)\n";
+    for (size_t nthread = 1; nthread <= 64; nthread *= 2) {
+        oss << nthread
+            << '\t' << run_lookup(&my_madder, LOOKUP_BY_LIST, nthread)
+            << '\t' << run_lookup(&my_madder, LOOKUP_BY_LABELS_KEY, nthread)
+            << '\t' << run_lookup(&my_madder, LOOKUP_BY_HANDLE, nthread) << '\n';
+    }
+    LOG(INFO) << "Lookup performance:\n" << oss.str();
+}
+
+class KeyCollector : public bvar::Dumper {
+public:
+    bool dump(const std::string&, const butil::StringPiece&) override {
+        return true;
+    }
+    bool dump_mvar(const std::string& name, const butil::StringPiece&) override {
+        keys.insert(name);
+        return true;
+    }
+    std::set<std::string> keys;
+};
+
+TEST_F(MultiDimensionTest, dump_keys) {
+    bvar::MultiDimension<bvar::LatencyRecorder> my_mlat("test_dump_keys", labels);
+    ASSERT_TRUE(my_mlat.get_stats({"bj", "get", "200"}));
+    ASSERT_TRUE(my_mlat.get_stats({"gz", "post", "500"}));
+    bvar::DumpOptions opts;
+    for (int i = 0; i < 2; ++i) {
+        // The second dump uses cached labels.
+        KeyCollector c;
+        ASSERT_EQ(2u * 9, my_mlat.dump(&c, &opts));
+        ASSERT_EQ(1u, c.keys.count(
+            "test_dump_keys_latency{idc=\"bj\",method=\"get\",status=\"200\"}"));
+        ASSERT_EQ(1u, c.keys.count(
+            "test_dump_keys_latency{idc=\"gz\",method=\"post\",status=\"500\",quantile=\"999\"}"));
+        ASSERT_EQ(1u, c.keys.count(
+            "test_dump_keys_count{idc=\"gz\",method=\"post\",status=\"500\"}"));
+    }
+    // Labels of deleted stats are not dumped.
+    my_mlat.delete_stats({"bj", "get", "200"});
+    KeyCollector c;
+    ASSERT_EQ(9u, my_mlat.dump(&c, &opts));
+    for (auto& key : c.keys) {
+        ASSERT_EQ(std::string::npos, key.find("bj")) << key;
+    }
+    ASSERT_EQ(1u, my_mlat._labels_string_cache.size());
+}
@@ -16,11 +16,21 @@
 // under the License.
 
 #include <limits>                           //std::numeric_limits
+#include <set>
+#include <gflags/gflags.h>
 #include "bvar/detail/sampler.h"
 #include "butil/time.h"
 #include "butil/logging.h"
+#include "butil/file_util.h"
+#include "butil/files/file_enumerator.h"
 #include <gtest/gtest.h>
 
+namespace bvar {
+namespace detail {
+DECLARE_int32(bvar_sampler_thread_num);
+}
+}
+
 namespace {
 
 TEST(SamplerTest, linked_list) {
@@ -136,4 +146,76 @@ TEST(SamplerTest, multi_threaded) {
     }
 #endif
 }
+
+// Records the time of the first call.
+class TimedSampler : public bvar::detail::Sampler {
+public:
+    TimedSampler() : _first_call_us(0) {}
+    void take_sample() {
+        if (_first_call_us == 0) {
+            _first_call_us = butil::gettimeofday_us();
+        }
+    }
+    int64_t first_call_us() const { return _first_call_us; }
+private:
+    int64_t _first_call_us;
+};
+
+static int CountSamplingThreads() {
+    int n = 0;
+    butil::FileEnumerator tasks(butil::FilePath("/proc/self/task"), false,
+                                butil::FileEnumerator::DIRECTORIES);
+    for (butil::FilePath dir = tasks.Next(); !dir.empty(); dir = tasks.Next()) {
+        std::string comm;
+        if (butil::ReadFileToString(dir.Append("comm"), &comm) &&
+            comm.compare(0, 12, "bvar_sampler") == 0) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+TEST(SamplerTest, sharded) {
+    // Make sure that the sampling threads are created.
+    TimedSampler* first = new TimedSampler;
+    first->schedule();
+    first->destroy();
+
+    ASSERT_TRUE(GFLAGS_NAMESPACE::SetCommandLineOption(
+        "bvar_sampler_thread_num", "0").empty());
+    ASSERT_TRUE(GFLAGS_NAMESPACE::SetCommandLineOption(
+        "bvar_sampler_thread_num", "1000").empty());
+    ASSERT_FALSE(GFLAGS_NAMESPACE::SetCommandLineOption(
+        "bvar_sampler_thread_num", "4").empty());
+    // New threads name themselves after they start.
+    for (int i = 0; i < 100 && CountSamplingThreads() < 4; ++i) {
+        usleep(10000);
+    }
+    ASSERT_EQ(4, CountSamplingThreads());
+
+    // Wait for new threads to align to their offsets.
+    usleep(1100000);
+    const int N = 400;
+    TimedSampler* s[N];
+    for (int i = 0; i < N; ++i) {
+        s[i] = new TimedSampler;
+        s[i]->schedule();
+    }
+    usleep(1100000);
+    // Threads sample at 4 different quarters of the second.
+    std::set<int64_t> quarters;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_NE(0, s[i]->first_call_us()) << "i=" << i;
+        quarters.insert(s[i]->first_call_us() % 1000000L / 250000L);
+    }
+    ASSERT_EQ(4u, quarters.size());
+    for (int i = 0; i < N; ++i) {
+        s[i]->destroy();
+    }
+    // Can't be decreased.
+    ASSERT_TRUE(GFLAGS_NAMESPACE::SetCommandLineOption(
+        "bvar_sampler_thread_num", "2").empty());
+    ASSERT_EQ(4, bvar::detail::FLAGS_bvar_sampler_thread_num);
+    ASSERT_EQ(4, CountSamplingThreads());
+}
 } // namespace
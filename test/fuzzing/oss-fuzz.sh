@@ -40,7 +40,7 @@ cp test/fuzz_* $OUT/
 
 pushd /lib/x86_64-linux-gnu/
 mkdir -p $OUT/lib/
-cp libgflags* libprotobuf* libleveldb* libprotoc* libsnappy* $OUT/lib/.
+cp libgflags* libprotobuf* libprotoc* libsnappy* $OUT/lib/.
 popd
 
 pushd $SRC/brpc/test/fuzzing
@@ -1342,6 +1342,53 @@ TEST_F(IOBufTest, append_from_fd_with_offset) {
 
 }
 
+TEST_F(IOBufTest, append_from_fd_pooled) {
+    butil::iobuf::remove_tls_block_chain();
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    butil::IOPortal p1;
+    butil::IOPortal p2;
+    ASSERT_EQ(5, write(fds[1], "hello", 5));
+    ASSERT_EQ(5, p1.append_from_file_descriptor_pooled(fds[0], 1024 * 1024));
+    ASSERT_EQ("hello", p1.to_string());
+    // Nothing is cached in the portal, the partially filled block is shared
+    // with the next reading.
+    ASSERT_TRUE(p1._block == NULL);
+    butil::IOBuf::Block* head = butil::iobuf::get_tls_block_head();
+    ASSERT_TRUE(head != NULL);
+    ASSERT_EQ(5u, butil::iobuf::block_size(head));
+    ASSERT_EQ(5, write(fds[1], "world", 5));
+    ASSERT_EQ(5, p2.append_from_file_descriptor_pooled(fds[0], 1024 * 1024));
+    ASSERT_EQ("world", p2.to_string());
+    ASSERT_EQ(head, butil::iobuf::get_tls_block_head());
+    ASSERT_EQ(10u, butil::iobuf::block_size(head));
+    ASSERT_EQ(head, p2._ref_at(0).block);
+
+    // Read more than one block.
+    std::string data(3 * butil::IOBuf::DEFAULT_BLOCK_SIZE, 'a');
+    ASSERT_EQ((ssize_t)data.size(), write(fds[1], data.data(), data.size()));
+    ssize_t total = 0;
+    while (total < (ssize_t)data.size()) {
+        const ssize_t nr = p1.append_from_file_descriptor_pooled(
+            fds[0], data.size() - total);
+        ASSERT_GT(nr, 0);
+        total += nr;
+    }
+    ASSERT_EQ("hello" + data, p1.to_string());
+    ASSERT_TRUE(p1._block == NULL);
+    ASSERT_LE(butil::iobuf::get_tls_block_count(), 8);
+
+    // EAGAIN keeps blocks in the pool.
+    butil::make_non_blocking(fds[0]);
+    const int nblock = butil::iobuf::get_tls_block_count();
+    ASSERT_EQ(-1, p2.append_from_file_descriptor_pooled(fds[0], 1024));
+    ASSERT_EQ(EAGAIN, errno);
+    ASSERT_EQ("world", p2.to_string());
+    ASSERT_EQ(nblock, butil::iobuf::get_tls_block_count());
+    close(fds[0]);
+    close(fds[1]);
+}
+
 static butil::atomic<int> s_nthread(0);
 static long number_per_thread = 1024;
 
@@ -15,10 +15,96 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <stdio.h>
+#include <algorithm>
+#include <sstream>
 #include "info_thread.h"
 
 namespace brpc {
 
+LatencyDistribution::LatencyDistribution() : _sum(0), _max(0) {
+    for (int i = 0; i < NBUCKET; ++i) {
+        _buckets[i].store(0, butil::memory_order_relaxed);
+    }
+}
+
+int LatencyDistribution::bucket_of(int64_t v) {
+    if (v < (1L << SUB_BUCKET_BITS)) {
+        return v < 0 ? 0 : v;
+    }
+    // Values in [2^k, 2^(k+1)) are divided into 2^SUB_BUCKET_BITS buckets.
+    const int k = 63 - __builtin_clzll(v);
+    const int sub = (v >> (k - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+    return ((k - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + sub;
+}
+
+int64_t LatencyDistribution::upper_bound_of(int bucket) {
+    if (bucket < (1 << SUB_BUCKET_BITS)) {
+        return bucket;
+    }
+    const int k = (bucket >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+    const int64_t sub = bucket & ((1 << SUB_BUCKET_BITS) - 1);
+    return (1L << k) + ((sub + 1) << (k - SUB_BUCKET_BITS)) - 1;
+}
+
+void LatencyDistribution::add(int64_t latency_us) {
+    _buckets[bucket_of(latency_us)].fetch_add(1, butil::memory_order_relaxed);
+    _sum.fetch_add(latency_us, butil::memory_order_relaxed);
+    int64_t max = _max.load(butil::memory_order_relaxed);
+    while (latency_us > max &&
+           !_max.compare_exchange_weak(max, latency_us,
+                                       butil::memory_order_relaxed)) {}
+}
+
+int64_t LatencyDistribution::count() const {
+    int64_t n = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        n += _buckets[i].load(butil::memory_order_relaxed);
+    }
+    return n;
+}
+
+int64_t LatencyDistribution::percentile(double ratio) const {
+    const int64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    const int64_t rank = std::max((int64_t)1, (int64_t)(ratio * n + 0.5));
+    int64_t seen = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        seen += _buckets[i].load(butil::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(upper_bound_of(i),
+                            _max.load(butil::memory_order_relaxed));
+        }
+    }
+    return _max.load(butil::memory_order_relaxed);
+}
+
+void LatencyDistribution::print(std::ostream& os, const char* name) const {
+    const int64_t n = count();
+    os << '[' << name << "]\n"
+       << "  count   " << n << '\n';
+    if (n == 0) {
+        return;
+    }
+    const double ratios[] = { 0.5, 0.7, 0.9, 0.95, 0.97, 0.99, 0.999, 0.9999 };
+    const char* names[] = { "50%", "70%", "90%", "95%", "97%", "99%",
+                            "99.9%", "99.99%" };
+    char buf[64];
+    snprintf(buf, sizeof(buf), "  %-8s%10lld us\n", "avg",
+             (long long)(_sum.load(butil::memory_order_relaxed) / n));
+    os << buf;
+    for (size_t i = 0; i < sizeof(ratios) / sizeof(ratios[0]); ++i) {
+        snprintf(buf, sizeof(buf), "  %-8s%10lld us\n", names[i],
+                 (long long)percentile(ratios[i]));
+        os << buf;
+    }
+    snprintf(buf, sizeof(buf), "  %-8s%10lld us\n", "max",
+             (long long)_max.load(butil::memory_order_relaxed));
+    os << buf;
+}
+
 InfoThread::InfoThread()
     : _stop(false)
     , _tid(0) {
@@ -125,6 +211,19 @@ void InfoThread::stop() {
         pthread_cond_signal(&_cond);
     }
     pthread_join(_tid, NULL);
+    std::ostringstream os;
+    if (_options.latency_distribution) {
+        _options.latency_distribution->print(os, "Latency of all requests");
+    }
+    if (_options.dumped_latency_distribution &&
+        _options.dumped_latency_distribution->count() > 0) {
+        _options.dumped_latency_distribution->print(os, "Latency when dumped");
+    }
+    if (_options.lag_distribution &&
+        _options.lag_distribution->count() > 0) {
+        _options.lag_distribution->print(os, "Lag behind original arrivals");
+    }
+    printf("%s", os.str().c_str());
 }
 
 } // brpc
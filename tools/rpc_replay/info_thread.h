@@ -19,19 +19,55 @@
 #define BRPC_RPC_REPLAY_INFO_THREAD_H
 
 #include <pthread.h>
+#include <ostream>
+#include <butil/atomicops.h>
 #include <bvar/bvar.h>
 
 namespace brpc {
 
+// Distribution of latencies during the whole replaying, unlike
+// bvar::LatencyRecorder which only keeps recent ones.
+// Values are put into log-linear buckets: each power of 2 is divided into
+// 16 buckets, so the relative error of percentiles is less than 1/16.
+class LatencyDistribution {
+public:
+    LatencyDistribution();
+    void add(int64_t latency_us);
+    int64_t count() const;
+    // Returns the value at `ratio' (in [0, 1]) of all values.
+    int64_t percentile(double ratio) const;
+    // Print count, avg, common percentiles and max.
+    void print(std::ostream& os, const char* name) const;
+
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int NBUCKET = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+    static int bucket_of(int64_t v);
+    static int64_t upper_bound_of(int bucket);
+
+    butil::atomic<int64_t> _buckets[NBUCKET];
+    butil::atomic<int64_t> _sum;
+    butil::atomic<int64_t> _max;
+};
+
 struct InfoThreadOptions {
     bvar::LatencyRecorder* latency_recorder;
     bvar::Adder<int64_t>* sent_count;
     bvar::Adder<int64_t>* error_count;
+    // Printed when the thread is stopped if it's not NULL.
+    const LatencyDistribution* latency_distribution;
+    // How late requests are sent compared to the original arrivals.
+    const LatencyDistribution* lag_distribution;
+    // Latencies recorded in dumped files.
+    const LatencyDistribution* dumped_latency_distribution;
 
     InfoThreadOptions()
         : latency_recorder(NULL)
         , sent_count(NULL)
-        , error_count(NULL) {}
+        , error_count(NULL)
+        , latency_distribution(NULL)
+        , lag_distribution(NULL)
+        , dumped_latency_distribution(NULL) {}
 };
 
 class InfoThread {
@@ -16,6 +16,7 @@
 // under the License.
 
 
+#include <queue>
 #include <gflags/gflags.h>
 #include <butil/logging.h>
 #include <butil/time.h>
@@ -45,10 +46,20 @@ DEFINE_int32(timeout_ms, 100, "RPC timeout in milliseconds");
 DEFINE_int32(max_retry, 3, "Maximum retry times");
 DEFINE_int32(dummy_port, 8899, "Port of dummy server(to monitor replaying)");
 DEFINE_string(http_host, "", "Host field for http protocol");
+DEFINE_bool(replay_arrival_time, false, "Send requests at the same pace as "
+            "they arrived at the dumping server, -qps is ignored");
+DEFINE_double(speedup, 1.0, "Replay original arrivals this times faster, "
+              "effective when -replay_arrival_time is true");
+DEFINE_int32(reorder_window, 10000, "Samples are dumped when responded, "
+             "reorder so many of them by arrival time before replaying, "
+             "effective when -replay_arrival_time is true");
 
 bvar::LatencyRecorder g_latency_recorder("rpc_replay");
 bvar::Adder<int64_t> g_error_count("rpc_replay_error_count");
 bvar::Adder<int64_t> g_sent_count;
+brpc::LatencyDistribution g_latency_distribution;
+brpc::LatencyDistribution g_lag_distribution;
+brpc::LatencyDistribution g_dumped_latency_distribution;
 
 // Include channels for all protocols that support both client and server.
 class ChannelGroup {
@@ -123,6 +134,7 @@ static void handle_response(brpc::Controller* cntl, int64_t start_time,
     const int64_t elp = end_time - start_time;
     if (!cntl->Failed()) {
         g_latency_recorder << elp;
+        g_latency_distribution.add(elp);
     } else {
         g_error_count << 1;
         if (sleep_on_error) {
@@ -132,6 +144,52 @@ static void handle_response(brpc::Controller* cntl, int64_t start_time,
     delete cntl;
 }
 
+// Iterate samples, which are dumped in order of completion, in order of
+// arrival time. A sample is out of order only if it's dumped more than
+// `window' samples after the ones arriving later than it.
+class ArrivalOrderedSampleIterator {
+public:
+    ArrivalOrderedSampleIterator(const std::string& dir, size_t window)
+        : _it(dir), _window(window) {}
+    ~ArrivalOrderedSampleIterator() {
+        while (!_heap.empty()) {
+            delete _heap.top();
+            _heap.pop();
+        }
+    }
+
+    // Caller is responsible for deleting the returned sample.
+    brpc::SampledRequest* Next() {
+        while (_heap.size() <= _window) {
+            brpc::SampledRequest* sample = _it.Next();
+            if (sample == NULL) {
+                break;
+            }
+            _heap.push(sample);
+        }
+        if (_heap.empty()) {
+            return NULL;
+        }
+        brpc::SampledRequest* sample = _heap.top();
+        _heap.pop();
+        return sample;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ArrivalOrderedSampleIterator);
+    struct ArrivesLater {
+        bool operator()(const brpc::SampledRequest* a,
+                        const brpc::SampledRequest* b) const {
+            return a->meta.arrival_time_us() > b->meta.arrival_time_us();
+        }
+    };
+    brpc::SampleIterator _it;
+    size_t _window;
+    std::priority_queue<brpc::SampledRequest*,
+                        std::vector<brpc::SampledRequest*>,
+                        ArrivesLater> _heap;
+};
+
 butil::atomic<int> g_thread_offset(0);
 
 static void* replay_thread(void* arg) {
@@ -145,14 +203,28 @@ static void* replay_thread(void* arg) {
     // the max tolerant delay between end_time and expected_time. 10ms or 10 intervals
     int64_t max_tolerant_delay = std::max((int64_t) 10000000L, 10 * interval);
     for (int i = 0; !brpc::IsAskedToQuit() && i < FLAGS_times; ++i) {
-        brpc::SampleIterator it(FLAGS_dir);
+        ArrivalOrderedSampleIterator it(
+            FLAGS_dir, FLAGS_replay_arrival_time ? FLAGS_reorder_window : 0);
         int j = 0;
+        // Original arrival time of the first sample and when it's replayed.
+        int64_t first_arrival_us = -1;
+        int64_t replay_start_us = 0;
         for (brpc::SampledRequest* sample = it.Next();
              !brpc::IsAskedToQuit() && sample != NULL; sample = it.Next(), ++j) {
             std::unique_ptr<brpc::SampledRequest> sample_guard(sample);
+            // All threads see the first sample, which is the start of the
+            // original timeline.
+            if (FLAGS_replay_arrival_time && first_arrival_us < 0 &&
+                sample->meta.has_arrival_time_us()) {
+                first_arrival_us = sample->meta.arrival_time_us();
+                replay_start_us = butil::monotonic_time_us();
+            }
             if ((j % FLAGS_thread_num) != thread_offset) {
                 continue;
             }
+            if (i == 0 && sample->meta.has_latency_us()) {
+                g_dumped_latency_distribution.add(sample->meta.latency_us());
+            }
             brpc::Channel* chan =
                 chan_group->channel(sample->meta.protocol_type());
             if (chan == NULL) {
@@ -189,9 +261,33 @@ static void* replay_thread(void* arg) {
             } else {
                 req.serialized_data() = sample->request.movable();
             }
+            if (FLAGS_replay_arrival_time && first_arrival_us >= 0 &&
+                sample->meta.has_arrival_time_us()) {
+                // Samples reordered out of -reorder_window are earlier than
+                // previous ones, they're sent immediately.
+                const int64_t due_us = replay_start_us + (int64_t)(
+                    (sample->meta.arrival_time_us() - first_arrival_us) /
+                    FLAGS_speedup);
+                const int64_t now_us = butil::monotonic_time_us();
+                if (now_us < due_us) {
+                    if (FLAGS_use_bthread) {
+                        bthread_usleep(due_us - now_us);
+                    } else {
+                        usleep(due_us - now_us);
+                    }
+                }
+                g_lag_distribution.add(
+                    std::max((int64_t)0, butil::monotonic_time_us() - due_us));
+            }
             g_sent_count << 1;
             const int64_t start_time = butil::gettimeofday_us();
-            if (FLAGS_qps <= 0) {
+            if (FLAGS_replay_arrival_time) {
+                // Never wait for responses, which changes the arrivals.
+                google::protobuf::Closure* done =
+                    brpc::NewCallback(handle_response, cntl, start_time, false);
+                chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
+                        cntl, req_ptr, NULL/*ignore response*/, done);
+            } else if (FLAGS_qps <= 0) {
                 chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
                         cntl, req_ptr, NULL/*ignore response*/, NULL);
                 handle_response(cntl, start_time, true);
@@ -235,8 +331,19 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    if (FLAGS_replay_arrival_time && FLAGS_speedup <= 0) {
+        LOG(ERROR) << "--speedup must be positive";
+        return -1;
+    }
+    if (FLAGS_reorder_window < 0) {
+        LOG(ERROR) << "--reorder_window must be non-negative";
+        return -1;
+    }
     if (FLAGS_thread_num <= 0) {
-        if (FLAGS_qps <= 0) { // unlimited qps
+        if (FLAGS_replay_arrival_time) {
+            // Requests are sent asynchronously, few threads are enough.
+            FLAGS_thread_num = 4;
+        } else if (FLAGS_qps <= 0) { // unlimited qps
             FLAGS_thread_num = 50;
         } else {
             FLAGS_thread_num = FLAGS_qps / 10000;
@@ -282,6 +389,9 @@ int main(int argc, char* argv[]) {
     info_thr_opt.latency_recorder = &g_latency_recorder;
     info_thr_opt.error_count = &g_error_count;
     info_thr_opt.sent_count = &g_sent_count;
+    info_thr_opt.latency_distribution = &g_latency_distribution;
+    info_thr_opt.lag_distribution = &g_lag_distribution;
+    info_thr_opt.dumped_latency_distribution = &g_dumped_latency_distribution;
     
     if (!info_thr.start(info_thr_opt)) {
         LOG(ERROR) << "Fail to create info_thread";